@@ -28,13 +28,32 @@
 
 // Model-specific registers that we use
 #define X86_MSR_APICBASE				0x1B
+#define X86_MSR_SYSENTER_CS				0x174
+#define X86_MSR_SYSENTER_ESP			0x175
+#define X86_MSR_SYSENTER_EIP			0x176
+#define X86_MSR_MTRRCAP					0xFE
+#define X86_MSR_MTRRPHYSBASE(num)		(0x200 + ((num) * 2))
+#define X86_MSR_MTRRPHYSMASK(num)		(0x201 + ((num) * 2))
 #define X86_MSR_PAT						0x277
+#define X86_MSR_MTRRDEFTYPE				0x2FF
 
 // Bitfields for the APICBASE MSR
 #define X86_MSR_APICBASE_BASEADDR		0xFFFFF000
 #define X86_MSR_APICBASE_APICENABLE		0x00000800
 #define X86_MSR_APICBASE_BSP			0x00000100
 
+// Bitfields for the MTRR MSRs
+#define X86_MSR_MTRRCAP_VCNT			0x000000FF
+#define X86_MSR_MTRRCAP_WC				0x00000400
+#define X86_MSR_MTRRDEFTYPE_ENABLE		0x00000800
+#define X86_MSR_MTRRPHYSBASE_TYPE		0x000000FF
+#define X86_MSR_MTRRPHYSMASK_VALID		0x00000800
+#define X86_MSR_MTRR_ADDR				0xFFFFF000
+
+// Memory types for MTRRs
+#define X86_MTRR_TYPE_UC				0x00
+#define X86_MTRR_TYPE_WC				0x01
+
 // Encodings for PAT MSR fields
 #define X86_MSR_PATENC_UC				0x00	// Strong uncacheable
 #define X86_MSR_PATENC_WC				0x01	// Write combining
@@ -90,16 +109,31 @@
 #define X86_PAGEFLAG_DIRTY				0x0040
 #define X86_PAGEFLAG_PAT				0x0080
 #define X86_PAGEFLAG_GLOBAL				0x0100
+// Available to the operating system
+#define X86_PAGEFLAG_SOFTWARE			0x0200
+// Page directory entries that map a 4MB page (PSE) use bit 7 as the page
+// size flag, and move the PAT bit up to bit 12
+#define X86_PAGEFLAG_LARGE				0x0080
+#define X86_PAGEFLAG_LARGEPAT			0x1000
+#define X86_LARGEPAGE_SIZE				0x00400000
 
 // Processor context values
 #define X86_FPU_STATE_LEN				108
 #define X86_IO_PORTS					65536
 #define X86_PORTS_BYTES					(X86_IO_PORTS / 8)
 #define X86_IOBITMAP_OFFSET				0x68
+#define X86_IOBITMAP_NONE				0xFFFF	// Past the TSS limit
+
+// SYSENTER/SYSEXIT are usable if CPUID function 1 reports them, except on
+// early Pentium Pro processors, which report them incorrectly
+#define X86_CPUID1_SEP(eax, edx) \
+	(((edx) & (1 << 11)) && !((((eax) & 0xF00) == 0x600) && \
+		(((eax) & 0xFFF) < 0x633)))
 
 // X86-specific CPU features
 typedef struct {
 	int cpuid1;
+	unsigned cpuid1Eax;
 	unsigned cpuid1Ecx;
 	unsigned cpuid1Edx;
 	int cpuid8_1;
@@ -161,6 +195,9 @@ typedef volatile struct {
 #define processorSetCR0(variable) \
 	__asm__ __volatile__ ("movl %0, %%cr0" : : "r" (variable))
 
+#define processorGetCR2(variable) \
+	__asm__ __volatile__ ("movl %%cr2, %0" : "=r" (variable))
+
 #define processorGetCR3(variable) \
 	__asm__ __volatile__ ("movl %%cr3, %0" : "=r" (variable))
 
@@ -373,8 +410,91 @@ typedef volatile struct {
 	processorPopFlags(); \
 } while (0)
 
+#define processorGetTaskReg(selector) \
+	__asm__ __volatile__ ("str %0" : "=r" (selector))
+
 #define processorClearTaskSwitched() __asm__ __volatile__ ("clts")
 
+#define processorSetTaskSwitched() \
+	__asm__ __volatile__ ( \
+		"movl %%cr0, %%eax \n\t" \
+		"orl $8, %%eax \n\t" \
+		"movl %%eax, %%cr0" \
+		: : : "%eax")
+
+// Save the callee-saved registers, flags and data segments on the current
+// stack, store the stack pointer in *saveStack, switch to the page directory
+// (if it's different) and the other stack, and 'return' to wherever it was
+// saved.  That's normally the end of this same code, in another process.
+#define processorContextSwitch(saveStack, loadStack, pageDir) do { \
+	unsigned _save = (unsigned) (saveStack); \
+	unsigned _load = (unsigned) (loadStack); \
+	unsigned _dir = (unsigned) (pageDir); \
+	__asm__ __volatile__ ( \
+		"pushfl \n\t" \
+		"pushl %%ebp \n\t" \
+		"pushl %%ebx \n\t" \
+		"pushl %%esi \n\t" \
+		"pushl %%edi \n\t" \
+		"pushl %%ds \n\t" \
+		"pushl %%es \n\t" \
+		"pushl %%fs \n\t" \
+		"pushl %%gs \n\t" \
+		"pushl $1f \n\t" \
+		"movl %%esp, (%%ecx) \n\t" \
+		"movl %%cr3, %%ecx \n\t" \
+		"cmpl %%ecx, %%eax \n\t" \
+		"je 2f \n\t" \
+		"movl %%eax, %%cr3 \n\t" \
+		"2: movl %%edx, %%esp \n\t" \
+		"ret \n\t" \
+		"1: popl %%gs \n\t" \
+		"popl %%fs \n\t" \
+		"popl %%es \n\t" \
+		"popl %%ds \n\t" \
+		"popl %%edi \n\t" \
+		"popl %%esi \n\t" \
+		"popl %%ebx \n\t" \
+		"popl %%ebp \n\t" \
+		"popfl" \
+		: "+c" (_save), "+d" (_load), "+a" (_dir) : : "memory", "cc"); \
+} while (0)
+
+// Start running new code at the same privilege level, on the given stack
+#define processorTaskStart(stack, eip, cs, eflags, ds) \
+	__asm__ __volatile__ ( \
+		"movl %0, %%esp \n\t" \
+		"pushl %3 \n\t" \
+		"pushl %2 \n\t" \
+		"pushl %1 \n\t" \
+		"movl %4, %%eax \n\t" \
+		"movw %%ax, %%ds \n\t" \
+		"movw %%ax, %%es \n\t" \
+		"movw %%ax, %%fs \n\t" \
+		"movw %%ax, %%gs \n\t" \
+		"iret" \
+		: : "r" (stack), "r" (eip), "i" (cs), "r" (eflags), "i" (ds) \
+		: "%eax", "memory")
+
+// Start running new code at a lower privilege level.  The stack is the
+// supervisor one, and the code gets its own stack.
+#define processorTaskStartUser(stack, eip, cs, eflags, userStack, ss, ds) \
+	__asm__ __volatile__ ( \
+		"movl %0, %%esp \n\t" \
+		"pushl %5 \n\t" \
+		"pushl %4 \n\t" \
+		"pushl %3 \n\t" \
+		"pushl %2 \n\t" \
+		"pushl %1 \n\t" \
+		"movl %6, %%eax \n\t" \
+		"movw %%ax, %%ds \n\t" \
+		"movw %%ax, %%es \n\t" \
+		"movw %%ax, %%fs \n\t" \
+		"movw %%ax, %%gs \n\t" \
+		"iret" \
+		: : "r" (stack), "r" (eip), "i" (cs), "r" (eflags), \
+			"r" (userStack), "i" (ss), "i" (ds) : "%eax", "memory")
+
 #define processorGetInstructionPointer(addr) \
 	__asm__ __volatile__ ( \
 		"call 1f \n\t" \
@@ -404,6 +524,9 @@ typedef volatile struct {
 
 #define processorIntReturn() __asm__ __volatile__ ("iret")
 
+#define processorApiFastEnter(userStack, userReturn) \
+	__asm__ __volatile__ ("sti" : "=c" (userStack), "=d" (userReturn))
+
 #define processorFarReturn() __asm__ __volatile__ ("lret")
 
 #define processorExceptionEnter(exAddr, ints) do { \
@@ -419,6 +542,22 @@ typedef volatile struct {
 	processorIntReturn(); \
 } while (0)
 
+// For exceptions where the processor pushes an error code after the return
+// address.  The error code has to be discarded before returning.
+#define processorExceptionErrorEnter(exAddr, ints) do { \
+	processorPushRegs(); \
+	processorSuspendInts(ints); \
+	__asm__ __volatile__ ("movl 8(%%ebp), %0" : "=r" (exAddr)); \
+} while (0)
+
+#define processorExceptionErrorExit(ints) do { \
+	processorRestoreInts(ints); \
+	processorPopRegs(); \
+	processorPopFrame(); \
+	__asm__ __volatile__ ("addl $4, %%esp" : : : "%esp"); \
+	processorIntReturn(); \
+} while (0)
+
 #define processorIsrEnter(stAddr) do { \
 	processorDisableInts(); \
 	processorPushRegs(); \
@@ -442,6 +581,18 @@ typedef volatile struct {
 	processorFarReturn(); \
 } while (0)
 
+#define processorApiFastExit(userStack, userReturn, codeLo, codeHi) \
+	__asm__ __volatile__ ( \
+		"movl %0, %%eax \n\t" \
+		"movl %1, %%edi \n\t" \
+		"movl %2, %%ecx \n\t" \
+		"movl %3, %%edx \n\t" \
+		"movl %%ebp, %%esp \n\t" \
+		"popl %%ebp \n\t" \
+		"sysexit" \
+		: : "m" (codeLo), "m" (codeHi), "m" (userStack), "m" (userReturn) \
+		: "%eax", "%ecx", "%edx", "%edi")
+
 //
 // Floating point ops
 //
@@ -488,6 +639,19 @@ typedef volatile struct {
 #define processorAddressCacheInvalidatePage(addr) \
 	__asm__ __volatile__ ("invlpg %0" : : "m" (*((char *)(addr))))
 
+// Also flushes 'global' pages, by toggling CR4[PGE]
+#define processorAddressCacheInvalidateAll() do { \
+	unsigned cr4; \
+	processorGetCR4(cr4); \
+	if (cr4 & 0x80) \
+	{ \
+		processorSetCR4(cr4 & ~0x80); \
+		processorSetCR4(cr4); \
+	} \
+	else \
+		processorAddressCacheInvalidate(); \
+} while (0)
+
 //
 // Misc
 //
@@ -501,6 +665,11 @@ typedef volatile struct {
 	__asm__ __volatile__ ("lock cmpxchgl %1, %2" \
 		: : "a" (0), "r" (proc), "m" (lck) : "memory")
 
+// Atomically add value to the variable, and return its old value in value
+#define processorLockFetchAdd(variable, value) \
+	__asm__ __volatile__ ("lock xaddl %0, %1" \
+		: "+r" (value), "+m" (variable) : : "memory")
+
 static inline unsigned short processorSwap16(unsigned short variable)
 {
 	volatile unsigned short tmp = (variable);
@@ -525,6 +694,8 @@ static inline unsigned processorSwap32(unsigned variable)
 	processorPopRegs(); \
 } while (0)
 
+#define processorPause() __asm__ __volatile__ ("pause" : : : "memory")
+
 #define processorHalt() __asm__ __volatile__ ("hlt")
 
 #define processorIdle() do { \
@@ -160,6 +160,7 @@ int filesystemMount(const char *, const char *);
 int filesystemUnmount(const char *);
 uquad_t filesystemGetFreeBytes(const char *);
 unsigned filesystemGetBlockSize(const char *);
+int filesystemTrim(const char *, progress *);
 
 //
 // File functions
@@ -206,6 +207,8 @@ int memoryRelease(void *);
 int memoryReleaseAllByProcId(int);
 int memoryGetStats(memoryStats *, int);
 int memoryGetBlocks(memoryBlock *, unsigned, int);
+int memoryGetCaches(memoryCacheStats *, unsigned);
+void *memoryReserve(unsigned, const char *);
 
 //
 // Multitasker functions
@@ -241,6 +244,7 @@ int multitaskerSignalRead(int);
 int multitaskerGetIoPerm(int, int);
 int multitaskerSetIoPerm(int, int, int);
 int multitaskerStackTrace(int);
+int multitaskerGetNumCpus(void);
 
 //
 // Loader functions
@@ -124,6 +124,7 @@ typedef volatile void * objectKey;
 #define _fnum_filesystemUnmount					0x3008
 #define _fnum_filesystemGetFreeBytes			0x3009
 #define _fnum_filesystemGetBlockSize			0x300A
+#define _fnum_filesystemTrim					0x300B
 
 // File functions.  All are in the 0x4000-0x4FFF range.
 #define _fnum_fileFixupPath						0x4000
@@ -166,6 +167,8 @@ typedef volatile void * objectKey;
 #define _fnum_memoryReleaseAllByProcId			0x5002
 #define _fnum_memoryGetStats					0x5003
 #define _fnum_memoryGetBlocks					0x5004
+#define _fnum_memoryGetCaches					0x5005
+#define _fnum_memoryReserve						0x5006
 
 // Multitasker functions.  All are in the 0x6000-0x6FFF range.
 #define _fnum_multitaskerCreateProcess			0x6000
@@ -199,6 +202,7 @@ typedef volatile void * objectKey;
 #define _fnum_multitaskerGetIoPerm				0x601C
 #define _fnum_multitaskerSetIoPerm				0x601D
 #define _fnum_multitaskerStackTrace				0x601E
+#define _fnum_multitaskerGetNumCpus				0x601F
 
 // Loader functions.  All are in the 0x7000-0x7FFF range.
 #define _fnum_loaderLoad						0x7000
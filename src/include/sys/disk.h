@@ -36,7 +36,6 @@
 #define DISK_MAX_MODELLENGTH		40
 #define DISK_MAX_PARTITIONS			16
 #define DISK_MAX_PRIMARY_PARTITIONS	4
-#define DISK_MAX_CACHE				1048576 // 1 Meg
 #define DISK_NAME_PREFIX_FLOPPY		"fd"
 #define DISK_NAME_PREFIX_CDROM		"cd"
 #define DISK_NAME_PREFIX_SCSIDISK	"sd"
@@ -52,6 +51,7 @@
 #define FS_OP_STAT					0x10
 #define FS_OP_RESIZECONST			0x20
 #define FS_OP_RESIZE				0x40
+#define FS_OP_TRIM					0x80
 
 // Flags to describe what type of disk is described by a disk structure
 #define DISKTYPE_PHYSLOG_MASK		0xF0000000
@@ -81,6 +81,7 @@
 	DISKTYPE_IDEDISK)
 
 // Flags to describe the current state of the disk
+#define DISKFLAG_DISCARD			0x20
 #define DISKFLAG_NOCACHE			0x10
 #define DISKFLAG_READONLY			0x08
 #define DISKFLAG_MOTORON			0x04
@@ -88,6 +89,15 @@
 #define DISKFLAG_DOOROPEN			0x01
 #define DISKFLAG_USERSETTABLE		(DISKFLAG_NOCACHE | DISKFLAG_READONLY)
 
+// Kinds of request, for the latency histograms in the disk stats.  A 'hit'
+// is a read or write that the cache took care of without any disk I/O.
+#define DISKSTAT_READHIT			0
+#define DISKSTAT_READMISS			1
+#define DISKSTAT_WRITEHIT			2
+#define DISKSTAT_WRITEMISS			3
+#define DISKSTAT_KINDS				4
+#define DISKSTAT_BUCKETS			24
+
 // This structure is used to describe an MS-DOS partition tag
 typedef struct {
 	unsigned char tag;
@@ -138,6 +148,37 @@ typedef struct {
 	unsigned readKbytes;
 	unsigned writeTimeMs;
 	unsigned writeKbytes;
+	// Caching.  The hits and misses are counted in sectors read, and the
+	// evictions in cache blocks.
+	uquad_t cacheSize;
+	uquad_t cacheMax;
+	unsigned cacheHits;
+	unsigned cacheMisses;
+	unsigned cacheEvictions;
+	// Requests.  Latencies are in microseconds, and counted by kind of
+	// request.  Bucket n of a histogram counts the requests that took less
+	// than 2^n microseconds (and at least 2^(n-1)), and the last bucket
+	// counts all of the slower ones too.
+	unsigned reads;
+	unsigned writes;
+	unsigned errors;
+	uquad_t latencyUs[DISKSTAT_KINDS];
+	unsigned latency[DISKSTAT_KINDS][DISKSTAT_BUCKETS];
+	// Disk I/O, which includes read-ahead and writing back the cache.  The
+	// service time is how long the driver took, in microseconds.  The queue
+	// depth counts the requests waiting for the driver or with it.  It's
+	// added to the total each time a request is queued, for averaging.
+	unsigned ioReads;
+	unsigned ioWrites;
+	unsigned ioDiscards;
+	uquad_t ioReadKbytes;
+	uquad_t ioWriteKbytes;
+	uquad_t ioReadUs;
+	uquad_t ioWriteUs;
+	unsigned queued;
+	unsigned queueDepth;
+	unsigned queueDepthMax;
+	uquad_t queueDepthTotal;
 
 } diskStats;
 
@@ -95,5 +95,17 @@
 #define KERNELVAR_NET_HOSTNAME		KERNELVAR_NETWORK "." KERNELVAR_HOSTNAME
 #define KERNELVAR_NET_DOMAINNAME	KERNELVAR_NETWORK "." KERNELVAR_DOMAINNAME
 
+// Scheduler
+#define KERNELVAR_SCHEDULER			"scheduler"
+#define KERNELVAR_SLICES			"slices"
+#define KERNELVAR_SCHED_SLICES		KERNELVAR_SCHEDULER "." KERNELVAR_SLICES
+
+// Disks
+#define KERNELVAR_DISK				"disk"
+#define KERNELVAR_CACHE				"cache"
+#define KERNELVAR_WRITEBACK			"writeback"
+#define KERNELVAR_DISK_CACHE		KERNELVAR_DISK "." KERNELVAR_CACHE
+#define KERNELVAR_DISK_WRITEBACK	KERNELVAR_DISK "." KERNELVAR_WRITEBACK
+
 #endif
 
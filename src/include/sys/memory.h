@@ -29,18 +29,26 @@
 #define MEMORY_PAGE_SIZE				4096
 #define MEMORY_BLOCK_SIZE				MEMORY_PAGE_SIZE
 #define MEMORY_MAX_DESC_LENGTH			31
+#define MEMORY_MAX_CACHES				32
 
 #define USER_MEMORY_HEAP_MULTIPLE		(64 * 1024)    // 64 Kb
 #define KERNEL_MEMORY_HEAP_MULTIPLE		(1024 * 1024)  // 1 meg
 
+#define MALLOCBLOCK_FREE				0x01
+#define MALLOCBLOCK_RUN					0x02
+
 typedef struct _mallocBlock {
 	int process;
 	unsigned start;
 	unsigned size;
 	unsigned heapAlloc;
 	unsigned heapAllocSize;
+	int flags;
 	struct _mallocBlock *prev;
 	struct _mallocBlock *next;
+	struct _mallocBlock *adjPrev;
+	struct _mallocBlock *adjNext;
+	struct _mallocBlock *hashNext;
 	const char *function;
 
 } mallocBlock;
@@ -60,9 +68,27 @@ typedef struct {
 	unsigned usedBlocks;
 	unsigned totalMemory;
 	unsigned usedMemory;
+	unsigned freeRanges;
+	unsigned largestFree;
+	unsigned zeroedMemory;
+	unsigned zeroedHits;
+	unsigned zeroedMisses;
 
 } memoryStats;
 
+// Struct that describes one of the kernel's object caches
+typedef struct {
+	char name[MEMORY_MAX_DESC_LENGTH + 1];
+	unsigned objectSize;
+	unsigned slabs;
+	unsigned slabSize;
+	unsigned totalObjects;
+	unsigned usedObjects;
+	unsigned allocs;
+	unsigned frees;
+
+} memoryCacheStats;
+
 // For using malloc() in kernel space
 extern unsigned mallocHeapMultiple;
 
@@ -29,7 +29,7 @@
 #include <sys/user.h>
 
 #define MAX_PROCNAME_LENGTH		63
-#define MAX_PROCESSES			((GDT_SIZE - RES_GLOBAL_DESCRIPTORS))
+#define MAX_PROCESSES			4096
 
 // An enumeration listing possible process states
 typedef enum {
@@ -68,6 +68,7 @@ typedef struct {
 	int parentProcessId;
 	int descendentThreads;
 	int cpuPercent;
+	int cpu;
 	processState state;
 
 } process;
@@ -42,6 +42,10 @@
 	#define PROCESSOR_PAGEFLAG_DIRTY		X86_PAGEFLAG_DIRTY
 	#define PROCESSOR_PAGEFLAG_PAT			X86_PAGEFLAG_PAT
 	#define PROCESSOR_PAGEFLAG_GLOBAL		X86_PAGEFLAG_GLOBAL
+	#define PROCESSOR_PAGEFLAG_RESERVED		X86_PAGEFLAG_SOFTWARE
+	#define PROCESSOR_PAGEFLAG_LARGE		X86_PAGEFLAG_LARGE
+	#define PROCESSOR_PAGEFLAG_LARGEPAT		X86_PAGEFLAG_LARGEPAT
+	#define PROCESSOR_LARGEPAGE_SIZE		X86_LARGEPAGE_SIZE
 
 #else
 	#error "ARCH not defined or not supported"
@@ -83,6 +83,8 @@ typedef struct {
 	int (*memoryRelease)(void *);
 	int (*memoryReleaseSystem)(void *);
 	int (*multitaskerGetCurrentProcessId)(void);
+	void *(*listItemGet)(void);
+	void (*listItemRelease)(void *);
 
 } kernelLibOps;
 
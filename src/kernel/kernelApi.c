@@ -37,6 +37,7 @@
 #include "kernelImage.h"
 #include "kernelKeyboard.h"
 #include "kernelLoader.h"
+#include "kernelMalloc.h"
 #include "kernelMemory.h"
 #include "kernelMisc.h"
 #include "kernelMultitasker.h"
@@ -49,6 +50,8 @@
 #include "kernelRandom.h"
 #include "kernelRtc.h"
 #include "kernelShutdown.h"
+#include "kernelSlab.h"
+#include "kernelSmp.h"
 #include "kernelText.h"
 #include "kernelTouch.h"
 #include "kernelUser.h"
@@ -401,6 +404,9 @@ static kernelArgInfo args_filesystemGetFreeBytes[] =
 	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR } };
 static kernelArgInfo args_filesystemGetBlockSize[] =
 	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR } };
+static kernelArgInfo args_filesystemTrim[] =
+	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR },
+		{ 1, type_ptr, API_ARG_USERPTR } };
 
 static kernelFunctionIndex filesystemFunctionIndex[] = {
 	{ _fnum_filesystemScan, kernelFilesystemScan,
@@ -424,7 +430,9 @@ static kernelFunctionIndex filesystemFunctionIndex[] = {
 	{ _fnum_filesystemGetFreeBytes, kernelFilesystemGetFreeBytes,
 		PRIVILEGE_USER, 1, args_filesystemGetFreeBytes, type_val },
 	{ _fnum_filesystemGetBlockSize, kernelFilesystemGetBlockSize,
-		PRIVILEGE_USER, 1, args_filesystemGetBlockSize, type_val }
+		PRIVILEGE_USER, 1, args_filesystemGetBlockSize, type_val },
+	{ _fnum_filesystemTrim, kernelFilesystemTrim,
+		PRIVILEGE_SUPERVISOR, 2, args_filesystemTrim, type_val }
 };
 
 // File functions (0x4000-0x4FFF range)
@@ -613,6 +621,12 @@ static kernelArgInfo args_memoryGetBlocks[] =
 	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR },
 		{ 1, type_val, API_ARG_ANYVAL },
 		{ 1, type_val, API_ARG_ANYVAL } };
+static kernelArgInfo args_memoryGetCaches[] =
+	{ { 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR },
+		{ 1, type_val, API_ARG_ANYVAL } };
+static kernelArgInfo args_memoryReserve[] =
+	{ { 1, type_val, API_ARG_ANYVAL },
+		{ 1, type_ptr, API_ARG_NONNULLPTR | API_ARG_USERPTR } };
 
 static kernelFunctionIndex memoryFunctionIndex[] = {
 	{ _fnum_memoryGet, kernelMemoryGet,
@@ -624,7 +638,11 @@ static kernelFunctionIndex memoryFunctionIndex[] = {
 	{ _fnum_memoryGetStats, kernelMemoryGetStats,
 		PRIVILEGE_USER, 2, args_memoryGetStats, type_val },
 	{ _fnum_memoryGetBlocks, kernelMemoryGetBlocks,
-		PRIVILEGE_USER, 3, args_memoryGetBlocks, type_val }
+		PRIVILEGE_USER, 3, args_memoryGetBlocks, type_val },
+	{ _fnum_memoryGetCaches, kernelSlabGetCaches,
+		PRIVILEGE_USER, 2, args_memoryGetCaches, type_val },
+	{ _fnum_memoryReserve, kernelMemoryReserve,
+		PRIVILEGE_USER, 2, args_memoryReserve, type_ptr }
 };
 
 // Multitasker functions (0x6000-0x6FFF range)
@@ -766,7 +784,9 @@ static kernelFunctionIndex multitaskerFunctionIndex[] = {
 	{ _fnum_multitaskerSetIoPerm, kernelMultitaskerSetIoPerm,
 		PRIVILEGE_SUPERVISOR, 3, args_multitaskerSetIoPerm, type_val },
 	{ _fnum_multitaskerStackTrace, kernelMultitaskerStackTrace,
-		PRIVILEGE_USER, 1, args_multitaskerStackTrace, type_val }
+		PRIVILEGE_USER, 1, args_multitaskerStackTrace, type_val },
+	{ _fnum_multitaskerGetNumCpus, kernelSmpNumCpus,
+		PRIVILEGE_USER, 0, NULL, type_val }
 };
 
 // Loader functions (0x7000-0x7FFF range)
@@ -1995,55 +2015,151 @@ static kernelFunctionIndex miscFunctionIndex[] = {
 		PRIVILEGE_USER, 0, NULL, type_val }
 };
 
-static kernelFunctionIndex *functionIndex[] = {
-	miscFunctionIndex,
-	textFunctionIndex,
-	diskFunctionIndex,
-	filesystemFunctionIndex,
-	fileFunctionIndex,
-	memoryFunctionIndex,
-	multitaskerFunctionIndex,
-	loaderFunctionIndex,
-	rtcFunctionIndex,
-	randomFunctionIndex,
-	variableListFunctionIndex,	// removed/unused
-	environmentFunctionIndex,
-	graphicFunctionIndex,
-	imageFunctionIndex,
-	fontFunctionIndex,
-	windowFunctionIndex,
-	userFunctionIndex,
-	networkFunctionIndex,
-	ipcFunctionIndex
+#define FUNCTIONINDEX(index) \
+	{ index, (sizeof(index) / sizeof(kernelFunctionIndex)) }
+
+static struct {
+	kernelFunctionIndex *index;
+	int count;
+
+} functionIndex[] = {
+	FUNCTIONINDEX(miscFunctionIndex),
+	FUNCTIONINDEX(textFunctionIndex),
+	FUNCTIONINDEX(diskFunctionIndex),
+	FUNCTIONINDEX(filesystemFunctionIndex),
+	FUNCTIONINDEX(fileFunctionIndex),
+	FUNCTIONINDEX(memoryFunctionIndex),
+	FUNCTIONINDEX(multitaskerFunctionIndex),
+	FUNCTIONINDEX(loaderFunctionIndex),
+	FUNCTIONINDEX(rtcFunctionIndex),
+	FUNCTIONINDEX(randomFunctionIndex),
+	FUNCTIONINDEX(variableListFunctionIndex),	// removed/unused
+	FUNCTIONINDEX(environmentFunctionIndex),
+	FUNCTIONINDEX(graphicFunctionIndex),
+	FUNCTIONINDEX(imageFunctionIndex),
+	FUNCTIONINDEX(fontFunctionIndex),
+	FUNCTIONINDEX(windowFunctionIndex),
+	FUNCTIONINDEX(userFunctionIndex),
+	FUNCTIONINDEX(networkFunctionIndex),
+	FUNCTIONINDEX(ipcFunctionIndex)
 };
 
+#define API_CATEGORIES \
+	((int)(sizeof(functionIndex) / sizeof(functionIndex[0])))
 
-/////////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////
-//
-//  Below here, the functions are exported for external use
-//
-/////////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////
+// The flattened dispatch table.  The entries for each category are
+// contiguous, starting at categoryStart[category].
+static kernelApiEntry *apiTable = NULL;
+static int categoryStart[API_CATEGORIES];
+static int categoryCount[API_CATEGORIES];
 
-void kernelApi(unsigned CS __attribute__((unused)), unsigned *args)
+
+static kernelApiEntry *getEntry(int functionNumber)
 {
-	// This is the initial entry point for the kernel's API.  This
-	// function will be first the recipient of all calls to the global
-	// call gate.  This function will pass a pointer to the rest of the
-	// arguments to the processCall function that does all the real work.
-	// This funcion does the far return.
+	// Find the dispatch table entry for the function number, or NULL
+
+	int category = (functionNumber >> 12);
+	int number = (functionNumber & 0xFFF);
+	kernelApiEntry *entry = NULL;
+
+	// 'misc' functions are in spot 0
+	if (category == 0xFF)
+		category = 0;
+
+	if (!apiTable || (category >= API_CATEGORIES) || (number >= categoryCount[category]))
+		return (entry = NULL);
+
+	entry = &apiTable[categoryStart[category] + number];
+
+	if (entry->functionNumber != functionNumber)
+		return (entry = NULL);
+
+	return (entry);
+}
+
+
+static int checkArgs(kernelApiEntry *entry, unsigned *functionArgs)
+{
+	// Check the arguments of an API call against the information we have
+	// about them.  Returns 0 if they're OK, negative otherwise.
+
+	int status = 0;
+	int count;
+
+	for (count = 0; count < entry->argCount; count ++)
+	{
+		switch (entry->args[count].type)
+		{
+			case type_ptr:
+				if (!functionArgs[count])
+				{
+					if (entry->args[count].content & API_ARG_NONNULLPTR)
+					{
+						kernelError(kernel_error, "API function %x argument "
+							"%d: Pointer is not allowed to be NULL",
+							entry->functionNumber, count);
+						return (status = ERR_NULLPARAMETER);
+					}
+					else
+						break;
+				}
+				if ((functionArgs[count] >= KERNEL_VIRTUAL_ADDRESS) &&
+					(entry->args[count].content & API_ARG_USERPTR))
+				{
+					kernelError(kernel_error, "API function %x argument %d: "
+						"Pointer must point to user memory",
+						entry->functionNumber, count);
+					return (status = ERR_PERMISSION);
+				}
+				if ((functionArgs[count] < KERNEL_VIRTUAL_ADDRESS) &&
+					(entry->args[count].content & API_ARG_KERNPTR))
+				{
+					kernelError(kernel_error, "API function %x argument %d: "
+						"Pointer must point to kernel memory",
+						entry->functionNumber, count);
+					return (status = ERR_PERMISSION);
+				}
+				break;
+
+			case type_val:
+				if (!functionArgs[count] &&
+					(entry->args[count].content & API_ARG_NONZEROVAL))
+				{
+					kernelError(kernel_error, "API function %x argument %d: "
+						"Value must be non-zero", entry->functionNumber,
+						count);
+					return (status = ERR_NULLPARAMETER);
+				}
+				if (((int) functionArgs[count] < 0) &&
+					(entry->args[count].content & API_ARG_POSINTVAL))
+				{
+					kernelError(kernel_error, "API function %x argument %d: "
+						"Value must be a positive integer",
+						entry->functionNumber, count);
+					return (status = ERR_RANGE);
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	return (status = 0);
+}
+
+
+static quad_t processCall(unsigned *args)
+{
+	// This does the real work of an API call, whichever way it was made.
+	// 'args' points to the function number, followed by a pointer to the
+	// function's arguments.
 
 	quad_t status = 0;
-	unsigned statusLo = 0;
-	unsigned statusHi = 0;
 	int functionNumber = 0;
 	unsigned *functionArgs = 0;
-	kernelFunctionIndex *functionEntry = NULL;
-	int currentProc = 0;
-	int currentPriv = 0;
+	kernelApiEntry *functionEntry = NULL;
 	quad_t (*functionPointer)() = NULL;
-	int pushCount = 0;
 	int count;
 	#if defined(DEBUG)
 	const char *symbolName = NULL;
@@ -2053,8 +2169,7 @@ void kernelApi(unsigned CS __attribute__((unused)), unsigned *args)
 	if (!args)
 	{
 		kernelError(kernel_error, "No args supplied to API call");
-		status = ERR_NULLPARAMETER;
-		goto out;
+		return (status = ERR_NULLPARAMETER);
 	}
 
 	// Which function number are we being asked to call?
@@ -2065,173 +2180,206 @@ void kernelApi(unsigned CS __attribute__((unused)), unsigned *args)
 	{
 		kernelError(kernel_error, "Illegal function number %x in API call",
 			functionNumber);
-		status = ERR_NOSUCHENTRY;
-		goto out;
-	}
-
-	if ((functionNumber >> 12) == 0xFF)
-	{
-		// 'misc' functions are in spot 0
-		functionEntry = &functionIndex[0][functionNumber & 0xFFF];
-	}
-	else
-	{
-		functionEntry =
-			&functionIndex[functionNumber >> 12][functionNumber & 0xFFF];
+		return (status = ERR_NOSUCHENTRY);
 	}
 
 	// Is there such a function?
-	if (!functionEntry || (functionEntry->functionNumber != functionNumber))
+	functionEntry = getEntry(functionNumber);
+	if (!functionEntry)
 	{
 		kernelError(kernel_error, "No such API function %x in API call",
 			functionNumber);
-		status = ERR_NOSUCHFUNCTION;
-		goto out;
+		return (status = ERR_NOSUCHFUNCTION);
 	}
 
 	// Does the caller have the adequate privilege level to call this
-	// function?
-	currentProc = kernelMultitaskerGetCurrentProcessId();
-	currentPriv = kernelMultitaskerGetProcessPrivilege(currentProc);
-	if (currentPriv < 0)
+	// function?  The privilege is kept in the process structure.
+	if (!kernelCurrentProcess)
 	{
 		kernelError(kernel_error, "Couldn't determine current privilege "
-			"level in call to API function %x",
-			functionEntry->functionNumber);
+			"level in call to API function %x", functionNumber);
 		if (functionEntry->returnType == type_ptr)
-			status = NULL;
+			return (status = NULL);
 		else
-			status = currentPriv;
-		goto out;
+			return (status = ERR_NOSUCHPROCESS);
 	}
-	else if (currentPriv > functionEntry->privilege)
+	else if (kernelCurrentProcess->privilege > functionEntry->privilege)
 	{
 		kernelError(kernel_error, "Insufficient privilege to invoke API "
-			"function %x", functionEntry->functionNumber);
+			"function %x", functionNumber);
 		if (functionEntry->returnType == type_ptr)
-			status = NULL;
+			return (status = NULL);
 		else
-			status = ERR_PERMISSION;
-		goto out;
+			return (status = ERR_PERMISSION);
 	}
 
-	// Make 'functionPointer' equal the address of the requested kernel
-	// function.
-	functionPointer = functionEntry->functionPointer;
-
 	#if defined(DEBUG)
-	symbolName = kernelLookupClosestSymbol(NULL, functionPointer);
+	symbolName = kernelLookupClosestSymbol(NULL,
+		functionEntry->functionPointer);
 	kernelDebug(debug_api, "Kernel API function %x (%s), %d args ",
 		functionNumber, symbolName, functionEntry->argCount);
 	for (count = 0; count < functionEntry->argCount; count ++)
 		kernelDebug(debug_api, "arg %d=%u", count, functionArgs[count]);
 	#endif // defined(DEBUG)
 
-	// Examine and tally the arguments
-	for (count = 0; count < functionEntry->argCount; count ++)
+	// Examine the arguments, if there's anything to check
+	if (functionEntry->checkArgs)
 	{
-		// Do we have information about the arguments?
-		if (functionEntry->args)
+		status = checkArgs(functionEntry, functionArgs);
+		if (status < 0)
 		{
-			// Check the argument
-			switch (functionEntry->args[count].type)
-			{
-				case type_ptr:
-					if (!functionArgs[count])
-					{
-						if (functionEntry->args[count].content &
-							API_ARG_NONNULLPTR)
-						{
-							kernelError(kernel_error, "API function %x "
-								"argument %d: Pointer is not allowed to be "
-								"NULL",	functionEntry->functionNumber, count);
-							if (functionEntry->returnType == type_ptr)
-								status = NULL;
-							else
-								status = ERR_NULLPARAMETER;
-							goto out;
-						}
-						else
-							break;
-					}
-					if ((functionArgs[count] >= KERNEL_VIRTUAL_ADDRESS) &&
-						(functionEntry->args[count].content & API_ARG_USERPTR))
-					{
-						kernelError(kernel_error, "API function %x argument "
-							"%d: Pointer must point to user memory",
-							functionEntry->functionNumber, count);
-						if (functionEntry->returnType == type_ptr)
-							status = NULL;
-						else
-							status = ERR_PERMISSION;
-						goto out;
-					}
-					if ((functionArgs[count] < KERNEL_VIRTUAL_ADDRESS) &&
-						(functionEntry->args[count].content & API_ARG_KERNPTR))
-					{
-						kernelError(kernel_error, "API function %x argument "
-							"%d: Pointer must point to kernel memory",
-							functionEntry->functionNumber, count);
-						if (functionEntry->returnType == type_ptr)
-							status = NULL;
-						else
-							status = ERR_PERMISSION;
-						goto out;
-					}
-					break;
-
-				case type_val:
-					if (!functionArgs[count] &&
-						(functionEntry->args[count].content &
-							API_ARG_NONZEROVAL))
-					{
-						kernelError(kernel_error, "API function %x argument "
-							"%d: Value must be non-zero",
-							functionEntry->functionNumber, count);
-						if (functionEntry->returnType == type_ptr)
-							status = NULL;
-						else
-							status = ERR_NULLPARAMETER;
-						goto out;
-					}
-					if (((int) functionArgs[count] < 0) &&
-						(functionEntry->args[count].content &
-							API_ARG_POSINTVAL))
-					{
-						kernelError(kernel_error, "API function %x argument "
-							"%d: Value must be a positive integer",
-							functionEntry->functionNumber, count);
-						if (functionEntry->returnType == type_ptr)
-							status = NULL;
-						else
-							status = ERR_RANGE;
-						goto out;
-					}
-					break;
-
-				default:
-					break;
-			}
+			if (functionEntry->returnType == type_ptr)
+				return (status = NULL);
+			else
+				return (status);
 		}
-
-		pushCount += functionEntry->args[count].dwords;
 	}
 
 	// Push each of the args onto the current stack
-	for (count = (pushCount - 1); count >= 0; count --)
+	for (count = (functionEntry->dwords - 1); count >= 0; count --)
 		processorPush(functionArgs[count]);
 
 	// Call the function
+	functionPointer = functionEntry->functionPointer;
 	status = functionPointer();
 
-	statusLo = (status & 0xFFFFFFFF);
-	statusHi = (status >> 32);
-
-out:
 	#if defined(DEBUG)
 	kernelDebug(debug_api, "ret=%lld", status);
 	#endif
 
+	return (status);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+//
+//  Below here, the functions are exported for external use
+//
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+int kernelApiInitialize(void)
+{
+	// Build the flattened dispatch table from the function indexes, so that
+	// API calls need only a single lookup.  Work that doesn't depend on the
+	// arguments themselves, such as counting the dwords to push and deciding
+	// whether there's anything to check, is done here once.
+
+	int status = 0;
+	kernelFunctionIndex *function = NULL;
+	kernelApiEntry *entry = NULL;
+	int total = 0;
+	int category, count, argCount;
+
+	for (category = 0; category < API_CATEGORIES; category ++)
+	{
+		categoryStart[category] = total;
+		categoryCount[category] = functionIndex[category].count;
+		total += functionIndex[category].count;
+	}
+
+	apiTable = kernelMalloc(total * sizeof(kernelApiEntry));
+	if (!apiTable)
+		return (status = ERR_MEMORY);
+
+	for (category = 0; category < API_CATEGORIES; category ++)
+	{
+		for (count = 0; count < categoryCount[category]; count ++)
+		{
+			function = &functionIndex[category].index[count];
+			entry = &apiTable[categoryStart[category] + count];
+
+			// Skip unused slots
+			if (!function->functionNumber)
+				continue;
+
+			// The function number has to match its position
+			if (((function->functionNumber & 0xFFF) != count) ||
+				(((function->functionNumber >> 12) != category) &&
+					!(!category && ((function->functionNumber >> 12) ==
+						0xFF))))
+			{
+				kernelError(kernel_error, "API function %x is out of place",
+					function->functionNumber);
+				continue;
+			}
+
+			entry->functionNumber = function->functionNumber;
+			entry->functionPointer = function->functionPointer;
+			entry->privilege = function->privilege;
+			entry->argCount = function->argCount;
+			entry->args = function->args;
+			entry->returnType = function->returnType;
+
+			for (argCount = 0; argCount < function->argCount; argCount ++)
+			{
+				if (!function->args)
+				{
+					entry->dwords += 1;
+					continue;
+				}
+
+				entry->dwords += function->args[argCount].dwords;
+
+				if (function->args[argCount].content)
+					entry->checkArgs = 1;
+			}
+		}
+	}
+
+	return (status = 0);
+}
+
+
+void kernelApi(unsigned CS __attribute__((unused)), unsigned *args)
+{
+	// This is the initial entry point for the kernel's API.  This
+	// function will be first the recipient of all calls to the global
+	// call gate.  This function will pass a pointer to the rest of the
+	// arguments to the processCall function that does all the real work.
+	// This funcion does the far return.
+
+	quad_t status = 0;
+	unsigned statusLo = 0;
+	unsigned statusHi = 0;
+
+	// Only one processor at a time runs kernel code
+	kernelSmpLock();
+	status = processCall(args);
+	kernelSmpUnlock();
+
+	statusLo = (status & 0xFFFFFFFF);
+	statusHi = (status >> 32);
+
 	processorApiExit(stackAddress, statusLo, statusHi);
 }
 
+
+void kernelApiFast(void)
+{
+	// This is the entry point for API calls made with the SYSENTER
+	// instruction, which is used by user processes when the processor
+	// supports it.  The processor has disabled interrupts and loaded the
+	// process's supervisor stack.  ECX holds the caller's stack pointer,
+	// which points to the same arguments as for the call gate, and EDX holds
+	// the return address.  The high dword of the result is returned in EDI,
+	// since SYSEXIT needs EDX.
+
+	unsigned userStack = 0;
+	unsigned userReturn = 0;
+	quad_t status = 0;
+	unsigned statusLo = 0;
+	unsigned statusHi = 0;
+
+	processorApiFastEnter(userStack, userReturn);
+
+	kernelSmpLock();
+	status = processCall((unsigned *) userStack);
+	kernelSmpUnlock();
+
+	statusLo = (status & 0xFFFFFFFF);
+	statusHi = (status >> 32);
+
+	processorApiFastExit(userStack, userReturn, statusLo, statusHi);
+}
@@ -22,6 +22,8 @@
 #ifndef _KERNELAPI_H
 #define _KERNELAPI_H
 
+#include <sys/types.h>
+
 // Pointer argument types
 #define API_ARG_NONNULLPTR	0x04
 #define API_ARG_USERPTR		0x02
@@ -55,8 +57,24 @@ typedef struct {
 
 } kernelFunctionIndex;
 
+// An entry in the flattened dispatch table, built from the function
+// indexes at initialization time
+typedef struct {
+	int functionNumber;
+	void *functionPointer;
+	int privilege;
+	int argCount;
+	int dwords;
+	int checkArgs;
+	kernelArgInfo *args;
+	kernelArgRetType returnType;
+
+} kernelApiEntry;
+
 // Functions exported from kernelApi.c
+int kernelApiInitialize(void);
 void kernelApi(unsigned, unsigned *);
+void kernelApiFast(void);
 
 #endif
 
@@ -1151,6 +1151,161 @@ void kernelApicDriverRegister(kernelDriver *driver)
 }
 
 
+int kernelApicGetId(void)
+{
+	// Returns the local APIC ID of the current processor
+
+	if (!localApicRegs)
+		return (ERR_NOTINITIALIZED);
+
+	return (readLocalReg(APIC_LOCALREG_APICID) >> 24);
+}
+
+
+void kernelApicEndOfInterrupt(void)
+{
+	// Acknowledge an interrupt that was delivered by the current processor's
+	// local APIC, such as its timer or an inter-processor interrupt
+
+	writeLocalReg(APIC_LOCALREG_EOI, 0);
+}
+
+
+int kernelApicSendIpi(int apicId, unsigned command)
+{
+	// Send an inter-processor interrupt to the processor with the supplied
+	// local APIC ID.  The command is the value for the low interrupt command
+	// register: the delivery mode and vector.
+
+	int status = 0;
+	int count;
+
+	if (!localApicRegs)
+		return (status = ERR_NOTINITIALIZED);
+
+	// Wait for any previous one to be accepted
+	for (count = 0; (readLocalReg(APIC_LOCALREG_INTCMDLO) &
+		APIC_IPI_PENDING); count ++)
+	{
+		if (count >= 100000)
+			return (status = ERR_TIMEOUT);
+
+		processorPause();
+	}
+
+	// The destination goes in the high register, and writing the low one
+	// sends it
+	writeLocalReg(APIC_LOCALREG_INTCMDHI, ((unsigned) apicId << 24));
+	writeLocalReg(APIC_LOCALREG_INTCMDLO, command);
+
+	return (status = 0);
+}
+
+
+int kernelApicStartCpu(int apicId, unsigned startAddress)
+{
+	// Start an application processor with the INIT-SIPI-SIPI sequence.  The
+	// start address is the (page-aligned, below 1MB) physical address of its
+	// real-mode startup code.
+
+	int status = 0;
+	int count;
+
+	if (!localApicRegs)
+		return (status = ERR_NOTINITIALIZED);
+
+	if ((startAddress & (MEMORY_PAGE_SIZE - 1)) || (startAddress >= 0x100000))
+		return (status = ERR_ALIGN);
+
+	kernelDebug(debug_io, "APIC starting CPU with local APIC ID %d at "
+		"0x%05x", apicId, startAddress);
+
+	status = kernelApicSendIpi(apicId, APIC_IPI_INIT);
+	if (status < 0)
+		return (status);
+
+	kernelCpuSpinMs(10);
+
+	for (count = 0; count < 2; count ++)
+	{
+		status = kernelApicSendIpi(apicId, (APIC_IPI_STARTUP |
+			((startAddress >> 12) & 0xFF)));
+		if (status < 0)
+			return (status);
+
+		kernelCpuSpinMs(1);
+	}
+
+	return (status = 0);
+}
+
+
+int kernelApicInitializeCpu(void)
+{
+	// Enable the local APIC of an application processor.  Device interrupts
+	// are only routed to the boot processor, so it doesn't get a logical
+	// destination or any local interrupt assignments.
+
+	int status = 0;
+
+	if (!localApicRegs || !getLocalApicBase())
+		return (status = ERR_NOTINITIALIZED);
+
+	kernelDebug(debug_io, "APIC initialize CPU local APIC ID=%d",
+		(readLocalReg(APIC_LOCALREG_APICID) >> 24));
+
+	// Accept all interrupts
+	writeLocalReg(APIC_LOCALREG_TASKPRI, 0);
+
+	// Mask off the local interrupt vectors
+	writeLocalReg(APIC_LOCALREG_LVT_TIMER, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_LVT_PERFCNT, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_LVT_LINT0, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_LVT_LINT1, (1 << 16));
+	writeLocalReg(APIC_LOCALREG_LVT_ERROR, (1 << 16));
+
+	// Flat model, and no logical destination
+	writeLocalReg(APIC_LOCALREG_DESTFMT,
+		(readLocalReg(APIC_LOCALREG_DESTFMT) | (0xF << 28)));
+	writeLocalReg(APIC_LOCALREG_LOGDEST,
+		(readLocalReg(APIC_LOCALREG_LOGDEST) & 0x00FFFFFF));
+
+	// Enable it, with the same spurious interrupt vector as the boot CPU
+	writeLocalReg(APIC_LOCALREG_SPURINT,
+		(readLocalReg(APIC_LOCALREG_SPURINT) | 0x000001FF));
+
+	return (status = 0);
+}
+
+
+void kernelApicTimerSetup(int vector)
+{
+	// Set up the current processor's local APIC timer for one-shot
+	// countdowns that raise the supplied interrupt vector.  The timer doesn't
+	// start until a count is written.
+
+	writeLocalReg(APIC_LOCALREG_TIMERDIV, APIC_TIMER_DIVIDE);
+	writeLocalReg(APIC_LOCALREG_LVT_TIMER, (vector & 0xFF));
+}
+
+
+void kernelApicTimerStart(unsigned count)
+{
+	// Start a one-shot countdown of the local APIC timer.  A count of zero
+	// stops it.
+
+	writeLocalReg(APIC_LOCALREG_TIMERINIT, count);
+}
+
+
+unsigned kernelApicTimerRead(void)
+{
+	// Returns the remaining count of the local APIC timer
+
+	return (readLocalReg(APIC_LOCALREG_TIMERCURR));
+}
+
+
 #ifdef DEBUG
 void kernelApicDebug(void)
 {
@@ -50,12 +50,29 @@
 #define APIC_LOCALREG_TIMERDIV		0x3E0
 // *support depends on processor version
 
+// Interrupt command register values for inter-processor interrupts
+#define APIC_IPI_FIXED				0x00004000
+#define APIC_IPI_INIT				0x00004500
+#define APIC_IPI_STARTUP			0x00004600
+#define APIC_IPI_PENDING			0x00001000
+
+// Local APIC timer divide configuration (divide by 16)
+#define APIC_TIMER_DIVIDE			0x3
+
 typedef struct {
 	unsigned char id;
 	volatile unsigned *regs;
 
 } kernelIoApic;
 
+int kernelApicGetId(void);
+void kernelApicEndOfInterrupt(void);
+int kernelApicSendIpi(int, unsigned);
+int kernelApicStartCpu(int, unsigned);
+int kernelApicInitializeCpu(void);
+void kernelApicTimerSetup(int);
+void kernelApicTimerStart(unsigned);
+unsigned kernelApicTimerRead(void);
 void kernelApicDebug(void);
 
 #endif
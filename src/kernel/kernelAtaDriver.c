@@ -33,6 +33,7 @@ static ataFeature features[] = {
 	{ "read caching",		82, 0x0040, 0xAA, 85, 0x0040, ATA_FEATURE_RCACHE },
 	{ "media status",		83, 0x0010, 0x95, 86, 0x0010, ATA_FEATURE_MEDSTAT },
 	{ "48-bit addressing",	83, 0x0400, 0, 0, 0, ATA_FEATURE_48BIT },
+	{ "TRIM",				169, 0x0001, 0, 0, 0, ATA_FEATURE_TRIM },
 	{ NULL, 0, 0, 0, 0, 0, 0 }
 };
 
@@ -107,6 +108,7 @@ ataCommandType kernelAtaCommandType(unsigned char ataCommand)
 		case ATA_IDENTIFY:
 			return (ata_pio);
 
+		case ATA_DATASETMGMT:
 		case ATA_READDMA_EXT:
 		case ATA_WRITEDMA_EXT:
 		case ATA_READDMA:
@@ -134,3 +136,30 @@ ataDmaMode *kernelAtaGetDmaModes(void)
 	return (dmaModes);
 }
 
+
+unsigned kernelAtaTrimRanges(unsigned long long *ranges,
+	unsigned long long *lba, unsigned long long *numSectors)
+{
+	// Fill a 512-byte block of DATA SET MANAGEMENT TRIM ranges, taking as
+	// many sectors as will fit from the start of the supplied range, and
+	// advancing it past them.  Unused ranges are zero.  Returns the number
+	// of ranges used.
+
+	unsigned count = 0;
+	unsigned sectors = 0;
+
+	memset(ranges, 0, (ATA_TRIM_RANGES * sizeof(unsigned long long)));
+
+	for (count = 0; (count < ATA_TRIM_RANGES) && *numSectors; count ++)
+	{
+		sectors = min(*numSectors, ATA_TRIM_MAXSECTORS);
+
+		ranges[count] = ((*lba & 0x0000FFFFFFFFFFFFULL) |
+			((unsigned long long) sectors << 48));
+
+		*lba += sectors;
+		*numSectors -= sectors;
+	}
+
+	return (count);
+}
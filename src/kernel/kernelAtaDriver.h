@@ -30,6 +30,7 @@
 
 // ATA commands
 #define ATA_NOP					0x00
+#define ATA_DATASETMGMT			0x06
 #define ATA_ATAPIRESET			0x08
 //#define ATA_RECALIBRATE		0x10	// Obsolete
 #define ATA_READSECTS			0x20
@@ -37,6 +38,7 @@
 #define ATA_READSECTS_EXT		0x24
 #define ATA_READDMA_EXT			0x25
 #define ATA_READMULTI_EXT		0x29
+#define ATA_READLOGEXT			0x2F
 #define ATA_WRITESECTS			0x30
 //#define ATA_WRITEECC			0x32	// Obsolete
 #define ATA_WRITESECTS_EXT		0x34
@@ -44,6 +46,8 @@
 #define ATA_WRITEMULTI_EXT		0x39
 #define ATA_VERIFYMULTI			0x40
 //#define ATA_FORMATTRACK		0x50	// Obsolete
+#define ATA_READFPDMA			0x60	// NCQ
+#define ATA_WRITEFPDMA			0x61	// NCQ
 //#define ATA_SEEK				0x70	// Obsolete
 #define ATA_DIAG				0x90
 //#define ATA_INITPARAMS		0x91	// Reserved
@@ -61,6 +65,11 @@
 #define ATA_IDENTIFY			0xEC
 #define ATA_SETFEATURES			0xEF
 
+// General purpose log addresses, and the fields of the NCQ command error log
+#define ATA_LOG_NCQERROR		0x10
+#define ATA_NCQERROR_NQ			0x80	// Error wasn't for a queued command
+#define ATA_NCQERROR_TAG		0x1F
+
 // ATAPI commands
 #define ATAPI_TESTREADY			0x00
 #define ATAPI_REQUESTSENSE		0x03
@@ -109,6 +118,8 @@
 
 // ATA feature flags.  These don't represent all possible features; just the
 // ones we [plan to] support.
+#define ATA_FEATURE_TRIM		0x200
+#define ATA_FEATURE_NCQ			0x100
 #define ATA_FEATURE_48BIT		0x80
 #define ATA_FEATURE_MEDSTAT		0x40
 #define ATA_FEATURE_WCACHE		0x20
@@ -119,6 +130,12 @@
 #define ATA_FEATURE_MWDMA		0x02
 #define ATA_FEATURE_MULTI		0x01
 
+// DATA SET MANAGEMENT.  A TRIM command takes a 512-byte block (or more) of
+// ranges, each of which is a 48-bit LBA and a 16-bit sector count.
+#define ATA_DSM_TRIM			0x01
+#define ATA_TRIM_RANGES			64
+#define ATA_TRIM_MAXSECTORS		0xFFFF
+
 // ATA transfer modes.
 #define ATA_TRANSMODE_UDMA6		0x46
 #define ATA_TRANSMODE_UDMA5		0x45
@@ -192,7 +209,7 @@ typedef union {
 		unsigned strmPerfGran;			// 0xC4		| word 98-99
 		unsigned long long maxLba48;	// 0xC8		| word 100-103
 		unsigned short strmXferTimePio;	// 0xD0		| word 104		| ATA 7
-		unsigned short reserved6;		// 0xD2		| word 105		| ATA 7
+		unsigned short maxDsmBlocks;	// 0xD2		| word 105		| ATA 8
 		unsigned short physLogSectSize;	// 0xD4		| word 106		| ATA 7
 		unsigned short intrSeekDelay;	// 0xD6		| word 107		| ATA 7
 		unsigned short naaIeeeHi;		// 0xD8		| word 108		| ATA 7
@@ -207,9 +224,11 @@ typedef union {
 		unsigned short securityStatus;	// 0x100	| word 128
 		unsigned short vendorSpec[31];	// 0x102	| word 129-159
 		unsigned short cfaPowerMode1;	// 0x140	| word 160
-		unsigned short reserved10[15];	// 0x142	| word 161-175
+		unsigned short reserved10[8];	// 0x142	| word 161-168
+		unsigned short dataSetMgmt;		// 0x152	| word 169		| ATA 8
+		unsigned short reserved11[6];	// 0x154	| word 170-175
 		unsigned short mediaSerial[30];	// 0x160	| word 176-205
-		unsigned short reserved11[49];	// 0x19C	| word 206-254
+		unsigned short reserved12[49];	// 0x19C	| word 206-254
 		unsigned short integrity;		// 0x1FE	| word 255
 
 	} __attribute__((packed)) field;
@@ -381,6 +400,8 @@ int kernelAtaCommandIsAtapi(unsigned char);
 ataCommandType kernelAtaCommandType(unsigned char);
 ataFeature *kernelAtaGetFeatures(void);
 ataDmaMode *kernelAtaGetDmaModes(void);
+unsigned kernelAtaTrimRanges(unsigned long long *, unsigned long long *,
+	unsigned long long *);
 
 #endif
 
@@ -132,6 +132,7 @@ static int driverDetectCpu(void *parent, kernelDriver *driver)
 		processorId(1, rega, regb, regc, regd);
 
 		features.cpuid1 = 1;
+		features.cpuid1Eax = rega;
 		features.cpuid1Ecx = regc;
 		features.cpuid1Edx = regd;
 
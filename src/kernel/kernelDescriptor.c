@@ -197,19 +197,92 @@ int kernelDescriptorInitialize(void)
 		// Something went wrong
 		return (status);
 
+	// Make the descriptors used by the SYSENTER/SYSEXIT fast API path.  These
+	// are copies of the ones above, but the processor requires them to be
+	// consecutive.
+	status = kernelDescriptorSet(
+		SYSENTER_CODE,			// SYSENTER code selector number
+		0,						// Starts at zero
+		0x000FFFFF,				// Maximum size
+		1,						// Present in memory
+		PRIVILEGE_SUPERVISOR,	// Supervisor privilege
+		1,						// Code segments are not system segs
+		0xA,					// Code, non-conforming, readable
+		1,						// LARGE size granularity
+		1);						// 32-bit code segment
+
+	if (status < 0)
+		// Something went wrong
+		return (status);
+
+	status = kernelDescriptorSet(
+		SYSENTER_STACK,			// SYSENTER stack selector number
+		0,						// Starts at zero
+		0x000FFFFF,				// Maximum size
+		1,						// Present in memory
+		PRIVILEGE_SUPERVISOR,	// Supervisor privilege
+		1,						// Stack segments are not system segs
+		0x2,					// Stack, expand-up, writable
+		1,						// LARGE size granularity
+		1);						// 32-bit stack segment
+
+	if (status < 0)
+		// Something went wrong
+		return (status);
+
+	status = kernelDescriptorSet(
+		SYSEXIT_CODE,			// SYSEXIT code selector number
+		0,						// Starts at zero
+		0x000FFFFF,				// Maximum size
+		1,						// Present in memory
+		PRIVILEGE_USER,			// User privilege
+		1,						// Code segments are not system segs
+		0xA,					// Code, non-conforming, readable
+		1,						// LARGE size granularity
+		1);						// 32-bit code segment
+
+	if (status < 0)
+		// Something went wrong
+		return (status);
+
+	status = kernelDescriptorSet(
+		SYSEXIT_STACK,			// SYSEXIT stack selector number
+		0,						// Starts at zero
+		0x000FFFFF,				// Maximum size
+		1,						// Present in memory
+		PRIVILEGE_USER,			// User privilege
+		1,						// Stack segments are not system segs
+		0x2,					// Stack, expand-up, writable
+		1,						// LARGE size granularity
+		1);						// 32-bit stack segment
+
+	if (status < 0)
+		// Something went wrong
+		return (status);
+
 	// Initialize the list of "free" descriptors
 	numFreeDescriptors = (GDT_SIZE - RES_GLOBAL_DESCRIPTORS);
 
 	for (count = 0; count < numFreeDescriptors; count ++)
 		freeDescriptors[count] = ((count + RES_GLOBAL_DESCRIPTORS) * 8);
 
-	// Now we can install our new GDT
+	// Now we can install our new GDT and IDT
+	kernelDescriptorLoad();
+
+	return (status = 0);
+}
+
+
+void kernelDescriptorLoad(void)
+{
+	// Load the GDT and IDT into the current processor.  Called at
+	// initialization time, and by each additional processor as it starts up.
+
+	// Install our GDT
 	processorSetGDT((void *) globalDescriptorTable, (GDT_SIZE * 8));
 
-	// And our new IDT
+	// And our IDT
 	processorSetIDT((void *) interruptDescriptorTable, (IDT_SIZE * 8));
-
-	return (status = 0);
 }
 
 
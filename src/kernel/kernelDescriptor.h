@@ -35,8 +35,17 @@
 #define USER_DATA				0x0000002B
 #define USER_STACK				0x00000033
 #define KERNEL_CALLGATE			0x0000003B
+// SYSENTER and SYSEXIT need their code and stack segments in this order
+#define SYSENTER_CODE			0x00000040
+#define SYSENTER_STACK			0x00000048
+#define SYSEXIT_CODE			0x00000053
+#define SYSEXIT_STACK			0x0000005B
+// Each CPU has a TSS at a fixed selector, so that the CPU number can be
+// determined from the task register
+#define CPU_TSS_SELECTORS		16
+#define CPU_TSS_SELECTOR(cpu)	(0x00000060 + ((cpu) * 8))
 
-#define RES_GLOBAL_DESCRIPTORS	8	// (0 is unusable)
+#define RES_GLOBAL_DESCRIPTORS	(12 + CPU_TSS_SELECTORS)	// (0 is unusable)
 #define GDT_SIZE				1024
 #define IDT_SIZE				256
 
@@ -60,6 +69,7 @@ typedef struct {
 
 // Functions exported by kernelDescriptor.c
 int kernelDescriptorInitialize(void);
+void kernelDescriptorLoad(void);
 int kernelDescriptorRequest(volatile kernelSelector *);
 int kernelDescriptorRelease(kernelSelector descriptorNumber);
 int kernelDescriptorSetUnformatted(volatile kernelSelector, unsigned char,
@@ -37,6 +37,7 @@
 #include "kernelParameters.h"
 #include "kernelRamDiskDriver.h"
 #include "kernelRandom.h"
+#include "kernelSlab.h"
 #include "kernelSysTimer.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -60,6 +61,8 @@ static char bootDisk[DISK_MAX_NAMELENGTH + 1];
 #define IOMODE_READ		0x01
 #define IOMODE_WRITE	0x02
 #define IOMODE_NOCACHE	0x04
+#define IOMODE_UNLOCK	0x08	// Let go of the disk while waiting
+#define IOMODE_DISCARD	0x10	// The sectors' contents aren't needed
 
 // For the disk thread
 static int threadPid = 0;
@@ -223,8 +226,25 @@ static gptPartType gptPartTypes[] = {
 	{ GUID_UNUSED,		GUID_UNUSED_DESC }
 };
 
+static kernelSlabCache cacheBlockCache;
+static kernelSlabCache cacheDataCache;
 static int initialized = 0;
 
+#if (DISK_CACHE)
+// The memory budget shared by the caches of all the disks
+static uquad_t cacheMax = DISK_CACHE_MIN;
+// Counts cache accesses, so that blocks can be put in LRU order across disks
+static uquad_t cacheClock = 0;
+// Dirty data is written back by the disk thread once it's this old
+static unsigned writebackAgeMs = DISK_WRITEBACK_AGE_MS;
+
+static void cachePrune(kernelPhysicalDisk *);
+static uquad_t cacheWriteback(kernelPhysicalDisk *, uquad_t);
+#endif // DISK_CACHE
+
+// The disk thread sleeps on this
+static kernelWaitQueue threadWaitQueue;
+
 
 #if defined(DEBUG)
 static void debugLockCheck(kernelPhysicalDisk *physicalDisk,
@@ -284,10 +304,19 @@ __attribute__((noreturn))
 static void diskThread(void)
 {
 	// This thread will be spawned at inititialization time to do any required
-	// ongoing operations on disks, such as shutting off floppy and CD/DVD
-	// motors
+	// ongoing operations on disks, such as writing back dirty cache data and
+	// shutting off floppy and CD/DVD motors.  Rather than waking up regularly
+	// to check, it sleeps until the earliest time that dirty data could need
+	// writing, or a running motor could need to be switched off.  Otherwise,
+	// it only checks once in a while, unless it's woken up because there's
+	// too much dirty data.
 
 	kernelPhysicalDisk *physicalDisk = NULL;
+	uquad_t currentTime = 0;
+	uquad_t wakeTime = 0;
+	#if (DISK_CACHE)
+	uquad_t writebackTime = 0;
+	#endif
 	int count;
 
 	// Don't try to do anything until we have registered disks
@@ -296,29 +325,67 @@ static void diskThread(void)
 
 	while (1)
 	{
+		currentTime = kernelCpuGetMs();
+		wakeTime = (currentTime + DISK_THREAD_IDLE_MS);
+
 		// Loop for each physical disk
 		for (count = 0; count < physicalDiskCounter; count ++)
 		{
 			physicalDisk = physicalDisks[count];
 
-			// If the disk is a floppy and has been idle for >= 2 seconds,
-			// turn off the motor.
-			if ((physicalDisk->type & DISKTYPE_FLOPPY) &&
-				(kernelSysTimerRead() > (physicalDisk->lastAccess + 40)))
+			#if (DISK_CACHE)
+			// Write back any dirty cache data that's due
+			if (physicalDisk->cache.dirty &&
+				(kernelLockGet(&physicalDisk->lock) >= 0))
+			{
+				writebackTime = cacheWriteback(physicalDisk, currentTime);
+				if (writebackTime && (writebackTime < wakeTime))
+					wakeTime = writebackTime;
+
+				kernelLockRelease(&physicalDisk->lock);
+			}
+			#endif // DISK_CACHE
+
+			if (!(physicalDisk->type & DISKTYPE_FLOPPY) ||
+				!(physicalDisk->flags & DISKFLAG_MOTORON))
+			{
+				continue;
+			}
+
+			// If the floppy has been idle for long enough, turn off the
+			// motor.  Otherwise, make sure we wake up in time to do it.
+			if (currentTime >= physicalDisk->motorOffTime)
 			{
 				// Lock the disk
 				if (kernelLockGet(&physicalDisk->lock) < 0)
 					continue;
 
-				motorOff(physicalDisk);
+				// Requests can still be in its queue, if the processes that
+				// made them let go of the disk while they waited
+				if (!physicalDisk->queue.head && !physicalDisk->queue.numActive)
+					motorOff(physicalDisk);
 
 				// Unlock the disk
 				kernelLockRelease(&physicalDisk->lock);
 			}
+			else if (physicalDisk->motorOffTime < wakeTime)
+			{
+				wakeTime = physicalDisk->motorOffTime;
+			}
 		}
 
-		// Yield the rest of the timeslice and wait for 1 second
-		kernelMultitaskerWait(MS_PER_SEC);
+		#if (DISK_CACHE)
+		// Give memory back if it's running low
+		cachePrune(NULL);
+		#endif // DISK_CACHE
+
+		// Sleep until then
+		currentTime = kernelCpuGetMs();
+		if (wakeTime > currentTime)
+		{
+			kernelMultitaskerWaitQueueSleep(&threadWaitQueue,
+				(unsigned)(wakeTime - currentTime));
+		}
 	}
 }
 
@@ -340,916 +407,1919 @@ static int spawnDiskThread(void)
 }
 
 
-static int realReadWrite(kernelPhysicalDisk *physicalDisk,
-	uquad_t startSector, uquad_t numSectors, void *data, unsigned mode)
+static unsigned elapsedUs(uquad_t startTime)
 {
-	// This function does all real, physical disk reads or writes.
-
-	int status = 0;
-	kernelDiskOps *ops = (kernelDiskOps *) physicalDisk->driver->ops;
-	processState tmpState;
+	// Returns the number of microseconds since the CPU timestamp 'startTime'
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	return ((unsigned)((kernelCpuTimestamp() - startTime) /
+		max((kernelCpuTimestampFreq() / US_PER_SEC), 1)));
+}
 
-	// Update the 'last access' value
-	physicalDisk->lastAccess = kernelSysTimerRead();
 
-	// Make sure the disk thread is running
-	if (kernelMultitaskerGetProcessState(threadPid, &tmpState) < 0)
-		// Re-spawn the disk thread
-		spawnDiskThread();
+static void statsLatency(kernelPhysicalDisk *physicalDisk, int kind,
+	unsigned us)
+{
+	// Count the latency of a read or write request in the disk's histogram
+	// for that kind of request
 
-	// Make sure the device driver function is available.
-	if (((mode & IOMODE_READ) && !ops->driverReadSectors) ||
-		((mode & IOMODE_WRITE) && !ops->driverWriteSectors))
-	{
-		kernelError(kernel_error, "Disk %s cannot %s", physicalDisk->name,
-			((mode & IOMODE_READ)? "read" : "write"));
-		return (status = ERR_NOSUCHFUNCTION);
-	}
+	int bucket = 0;
 
-	// Do the actual read/write operation
+	while ((us >> bucket) && (bucket < (DISKSTAT_BUCKETS - 1)))
+		bucket += 1;
 
-	kernelDebug(debug_io, "Disk %s %s %llu sectors at %llu",
-		physicalDisk->name, ((mode & IOMODE_READ)? "read" : "write"),
-		numSectors, startSector);
+	physicalDisk->stats.latencyUs[kind] += us;
+	physicalDisk->stats.latency[kind][bucket] += 1;
+}
 
-	if (mode & IOMODE_READ)
-		status = ops->driverReadSectors(physicalDisk->deviceNumber,
-			startSector, numSectors, data);
-	else
-		status = ops->driverWriteSectors(physicalDisk->deviceNumber,
-			startSector, numSectors, data);
 
-	kernelDebug(debug_io, "Disk %s done %sing %llu sectors at %llu",
-		physicalDisk->name, ((mode & IOMODE_READ)? "read" : "writ"),
-		numSectors, startSector);
+static void statsIo(kernelPhysicalDisk *physicalDisk,
+	kernelDiskRequest *request, unsigned us)
+{
+	// Count a request that the driver has done (along with any that were
+	// merged with it, as one operation).  The caller must have interrupts
+	// suspended.
 
-	// Update the 'last access' value again
-	physicalDisk->lastAccess = kernelSysTimerRead();
+	uquad_t kbytes = ((request->ioSectors * physicalDisk->sectorSize) / 1024);
 
-	if (status < 0)
+	if (request->mode & IOMODE_DISCARD)
 	{
-		// If it is a write-protect error, mark the disk as read only
-		if ((mode & IOMODE_WRITE) && (status == ERR_NOWRITE))
-		{
-			kernelError(kernel_error, "Disk %s is write-protected",
-				physicalDisk->name);
-			physicalDisk->flags |= DISKFLAG_READONLY;
-		}
-		else
-		{
-			kernelError(kernel_error, "Error %d %sing %llu sectors at %llu, "
-				"disk %s", status, ((mode & IOMODE_READ)? "read" : "writ"),
-				numSectors, startSector, physicalDisk->name);
-		}
+		physicalDisk->stats.ioDiscards += 1;
+	}
+	else if (request->mode & IOMODE_READ)
+	{
+		physicalDisk->stats.ioReads += 1;
+		physicalDisk->stats.ioReadKbytes += kbytes;
+		physicalDisk->stats.ioReadUs += us;
+	}
+	else
+	{
+		physicalDisk->stats.ioWrites += 1;
+		physicalDisk->stats.ioWriteKbytes += kbytes;
+		physicalDisk->stats.ioWriteUs += us;
 	}
-
-	return (status);
 }
 
 
-#if (DISK_CACHE)
+static void queueInsert(kernelDiskQueue *queue, kernelDiskRequest *request)
+{
+	// Insert a request into the queue, which is sorted by starting sector
 
-#define bufferEnd(buffer) (buffer->startSector + buffer->numSectors - 1)
-#define bufferBytes(physicalDisk, buffer) \
-	(buffer->numSectors * physicalDisk->sectorSize)
+	kernelDiskRequest **entry = (kernelDiskRequest **) &queue->head;
 
-static inline void cacheMarkDirty(kernelPhysicalDisk *physicalDisk,
-	kernelDiskCacheBuffer *buffer)
-{
-	if (!buffer->dirty)
-	{
-		buffer->dirty = 1;
-		physicalDisk->cache.dirty += 1;
-	}
+	while (*entry && ((*entry)->ioStart <= request->ioStart))
+		entry = (kernelDiskRequest **) &(*entry)->next;
+
+	request->next = *entry;
+	*entry = request;
+	queue->numQueued += 1;
 }
 
 
-static inline void cacheMarkClean(kernelPhysicalDisk *physicalDisk,
-	kernelDiskCacheBuffer *buffer)
+static void queueRemove(kernelDiskQueue *queue, kernelDiskRequest *request)
 {
-	if (buffer->dirty)
+	// Take a request out of the queue
+
+	kernelDiskRequest **entry = (kernelDiskRequest **) &queue->head;
+
+	while (*entry && (*entry != request))
+		entry = (kernelDiskRequest **) &(*entry)->next;
+
+	if (*entry)
 	{
-		buffer->dirty = 0;
-		physicalDisk->cache.dirty -= 1;
+		*entry = request->next;
+		queue->numQueued -= 1;
 	}
+
+	request->next = NULL;
 }
 
 
-static int cacheSync(kernelPhysicalDisk *physicalDisk)
+static void queueAdd(kernelPhysicalDisk *physicalDisk,
+	kernelDiskRequest *request)
 {
-	// Write all dirty cached buffers to the disk
-
-	int status = 0;
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
-	int errors = 0;
-
-	debugLockCheck(physicalDisk, __FUNCTION__);
-
-	if (!physicalDisk->cache.dirty || (physicalDisk->flags &
-		DISKFLAG_READONLY))
+	// Add a request to the disk's queue.  If there's a queued request of the
+	// same kind that's adjacent to it (or that it overlaps, if both are
+	// reads), and the two together aren't too big, chain it to that one
+	// instead, so that the driver does both in a single operation.  The
+	// caller must have interrupts suspended.
+
+	kernelDiskQueue *queue = &physicalDisk->queue;
+	kernelDiskRequest *entry = NULL;
+	uquad_t maxSectors = 0;
+	uquad_t requestEnd = 0;
+	uquad_t entryEnd = 0;
+	uquad_t newStart = 0;
+	uquad_t newEnd = 0;
+
+	request->ioStart = request->startSector;
+	request->ioSectors = request->numSectors;
+	requestEnd = (request->startSector + request->numSectors);
+
+	// Discards have no data to combine
+	if (request->mode & IOMODE_DISCARD)
 	{
-		return (status = 0);
+		queueInsert(queue, request);
+		return;
 	}
 
-	while (buffer)
-	{
-		if (buffer->dirty)
-		{
-			status = realReadWrite(physicalDisk, buffer->startSector,
-				buffer->numSectors, buffer->data, IOMODE_WRITE);
-			if (status < 0)
-				errors = status;
-			else
-				cacheMarkClean(physicalDisk, buffer);
-		}
+	maxSectors = max((DISK_QUEUE_MERGE_MAX / physicalDisk->sectorSize), 1);
 
-		buffer = buffer->next;
-	}
+	for (entry = queue->head; entry; entry = entry->next)
+	{
+		if (entry->mode != request->mode)
+			continue;
 
-	return (status = errors);
-}
+		entryEnd = (entry->ioStart + entry->ioSectors);
 
+		if (request->mode & IOMODE_WRITE)
+		{
+			// The order of overlapping writes matters, so only adjacent ones
+			if ((request->startSector != entryEnd) &&
+				(requestEnd != entry->ioStart))
+			{
+				continue;
+			}
+		}
+		else
+		{
+			if ((request->startSector > entryEnd) ||
+				(requestEnd < entry->ioStart))
+			{
+				continue;
+			}
+		}
 
-static kernelDiskCacheBuffer *cacheGetBuffer(kernelPhysicalDisk *physicalDisk,
-	uquad_t startSector, uquad_t numSectors)
-{
-	// Get a new cache buffer for the specified number of sectors.
+		newStart = min(entry->ioStart, request->startSector);
+		newEnd = max(entryEnd, requestEnd);
 
-	kernelDiskCacheBuffer *buffer = NULL;
+		if ((newEnd - newStart) > maxSectors)
+			continue;
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+		kernelDebug(debug_io, "Disk %s merge %llu sectors at %llu with %llu "
+			"at %llu", physicalDisk->name, request->numSectors,
+			request->startSector, entry->ioSectors, entry->ioStart);
 
-	// Get memory for the structure
-	buffer = kernelMalloc(sizeof(kernelDiskCacheBuffer));
-	if (!buffer)
-		return (buffer);
+		// Re-insert the entry, since its start might have changed
+		queueRemove(queue, entry);
 
-	buffer->startSector = startSector;
-	buffer->numSectors = numSectors;
+		request->merged = entry->merged;
+		entry->merged = request;
+		entry->ioStart = newStart;
+		entry->ioSectors = (newEnd - newStart);
 
-	// Get memory for the data
-	buffer->data = kernelMalloc(numSectors * physicalDisk->sectorSize);
-	if (!buffer->data)
-	{
-		kernelFree((void *) buffer);
-		return (buffer = NULL);
+		queueInsert(queue, entry);
+		return;
 	}
 
-	return (buffer);
+	queueInsert(queue, request);
 }
 
 
-static inline void cachePutBuffer(kernelDiskCacheBuffer *buffer)
+static kernelDiskRequest *queueNext(kernelDiskQueue *queue)
 {
-	// Deallocate a cache buffer.
+	// Take the next request out of the queue, elevator-style: the first one
+	// at or after the place where the last one ended, or else go back to the
+	// start.  The caller must have interrupts suspended.
+
+	kernelDiskRequest *request = NULL;
 
-	if (buffer->data)
-		kernelFree(buffer->data);
+	for (request = queue->head; request; request = request->next)
+	{
+		if (request->ioStart >= queue->lastSector)
+			break;
+	}
 
-	kernelFree((void *) buffer);
+	if (!request)
+		request = queue->head;
 
-	return;
+	if (request)
+	{
+		queueRemove(queue, request);
+		queue->lastSector = (request->ioStart + request->ioSectors);
+	}
+
+	return (request);
 }
 
 
-static int cacheInvalidate(kernelPhysicalDisk *physicalDisk)
+static int queueDriverIo(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
+	uquad_t numSectors, void *data, unsigned mode)
 {
-	// Invalidate the disk cache, syncing dirty sectors first.
+	// Call the driver's read, write, or discard function
 
 	int status = 0;
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
-	kernelDiskCacheBuffer *next = NULL;
+	kernelDiskOps *ops = (kernelDiskOps *) physicalDisk->driver->ops;
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	if (mode & IOMODE_DISCARD)
+	{
+		kernelDebug(debug_io, "Disk %s discard %llu sectors at %llu",
+			physicalDisk->name, numSectors, startSector);
 
-	// Try to sync dirty sectors first.
-	cacheSync(physicalDisk);
+		return (status = ops->driverDiscardSectors(physicalDisk->deviceNumber,
+			startSector, numSectors));
+	}
 
-	if (physicalDisk->cache.dirty)
-		kernelError(kernel_warn, "Invalidating dirty disk cache!");
+	kernelDebug(debug_io, "Disk %s %s %llu sectors at %llu",
+		physicalDisk->name, ((mode & IOMODE_READ)? "read" : "write"),
+		numSectors, startSector);
 
-	while (buffer)
-	{
-		next = buffer->next;
-		cachePutBuffer(buffer);
-		buffer = next;
-	}
+	if (mode & IOMODE_READ)
+		status = ops->driverReadSectors(physicalDisk->deviceNumber,
+			startSector, numSectors, data);
+	else
+		status = ops->driverWriteSectors(physicalDisk->deviceNumber,
+			startSector, numSectors, data);
 
-	physicalDisk->cache.buffer = NULL;
-	physicalDisk->cache.size = 0;
-	physicalDisk->cache.dirty = 0;
+	kernelDebug(debug_io, "Disk %s done %sing %llu sectors at %llu",
+		physicalDisk->name, ((mode & IOMODE_READ)? "read" : "writ"),
+		numSectors, startSector);
 
 	return (status);
 }
 
 
-static kernelDiskCacheBuffer *cacheFind(kernelPhysicalDisk *physicalDisk,
-	uquad_t startSector, uquad_t numSectors)
+static void queueIo(kernelPhysicalDisk *physicalDisk,
+	kernelDiskRequest *request)
 {
-	// Finds the first buffer that intersects the supplied range of sectors.
-	// If not found, return NULL.
+	// Do a request from the queue, along with any that were merged with it,
+	// and set their statuses.  Merged requests are done as one operation
+	// using a buffer of our own, and if that fails, one at a time.
 
-	uquad_t endSector = (startSector + numSectors - 1);
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
+	int status = 0;
+	kernelDiskRequest *merged = NULL;
+	void *buffer = NULL;
+	unsigned offset = 0;
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	if (request->merged)
+	{
+		buffer = kernelMemoryGetSystem((request->ioSectors *
+			physicalDisk->sectorSize), "disk merged request");
+	}
 
-	while (buffer)
+	if (buffer)
 	{
-		// Start sector inside buffer?
-		if ((startSector >= buffer->startSector) &&
-			(startSector <= bufferEnd(buffer)))
+		if (request->mode & IOMODE_WRITE)
 		{
-			return (buffer);
+			for (merged = request; merged; merged = merged->merged)
+			{
+				offset = ((merged->startSector - request->ioStart) *
+					physicalDisk->sectorSize);
+				memcpy((buffer + offset), merged->data, (merged->numSectors *
+					physicalDisk->sectorSize));
+			}
 		}
 
-		// End sector inside buffer?
-		if ((endSector >= buffer->startSector) &&
-			(endSector <= bufferEnd(buffer)))
+		status = queueDriverIo(physicalDisk, request->ioStart,
+			request->ioSectors, buffer, request->mode);
+
+		for (merged = request; merged; merged = merged->merged)
 		{
-			return (buffer);
+			if ((status >= 0) && (request->mode & IOMODE_READ))
+			{
+				offset = ((merged->startSector - request->ioStart) *
+					physicalDisk->sectorSize);
+				memcpy(merged->data, (buffer + offset), (merged->numSectors *
+					physicalDisk->sectorSize));
+			}
+
+			merged->status = status;
 		}
 
-		// Range overlaps buffer?
-		if ((startSector < buffer->startSector) &&
-			(endSector > bufferEnd(buffer)))
+		kernelMemoryReleaseSystem(buffer);
+	}
+
+	if (!buffer || (status < 0))
+	{
+		for (merged = request; merged; merged = merged->merged)
 		{
-			return (buffer);
+			merged->status = queueDriverIo(physicalDisk, merged->startSector,
+				merged->numSectors, merged->data, merged->mode);
 		}
-
-		buffer = buffer->next;
 	}
 
-	// Not found
-	return (buffer = NULL);
+	// Update the 'last access' value
+	physicalDisk->lastAccess = kernelSysTimerRead();
+	physicalDisk->motorOffTime = (kernelCpuGetMs() + DISK_MOTOROFF_MS);
 }
 
 
-static unsigned cacheQueryRange(kernelPhysicalDisk *physicalDisk,
-	uquad_t startSector, uquad_t numSectors, uquad_t *firstCached)
+static void queueComplete(kernelDiskRequest *request, int status)
 {
-	// Search the cache for a range of sectors.  If any of the range is
-	// cached, return the *first* portion that is cached.
-
-	kernelDiskCacheBuffer *buffer = NULL;
-	uquad_t numCached = 0;
+	// Mark a request, and any that were merged with it, as done.  If the
+	// status is an error, it overrides theirs.  Once a request is done, its
+	// owner can return at any time, so don't touch it again.
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	kernelDiskRequest *merged = NULL;
 
-	buffer = cacheFind(physicalDisk, startSector, numSectors);
-	if (buffer)
+	while (request)
 	{
-		*firstCached = max(startSector, buffer->startSector);
-		numCached = min((numSectors - (*firstCached - startSector)),
-			(buffer->numSectors - (*firstCached - buffer->startSector)));
-		kernelDebug(debug_io, "Disk %s found %llu->%llu in %llu->%llu, "
-			"first=%llu num=%llu", physicalDisk->name, startSector,
-			(startSector + numSectors - 1), buffer->startSector,
-			bufferEnd(buffer), *firstCached, numCached);
-	}
-	else
-	{
-		kernelDebug(debug_io, "Disk %s %llu->%llu not found",
-			physicalDisk->name, startSector, (startSector + numSectors - 1));
-	}
+		merged = request->merged;
 
-	return (numCached);
+		if (status < 0)
+			request->status = status;
+
+		request->done = 1;
+		request = merged;
+	}
 }
 
 
-#if defined(DEBUG)
-static void cachePrint(kernelPhysicalDisk *physicalDisk)
+static void queueVerify(kernelPhysicalDisk *physicalDisk)
 {
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
+	// Make sure that the processes handing the active requests to the driver
+	// haven't died while doing it.  If one has, fail its request, so that
+	// the processes waiting for it don't wait forever.  The caller must have
+	// interrupts suspended.
+
+	kernelDiskQueue *queue = &physicalDisk->queue;
+	kernelDiskRequest **entry = (kernelDiskRequest **) &queue->active;
+	kernelDiskRequest *request = NULL;
+	processState state;
 
-	while (buffer)
+	while ((request = *entry))
 	{
-		kernelTextPrintLine("%s cache: %llu->%llu (%llu sectors) %s",
-			physicalDisk->name, buffer->startSector, bufferEnd(buffer),
-			buffer->numSectors, (buffer->dirty? "(dirty)" : ""));
-		buffer = buffer->next;
+		if ((kernelMultitaskerGetProcessState(request->dispatcher,
+				&state) < 0) || (state == proc_stopped) ||
+			(state == proc_finished) || (state == proc_zombie))
+		{
+			kernelError(kernel_warn, "Disk %s request dispatcher %d died",
+				physicalDisk->name, request->dispatcher);
+
+			*entry = request->next;
+			queue->numActive -= 1;
+			queueComplete(request, ERR_IO);
+			continue;
+		}
+
+		entry = (kernelDiskRequest **) &request->next;
 	}
 }
 
 
-static void cacheCheck(kernelPhysicalDisk *physicalDisk)
+static int queueRequest(kernelPhysicalDisk *physicalDisk,
+	kernelDiskRequest *request, int unlock)
 {
-	kernelDiskCacheBuffer *buffer = physicalDisk->cache.buffer;
-	uquad_t cacheSize = 0;
-	uquad_t numDirty = 0;
+	// Put a request in the disk's queue, and wait for it to be done.  While
+	// it's waiting, if the driver can take another request, we hand it the
+	// next one ourselves (which isn't necessarily ours).  If requested, let
+	// go of the disk lock while we wait, so that other processes can queue
+	// requests too.
+
+	int status = 0;
+	kernelDiskQueue *queue = &physicalDisk->queue;
+	kernelDiskRequest **entry = NULL;
+	kernelDiskRequest *next = NULL;
+	int processId = kernelMultitaskerGetCurrentProcessId();
+	uquad_t startTime = 0;
+	unsigned us = 0;
+	unsigned depth = 0;
+	int interrupts = 0;
+
+	processorSuspendInts(interrupts);
+
+	queueAdd(physicalDisk, request);
+
+	// Queue stats collection
+	depth = (queue->numQueued + queue->numActive);
+	physicalDisk->stats.queued += 1;
+	physicalDisk->stats.queueDepthTotal += depth;
+	if (depth > physicalDisk->stats.queueDepthMax)
+		physicalDisk->stats.queueDepthMax = depth;
+
+	if (unlock)
+		kernelLockRelease(&physicalDisk->lock);
 
-	while (buffer)
+	while (!request->done)
 	{
-		if (buffer->next)
+		next = NULL;
+		if (queue->numActive < max(physicalDisk->queueDepth, 1))
+			next = queueNext(queue);
+
+		if (!next)
 		{
-			if (buffer->startSector >= buffer->next->startSector)
-			{
-				kernelError(kernel_warn, "%s startSector (%llu) >= "
-					"next->startSector (%llu)", physicalDisk->name,
-					buffer->startSector, buffer->next->startSector);
-				cachePrint(physicalDisk); while (1);
-			}
+			// Ours is with the driver, or the driver is busy.  Wait until
+			// one of the active requests is done.
+			kernelMultitaskerWaitQueueSleep(&queue->waitQueue,
+				DISK_QUEUE_VERIFY_MS);
+			queueVerify(physicalDisk);
+			continue;
+		}
 
-			if (bufferEnd(buffer) >= buffer->next->startSector)
-			{
-				kernelError(kernel_warn, "%s (startSector(%llu) + "
-					"numSectors(%llu) = %llu) > next->startSector(%llu)",
-					physicalDisk->name, buffer->startSector,
-					buffer->numSectors, (buffer->startSector +
-					buffer->numSectors), buffer->next->startSector);
-				cachePrint(physicalDisk); while (1);
-			}
+		next->dispatcher = processId;
+		next->next = queue->active;
+		queue->active = next;
+		queue->numActive += 1;
 
-			if ((bufferEnd(buffer) == (buffer->next->startSector - 1)) &&
-				(buffer->dirty == buffer->next->dirty))
-			{
-				kernelError(kernel_warn, "%s buffer %llu->%llu should be "
-					"joined with %llu->%llu (%s)", physicalDisk->name,
-					buffer->startSector, bufferEnd(buffer),
-					buffer->next->startSector, bufferEnd(buffer->next),
-					(buffer->dirty? "dirty" : "clean"));
-				cachePrint(physicalDisk); while (1);
-			}
+		processorRestoreInts(interrupts);
 
-			if (buffer->next->prev != buffer)
-			{
-				kernelError(kernel_warn, "%s buffer->next->prev != buffer",
-					physicalDisk->name);
-				cachePrint(physicalDisk); while (1);
-			}
-		}
+		startTime = kernelCpuTimestamp();
+		queueIo(physicalDisk, next);
+		us = elapsedUs(startTime);
 
-		if (buffer->prev)
+		processorSuspendInts(interrupts);
+
+		// Take it out of the active list, unless it was given up on
+		for (entry = (kernelDiskRequest **) &queue->active; *entry;
+			entry = (kernelDiskRequest **) &(*entry)->next)
 		{
-			if (buffer->prev->next != buffer)
+			if (*entry == next)
 			{
-				kernelError(kernel_warn, "%s buffer->prev->next != buffer",
-					physicalDisk->name);
-				cachePrint(physicalDisk); while (1);
+				*entry = next->next;
+				queue->numActive -= 1;
+				statsIo(physicalDisk, next, us);
+				queueComplete(next, 0);
+				break;
 			}
 		}
 
-		cacheSize += bufferBytes(physicalDisk, buffer);
-		if (buffer->dirty)
-			numDirty += 1;
-
-		buffer = buffer->next;
+		kernelMultitaskerWaitQueueWakeAll(&queue->waitQueue);
 	}
 
-	if (cacheSize != physicalDisk->cache.size)
-	{
-		kernelError(kernel_warn, "%s cacheSize(%llu) != "
-			"physicalDisk->cache.size(%llu)", physicalDisk->name, cacheSize,
-			physicalDisk->cache.size);
-		cachePrint(physicalDisk); while (1);
-	}
+	processorRestoreInts(interrupts);
 
-	if (numDirty != physicalDisk->cache.dirty)
+	if (unlock)
 	{
-		kernelError(kernel_warn, "%s numDirty(%llu) != "
-			"physicalDisk->cache.dirty(%llu)", physicalDisk->name, numDirty,
-			physicalDisk->cache.dirty);
-		cachePrint(physicalDisk); while (1);
+		status = kernelLockGet(&physicalDisk->lock);
+		if (status < 0)
+			return (status);
 	}
-}
-#else
-	#define cacheCheck(physicalDisk) do { } while (0)
-#endif // DEBUG
-
-
-static void cacheRemove(kernelPhysicalDisk *physicalDisk,
-	kernelDiskCacheBuffer *buffer)
-{
-	debugLockCheck(physicalDisk, __FUNCTION__);
-
-	if (buffer == physicalDisk->cache.buffer)
-		physicalDisk->cache.buffer = buffer->next;
-
-	if (buffer->prev)
-		buffer->prev->next = buffer->next;
-	if (buffer->next)
-		buffer->next->prev = buffer->prev;
 
-	physicalDisk->cache.size -= bufferBytes(physicalDisk, buffer);
-	cachePutBuffer(buffer);
+	return (status = request->status);
 }
 
 
-static void cachePrune(kernelPhysicalDisk *physicalDisk)
+static int realReadWrite(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors, void *data, unsigned mode)
 {
-	// If the cache has grown larger than the pre-ordained DISK_CACHE_MAX
-	// value, uncache some data.  Uncache the least-recently-used buffers
-	// until we're under the limit.
+	// This function does all real, physical disk reads or writes, by way of
+	// the disk's request queue.
 
-	kernelDiskCacheBuffer *currBuffer = NULL;
-	unsigned oldestTime = 0;
-	kernelDiskCacheBuffer *oldestBuffer = NULL;
+	int status = 0;
+	kernelDiskOps *ops = (kernelDiskOps *) physicalDisk->driver->ops;
+	processState tmpState;
+	kernelDiskRequest request;
+	uquad_t chunkSectors = numSectors;
+	uquad_t doneSectors = 0;
+	unsigned bytes = 0;
+	void *bounce = NULL;
 
 	debugLockCheck(physicalDisk, __FUNCTION__);
 
-	while (physicalDisk->cache.size > DISK_MAX_CACHE)
-	{
-		currBuffer = physicalDisk->cache.buffer;
+	// Update the 'last access' value
+	physicalDisk->lastAccess = kernelSysTimerRead();
 
-		// Don't bother uncaching the only buffer
-		if (!currBuffer->next)
+	// Make sure the disk thread is running
+	if (kernelMultitaskerGetProcessState(threadPid, &tmpState) < 0)
+		// Re-spawn the disk thread
+		spawnDiskThread();
+
+	// Make sure the device driver function is available.
+	if (((mode & IOMODE_READ) && !ops->driverReadSectors) ||
+		((mode & IOMODE_WRITE) && !ops->driverWriteSectors))
+	{
+		kernelError(kernel_error, "Disk %s cannot %s", physicalDisk->name,
+			((mode & IOMODE_READ)? "read" : "write"));
+		return (status = ERR_NOSUCHFUNCTION);
+	}
+
+	// Another process might do the actual read/write operation, and user
+	// memory is only mapped in the address space of this one.  Drivers might
+	// also do DMA straight to or from the buffer, assuming that it's
+	// physically contiguous, which user memory isn't necessarily (pages of
+	// lazily-backed memory get their memory one at a time, on first use).
+	// So use a bounce buffer for user memory, and do the transfer in chunks
+	// that fit in it.
+	if (data < (void *) KERNEL_VIRTUAL_ADDRESS)
+	{
+		chunkSectors = min(numSectors, (uquad_t)(DISK_BOUNCE_MAX /
+			physicalDisk->sectorSize));
+		if (!chunkSectors)
+			chunkSectors = 1;
+
+		bounce = kernelMemoryGetSystem((chunkSectors *
+			physicalDisk->sectorSize), "disk bounce buffer");
+		if (!bounce)
+			return (status = ERR_MEMORY);
+	}
+
+	#if (DISK_CACHE)
+	// Anyone reading these sectors right now might get the old data
+	if (mode & IOMODE_WRITE)
+		physicalDisk->cache.generation += 1;
+	#endif // DISK_CACHE
+
+	while (doneSectors < numSectors)
+	{
+		chunkSectors = min(chunkSectors, (numSectors - doneSectors));
+		bytes = (chunkSectors * physicalDisk->sectorSize);
+
+		if (bounce && (mode & IOMODE_WRITE))
+			memcpy(bounce, data, bytes);
+
+		memset((void *) &request, 0, sizeof(kernelDiskRequest));
+		request.startSector = (startSector + doneSectors);
+		request.numSectors = chunkSectors;
+		request.data = (bounce? bounce : data);
+		request.mode = (mode & (IOMODE_READ | IOMODE_WRITE));
+
+		status = queueRequest(physicalDisk, &request, (mode & IOMODE_UNLOCK));
+		if (status < 0)
+			break;
+
+		if (bounce && (mode & IOMODE_READ))
+			memcpy(data, bounce, bytes);
+
+		doneSectors += chunkSectors;
+		data += bytes;
+	}
+
+	if (bounce)
+		kernelMemoryReleaseSystem(bounce);
+
+	if (status < 0)
+	{
+		// If it is a write-protect error, mark the disk as read only
+		if ((mode & IOMODE_WRITE) && (status == ERR_NOWRITE))
+		{
+			kernelError(kernel_error, "Disk %s is write-protected",
+				physicalDisk->name);
+			physicalDisk->flags |= DISKFLAG_READONLY;
+		}
+		else
+		{
+			kernelError(kernel_error, "Error %d %sing %llu sectors at %llu, "
+				"disk %s", status, ((mode & IOMODE_READ)? "read" : "writ"),
+				chunkSectors, (startSector + doneSectors),
+				physicalDisk->name);
+		}
+	}
+
+	return (status);
+}
+
+
+#if (DISK_CACHE)
+
+#define blockBytes(physicalDisk) \
+	((physicalDisk)->cache.blockSectors * (physicalDisk)->sectorSize)
+#define blockStart(physicalDisk, block) \
+	((block)->number * (physicalDisk)->cache.blockSectors)
+#define blockMask(physicalDisk) \
+	sectorMask(0, (physicalDisk)->cache.blockSectors)
+#define hashBucket(physicalDisk, blockNumber) \
+	((unsigned)(blockNumber) & ((physicalDisk)->cache.hashBuckets - 1))
+
+static inline unsigned sectorMask(unsigned first, unsigned count)
+{
+	// Returns the bitmap of 'count' sectors, starting at 'first', in a block
+
+	if (count >= 32)
+		return (~0U);
+	else
+		return (((1U << count) - 1) << first);
+}
+
+
+static inline unsigned sectorRun(unsigned bitmap, unsigned first,
+	unsigned max, int set)
+{
+	// Count the sectors, starting at 'first' and up to 'max' of them, whose
+	// bits in the bitmap are all set (or all clear)
+
+	unsigned count = 0;
+
+	while ((count < max) && (((bitmap >> (first + count)) & 1) == (set? 1U :
+		0U)))
+	{
+		count += 1;
+	}
+
+	return (count);
+}
+
+
+static inline void lruRemove(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		physicalDisk->cache.lruHead = block->next;
+
+	if (block->next)
+		block->next->prev = block->prev;
+	else
+		physicalDisk->cache.lruTail = block->prev;
+
+	block->prev = block->next = NULL;
+}
+
+
+static inline void lruAdd(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	// Add to the most-recently-used end of the list
+
+	block->prev = NULL;
+	block->next = physicalDisk->cache.lruHead;
+
+	if (block->next)
+		block->next->prev = block;
+	else
+		physicalDisk->cache.lruTail = block;
+
+	physicalDisk->cache.lruHead = block;
+}
+
+
+static inline void cacheTouch(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	block->lastAccess = ++cacheClock;
+
+	// Dirty blocks aren't on the LRU list
+	if (!block->dirty && (physicalDisk->cache.lruHead != block))
+	{
+		lruRemove(physicalDisk, block);
+		lruAdd(physicalDisk, block);
+	}
+}
+
+
+static inline void dirtyRemove(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	if (block->dirtyPrev)
+		block->dirtyPrev->dirtyNext = block->dirtyNext;
+	else
+		physicalDisk->cache.dirtyHead = block->dirtyNext;
+
+	if (block->dirtyNext)
+		block->dirtyNext->dirtyPrev = block->dirtyPrev;
+	else
+		physicalDisk->cache.dirtyTail = block->dirtyPrev;
+
+	block->dirtyPrev = block->dirtyNext = NULL;
+}
+
+
+static inline void dirtyAdd(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	// Add to the end of the list, so that the oldest dirty block is first
+
+	block->dirtyNext = NULL;
+	block->dirtyPrev = physicalDisk->cache.dirtyTail;
+
+	if (block->dirtyPrev)
+		block->dirtyPrev->dirtyNext = block;
+	else
+		physicalDisk->cache.dirtyHead = block;
+
+	physicalDisk->cache.dirtyTail = block;
+}
+
+
+static inline void cacheMarkDirty(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block, unsigned sectors)
+{
+	// A dirty block moves from the LRU list to the dirty list, so that it
+	// can't be evicted until it has been written back
+
+	if (!block->dirty)
+	{
+		block->dirtyTime = kernelCpuGetMs();
+		lruRemove(physicalDisk, block);
+		dirtyAdd(physicalDisk, block);
+		physicalDisk->cache.dirty += 1;
+	}
+
+	block->dirty |= sectors;
+}
+
+
+static inline void cacheMarkClean(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	if (block->dirty)
+	{
+		block->dirty = 0;
+		dirtyRemove(physicalDisk, block);
+		lruAdd(physicalDisk, block);
+		physicalDisk->cache.dirty -= 1;
+	}
+}
+
+
+static int cacheSetup(kernelPhysicalDisk *physicalDisk)
+{
+	// Set up the disk's cache the first time it's used.  Blocks are a fixed
+	// number of sectors, and there is one bit per sector in the 'valid' and
+	// 'dirty' bitmaps of a block.
+
+	int status = 0;
+
+	if (physicalDisk->cache.hash)
+		return (status = 0);
+
+	if (!physicalDisk->sectorSize)
+		return (status = ERR_INVALID);
+
+	physicalDisk->cache.blockSectors = (DISK_CACHE_BLOCK /
+		physicalDisk->sectorSize);
+	if (!physicalDisk->cache.blockSectors)
+		physicalDisk->cache.blockSectors = 1;
+	if (physicalDisk->cache.blockSectors > 32)
+		physicalDisk->cache.blockSectors = 32;
+
+	physicalDisk->cache.hash = kernelMalloc(DISK_CACHE_HASH_BUCKETS *
+		sizeof(kernelDiskCacheBlock *));
+	if (!physicalDisk->cache.hash)
+		return (status = ERR_MEMORY);
+
+	physicalDisk->cache.hashBuckets = DISK_CACHE_HASH_BUCKETS;
+
+	return (status = 0);
+}
+
+
+static void cacheRehash(kernelPhysicalDisk *physicalDisk)
+{
+	// The cache has outgrown its hash table.  Try to double the number of
+	// buckets so that the chains stay short.  If we can't, we carry on with
+	// longer chains.
+
+	unsigned newBuckets = (physicalDisk->cache.hashBuckets * 2);
+	kernelDiskCacheBlock **newHash = NULL;
+	kernelDiskCacheBlock *block = NULL;
+	unsigned bucket = 0;
+
+	newHash = kernelMalloc(newBuckets * sizeof(kernelDiskCacheBlock *));
+	if (!newHash)
+		return;
+
+	kernelDebug(debug_io, "Disk %s cache hash grows to %u buckets",
+		physicalDisk->name, newBuckets);
+
+	kernelFree((void *) physicalDisk->cache.hash);
+	physicalDisk->cache.hash = newHash;
+	physicalDisk->cache.hashBuckets = newBuckets;
+
+	// All of the blocks are on either the LRU list or the dirty list
+	for (block = physicalDisk->cache.lruHead; block; block = block->next)
+	{
+		bucket = hashBucket(physicalDisk, block->number);
+		block->hashNext = newHash[bucket];
+		newHash[bucket] = block;
+	}
+
+	for (block = physicalDisk->cache.dirtyHead; block;
+		block = block->dirtyNext)
+	{
+		bucket = hashBucket(physicalDisk, block->number);
+		block->hashNext = newHash[bucket];
+		newHash[bucket] = block;
+	}
+}
+
+
+static kernelDiskCacheBlock *cacheLookup(kernelPhysicalDisk *physicalDisk,
+	uquad_t blockNumber)
+{
+	// Find a block in the cache.  If not found, return NULL.
+
+	kernelDiskCacheBlock *block = NULL;
+
+	block = physicalDisk->cache.hash[hashBucket(physicalDisk, blockNumber)];
+
+	while (block && (block->number != blockNumber))
+		block = block->hashNext;
+
+	return (block);
+}
+
+
+static kernelDiskCacheBlock *cacheGetBlock(kernelPhysicalDisk *physicalDisk,
+	uquad_t blockNumber)
+{
+	// Get a new, empty cache block, and add it to the cache
+
+	kernelDiskCacheBlock *block = NULL;
+	unsigned bucket = 0;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	// Get memory for the structure
+	block = kernelSlabAlloc(&cacheBlockCache);
+	if (!block)
+		return (block);
+
+	block->number = blockNumber;
+
+	// Get memory for the data.  Unless the disk has enormous sectors, this
+	// comes from a cache of its own too.
+	if (blockBytes(physicalDisk) == DISK_CACHE_BLOCK)
+		block->data = kernelSlabAlloc(&cacheDataCache);
+	else
+		block->data = kernelMalloc(blockBytes(physicalDisk));
+
+	if (!block->data)
+	{
+		kernelSlabFree(&cacheBlockCache, (void *) block);
+		return (block = NULL);
+	}
+
+	bucket = hashBucket(physicalDisk, blockNumber);
+	block->hashNext = physicalDisk->cache.hash[bucket];
+	physicalDisk->cache.hash[bucket] = block;
+
+	lruAdd(physicalDisk, block);
+
+	physicalDisk->cache.size += blockBytes(physicalDisk);
+	physicalDisk->cache.blocks += 1;
+
+	if (physicalDisk->cache.blocks > (physicalDisk->cache.hashBuckets * 2))
+		cacheRehash(physicalDisk);
+
+	return (block);
+}
+
+
+static void cachePutBlock(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	// Remove a block from the cache, and deallocate it.  Any dirty data is
+	// discarded.
+
+	kernelDiskCacheBlock *volatile *link = NULL;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	link = &physicalDisk->cache.hash[hashBucket(physicalDisk, block->number)];
+	while (*link && (*link != block))
+		link = &(*link)->hashNext;
+	if (*link)
+		*link = block->hashNext;
+
+	if (block->dirty)
+	{
+		dirtyRemove(physicalDisk, block);
+		physicalDisk->cache.dirty -= 1;
+	}
+	else
+	{
+		lruRemove(physicalDisk, block);
+	}
+
+	physicalDisk->cache.size -= blockBytes(physicalDisk);
+	physicalDisk->cache.blocks -= 1;
+
+	if (blockBytes(physicalDisk) == DISK_CACHE_BLOCK)
+		kernelSlabFree(&cacheDataCache, block->data);
+	else
+		kernelFree(block->data);
+
+	kernelSlabFree(&cacheBlockCache, (void *) block);
+}
+
+
+static int cacheWriteBlock(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	// Write the dirty sectors of a single block to the disk
+
+	int status = 0;
+	unsigned first = 0;
+	unsigned count = 0;
+
+	while (first < physicalDisk->cache.blockSectors)
+	{
+		count = sectorRun(block->dirty, first,
+			(physicalDisk->cache.blockSectors - first), 1);
+
+		if (count)
+		{
+			status = realReadWrite(physicalDisk, (blockStart(physicalDisk,
+				block) + first), count, (block->data + (first *
+					physicalDisk->sectorSize)), IOMODE_WRITE);
+			if (status < 0)
+				return (status);
+
+			first += count;
+		}
+		else
+		{
+			first += 1;
+		}
+	}
+
+	cacheMarkClean(physicalDisk, block);
+
+	return (status = 0);
+}
+
+
+static inline unsigned firstSector(unsigned bitmap)
+{
+	// Returns the first sector whose bit is set in a (non-zero) bitmap
+	return (__builtin_ctz(bitmap));
+}
+
+
+static inline int singleRun(unsigned bitmap)
+{
+	// Returns 1 if the bits that are set in a (non-zero) bitmap are all
+	// contiguous
+	bitmap >>= firstSector(bitmap);
+	return (!(bitmap & (bitmap + 1)));
+}
+
+
+#define dirtyAtStart(block) ((block)->dirty & 1)
+#define dirtyAtEnd(physicalDisk, block) \
+	(((block)->dirty >> ((physicalDisk)->cache.blockSectors - 1)) & 1)
+
+static int cacheFlush(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block)
+{
+	// Write a dirty block to the disk.  If its dirty sectors are contiguous,
+	// look up its neighbours for dirty sectors that continue the run in
+	// either direction, and write them all in one go.
+
+	int status = 0;
+	kernelDiskCacheBlock *first = block;
+	kernelDiskCacheBlock *last = block;
+	kernelDiskCacheBlock *other = NULL;
+	unsigned numBlocks = 1;
+	uquad_t numSectors = 0;
+	void *buffer = NULL;
+	unsigned bytes = 0;
+	unsigned count;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	if (!singleRun(block->dirty))
+		return (status = cacheWriteBlock(physicalDisk, block));
+
+	// Look backwards, and then forwards, for the extent of the run
+	while ((numBlocks < DISK_CACHE_FLUSH_BLOCKS) && dirtyAtStart(first) &&
+		first->number)
+	{
+		other = cacheLookup(physicalDisk, (first->number - 1));
+		if (!other || !other->dirty || !singleRun(other->dirty) ||
+			!dirtyAtEnd(physicalDisk, other))
+		{
 			break;
+		}
+
+		first = other;
+		numBlocks += 1;
+	}
+
+	while ((numBlocks < DISK_CACHE_FLUSH_BLOCKS) &&
+		dirtyAtEnd(physicalDisk, last))
+	{
+		other = cacheLookup(physicalDisk, (last->number + 1));
+		if (!other || !dirtyAtStart(other) || !singleRun(other->dirty))
+			break;
+
+		last = other;
+		numBlocks += 1;
+	}
+
+	if (numBlocks == 1)
+		return (status = cacheWriteBlock(physicalDisk, block));
+
+	for (count = 0; count < numBlocks; count ++)
+	{
+		other = cacheLookup(physicalDisk, (first->number + count));
+		numSectors += __builtin_popcount(other->dirty);
+	}
+
+	buffer = kernelMemoryGetSystem((numSectors * physicalDisk->sectorSize),
+		"disk cache flush");
+	if (!buffer)
+		// Never mind, just write the one
+		return (status = cacheWriteBlock(physicalDisk, block));
+
+	kernelDebug(debug_io, "Disk %s flush %llu sectors from %u cache blocks "
+		"at %llu", physicalDisk->name, numSectors, numBlocks,
+		(blockStart(physicalDisk, first) + firstSector(first->dirty)));
+
+	for (count = 0; count < numBlocks; count ++)
+	{
+		other = cacheLookup(physicalDisk, (first->number + count));
+		memcpy((buffer + bytes), (other->data + (firstSector(other->dirty) *
+			physicalDisk->sectorSize)), (__builtin_popcount(other->dirty) *
+				physicalDisk->sectorSize));
+		bytes += (__builtin_popcount(other->dirty) * physicalDisk->sectorSize);
+	}
+
+	status = realReadWrite(physicalDisk, (blockStart(physicalDisk, first) +
+		firstSector(first->dirty)), numSectors, buffer, IOMODE_WRITE);
+
+	if (status >= 0)
+	{
+		for (count = 0; count < numBlocks; count ++)
+			cacheMarkClean(physicalDisk, cacheLookup(physicalDisk,
+				(first->number + count)));
+	}
+
+	kernelMemoryReleaseSystem(buffer);
+
+	return (status);
+}
+
+
+static int cacheSync(kernelPhysicalDisk *physicalDisk)
+{
+	// Write all dirty cached blocks to the disk, oldest first
+
+	int status = 0;
+	kernelDiskCacheBlock *block = NULL;
+	uquad_t count = 0;
+	int errors = 0;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	if (!physicalDisk->cache.dirty || (physicalDisk->flags &
+		DISKFLAG_READONLY))
+	{
+		return (status = 0);
+	}
+
+	// Each block is at the head of the list at most once, since the ones we
+	// can't write go to the back
+	for (count = physicalDisk->cache.dirty; (count &&
+		physicalDisk->cache.dirty); count --)
+	{
+		block = physicalDisk->cache.dirtyHead;
+
+		status = cacheFlush(physicalDisk, block);
+		if (status < 0)
+		{
+			errors = status;
+			dirtyRemove(physicalDisk, block);
+			dirtyAdd(physicalDisk, block);
+		}
+	}
+
+	return (status = errors);
+}
+
+
+static int cacheInvalidate(kernelPhysicalDisk *physicalDisk)
+{
+	// Invalidate the disk cache, syncing dirty sectors first.
+
+	int status = 0;
+	unsigned generation = 0;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	// Try to sync dirty sectors first.
+	cacheSync(physicalDisk);
+
+	if (physicalDisk->cache.dirty)
+		kernelError(kernel_warn, "Invalidating dirty disk cache!");
+
+	while (physicalDisk->cache.lruHead)
+		cachePutBlock(physicalDisk, physicalDisk->cache.lruHead);
+	while (physicalDisk->cache.dirtyHead)
+		cachePutBlock(physicalDisk, physicalDisk->cache.dirtyHead);
+
+	if (physicalDisk->cache.hash)
+		kernelFree((void *) physicalDisk->cache.hash);
+
+	generation = physicalDisk->cache.generation;
+	memset((void *) &physicalDisk->cache, 0, sizeof(kernelDiskCache));
+	physicalDisk->cache.generation = (generation + 1);
+
+	return (status);
+}
+
+
+static void cacheDiscardBlock(kernelPhysicalDisk *physicalDisk,
+	kernelDiskCacheBlock *block, uquad_t startSector, uquad_t endSector)
+{
+	// Forget about any of a block's sectors in the range, whether or not
+	// they're dirty.  If there's nothing left in the block, remove it.
+
+	uquad_t first = max(startSector, blockStart(physicalDisk, block));
+	uquad_t last = min(endSector, (blockStart(physicalDisk, block) +
+		physicalDisk->cache.blockSectors));
+	unsigned sectors = 0;
+
+	if (first >= last)
+		return;
 
-		oldestTime = ~0UL;
-		oldestBuffer = NULL;
+	sectors = sectorMask((first - blockStart(physicalDisk, block)),
+		(last - first));
 
-		while (currBuffer)
+	if (!(block->valid & ~sectors))
+	{
+		cachePutBlock(physicalDisk, block);
+		return;
+	}
+
+	if (block->dirty && !(block->dirty & ~sectors))
+		cacheMarkClean(physicalDisk, block);
+	else
+		block->dirty &= ~sectors;
+
+	block->valid &= ~sectors;
+}
+
+
+static void cacheDiscard(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors)
+{
+	// Forget about cached sectors that are being discarded.  If the range
+	// covers more blocks than there are in the cache, it's quicker to look at
+	// each of those instead.
+
+	kernelDiskCacheBlock *block = NULL;
+	kernelDiskCacheBlock *next = NULL;
+	uquad_t endSector = (startSector + numSectors);
+	uquad_t blockNumber = 0;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	if (!physicalDisk->cache.blocks)
+		return;
+
+	if ((numSectors / physicalDisk->cache.blockSectors) >
+		physicalDisk->cache.blocks)
+	{
+		for (block = physicalDisk->cache.dirtyHead; block; block = next)
+		{
+			next = block->dirtyNext;
+			cacheDiscardBlock(physicalDisk, block, startSector, endSector);
+		}
+
+		for (block = physicalDisk->cache.lruHead; block; block = next)
+		{
+			next = block->next;
+			cacheDiscardBlock(physicalDisk, block, startSector, endSector);
+		}
+	}
+	else
+	{
+		for (blockNumber = (startSector / physicalDisk->cache.blockSectors);
+			(blockNumber * physicalDisk->cache.blockSectors) < endSector;
+			blockNumber ++)
 		{
-			if (currBuffer->lastAccess < oldestTime)
+			block = cacheLookup(physicalDisk, blockNumber);
+			if (block)
 			{
-				oldestTime = currBuffer->lastAccess;
-				oldestBuffer = currBuffer;
+				cacheDiscardBlock(physicalDisk, block, startSector,
+					endSector);
 			}
-
-			currBuffer = currBuffer->next;
 		}
+	}
+
+	// Anyone reading these sectors right now might get the old data
+	physicalDisk->cache.generation += 1;
+}
+
+
+#if defined(DEBUG)
+static void cachePrint(kernelPhysicalDisk *physicalDisk)
+{
+	kernelDiskCacheBlock *block = NULL;
+
+	for (block = physicalDisk->cache.lruHead; block; block = block->next)
+	{
+		kernelTextPrintLine("%s cache: block %llu (sector %llu) valid=%x",
+			physicalDisk->name, block->number, blockStart(physicalDisk,
+			block), block->valid);
+	}
+
+	for (block = physicalDisk->cache.dirtyHead; block;
+		block = block->dirtyNext)
+	{
+		kernelTextPrintLine("%s cache: block %llu (sector %llu) valid=%x "
+			"dirty=%x", physicalDisk->name, block->number,
+			blockStart(physicalDisk, block), block->valid, block->dirty);
+	}
+}
+
+
+static void cacheCheck(kernelPhysicalDisk *physicalDisk)
+{
+	kernelDiskCacheBlock *block = NULL;
+	unsigned numBlocks = 0;
+	uquad_t numDirty = 0;
 
-		if (!oldestBuffer)
+	for (block = physicalDisk->cache.lruHead; block; block = block->next)
+	{
+		if (block->next && (block->next->prev != block))
 		{
-			kernelDebug(debug_io, "Disk %s, no oldest buffer!",
+			kernelError(kernel_warn, "%s block->next->prev != block",
 				physicalDisk->name);
-			break;
+			cachePrint(physicalDisk); while (1);
+		}
+
+		if (block->dirty)
+		{
+			kernelError(kernel_warn, "%s dirty block %llu is on the LRU "
+				"list", physicalDisk->name, block->number);
+			cachePrint(physicalDisk); while (1);
+		}
+
+		if (cacheLookup(physicalDisk, block->number) != block)
+		{
+			kernelError(kernel_warn, "%s block %llu is not in the hash "
+				"table", physicalDisk->name, block->number);
+			cachePrint(physicalDisk); while (1);
+		}
+
+		numBlocks += 1;
+	}
+
+	for (block = physicalDisk->cache.dirtyHead; block;
+		block = block->dirtyNext)
+	{
+		if (block->dirtyNext && (block->dirtyNext->dirtyPrev != block))
+		{
+			kernelError(kernel_warn, "%s block->dirtyNext->dirtyPrev != "
+				"block", physicalDisk->name);
+			cachePrint(physicalDisk); while (1);
+		}
+
+		if (!block->dirty)
+		{
+			kernelError(kernel_warn, "%s clean block %llu is on the dirty "
+				"list", physicalDisk->name, block->number);
+			cachePrint(physicalDisk); while (1);
+		}
+
+		if (block->dirty & ~block->valid)
+		{
+			kernelError(kernel_warn, "%s block %llu has dirty sectors (%x) "
+				"that aren't valid (%x)", physicalDisk->name, block->number,
+				block->dirty, block->valid);
+			cachePrint(physicalDisk); while (1);
+		}
+
+		if (cacheLookup(physicalDisk, block->number) != block)
+		{
+			kernelError(kernel_warn, "%s block %llu is not in the hash "
+				"table", physicalDisk->name, block->number);
+			cachePrint(physicalDisk); while (1);
+		}
+
+		numDirty += 1;
+	}
+
+	if (numDirty != physicalDisk->cache.dirty)
+	{
+		kernelError(kernel_warn, "%s numDirty(%llu) != "
+			"physicalDisk->cache.dirty(%llu)", physicalDisk->name, numDirty,
+			physicalDisk->cache.dirty);
+		cachePrint(physicalDisk); while (1);
+	}
+
+	numBlocks += numDirty;
+
+	if (numBlocks != physicalDisk->cache.blocks)
+	{
+		kernelError(kernel_warn, "%s numBlocks(%u) != "
+			"physicalDisk->cache.blocks(%u)", physicalDisk->name, numBlocks,
+			physicalDisk->cache.blocks);
+		cachePrint(physicalDisk); while (1);
+	}
+
+	if ((numBlocks * blockBytes(physicalDisk)) != physicalDisk->cache.size)
+	{
+		kernelError(kernel_warn, "%s cacheSize(%u) != "
+			"physicalDisk->cache.size(%llu)", physicalDisk->name,
+			(numBlocks * blockBytes(physicalDisk)), physicalDisk->cache.size);
+		cachePrint(physicalDisk); while (1);
+	}
+}
+#else
+	#define cacheCheck(physicalDisk) do { } while (0)
+#endif // DEBUG
+
+
+static uquad_t cacheTotal(void)
+{
+	// Returns the amount of memory used by the caches of all the disks
+
+	uquad_t total = 0;
+	int count;
+
+	for (count = 0; count < physicalDiskCounter; count ++)
+		total += physicalDisks[count]->cache.size;
+
+	return (total);
+}
+
+
+static uquad_t cacheDirtyTotal(void)
+{
+	// Returns the amount of dirty data in the caches of all the disks
+
+	uquad_t total = 0;
+	int count;
+
+	for (count = 0; count < physicalDiskCounter; count ++)
+	{
+		total += (physicalDisks[count]->cache.dirty *
+			blockBytes(physicalDisks[count]));
+	}
+
+	return (total);
+}
+
+
+static uquad_t cacheLimit(void)
+{
+	// Returns the most memory that the caches of all the disks may use
+	// together.  Normally that's the budget, but if free memory is low, the
+	// caches give back enough to bring it up to the low water mark.
+
+	memoryStats memStats;
+	uquad_t limit = cacheMax;
+	uquad_t freeMemory = 0;
+	uquad_t lowWater = 0;
+	uquad_t total = 0;
+
+	if (kernelMemoryGetStats(&memStats, 0 /* not kernel */) < 0)
+		return (limit);
+
+	freeMemory = (memStats.totalMemory - memStats.usedMemory);
+	lowWater = (((uquad_t) memStats.totalMemory * DISK_CACHE_LOWMEM) / 100);
+
+	if (freeMemory < lowWater)
+	{
+		total = cacheTotal();
+		if (total > (lowWater - freeMemory))
+			limit = min(limit, (total - (lowWater - freeMemory)));
+		else
+			limit = 0;
+
+		limit = max(limit, (uquad_t) DISK_CACHE_MIN);
+	}
+
+	return (limit);
+}
+
+
+static void cachePrune(kernelPhysicalDisk *lockedDisk)
+{
+	// If the caches of all the disks have together grown larger than the
+	// limit, uncache some data.  Uncache the least-recently-used clean
+	// blocks, whichever disks they belong to, until we're under the limit.
+	// The caller might have one disk locked already; others are only pruned
+	// if we can lock them without waiting.  Only the disk thread (which
+	// doesn't lock a disk first) writes back dirty blocks to make room.
+
+	uquad_t limit = 0;
+	uquad_t total = 0;
+	int processId = kernelMultitaskerGetCurrentProcessId();
+	int usable[DISK_MAXDEVICES];
+	int release[DISK_MAXDEVICES];
+	kernelPhysicalDisk *physicalDisk = NULL;
+	kernelDiskCacheBlock *block = NULL;
+	int oldest = 0;
+	int count;
+
+	if (lockedDisk)
+		debugLockCheck(lockedDisk, __FUNCTION__);
+
+	// While we're within the budget, only the disk thread checks whether
+	// memory is running low
+	total = cacheTotal();
+	if ((total <= cacheMax) && (lockedDisk || (total <= DISK_CACHE_MIN)))
+		return;
+
+	limit = cacheLimit();
+	if (total <= limit)
+		return;
+
+	for (count = 0; count < physicalDiskCounter; count ++)
+	{
+		physicalDisk = physicalDisks[count];
+		usable[count] = release[count] = 0;
+
+		if (!physicalDisk->cache.blocks)
+			continue;
+
+		if (physicalDisk->lock.processId == processId)
+		{
+			usable[count] = 1;
+		}
+		else if (kernelLockTry(&physicalDisk->lock) >= 0)
+		{
+			usable[count] = release[count] = 1;
 		}
+	}
+
+	while (total > limit)
+	{
+		// Find the disk with the least-recently-used block
+		oldest = -1;
+		for (count = 0; count < physicalDiskCounter; count ++)
+		{
+			if (!usable[count] || !physicalDisks[count]->cache.lruTail)
+				continue;
 
-		kernelDebug(debug_io, "Disk %s uncache buffer %llu->%llu, mem=%p, "
-			"dirty=%d", physicalDisk->name, oldestBuffer->startSector,
-			bufferEnd(oldestBuffer), oldestBuffer->data, oldestBuffer->dirty);
+			if ((oldest < 0) ||
+				(physicalDisks[count]->cache.lruTail->lastAccess <
+					physicalDisks[oldest]->cache.lruTail->lastAccess))
+			{
+				oldest = count;
+			}
+		}
 
-		if (oldestBuffer->dirty)
+		if (oldest < 0)
 		{
-			if (realReadWrite(physicalDisk, oldestBuffer->startSector,
-				oldestBuffer->numSectors, oldestBuffer->data,
-				IOMODE_WRITE) < 0)
+			// Everything left is dirty
+			if (lockedDisk)
+				break;
+
+			// Write back the oldest dirty block, so that it can be
+			// evicted
+			for (count = 0; count < physicalDiskCounter; count ++)
+			{
+				if (!usable[count] || !physicalDisks[count]->cache.dirtyHead)
+					continue;
+
+				if ((oldest < 0) ||
+					(physicalDisks[count]->cache.dirtyHead->dirtyTime <
+						physicalDisks[oldest]->cache.dirtyHead->dirtyTime))
+				{
+					oldest = count;
+				}
+			}
+
+			if (oldest < 0)
+				break;
+
+			if (cacheFlush(physicalDisks[oldest],
+				physicalDisks[oldest]->cache.dirtyHead) < 0)
 			{
-				kernelDebug(debug_io, "Disk %s error writing dirty buffer",
-					physicalDisk->name);
-				return;
+				// Leave this disk alone
+				kernelDebug(debug_io, "Disk %s error writing dirty block",
+					physicalDisks[oldest]->name);
+				usable[oldest] = 0;
 			}
 
-			cacheMarkClean(physicalDisk, oldestBuffer);
+			continue;
 		}
 
-		cacheRemove(physicalDisk, oldestBuffer);
+		physicalDisk = physicalDisks[oldest];
+		block = physicalDisk->cache.lruTail;
+
+		kernelDebug(debug_io, "Disk %s uncache block %llu, mem=%p",
+			physicalDisk->name, block->number, block->data);
+
+		cachePutBlock(physicalDisk, block);
+		physicalDisk->stats.cacheEvictions += 1;
+		total -= blockBytes(physicalDisk);
+	}
+
+	for (count = 0; count < physicalDiskCounter; count ++)
+	{
+		if (release[count])
+			kernelLockRelease(&physicalDisks[count]->lock);
 	}
 
 	return;
 }
 
 
-static kernelDiskCacheBuffer *cacheAdd(kernelPhysicalDisk *physicalDisk,
+static uquad_t cacheWriteback(kernelPhysicalDisk *physicalDisk,
+	uquad_t currentTime)
+{
+	// Called by the disk thread.  Write back the disk's dirty blocks that
+	// have been dirty for long enough, oldest first, and also any others
+	// while there's more dirty data than the background threshold.  Returns
+	// the time at which the oldest remaining dirty block will be due, if
+	// any.
+
+	kernelDiskCacheBlock *block = NULL;
+	uquad_t background = ((cacheMax * DISK_DIRTY_BACKGROUND) / 100);
+	uquad_t count = 0;
+
+	debugLockCheck(physicalDisk, __FUNCTION__);
+
+	if (physicalDisk->flags & DISKFLAG_READONLY)
+		return (0);
+
+	// Each block is at the head of the list at most once, since the ones we
+	// can't write go to the back
+	for (count = physicalDisk->cache.dirty; count; count --)
+	{
+		block = physicalDisk->cache.dirtyHead;
+		if (!block)
+			break;
+
+		if (((currentTime - block->dirtyTime) < writebackAgeMs) &&
+			(cacheDirtyTotal() <= background))
+		{
+			break;
+		}
+
+		if (cacheFlush(physicalDisk, block) < 0)
+		{
+			// Try again later
+			block->dirtyTime = currentTime;
+			dirtyRemove(physicalDisk, block);
+			dirtyAdd(physicalDisk, block);
+		}
+	}
+
+	cacheCheck(physicalDisk);
+
+	if (physicalDisk->cache.dirtyHead)
+		return (physicalDisk->cache.dirtyHead->dirtyTime + writebackAgeMs);
+	else
+		return (0);
+}
+
+
+static uquad_t cacheCopyCached(kernelPhysicalDisk *physicalDisk,
 	uquad_t startSector, uquad_t numSectors, void *data)
 {
-	// Add the supplied range of sectors to the cache.
+	// Copy the cached sectors at the start of the range into the data
+	// buffer, stopping at the first one that isn't cached.  Returns the
+	// number of sectors copied.
+
+	kernelDiskCacheBlock *block = NULL;
+	uquad_t done = 0;
+	unsigned first = 0;
+	unsigned max = 0;
+	unsigned count = 0;
+
+	while (done < numSectors)
+	{
+		block = cacheLookup(physicalDisk, ((startSector + done) /
+			physicalDisk->cache.blockSectors));
+		if (!block)
+			break;
+
+		first = ((startSector + done) % physicalDisk->cache.blockSectors);
+		max = (unsigned) min((uquad_t)(physicalDisk->cache.blockSectors -
+			first), (numSectors - done));
+
+		count = sectorRun(block->valid, first, max, 1);
+		if (!count)
+			break;
+
+		memcpy((data + (done * physicalDisk->sectorSize)), (block->data +
+			(first * physicalDisk->sectorSize)),
+			(count * physicalDisk->sectorSize));
+
+		cacheTouch(physicalDisk, block);
+
+		done += count;
+
+		if (count < max)
+			break;
+	}
+
+	return (done);
+}
+
+
+static uquad_t cacheCountUncached(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors)
+{
+	// Count the sectors at the start of the range that aren't cached
+
+	kernelDiskCacheBlock *block = NULL;
+	uquad_t done = 0;
+	unsigned first = 0;
+	unsigned max = 0;
+	unsigned count = 0;
+
+	while (done < numSectors)
+	{
+		first = ((startSector + done) % physicalDisk->cache.blockSectors);
+		max = (unsigned) min((uquad_t)(physicalDisk->cache.blockSectors -
+			first), (numSectors - done));
+
+		block = cacheLookup(physicalDisk, ((startSector + done) /
+			physicalDisk->cache.blockSectors));
+		if (block)
+			count = sectorRun(block->valid, first, max, 0);
+		else
+			count = max;
+
+		done += count;
+
+		if (count < max)
+			break;
+	}
+
+	return (done);
+}
 
-	kernelDiskCacheBuffer *prevBuffer = NULL;
-	kernelDiskCacheBuffer *nextBuffer = NULL;
-	kernelDiskCacheBuffer *newBuffer = NULL;
 
-	//kernelDebug(debug_io, "Disk %s adding %llu->%llu", physicalDisk->name,
-	//	startSector, (startSector + numSectors - 1));
+static int cacheFill(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
+	uquad_t numSectors, void *data, int dirty)
+{
+	// Copy the supplied range of sectors into the cache, getting new blocks
+	// as needed, and optionally mark them dirty.
+
+	int status = 0;
+	kernelDiskCacheBlock *block = NULL;
+	uquad_t blockNumber = 0;
+	uquad_t done = 0;
+	unsigned first = 0;
+	unsigned count = 0;
 
 	debugLockCheck(physicalDisk, __FUNCTION__);
 
-	// Find out where in the order the new buffer would go.
-	nextBuffer = physicalDisk->cache.buffer;
-	while (nextBuffer)
+	if (dirty)
+		physicalDisk->cache.generation += 1;
+
+	while (done < numSectors)
+	{
+		blockNumber = ((startSector + done) /
+			physicalDisk->cache.blockSectors);
+		first = ((startSector + done) % physicalDisk->cache.blockSectors);
+		count = (unsigned) min((uquad_t)(physicalDisk->cache.blockSectors -
+			first), (numSectors - done));
+
+		block = cacheLookup(physicalDisk, blockNumber);
+		if (!block)
+		{
+			block = cacheGetBlock(physicalDisk, blockNumber);
+			if (!block)
+			{
+				kernelError(kernel_error, "Couldn't get a new block for "
+					"%s's disk cache", physicalDisk->name);
+				return (status = ERR_MEMORY);
+			}
+		}
+
+		memcpy((block->data + (first * physicalDisk->sectorSize)),
+			(data + (done * physicalDisk->sectorSize)),
+			(count * physicalDisk->sectorSize));
+
+		block->valid |= sectorMask(first, count);
+		if (dirty)
+			cacheMarkDirty(physicalDisk, block, sectorMask(first, count));
+
+		cacheTouch(physicalDisk, block);
+
+		done += count;
+	}
+
+	return (status = 0);
+}
+
+
+static uquad_t cacheReadAhead(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors)
+{
+	// Look for a stream of sequential reads that this read continues, and
+	// return the number of sectors we should read ahead of it.  Keeping a few
+	// streams per disk means that a couple of files being read at the same
+	// time, or a filesystem reading its metadata in between, doesn't keep
+	// resetting the window.  If the read doesn't continue any stream, it
+	// replaces the least recently used one.
+
+	kernelDiskReadStream *readStream = NULL;
+	uquad_t maxWindow = 0;
+	int count;
+
+	maxWindow = (DISK_READAHEAD_MAX / physicalDisk->sectorSize);
+	if (maxWindow < DISK_READAHEAD_SECTORS)
+		maxWindow = DISK_READAHEAD_SECTORS;
+
+	for (count = 0; count < DISK_READAHEAD_STREAMS; count ++)
 	{
-		if (startSector > nextBuffer->startSector)
+		if (physicalDisk->cache.stream[count].nextSector == startSector)
+		{
+			readStream = &physicalDisk->cache.stream[count];
+			break;
+		}
+
+		if (!readStream || (physicalDisk->cache.stream[count].lastUse <
+			readStream->lastUse))
 		{
-			prevBuffer = nextBuffer;
-			nextBuffer = nextBuffer->next;
+			readStream = &physicalDisk->cache.stream[count];
 		}
-		else
-			break;
 	}
 
-	// Get a new cache buffer.
-	newBuffer = cacheGetBuffer(physicalDisk, startSector, numSectors);
-	if (!newBuffer)
+	if (readStream->nextSector == startSector)
 	{
-		kernelError(kernel_error, "Couldn't get a new buffer for %s's disk "
-			"cache", physicalDisk->name);
-		return (newBuffer);
+		// Sequential.  Grow the window.
+		if (!readStream->window)
+			readStream->window = DISK_READAHEAD_SECTORS;
+		else
+			readStream->window = min((readStream->window * 2), maxWindow);
 	}
-
-	// Copy the data into the cache buffer.
-	memcpy(newBuffer->data, data, bufferBytes(physicalDisk, newBuffer));
-
-	newBuffer->prev = prevBuffer;
-	newBuffer->next = nextBuffer;
-
-	if (newBuffer->prev)
-		newBuffer->prev->next = newBuffer;
 	else
-		// This will be the first cache buffer in the cache.
-		physicalDisk->cache.buffer = newBuffer;
+	{
+		// A new stream
+		readStream->window = 0;
+	}
 
-	if (newBuffer->next)
-		newBuffer->next->prev = newBuffer;
+	readStream->nextSector = (startSector + numSectors);
+	readStream->lastUse = ++cacheClock;
 
-	physicalDisk->cache.size += bufferBytes(physicalDisk, newBuffer);
+	// Don't read past the end of the disk
+	if (readStream->nextSector >= physicalDisk->numSectors)
+		return (0);
 
-	return (newBuffer);
+	return (min(readStream->window, (physicalDisk->numSectors -
+		readStream->nextSector)));
 }
 
 
-static void cacheMerge(kernelPhysicalDisk *physicalDisk)
+static int cacheReadExtended(kernelPhysicalDisk *physicalDisk,
+	uquad_t startSector, uquad_t numSectors, uquad_t ahead, void *data)
 {
-	// Check whether we should merge cache entries.  We do this if they are
-	// a) adjacent; and b) their clean/dirty state matches.
-
-	kernelDiskCacheBuffer *currBuffer = NULL;
-	kernelDiskCacheBuffer *nextBuffer = NULL;
-	void *newData = NULL;
+	// Read the requested sectors plus the read-ahead sectors that follow them
+	// in a single disk operation, copy the requested ones into the target
+	// data buffer, and put all of them in the cache
 
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	int status = 0;
+	unsigned generation = physicalDisk->cache.generation;
+	void *buffer = NULL;
 
-	currBuffer = physicalDisk->cache.buffer;
+	buffer = kernelMemoryGetSystem(((numSectors + ahead) *
+		physicalDisk->sectorSize), "disk read-ahead");
+	if (!buffer)
+		return (status = ERR_MEMORY);
 
-	while (currBuffer)
+	status = realReadWrite(physicalDisk, startSector, (numSectors + ahead),
+		buffer, (IOMODE_READ | IOMODE_UNLOCK));
+	if (status >= 0)
 	{
-		nextBuffer = currBuffer->next;
-
-		if (nextBuffer)
-		{
-			if ((bufferEnd(currBuffer) == (nextBuffer->startSector - 1)) &&
-				(currBuffer->dirty == nextBuffer->dirty))
-			{
-				// Merge the 2 entries by expanding the memory of the first
-				// entry, copying both entries' data into it, and removing the
-				// second entry.
-
-				kernelDebug(debug_io, "Disk %s merge %llu->%llu and "
-					"%llu->%llu", physicalDisk->name, currBuffer->startSector,
-					bufferEnd(currBuffer), nextBuffer->startSector,
-					bufferEnd(nextBuffer));
-
-				// Get a new cache buffer
-				newData = kernelMalloc(bufferBytes(physicalDisk, currBuffer) +
-					bufferBytes(physicalDisk, nextBuffer));
-				if (!newData)
-				{
-					kernelError(kernel_error, "Couldn't get a new buffer for "
-						"%s's disk cache", physicalDisk->name);
-					return;
-				}
-
-				// Copy the data from each existing entry
-				memcpy(newData, currBuffer->data,
-					bufferBytes(physicalDisk, currBuffer));
-				memcpy((newData + bufferBytes(physicalDisk, currBuffer)),
-					nextBuffer->data, bufferBytes(physicalDisk, nextBuffer));
-
-				// Replace the buffer pointer
-				kernelFree(currBuffer->data);
-				currBuffer->data = newData;
-
-				// Update the first entry's size
-				currBuffer->numSectors += nextBuffer->numSectors;
-
-				// Briefly grow the cache size; removing the 'next' entry will
-				// shrink it back again
-				physicalDisk->cache.size +=
-					bufferBytes(physicalDisk, nextBuffer);
+		memcpy(data, buffer, (numSectors * physicalDisk->sectorSize));
 
-				// Remove the second entry
-				cacheRemove(physicalDisk, nextBuffer);
-
-				if (currBuffer->dirty)
-					physicalDisk->cache.dirty -= 1;
-
-				// Process this one again, since we might want to merge it
-				// with the next one as well.
-				continue;
-			}
-		}
-
-		// Move to the next one
-		currBuffer = nextBuffer;
+		if (physicalDisk->cache.generation == generation)
+			cacheFill(physicalDisk, startSector, (numSectors + ahead),
+				buffer, 0 /* clean */);
 	}
+
+	kernelMemoryReleaseSystem(buffer);
+	return (status);
 }
 
 
 static int cacheRead(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
-	uquad_t numSectors, void *data)
+	uquad_t numSectors, void *data, int *miss)
 {
 	// For ranges of sectors that are in the cache, copy them into the target
 	// data buffer.  For ranges that are not in the cache, read the sectors
-	// from disk and put a copy in a new cache buffer.
+	// from disk and put a copy in the cache.  If we had to read from the
+	// disk, set 'miss'.
 
 	int status = 0;
-	uquad_t numCached = 0;
-	uquad_t firstCached = 0;
-	uquad_t notCached = 0;
+	unsigned generation = 0;
+	uquad_t window = 0;
+	uquad_t count = 0;
+	uquad_t ahead = 0;
 	int added = 0;
-	kernelDiskCacheBuffer *buffer = NULL;
 
 	debugLockCheck(physicalDisk, __FUNCTION__);
 
+	window = cacheReadAhead(physicalDisk, startSector, numSectors);
+
 	while (numSectors)
 	{
-		numCached = cacheQueryRange(physicalDisk, startSector, numSectors,
-			&firstCached);
-
-		if (numCached)
+		// We let go of the disk while reading from it, below, so the cache
+		// might have been invalidated in the meantime
+		if (cacheSetup(physicalDisk) < 0)
 		{
-			// At least some of the data is cached.  Any uncached portion that
-			// comes before the cached portion needs to be read from disk and
-			// added to the cache.
+			*miss = 1;
+			return (status = realReadWrite(physicalDisk, startSector,
+				numSectors, data, IOMODE_READ));
+		}
 
-			notCached = (firstCached - startSector);
+		count = cacheCopyCached(physicalDisk, startSector, numSectors, data);
+		physicalDisk->stats.cacheHits += count;
 
-			// Read the uncached portion from disk.
-			if (notCached)
-			{
-				status = realReadWrite(physicalDisk, startSector, notCached,
-					data, IOMODE_READ);
-				if (status < 0)
-					return (status);
+		if (!count)
+		{
+			// Read the uncached portion from disk, and add it to the cache.
+			count = cacheCountUncached(physicalDisk, startSector, numSectors);
 
-				// Add the data to the cache.
-				buffer = cacheAdd(physicalDisk, startSector, notCached, data);
-				if (buffer)
-				{
-					buffer->lastAccess = kernelSysTimerRead();
-					added = 1;
-				}
+			kernelDebug(debug_io, "Disk %s %llu->%llu not cached",
+				physicalDisk->name, startSector, (startSector + count - 1));
 
-				startSector += notCached;
-				numSectors -= notCached;
-				data += (notCached * physicalDisk->sectorSize);
-			}
+			physicalDisk->stats.cacheMisses += count;
+			*miss = 1;
 
-			// Get the cached portion
-			buffer = cacheFind(physicalDisk, startSector, numCached);
-			if (buffer)
+			// If the uncached part runs to the end of a sequential read,
+			// extend it with whatever follows that isn't cached either, so
+			// that the read-ahead is part of the same disk operation.
+			ahead = 0;
+			if (window && (count == numSectors))
+				ahead = cacheCountUncached(physicalDisk, (startSector +
+					count), window);
+
+			if (!ahead || (cacheReadExtended(physicalDisk, startSector, count,
+				ahead, data) < 0))
 			{
-				memcpy(data, (buffer->data +
-					((startSector - buffer->startSector) *
-						physicalDisk->sectorSize)),
-					(numCached * physicalDisk->sectorSize));
-				buffer->lastAccess = kernelSysTimerRead();
-			}
+				// Other processes can use the disk while we wait.  If any
+				// of them wrote to it, or invalidated the cache, what we
+				// read might already be stale, so don't cache it.
+				generation = physicalDisk->cache.generation;
 
-			startSector += numCached;
-			numSectors -= numCached;
-			data += (numCached * physicalDisk->sectorSize);
-		}
-		else
-		{
-			// Nothing is cached.  Read everything from disk.
-			status = realReadWrite(physicalDisk, startSector, numSectors,
-				data, IOMODE_READ);
-			if (status < 0)
-				return (status);
+				status = realReadWrite(physicalDisk, startSector, count, data,
+					(IOMODE_READ | IOMODE_UNLOCK));
+				if (status < 0)
+					return (status);
 
-			// Add the data to the cache.
-			buffer = cacheAdd(physicalDisk, startSector, numSectors, data);
-			if (buffer)
-			{
-				buffer->lastAccess = kernelSysTimerRead();
-				added = 1;
+				if (physicalDisk->cache.generation == generation)
+					cacheFill(physicalDisk, startSector, count, data,
+						0 /* clean */);
 			}
 
-			break;
+			added = 1;
 		}
+
+		startSector += count;
+		numSectors -= count;
+		data += (count * physicalDisk->sectorSize);
 	}
 
 	if (added)
 	{
 		// Since we added something to the cache above, check whether we
 		// should prune it
-		if (physicalDisk->cache.size > DISK_MAX_CACHE)
-			cachePrune(physicalDisk);
+		cachePrune(physicalDisk);
 	}
 
-	// Check whether we should merge any entries
-	cacheMerge(physicalDisk);
-
 	cacheCheck(physicalDisk);
 
 	return (status = 0);
 }
 
 
-static kernelDiskCacheBuffer *cacheSplit(kernelPhysicalDisk *physicalDisk,
-	uquad_t startSector, uquad_t numSectors, void *data,
-	kernelDiskCacheBuffer *buffer)
+static int cacheWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
+	uquad_t numSectors, void *data, int *miss)
 {
-	// Given a range of sectors, split them from the supplied buffer,
-	// resulting in a previous buffer (if applicable), a next buffer (if
-	// applicable), and the new split-off buffer which we return.
-
-	uquad_t prevSectors = 0;
-	uquad_t nextSectors = 0;
-	kernelDiskCacheBuffer *prevBuffer = NULL;
-	kernelDiskCacheBuffer *newBuffer = NULL;
-	kernelDiskCacheBuffer *nextBuffer = NULL;
-
-	prevSectors = (startSector - buffer->startSector);
-	nextSectors = ((buffer->startSector + buffer->numSectors) -
-		(startSector + numSectors));
-
-	if (!prevSectors && !nextSectors)
-	{
-		kernelError(kernel_error, "Cannot split %llu sectors from a "
-			"%llu-sector buffer", numSectors, buffer->numSectors);
-		return (newBuffer = NULL);
-	}
-
-	if (prevSectors)
-		prevBuffer = cacheGetBuffer(physicalDisk, buffer->startSector,
-			prevSectors);
-
-	newBuffer = cacheGetBuffer(physicalDisk, startSector, numSectors);
-
-	if (nextSectors)
-		nextBuffer = cacheGetBuffer(physicalDisk, (startSector + numSectors),
-			nextSectors);
+	// Copy the sectors into the cache, overwriting any cached data, and mark
+	// them dirty.  If we had to write to the disk, set 'miss'.
 
-	if ((prevSectors && !prevBuffer) || !newBuffer ||
-		(nextSectors && !nextBuffer))
-	{
-		kernelError(kernel_error, "Couldn't get a new buffer for %s's disk "
-			"cache", physicalDisk->name);
-		return (newBuffer = NULL);
-	}
-
-	// Copy data
-	if (prevBuffer)
-	{
-		memcpy(prevBuffer->data, buffer->data,
-			(prevSectors * physicalDisk->sectorSize));
-		if (buffer->dirty)
-			cacheMarkDirty(physicalDisk, prevBuffer);
-		prevBuffer->lastAccess = buffer->lastAccess;
-
-		prevBuffer->prev = buffer->prev;
-		prevBuffer->next = newBuffer;
+	int status = 0;
+	uquad_t dirtyTotal = 0;
 
-		if (prevBuffer->prev)
-			prevBuffer->prev->next = prevBuffer;
-		else
-			physicalDisk->cache.buffer = prevBuffer;
+	debugLockCheck(physicalDisk, __FUNCTION__);
 
-		if (prevBuffer->next)
-			prevBuffer->next->prev = prevBuffer;
-	}
-	else
+	if (cacheSetup(physicalDisk) < 0)
 	{
-		newBuffer->prev = buffer->prev;
-
-		if (newBuffer->prev)
-			newBuffer->prev->next = newBuffer;
-		else
-			physicalDisk->cache.buffer = newBuffer;
+		*miss = 1;
+		return (status = realReadWrite(physicalDisk, startSector, numSectors,
+			data, IOMODE_WRITE));
 	}
 
-	memcpy(newBuffer->data, data,
-		(numSectors * physicalDisk->sectorSize));
-	if (buffer->dirty)
-		cacheMarkDirty(physicalDisk, newBuffer);
-	newBuffer->lastAccess = buffer->lastAccess;
-
-	if (nextBuffer)
-	{
-		memcpy(nextBuffer->data, (buffer->data + (prevSectors *
-			physicalDisk->sectorSize) + (numSectors *
-				physicalDisk->sectorSize)),
-			(nextSectors * physicalDisk->sectorSize));
-		if (buffer->dirty)
-			cacheMarkDirty(physicalDisk, nextBuffer);
-		nextBuffer->lastAccess = buffer->lastAccess;
-
-		nextBuffer->prev = newBuffer;
-		nextBuffer->next = buffer->next;
-
-		if (nextBuffer->prev)
-			nextBuffer->prev->next = nextBuffer;
-		if (nextBuffer->next)
-			nextBuffer->next->prev = nextBuffer;
-	}
-	else
+	status = cacheFill(physicalDisk, startSector, numSectors, data,
+		1 /* dirty */);
+	if (status < 0)
 	{
-		newBuffer->next = buffer->next;
-
-		if (newBuffer->next)
-			newBuffer->next->prev = newBuffer;
+		// We couldn't cache all of it.  Write it through to the disk
+		// instead.
+		*miss = 1;
+		status = realReadWrite(physicalDisk, startSector, numSectors, data,
+			IOMODE_WRITE);
+		if (status < 0)
+			return (status);
 	}
 
-	if (buffer->dirty)
-		cacheMarkClean(physicalDisk, buffer);
-
-	cachePutBuffer(buffer);
-
-	return (newBuffer);
-}
-
-
-static int cacheWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
-	uquad_t numSectors, void *data)
-{
-	// For ranges of sectors that are in the cache, overwrite the cache buffer
-	// with the new data.  For ranges that are not in the cache, allocate a
-	// new cache buffer for the new data.
-
-	int status = 0;
-	uquad_t numCached = 0;
-	uquad_t firstCached = 0;
-	uquad_t notCached = 0;
-	int added = 0;
-	kernelDiskCacheBuffer *buffer = NULL;
-
-	debugLockCheck(physicalDisk, __FUNCTION__);
+	// Since we added something to the cache above, check whether we should
+	// prune it.
+	cachePrune(physicalDisk);
 
-	while (numSectors)
+	// Dirty data is normally written back by the disk thread.  If there's
+	// more than the background threshold, wake it up now.  If there's more
+	// than the limit, the writer has to help, by writing back this disk's
+	// oldest dirty blocks.
+	dirtyTotal = cacheDirtyTotal();
+	if (dirtyTotal > ((cacheMax * DISK_DIRTY_BACKGROUND) / 100))
 	{
-		numCached = cacheQueryRange(physicalDisk, startSector, numSectors,
-			&firstCached);
-
-		if (numCached)
+		if (dirtyTotal > ((cacheMax * DISK_DIRTY_LIMIT) / 100))
 		{
-			// At least some of the data is cached.  For any uncached portion
-			// that comes before the cached portion, allocate a new cache
-			// buffer.
+			kernelDebug(debug_io, "Disk %s over the dirty limit",
+				physicalDisk->name);
 
-			notCached = (firstCached - startSector);
+			*miss = 1;
 
-			if (notCached)
+			while (physicalDisk->cache.dirtyHead &&
+				(cacheDirtyTotal() > ((cacheMax * DISK_DIRTY_LIMIT) / 100)))
 			{
-				// Add the data to the cache, and mark it dirty.
-				buffer = cacheAdd(physicalDisk, startSector, notCached, data);
-				if (buffer)
+				// If it fails, the disk thread will keep trying
+				if (cacheFlush(physicalDisk,
+					physicalDisk->cache.dirtyHead) < 0)
 				{
-					cacheMarkDirty(physicalDisk, buffer);
-					buffer->lastAccess = kernelSysTimerRead();
-					added = 1;
+					break;
 				}
-
-				startSector += notCached;
-				numSectors -= notCached;
-				data += (notCached * physicalDisk->sectorSize);
-			}
-
-			buffer = cacheFind(physicalDisk, startSector, numCached);
-
-			// If the buffer is clean, and we're not dirtying the whole thing,
-			// split off the bit we're making dirty.
-			if (!buffer->dirty && (numCached != buffer->numSectors))
-			{
-				buffer = cacheSplit(physicalDisk, startSector, numCached,
-					data, buffer);
-			}
-			else
-			{
-				// Overwrite the cached portion.
-				memcpy((buffer->data + ((startSector - buffer->startSector) *
-					physicalDisk->sectorSize)), data,
-					(numCached * physicalDisk->sectorSize));
-			}
-
-			if (buffer)
-			{
-				cacheMarkDirty(physicalDisk, buffer);
-				buffer->lastAccess = kernelSysTimerRead();
-			}
-
-			startSector += numCached;
-			numSectors -= numCached;
-			data += (numCached * physicalDisk->sectorSize);
-		}
-		else
-		{
-			// Nothing is cached.  Add it all to the cache, and mark it dirty.
-			buffer = cacheAdd(physicalDisk, startSector, numSectors, data);
-			if (buffer)
-			{
-				cacheMarkDirty(physicalDisk, buffer);
-				buffer->lastAccess = kernelSysTimerRead();
-				added = 1;
 			}
-			break;
 		}
-	}
 
-	if (added)
-	{
-		// Since we added something to the cache above, check whether we
-		// should prune it.
-		if (physicalDisk->cache.size > DISK_MAX_CACHE)
-			cachePrune(physicalDisk);
+		kernelMultitaskerWaitQueueWakeAll(&threadWaitQueue);
 	}
 
-	// Check whether we should merge any entries
-	cacheMerge(physicalDisk);
-
 	cacheCheck(physicalDisk);
 
 	return (status = 0);
@@ -1265,6 +2335,9 @@ static int readWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 
 	int status = 0;
 	uquad_t startTime = kernelCpuGetMs();
+	uquad_t startStamp = kernelCpuTimestamp();
+	int miss = 0;
+	unsigned us = 0;
 
 	debugLockCheck(physicalDisk, __FUNCTION__);
 
@@ -1279,33 +2352,47 @@ static int readWrite(kernelPhysicalDisk *physicalDisk, uquad_t startSector,
 	if (!(physicalDisk->flags & DISKFLAG_NOCACHE) && !(mode & IOMODE_NOCACHE))
 	{
 		if (mode & IOMODE_READ)
-			status = cacheRead(physicalDisk, startSector, numSectors, data);
+			status = cacheRead(physicalDisk, startSector, numSectors, data,
+				&miss);
 		else
-			status = cacheWrite(physicalDisk, startSector, numSectors, data);
+			status = cacheWrite(physicalDisk, startSector, numSectors, data,
+				&miss);
 	}
 	else
 	#endif // DISK_CACHE
 	{
+		miss = 1;
 		status = realReadWrite(physicalDisk, startSector, numSectors, data,
-			mode);
+			(mode | IOMODE_UNLOCK));
 	}
 
-	// Throughput stats collection
+	us = elapsedUs(startStamp);
+
+	// Throughput and latency stats collection
 	if (mode & IOMODE_READ)
 	{
+		physicalDisk->stats.reads += 1;
 		physicalDisk->stats.readTimeMs += (unsigned)(kernelCpuGetMs() -
 			startTime);
 		physicalDisk->stats.readKbytes += ((numSectors *
 			physicalDisk->sectorSize) / 1024);
+		statsLatency(physicalDisk, (miss? DISKSTAT_READMISS :
+			DISKSTAT_READHIT), us);
 	}
 	else
 	{
+		physicalDisk->stats.writes += 1;
 		physicalDisk->stats.writeTimeMs += (unsigned)(kernelCpuGetMs() -
 			startTime);
 		physicalDisk->stats.writeKbytes += ((numSectors *
 			physicalDisk->sectorSize) / 1024);
+		statsLatency(physicalDisk, (miss? DISKSTAT_WRITEMISS :
+			DISKSTAT_WRITEHIT), us);
 	}
 
+	if (status < 0)
+		physicalDisk->stats.errors += 1;
+
 	return (status);
 }
 
@@ -2198,6 +3285,7 @@ int kernelDiskRegisterDevice(kernelDevice *dev)
 
 	// Reset the 'last access' and 'last sync' values
 	physicalDisk->lastAccess = kernelSysTimerRead();
+	physicalDisk->motorOffTime = (kernelCpuGetMs() + DISK_MOTOROFF_MS);
 
 	// Unlock the disk
 	kernelLockRelease(&physicalDisk->lock);
@@ -2295,6 +3383,18 @@ int kernelDiskInitialize(void)
 	// Initialize the name of the boot disk
 	bootDisk[0] = '\0';
 
+	// The headers of disk cache blocks, and their data, come from their own
+	// caches
+	status = kernelSlabCacheInit(&cacheBlockCache, "disk cache blocks",
+		sizeof(kernelDiskCacheBlock), NULL /* no constructor */);
+	if (status < 0)
+		return (status);
+
+	status = kernelSlabCacheInit(&cacheDataCache, "disk cache data",
+		DISK_CACHE_BLOCK, NULL /* no constructor */);
+	if (status < 0)
+		return (status);
+
 	// If we booted with a RAM disk specified, register it
 	if (kernelOsLoaderInfo->ramDiskMemory && kernelOsLoaderInfo->ramDiskSize)
 	{
@@ -2322,6 +3422,12 @@ int kernelDiskInitialize(void)
 	}
 
 	// Spawn the disk thread
+	#if (DISK_CACHE)
+	// Set the default cache budget.  The kernel's configuration can change
+	// it later.
+	kernelDiskSetCachePercent(DISK_CACHE_PERCENT);
+	#endif // DISK_CACHE
+
 	status = spawnDiskThread();
 	if (status < 0)
 		kernelError(kernel_warn, "Unable to start disk thread");
@@ -2472,6 +3578,66 @@ int kernelDiskInvalidateCache(const char *diskName)
 }
 
 
+int kernelDiskSetCachePercent(int percent)
+{
+	// Set the memory budget shared by the caches of all the disks, as a
+	// percentage of the memory that's free (including what the caches are
+	// using already).
+
+	int status = 0;
+
+	if ((percent < 1) || (percent > DISK_CACHE_MAX_PERCENT))
+	{
+		kernelError(kernel_error, "Disk cache must be between 1%% and %d%% "
+			"of free memory", DISK_CACHE_MAX_PERCENT);
+		return (status = ERR_RANGE);
+	}
+
+	#if (DISK_CACHE)
+	memoryStats memStats;
+
+	status = kernelMemoryGetStats(&memStats, 0 /* not kernel */);
+	if (status < 0)
+		return (status);
+
+	cacheMax = (((((uquad_t) memStats.totalMemory - memStats.usedMemory) +
+		cacheTotal()) * percent) / 100);
+	cacheMax = max(cacheMax, (uquad_t) DISK_CACHE_MIN);
+
+	kernelDebug(debug_io, "Disk cache budget is %llu Kb", (cacheMax >> 10));
+
+	// If it shrank, the disk thread will catch up
+	#endif // DISK_CACHE
+
+	return (status = 0);
+}
+
+
+int kernelDiskSetWritebackAge(int seconds)
+{
+	// Set how long data can stay dirty in the disk caches before the disk
+	// thread writes it back
+
+	int status = 0;
+
+	if ((seconds < 1) || (seconds > DISK_WRITEBACK_MAX_SECS))
+	{
+		kernelError(kernel_error, "Disk write-back age must be between 1 and "
+			"%d seconds", DISK_WRITEBACK_MAX_SECS);
+		return (status = ERR_RANGE);
+	}
+
+	#if (DISK_CACHE)
+	writebackAgeMs = (seconds * MS_PER_SEC);
+
+	// Let the disk thread work out when to wake up again
+	kernelMultitaskerWaitQueueWakeAll(&threadWaitQueue);
+	#endif // DISK_CACHE
+
+	return (status = 0);
+}
+
+
 int kernelDiskShutdown(void)
 {
 	// Shut down.
@@ -3694,6 +4860,97 @@ int kernelDiskEraseSectors(const char *diskName, uquad_t logicalSector,
 }
 
 
+int kernelDiskDiscardSectors(const char *diskName, uquad_t logicalSector,
+	uquad_t numSectors)
+{
+	// Tell the disk that the contents of some sectors are no longer needed,
+	// so that (for example) a solid state disk can erase them ahead of time.
+	// Returns ERR_NOTIMPLEMENTED if the disk can't do it.
+
+	int status = 0;
+	kernelPhysicalDisk *physicalDisk = NULL;
+	kernelDisk *theDisk = NULL;
+	kernelDiskOps *ops = NULL;
+	kernelDiskRequest request;
+
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	// Check params
+	if (!diskName)
+		return (status = ERR_NULLPARAMETER);
+
+	// Get the disk structure.  Try a physical disk first.
+	physicalDisk = getPhysicalByName(diskName);
+	if (!physicalDisk)
+	{
+		// Try logical
+		theDisk = kernelDiskGetByName(diskName);
+		if (!theDisk)
+			// No such disk.
+			return (status = ERR_NOSUCHENTRY);
+
+		// Start at the beginning of the logical volume.
+		logicalSector += theDisk->startSector;
+
+		// Make sure the logical sector number does not exceed the number
+		// of logical sectors on this volume
+		if ((logicalSector >= (theDisk->startSector + theDisk->numSectors)) ||
+			((logicalSector + numSectors) >
+				(theDisk->startSector + theDisk->numSectors)))
+		{
+			// Make a kernelError.
+			kernelError(kernel_error, "Exceeding volume boundary");
+			return (status = ERR_BOUNDS);
+		}
+
+		physicalDisk = theDisk->physical;
+	}
+
+	ops = (kernelDiskOps *) physicalDisk->driver->ops;
+
+	if (!ops->driverDiscardSectors || !(physicalDisk->flags &
+		DISKFLAG_DISCARD))
+	{
+		return (status = ERR_NOTIMPLEMENTED);
+	}
+
+	if (physicalDisk->flags & DISKFLAG_READONLY)
+		return (status = ERR_NOWRITE);
+
+	if (!numSectors)
+		return (status = 0);
+
+	// Lock the disk
+	status = kernelLockGet(&physicalDisk->lock);
+	if (status < 0)
+		return (status = ERR_NOLOCK);
+
+	#if (DISK_CACHE)
+	cacheDiscard(physicalDisk, logicalSector, numSectors);
+	#endif // DISK_CACHE
+
+	// It goes through the queue, so that the driver doesn't get it while
+	// it's doing something else
+	memset((void *) &request, 0, sizeof(kernelDiskRequest));
+	request.startSector = logicalSector;
+	request.numSectors = numSectors;
+	request.mode = IOMODE_DISCARD;
+
+	status = queueRequest(physicalDisk, &request, 0 /* don't unlock */);
+	if (status < 0)
+	{
+		kernelError(kernel_warn, "Error %d discarding %llu sectors at %llu, "
+			"disk %s", status, numSectors, logicalSector, physicalDisk->name);
+	}
+
+	// Unlock the disk
+	kernelLockRelease(&physicalDisk->lock);
+
+	return (status);
+}
+
+
 int kernelDiskGetStats(const char *diskName, diskStats *stats)
 {
 	// Return performance stats about the supplied disk name (if non-NULL,
@@ -3702,7 +4959,7 @@ int kernelDiskGetStats(const char *diskName, diskStats *stats)
 	int status = 0;
 	kernelPhysicalDisk *physicalDisk = NULL;
 	kernelDisk *logicalDisk = NULL;
-	int count;
+	int count, kind, bucket;
 
 	if (!initialized)
 		return (status = ERR_NOTINITIALIZED);
@@ -3727,6 +4984,12 @@ int kernelDiskGetStats(const char *diskName, diskStats *stats)
 		}
 
 		memcpy(stats, (void *) &physicalDisk->stats, sizeof(diskStats));
+		stats->queueDepth = (physicalDisk->queue.numQueued +
+			physicalDisk->queue.numActive);
+
+		#if (DISK_CACHE)
+		stats->cacheSize = physicalDisk->cache.size;
+		#endif // DISK_CACHE
 	}
 	else
 	{
@@ -3737,9 +5000,46 @@ int kernelDiskGetStats(const char *diskName, diskStats *stats)
 			stats->readKbytes += physicalDisk->stats.readKbytes;
 			stats->writeTimeMs += physicalDisk->stats.writeTimeMs;
 			stats->writeKbytes += physicalDisk->stats.writeKbytes;
+			stats->cacheHits += physicalDisk->stats.cacheHits;
+			stats->cacheMisses += physicalDisk->stats.cacheMisses;
+			stats->cacheEvictions += physicalDisk->stats.cacheEvictions;
+			stats->reads += physicalDisk->stats.reads;
+			stats->writes += physicalDisk->stats.writes;
+			stats->errors += physicalDisk->stats.errors;
+
+			for (kind = 0; kind < DISKSTAT_KINDS; kind ++)
+			{
+				stats->latencyUs[kind] += physicalDisk->stats.latencyUs[kind];
+				for (bucket = 0; bucket < DISKSTAT_BUCKETS; bucket ++)
+					stats->latency[kind][bucket] +=
+						physicalDisk->stats.latency[kind][bucket];
+			}
+
+			stats->ioReads += physicalDisk->stats.ioReads;
+			stats->ioWrites += physicalDisk->stats.ioWrites;
+			stats->ioDiscards += physicalDisk->stats.ioDiscards;
+			stats->ioReadKbytes += physicalDisk->stats.ioReadKbytes;
+			stats->ioWriteKbytes += physicalDisk->stats.ioWriteKbytes;
+			stats->ioReadUs += physicalDisk->stats.ioReadUs;
+			stats->ioWriteUs += physicalDisk->stats.ioWriteUs;
+			stats->queued += physicalDisk->stats.queued;
+			stats->queueDepth += (physicalDisk->queue.numQueued +
+				physicalDisk->queue.numActive);
+			stats->queueDepthMax = max(stats->queueDepthMax,
+				physicalDisk->stats.queueDepthMax);
+			stats->queueDepthTotal += physicalDisk->stats.queueDepthTotal;
 		}
+
+		#if (DISK_CACHE)
+		stats->cacheSize = cacheTotal();
+		#endif // DISK_CACHE
 	}
 
+	#if (DISK_CACHE)
+	// The budget is shared by all the disks
+	stats->cacheMax = cacheMax;
+	#endif // DISK_CACHE
+
 	return (status = 0);
 }
 
@@ -28,11 +28,30 @@
 #include "kernelFile.h"
 #include "kernelDevice.h"
 #include "kernelLock.h"
+#include "kernelMultitasker.h"
 #include <sys/disk.h>
 
 #define DISK_CACHE				1
 #define DISK_CACHE_ALIGN		(64 * 1024)	// Convenient for floppies
-#define DISK_READAHEAD_SECTORS	32
+#define DISK_CACHE_BLOCK		4096
+#define DISK_CACHE_HASH_BUCKETS	256			// Initially; grows with the cache
+#define DISK_CACHE_FLUSH_BLOCKS	64			// Most blocks per coalesced write
+#define DISK_CACHE_PERCENT		12			// Default budget, % of free memory
+#define DISK_CACHE_MAX_PERCENT	50
+#define DISK_CACHE_MIN			(1024 * 1024)
+#define DISK_CACHE_LOWMEM		5			// Shrink below this % free memory
+#define DISK_DIRTY_BACKGROUND	10			// % of budget; start writing back
+#define DISK_DIRTY_LIMIT		40			// % of budget; writers must write
+#define DISK_WRITEBACK_AGE_MS	(5 * MS_PER_SEC)
+#define DISK_WRITEBACK_MAX_SECS	600
+#define DISK_READAHEAD_SECTORS	32			// Initial read-ahead window
+#define DISK_READAHEAD_MAX		(256 * 1024)	// Largest window, in bytes
+#define DISK_READAHEAD_STREAMS	4
+#define DISK_QUEUE_MERGE_MAX	(256 * 1024)	// Largest merged request, in bytes
+#define DISK_QUEUE_VERIFY_MS	500
+#define DISK_BOUNCE_MAX			(1024 * 1024)	// Largest bounced request, in bytes
+#define DISK_MOTOROFF_MS		2000
+#define DISK_THREAD_IDLE_MS		MS_PER_SEC
 
 typedef enum { addr_pchs, addr_lba } kernelAddrMethod;
 
@@ -86,27 +105,87 @@ typedef struct {
 	int (*driverReadSectors)(int, uquad_t, uquad_t, void *);
 	int (*driverWriteSectors)(int, uquad_t, uquad_t, const void *);
 	int (*driverFlush)(int);
+	int (*driverDiscardSectors)(int, uquad_t, uquad_t);
 
 } kernelDiskOps;
 
-#if (DISK_CACHE)
-// This is for metadata about a range of data in a disk cache
-typedef volatile struct _kernelDiskCacheSector {
+// This is a read or write waiting in a physical disk's queue.  Requests for
+// adjacent ranges of sectors (or overlapping ones, when reading) are merged
+// into a single driver operation, in which case the others are chained to
+// the one that's in the queue, and it covers the range of all of them.
+typedef volatile struct _kernelDiskRequest {
 	uquad_t startSector;
 	uquad_t numSectors;
 	void *data;
-	int dirty;
-	unsigned lastAccess;
-	volatile struct _kernelDiskCacheSector *prev;
-	volatile struct _kernelDiskCacheSector *next;
+	unsigned mode;
+	uquad_t ioStart;
+	uquad_t ioSectors;
+	int status;
+	int done;
+	int dispatcher;		// Process handing it to the driver
+	volatile struct _kernelDiskRequest *next;
+	volatile struct _kernelDiskRequest *merged;
 
-} kernelDiskCacheBuffer;
+} kernelDiskRequest;
+
+// This is the queue of requests for a physical disk, sorted by sector.  A
+// process with a request in the queue hands requests to the driver, in
+// elevator order, as long as the driver doesn't already have as many as it
+// can take at once (the disk's queue depth, 1 unless the driver says
+// otherwise).  The ones the driver has are in the 'active' list.
+typedef volatile struct {
+	kernelDiskRequest *head;
+	kernelDiskRequest *active;
+	int numQueued;
+	int numActive;
+	uquad_t lastSector;
+	kernelWaitQueue waitQueue;
+
+} kernelDiskQueue;
+
+#if (DISK_CACHE)
+// This is for metadata about a fixed-size block of data in a disk cache.
+// Blocks are found by block number in a hash table.  Clean ones are kept in
+// LRU order (most recently used first) in one list, and dirty ones in the
+// order they were dirtied (oldest first) in another.
+typedef volatile struct _kernelDiskCacheBlock {
+	uquad_t number;
+	void *data;
+	unsigned valid;		// Bitmap of sectors that hold data
+	unsigned dirty;		// Bitmap of sectors that need writing
+	uquad_t dirtyTime;
+	uquad_t lastAccess;
+	volatile struct _kernelDiskCacheBlock *hashNext;
+	volatile struct _kernelDiskCacheBlock *prev;
+	volatile struct _kernelDiskCacheBlock *next;
+	volatile struct _kernelDiskCacheBlock *dirtyPrev;
+	volatile struct _kernelDiskCacheBlock *dirtyNext;
+
+} kernelDiskCacheBlock;
+
+// This is for detecting a sequential stream of reads, so that the cache can
+// read ahead of it.  The window doubles each time the stream continues.
+typedef volatile struct {
+	uquad_t nextSector;
+	uquad_t window;
+	uquad_t lastUse;
+
+} kernelDiskReadStream;
 
 // This is for managing the data cache of a physical disk
 typedef volatile struct {
-	kernelDiskCacheBuffer *buffer;
+	kernelDiskCacheBlock **hash;
+	unsigned hashBuckets;
+	unsigned blockSectors;
+	unsigned blocks;
+	kernelDiskCacheBlock *lruHead;
+	kernelDiskCacheBlock *lruTail;
+	kernelDiskCacheBlock *dirtyHead;
+	kernelDiskCacheBlock *dirtyTail;
 	uquad_t size;
 	uquad_t dirty;
+	unsigned generation;	// Changes whenever cached data might go stale
+	kernelDiskReadStream stream[DISK_READAHEAD_STREAMS];
 
 } kernelDiskCache;
 #endif // DISK_CACHE
@@ -137,7 +216,9 @@ typedef volatile struct _kernelPhysicalDisk {
 	unsigned lastSession;  // Needed for multisession CD-ROM
 	spinLock lock;
 	unsigned lastAccess;
+	uquad_t motorOffTime;
 	int multiSectors;
+	int queueDepth;		// Requests the driver can do at once, if > 1
 
 	// Physical disk driver
 	kernelDriver *driver;
@@ -145,6 +226,9 @@ typedef volatile struct _kernelPhysicalDisk {
 
 	diskStats stats;
 
+	// Requests waiting for the driver
+	kernelDiskQueue queue;
+
 #if (DISK_CACHE)
 	// The cache
 	kernelDiskCache cache;
@@ -159,6 +243,8 @@ int kernelDiskInitialize(void);
 void kernelDiskAutoMount(kernelDisk *);
 void kernelDiskAutoMountAll(void);
 int kernelDiskInvalidateCache(const char *);
+int kernelDiskSetCachePercent(int);
+int kernelDiskSetWritebackAge(int);
 int kernelDiskShutdown(void);
 int kernelDiskFromLogical(kernelDisk *, disk *);
 kernelDisk *kernelDiskGetByName(const char *);
@@ -186,6 +272,7 @@ int kernelDiskMediaChanged(const char *);
 int kernelDiskReadSectors(const char *, uquad_t, uquad_t, void *);
 int kernelDiskWriteSectors(const char *, uquad_t, uquad_t, const void *);
 int kernelDiskEraseSectors(const char *, uquad_t, uquad_t, int);
+int kernelDiskDiscardSectors(const char *, uquad_t, uquad_t);
 int kernelDiskGetStats(const char *, diskStats *);
 
 #endif
@@ -34,6 +34,7 @@
 #include "kernelMultitasker.h"
 #include "kernelRandom.h"
 #include "kernelRtc.h"
+#include "kernelSlab.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,39 +45,12 @@
 // The root directory
 static kernelFileEntry *rootEntry = NULL;
 
-// Memory for free file entries
-static kernelFileEntry *freeEntries = NULL;
-static spinLock freeEntriesLock;
+// Memory for file entries
+static kernelSlabCache entryCache;
 
 static int initialized = 0;
 
 
-static int allocateFileEntries(void)
-{
-	// This function is used to allocate more memory for the freeEntries list.
-	// The freeEntriesLock should be held before calling this function.
-
-	int status = 0;
-	kernelFileEntry *entries = NULL;
-	int count;
-
-	// Allocate memory for file entries
-	entries = kernelMalloc(sizeof(kernelFileEntry) * MAX_BUFFERED_FILES);
-	if (!entries)
-		return (status = ERR_MEMORY);
-
-	// Initialize the new kernelFileEntry structures
-
-	for (count = 0; count < (MAX_BUFFERED_FILES - 1); count ++)
-		entries[count].nextEntry = &entries[count + 1];
-
-	// The free file entries are the new memory
-	freeEntries = entries;
-
-	return (status = 0);
-}
-
-
 static int isLeafDir(kernelFileEntry *entry)
 {
 	// This function will determine whether the supplied directory entry is a
@@ -1185,8 +1159,8 @@ static int fileCopy(file *sourceFile, file *destFile)
 	bufferSize = max((srcBlocks * sourceFile->blockSize),
 		(destBlocks * destFile->blockSize));
 
-	// (but no bigger than the maximum disk cache size)
-	bufferSize = max(bufferSize, DISK_MAX_CACHE);
+	// (but no smaller than the minimum disk cache size)
+	bufferSize = max(bufferSize, DISK_CACHE_MIN);
 
 	while (!(copyBuffer = kernelMemoryGet(bufferSize, "file copy buffer")))
 	{
@@ -1372,9 +1346,8 @@ int kernelFileInitialize(void)
 {
 	// We're not initialized until the root directory has been set, below
 
-	memset((void *) &freeEntriesLock, 0, sizeof(spinLock));
-
-	return (0);
+	return (kernelSlabCacheInit(&entryCache, "file entries",
+		sizeof(kernelFileEntry), NULL /* no constructor */));
 }
 
 
@@ -1417,30 +1390,10 @@ kernelFileEntry *kernelFileNewEntry(kernelDisk *fsDisk)
 		return (entry = NULL);
 	}
 
-	// Try to get a lock on the free entries list
-	status = kernelLockGet(&freeEntriesLock);
-	if (status < 0)
-		return (entry = NULL);
-
-	// Make sure there is a free file entry available
-	if (!freeEntries)
-	{
-		status = allocateFileEntries();
-		if (status < 0)
-		{
-			kernelLockRelease(&freeEntriesLock);
-			return (entry = NULL);
-		}
-	}
-
-	// Get a free file entry.  Grab it from the first spot.
-	entry = freeEntries;
-	freeEntries = entry->nextEntry;
-
-	kernelLockRelease(&freeEntriesLock);
-
-	// Clear it
-	memset((void *) entry, 0, sizeof(kernelFileEntry));
+	// Get a free file entry.  It comes cleared.
+	entry = kernelSlabAlloc(&entryCache);
+	if (!entry)
+		return (entry);
 
 	// Set some default time/date values
 	updateAllTimes(entry);
@@ -1459,7 +1412,10 @@ kernelFileEntry *kernelFileNewEntry(kernelDisk *fsDisk)
 	{
 		status = driver->driverNewEntry(entry);
 		if (status < 0)
+		{
+			kernelSlabFree(&entryCache, (void *) entry);
 			return (entry = NULL);
+		}
 	}
 
 	return (entry);
@@ -1498,18 +1454,8 @@ void kernelFileReleaseEntry(kernelFileEntry *entry)
 		}
 	}
 
-	// Clear it out
-	memset((void *) entry, 0, sizeof(kernelFileEntry));
-
-	// Try to get a lock on the free entries list
-	if (kernelLockGet(&freeEntriesLock) < 0)
-		return;
-
-	// Put the entry back into the pool of free entries
-	entry->nextEntry = freeEntries;
-	freeEntries = entry;
-
-	kernelLockRelease(&freeEntriesLock);
+	// Put the entry back into the cache of free entries
+	kernelSlabFree(&entryCache, (void *) entry);
 }
 
 
@@ -26,7 +26,6 @@
 #include <sys/disk.h>
 
 // Definitions
-#define MAX_BUFFERED_FILES		1024
 // Microsoft's filesystems can't handle too many directory entries
 #define MAX_DIRECTORY_ENTRIES	0xFFFE
 
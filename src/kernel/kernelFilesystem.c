@@ -161,6 +161,8 @@ finished:
 			theDisk->opFlags |= FS_OP_CHECK;
 		if (driver->driverDefragment)
 			theDisk->opFlags |= FS_OP_DEFRAG;
+		if (driver->driverTrim)
+			theDisk->opFlags |= FS_OP_TRIM;
 		if (driver->driverStat)
 			theDisk->opFlags |= FS_OP_STAT;
 		if (driver->driverResizeConstraints)
@@ -588,6 +590,66 @@ int kernelFilesystemDefragment(const char *diskName, progress *prog)
 }
 
 
+int kernelFilesystemTrim(const char *diskName, progress *prog)
+{
+	// This function is a wrapper for the filesystem driver's 'trim'
+	// function, if applicable, which discards the filesystem's unused blocks
+
+	int status = 0;
+	kernelDisk *theDisk = NULL;
+	kernelFilesystemDriver *theDriver = NULL;
+
+	// Check params
+	if (!diskName)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (status = ERR_NULLPARAMETER);
+	}
+
+	theDisk = kernelDiskGetByName(diskName);
+	if (!theDisk)
+	{
+		kernelError(kernel_error, "No such disk \"%s\"", diskName);
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	if (theDisk->physical->type & DISKTYPE_REMOVABLE)
+		checkRemovable(theDisk);
+
+	// Make sure the disk can discard sectors
+	if (!(theDisk->physical->flags & DISKFLAG_DISCARD))
+	{
+		kernelError(kernel_error, "Disk \"%s\" does not support discarding "
+			"sectors", theDisk->name);
+		return (status = ERR_NOTIMPLEMENTED);
+	}
+
+	if (!theDisk->filesystem.driver)
+	{
+		// Try a scan before we error out
+		if (kernelFilesystemScan((char *) theDisk->name) < 0)
+		{
+			kernelError(kernel_error, "The filesystem type of disk \"%s\" is "
+				"unknown", theDisk->name);
+			return (status = ERR_NOTIMPLEMENTED);
+		}
+	}
+
+	theDriver = theDisk->filesystem.driver;
+
+	// Make sure the driver's trimming function is not NULL
+	if (!theDriver->driverTrim)
+	{
+		kernelError(kernel_error, "The filesystem driver does not support "
+			"the 'trim' operation");
+		return (status = ERR_NOSUCHFUNCTION);
+	}
+
+	// Trim the filesystem
+	return (status = theDriver->driverTrim(theDisk, prog));
+}
+
+
 int kernelFilesystemStat(const char *diskName, kernelFilesystemStats *stat)
 {
 	// This function is a wrapper for the filesystem driver's 'stat' function,
@@ -52,6 +52,7 @@ typedef struct _kernelFilesystemDriver {
 	int (*driverClobber)(kernelDisk *);
 	int (*driverCheck)(kernelDisk *, int, int, progress *);
 	int (*driverDefragment)(kernelDisk *, progress *);
+	int (*driverTrim)(kernelDisk *, progress *);
 	int (*driverStat)(kernelDisk *, kernelFilesystemStats *);
 	uquad_t (*driverGetFreeBytes)(kernelDisk *);
 	int (*driverResizeConstraints)(kernelDisk *, uquad_t *, uquad_t *,
@@ -93,6 +94,7 @@ int kernelFilesystemFormat(const char *, const char *, const char *, int,
 int kernelFilesystemClobber(const char *);
 int kernelFilesystemCheck(const char *, int, int, progress *);
 int kernelFilesystemDefragment(const char *, progress *);
+int kernelFilesystemTrim(const char *, progress *);
 int kernelFilesystemStat(const char *, kernelFilesystemStats *);
 int kernelFilesystemResizeConstraints(const char *, uquad_t *, uquad_t *,
 	progress *);
@@ -2046,6 +2046,7 @@ static kernelFilesystemDriver fsDriver = {
 	clobber,
 	NULL,		// driverCheck
 	NULL,		// driverDefragment
+	NULL,		// driverTrim
 	NULL,		// driverStat
 	getFreeBytes,
 	NULL,		// driverResizeConstraints
@@ -505,6 +505,13 @@ static fatInternalData *getFatData(kernelDisk *theDisk)
 	// Attach the disk structure to the fatData structure
 	fatData->disk = theDisk;
 
+	// Freed clusters get discarded, if the disk can do it
+	if ((theDisk->physical->flags & DISKFLAG_DISCARD) &&
+		!(theDisk->physical->flags & DISKFLAG_READONLY))
+	{
+		fatData->canDiscard = 1;
+	}
+
 	// Get the disk's boot sector info
 	status = readVolumeInfo(fatData);
 	if (status < 0)
@@ -1087,6 +1094,116 @@ static int getNumClusters(fatInternalData *fatData, unsigned startCluster,
 }
 
 
+static int discardFree(fatInternalData *fatData, unsigned startCluster,
+	unsigned numClusters, uquad_t *discarded)
+{
+	// Discard the runs of clusters in the range that are (still) free.  The
+	// caller must hold the free bitmap lock.
+
+	int status = 0;
+	unsigned endCluster = (startCluster + numClusters);
+	unsigned runStart = 0;
+
+	while (startCluster < endCluster)
+	{
+		// Skip used clusters
+		if (fatData->freeClusterBitmap[startCluster / 8] &
+			(1 << (startCluster % 8)))
+		{
+			startCluster += 1;
+			continue;
+		}
+
+		runStart = startCluster;
+		while ((startCluster < endCluster) &&
+			!(fatData->freeClusterBitmap[startCluster / 8] &
+				(1 << (startCluster % 8))))
+		{
+			startCluster += 1;
+		}
+
+		status = kernelDiskDiscardSectors((char *) fatData->disk->name,
+			fatClusterToLogical(fatData, runStart), ((uquad_t)(startCluster -
+				runStart) * fatData->bpb.sectsPerClust));
+		if (status < 0)
+		{
+			if (status == ERR_NOTIMPLEMENTED)
+				fatData->canDiscard = 0;
+			return (status);
+		}
+
+		if (discarded)
+			*discarded += (startCluster - runStart);
+	}
+
+	return (status = 0);
+}
+
+
+static void discardFlush(fatInternalData *fatData)
+{
+	// Discard the freed clusters that have been waiting.  First, make sure
+	// that the FAT saying they're free is on the disk, so that a crash can't
+	// leave any files pointing at discarded clusters.  The caller must hold
+	// the free bitmap lock.
+
+	int count;
+
+	if (!fatData->numDiscard)
+		return;
+
+	kernelDebug(debug_fs, "FAT discard %u freed clusters in %d extents",
+		fatData->discardClusters, fatData->numDiscard);
+
+	if (kernelDiskSync((char *) fatData->disk->name) >= 0)
+	{
+		for (count = 0; (count < fatData->numDiscard) &&
+			fatData->canDiscard; count ++)
+		{
+			if (discardFree(fatData, fatData->discard[count].startCluster,
+				fatData->discard[count].numClusters, NULL) < 0)
+			{
+				break;
+			}
+		}
+	}
+
+	fatData->numDiscard = 0;
+	fatData->discardClusters = 0;
+}
+
+
+static void discardQueue(fatInternalData *fatData, unsigned cluster)
+{
+	// Remember a freed cluster, so that it can be discarded later, along with
+	// any others.  The caller must hold the free bitmap lock.
+
+	fatExtent *extent = NULL;
+
+	if (!fatData->canDiscard)
+		return;
+
+	if (fatData->numDiscard)
+	{
+		extent = &fatData->discard[fatData->numDiscard - 1];
+		if (cluster == (extent->startCluster + extent->numClusters))
+		{
+			extent->numClusters += 1;
+			fatData->discardClusters += 1;
+			return;
+		}
+	}
+
+	if (fatData->numDiscard >= FAT_DISCARD_EXTENTS)
+		discardFlush(fatData);
+
+	extent = &fatData->discard[fatData->numDiscard++];
+	extent->startCluster = cluster;
+	extent->numClusters = 1;
+	fatData->discardClusters += 1;
+}
+
+
 static int releaseClusterChain(fatInternalData *fatData,
 	unsigned startCluster)
 {
@@ -1143,6 +1260,9 @@ static int releaseClusterChain(fatInternalData *fatData,
 		// Adjust the free cluster count
 		fatData->freeClusters += 1;
 
+		// Discard it later
+		discardQueue(fatData, currentCluster);
+
 		// Any more to do?
 		if (nextCluster >= fatData->terminalClust)
 			break;
@@ -1150,6 +1270,12 @@ static int releaseClusterChain(fatInternalData *fatData,
 		currentCluster = nextCluster;
 	}
 
+	if ((fatData->discardClusters * fatData->bpb.sectsPerClust) >=
+		FAT_DISCARD_SECTORS)
+	{
+		discardFlush(fatData);
+	}
+
 	// Unlock the list and return success
 	kernelLockRelease(&fatData->freeBitmapLock);
 	return (status = 0);
@@ -4388,6 +4514,122 @@ out:
 }
 
 
+static int trim(kernelDisk *theDisk, progress *prog)
+{
+	// This function discards (trims) all of the free clusters in a FAT
+	// filesystem, so that a solid state disk knows it doesn't need to keep
+	// their contents.  The filesystem can be mounted or not.
+
+	int status = 0;
+	fatInternalData *fatData = NULL;
+	int mounted = 0;
+	unsigned cluster = 0;
+	unsigned numClusters = 0;
+	uquad_t discarded = 0;
+
+	// Check params
+	if (!theDisk)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (status = ERR_NULLPARAMETER);
+	}
+
+	mounted = theDisk->filesystem.mounted;
+
+	if (prog && (kernelLockGet(&prog->lock) >= 0))
+	{
+		strcpy((char *) prog->statusMessage, _("Reading filesystem info"));
+		kernelLockRelease(&prog->lock);
+	}
+
+	fatData = getFatData(theDisk);
+	if (!fatData)
+	{
+		status = ERR_BADDATA;
+		goto out;
+	}
+
+	if (!mounted)
+	{
+		// Build the free-cluster list, and wait for it to be finished
+		status = makeFreeBitmap(fatData);
+		if (status < 0)
+		{
+			kernelDebugError("Unable to create the free cluster bitmap");
+			goto out;
+		}
+
+		if (makeFatFreePid >= 0)
+			kernelMultitaskerBlock(makeFatFreePid);
+	}
+
+	status = kernelLockGet(&fatData->freeBitmapLock);
+	if (status < 0)
+		goto out;
+
+	// This takes care of any freed clusters that were waiting
+	fatData->numDiscard = 0;
+	fatData->discardClusters = 0;
+
+	// Make sure the FAT on the disk agrees with the free bitmap
+	status = kernelDiskSync((char *) theDisk->name);
+	if (status < 0)
+		goto unlock;
+
+	if (prog && (kernelLockGet(&prog->lock) >= 0))
+	{
+		prog->numTotal = fatData->dataClusters;
+		strcpy((char *) prog->statusMessage, _("Trimming free space"));
+		kernelLockRelease(&prog->lock);
+	}
+
+	// Go through in chunks, so that progress can be reported
+	for (cluster = 2; cluster < (fatData->dataClusters + 2);
+		cluster += numClusters)
+	{
+		numClusters = min(((fatData->dataClusters + 2) - cluster),
+			((fatData->dataClusters / 100) + 1));
+
+		status = discardFree(fatData, cluster, numClusters, &discarded);
+		if (status < 0)
+			goto unlock;
+
+		if (prog && (kernelLockGet(&prog->lock) >= 0))
+		{
+			prog->numFinished = ((cluster + numClusters) - 2);
+			prog->percentFinished = ((prog->numFinished * 100) /
+				prog->numTotal);
+			kernelLockRelease(&prog->lock);
+		}
+	}
+
+	if (prog && (kernelLockGet(&prog->lock) >= 0))
+	{
+		snprintf((char *) prog->statusMessage, PROGRESS_MAX_MESSAGELEN,
+			_("Trimmed %llu MB"), ((discarded * fatClusterBytes(fatData)) /
+				1048576));
+		kernelLockRelease(&prog->lock);
+	}
+
+	status = 0;
+
+unlock:
+	kernelLockRelease(&fatData->freeBitmapLock);
+
+out:
+	if (!mounted)
+		freeFatData(theDisk);
+
+	if (prog && (kernelLockGet(&prog->lock) >= 0))
+	{
+		prog->complete = 1;
+		kernelLockRelease(&prog->lock);
+	}
+
+	return (status);
+}
+
+
 static uquad_t getFreeBytes(kernelDisk *theDisk)
 {
 	// This function returns the amount of free disk space, in bytes
@@ -4899,6 +5141,13 @@ static int unmount(kernelDisk *theDisk)
 				return (status);
 			}
 		}
+
+		// Discard any freed clusters that are still waiting
+		if (kernelLockGet(&fatData->freeBitmapLock) >= 0)
+		{
+			discardFlush(fatData);
+			kernelLockRelease(&fatData->freeBitmapLock);
+		}
 	}
 
 	// Everything should be cozily tucked away now.  We can safely discard the
@@ -5462,6 +5711,7 @@ static kernelFilesystemDriver fsDriver = {
 	clobber,
 	NULL,		// driverCheck
 	defragment,
+	trim,
 	NULL,		// driverStat
 	getFreeBytes,
 	resizeConstraints,
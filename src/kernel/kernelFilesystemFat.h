@@ -28,6 +28,12 @@
 
 // Definitions
 
+// Freed clusters are discarded (trimmed) in batches: once there are this many
+// sectors' worth of them, once there are this many separate extents, or at
+// unmount time
+#define FAT_DISCARD_SECTORS		8192
+#define FAT_DISCARD_EXTENTS		32
+
 // Structures used internally by the filesystem driver to keep track of files
 // and directories
 
@@ -46,6 +52,12 @@ typedef volatile struct {
 
 } fatEntryData;
 
+typedef volatile struct {
+	unsigned startCluster;
+	unsigned numClusters;
+
+} fatExtent;
+
 // This structure will contain all of the internal global data for a particular
 // filesystem on a particular volume
 typedef volatile struct {
@@ -68,6 +80,13 @@ typedef volatile struct {
 	unsigned freeClusters;
 	spinLock freeBitmapLock;
 
+	// Freed clusters waiting to be discarded.  Protected by the free bitmap
+	// lock.
+	int canDiscard;
+	fatExtent discard[FAT_DISCARD_EXTENTS];
+	int numDiscard;
+	unsigned discardClusters;
+
 	// Miscellany
 	kernelDisk *disk;
 
@@ -653,6 +653,7 @@ static kernelFilesystemDriver fsDriver = {
 	NULL,	// driverClobber
 	NULL,	// driverCheck
 	NULL,	// driverDefragment
+	NULL,	// driverTrim
 	NULL,	// driverStat
 	NULL,	// getFreeBytes
 	NULL,	// driverResizeConstraints
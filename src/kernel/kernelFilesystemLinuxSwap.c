@@ -440,6 +440,7 @@ static kernelFilesystemDriver defaultLinuxSwapDriver = {
 	clobber,
 	NULL,	// driverCheck
 	NULL,	// driverDefragment
+	NULL,	// driverTrim
 	NULL,	// driverStat
 	NULL,	// getFreeBytes
 	resizeConstraints,
@@ -363,6 +363,7 @@ static kernelFilesystemDriver fsDriver = {
 	clobber,
 	NULL,	// driverCheck
 	NULL,	// driverDefragment
+	NULL,	// driverTrim
 	NULL,	// driverStat
 	NULL,	// driverResizeConstraints
 	NULL,	// driverResize
@@ -875,6 +875,7 @@ static kernelFilesystemDriver defaultUdfDriver = {
 	NULL,	// driverClobber
 	NULL,	// driverCheck
 	NULL,	// driverDefragment
+	NULL,	// driverTrim
 	NULL,	// driverStat
 	NULL,	// getFreeBytes
 	NULL,	// driverResizeConstraints
@@ -710,7 +710,7 @@ static void floppyInterrupt(void)
 
 	void *address = NULL;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 	kernelInterruptSetCurrent(INTERRUPT_NUM_FLOPPY);
 
 	// Check whether to do the "sense interrupt status" command
@@ -733,7 +733,7 @@ static void floppyInterrupt(void)
 
 	kernelPicEndOfInterrupt(INTERRUPT_NUM_FLOPPY);
 	kernelInterruptClearCurrent();
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
@@ -1070,7 +1070,8 @@ static kernelDiskOps floppyOps = {
 	driverMediaChanged,
 	driverReadSectors,
 	driverWriteSectors,
-	NULL	// driverFlush
+	NULL,	// driverFlush
+	NULL	// driverDiscardSectors
 };
 
 
@@ -63,6 +63,8 @@
 	(DISK(diskNum).featureFlags & ATA_FEATURE_MEDSTAT)
 #define DISKIS48(diskNum) \
 	(DISK(diskNum).featureFlags & ATA_FEATURE_48BIT)
+#define DISKISTRIM(diskNum) \
+	(DISK(diskNum).featureFlags & ATA_FEATURE_TRIM)
 #define BMPORT_CMD(ctrlNum, chanNum) \
 	(controllers[ctrlNum].busMasterIo + (chanNum * 8))
 #define BMPORT_STATUS(ctrlNum, chanNum) (BMPORT_CMD(ctrlNum, chanNum) + 2)
@@ -244,9 +246,11 @@ static void lbaSetup(int diskNum, uquad_t logicalSector, uquad_t numSectors)
 		cmd = ((logicalSector >> 24) & 0xFF);
 		processorOutPort8(DISK_CHAN(diskNum).ports.lbaLow, cmd);
 		// Bits 32-39 of the address
-		processorOutPort8(DISK_CHAN(diskNum).ports.lbaMid, 0);
+		cmd = ((logicalSector >> 32) & 0xFF);
+		processorOutPort8(DISK_CHAN(diskNum).ports.lbaMid, cmd);
 		// Bits 40-47 of the address
-		processorOutPort8(DISK_CHAN(diskNum).ports.lbaHigh, 0);
+		cmd = ((logicalSector >> 40) & 0xFF);
+		processorOutPort8(DISK_CHAN(diskNum).ports.lbaHigh, cmd);
 	}
 	else
 	{
@@ -873,89 +877,99 @@ static void dmaClearStatus(int diskNum)
 static int dmaSetup(int diskNum, void *address, unsigned bytes, int read,
 	unsigned *doneBytes)
 {
-	// Do DMA transfer setup
+	// Do DMA transfer setup.  The PRD table is built from the physical
+	// pages of the buffer, so it doesn't need to be physically contiguous.
+	// Returns the number of bytes the PRDs cover in doneBytes, which might be
+	// less than requested if we run out of PRDs.
 
 	int status = 0;
-	unsigned maxBytes = 0;
+	int processId = 0;
 	unsigned physicalAddress = 0;
 	unsigned doBytes = 0;
+	unsigned excess = 0;
 	int numPrds = 0;
 	idePrd *prds = NULL;
-	int count;
-
-	// How many bytes can we do per DMA operation?
-	maxBytes = min((DISK(diskNum).physical.multiSectors * 512), 0x10000);
-
-	// Get the buffer physical address
-	physicalAddress = kernelPageGetPhysical((((unsigned) address <
-		KERNEL_VIRTUAL_ADDRESS)? kernelCurrentProcess->processId :
-		KERNELPROCID), address);
-	if (!physicalAddress)
-	{
-		kernelError(kernel_error, "Couldn't get buffer physical address for "
-			"%p", address);
-		return (status = ERR_INVALID);
-	}
 
-	// Address must be dword-aligned
-	if (physicalAddress % 4)
-	{
-		kernelError(kernel_error, "Physical address 0x%08x of virtual "
-			"address %p not dword-aligned", physicalAddress, address);
-		return (status = ERR_ALIGN);
-	}
+	processId = (((unsigned) address < KERNEL_VIRTUAL_ADDRESS)?
+		kernelCurrentProcess->processId : KERNELPROCID);
 
 	kernelDebug(debug_io, "IDE disk %02x do DMA setup for %u bytes to "
-		"address 0x%08x", diskNum, bytes, physicalAddress);
+		"address %p", diskNum, bytes, address);
+
+	*doneBytes = 0;
 
 	// Set up all the PRDs
 	prds = DISK_CHAN(diskNum).prds.virtual;
 
-	for (count = 0; bytes > 0; count ++)
+	while (bytes > 0)
 	{
-		if (numPrds >= DISK_CHAN(diskNum).prdEntries)
+		// Get the physical address of this page of the buffer
+		physicalAddress = kernelPageGetPhysical(processId, address);
+		if (!physicalAddress)
 		{
-			// We've reached the limit of what we can do in one DMA setup
-			break;
+			kernelError(kernel_error, "Couldn't get buffer physical address "
+				"for %p", address);
+			return (status = ERR_INVALID);
 		}
 
-		doBytes = min(bytes, maxBytes);
-
-		// No individual transfer (as represented by 1 PRD) should cross a
-		// 64K boundary -- some DMA chips won't do that
-		if ((((unsigned) physicalAddress & 0xFFFF) + doBytes) > 0x10000)
+		// Address must be dword-aligned
+		if (physicalAddress % 4)
 		{
-			kernelDebug(debug_io, "IDE physical buffer crosses a 64K "
-				"boundary");
-			doBytes = (0x10000 - ((unsigned) physicalAddress & 0xFFFF));
+			kernelError(kernel_error, "Physical address 0x%08x of virtual "
+				"address %p not dword-aligned", physicalAddress, address);
+			return (status = ERR_ALIGN);
 		}
 
-		// If the number of bytes is exactly 64K, break it up into 2 transfers
-		// in case the controller gets confused by a count of zero
-		if (doBytes == 0x10000)
-			doBytes = 0x8000;
-
-		// Each byte count must be dword-multiple
-		if (doBytes % 4)
+		// Up to the end of the page
+		doBytes = min(bytes, (MEMORY_PAGE_SIZE - ((unsigned) address %
+			MEMORY_PAGE_SIZE)));
+
+		// If this page follows on physically from the last PRD, just extend
+		// it.  No individual transfer (as represented by 1 PRD) should cross
+		// a 64K boundary -- some DMA chips won't do that -- and we keep them
+		// below 64K in case the controller gets confused by a count of zero.
+		if (numPrds && ((prds[numPrds - 1].physicalAddress +
+			prds[numPrds - 1].count) == physicalAddress) &&
+			(physicalAddress & 0xFFFF) &&
+			((prds[numPrds - 1].count + doBytes) <= IDE_PRD_MAXBYTES))
 		{
-			kernelError(kernel_error, "Byte count not dword-multiple");
-			return (status = ERR_ALIGN);
+			prds[numPrds - 1].count += doBytes;
 		}
+		else
+		{
+			if (numPrds >= DISK_CHAN(diskNum).prdEntries)
+			{
+				// We've reached the limit of what we can do in one DMA setup
+				break;
+			}
 
-		// Set up the address and count in the channel's PRD
-		prds[count].physicalAddress = physicalAddress;
-		prds[count].count = doBytes;
-		prds[count].EOT = 0;
-
-		kernelDebug(debug_io, "IDE disk %02x set up PRD for address 0x%08x, "
-			"bytes %u", diskNum, prds[count].physicalAddress, doBytes);
+			// Set up the address and count in the channel's PRD
+			prds[numPrds].physicalAddress = physicalAddress;
+			prds[numPrds].count = doBytes;
+			prds[numPrds].EOT = 0;
+			numPrds += 1;
+		}
 
-		physicalAddress += doBytes;
+		address += doBytes;
 		bytes -= doBytes;
 		*doneBytes += doBytes;
-		numPrds += 1;
 	}
 
+	// If we ran out of PRDs, only cover whole sectors
+	excess = (*doneBytes % 512);
+	while (excess)
+	{
+		doBytes = min(excess, prds[numPrds - 1].count);
+		prds[numPrds - 1].count -= doBytes;
+		if (!prds[numPrds - 1].count)
+			numPrds -= 1;
+		excess -= doBytes;
+		*doneBytes -= doBytes;
+	}
+
+	kernelDebug(debug_io, "IDE disk %02x set up %d PRDs for %u bytes",
+		diskNum, numPrds, *doneBytes);
+
 	// Mark the last entry in the PRD table
 	prds[numPrds - 1].EOT = 0x8000;
 
@@ -1332,9 +1346,11 @@ static int readWriteDma(int diskNum, uquad_t logicalSector,
 {
 	int status = 0;
 	unsigned char command = 0;
+	unsigned maxSectors = 0;
 	unsigned sectorsPerCommand = 0;
 	unsigned dmaBytes = 0;
 	int dmaStatus = 0;
+	void *bounce = NULL;
 
 	// Figure out which command we're going to be sending to the controller
 	if (DISKIS48(diskNum))
@@ -1353,15 +1369,21 @@ static int readWriteDma(int diskNum, uquad_t logicalSector,
 	}
 
 	// Figure out the number of sectors per command
-	sectorsPerCommand = numSectors;
-	if (DISKIS48(diskNum))
-	{
-		if (sectorsPerCommand > 65536)
-			sectorsPerCommand = 65536;
-	}
-	else if (sectorsPerCommand > 256)
+	maxSectors = min(numSectors, (DISKIS48(diskNum)? 65536 : 256));
+
+	// The controller can only do DMA to and from dword-aligned memory.  If
+	// the buffer isn't, go through a bounce buffer instead.
+	if ((unsigned) buffer % 4)
 	{
-		sectorsPerCommand = 256;
+		maxSectors = min(maxSectors, IDE_BOUNCE_SECTORS);
+
+		kernelDebug(debug_io, "IDE buffer %p not dword-aligned, using "
+			"bounce buffer", buffer);
+
+		bounce = kernelMemoryGetSystem((maxSectors * 512),
+			"ide bounce buffer");
+		if (!bounce)
+			return (status = ERR_MEMORY);
 	}
 
 	// This outer loop is done once for each *command* we send.	Actual data
@@ -1371,14 +1393,17 @@ static int readWriteDma(int diskNum, uquad_t logicalSector,
 
 	while (numSectors > 0)
 	{
-		sectorsPerCommand = min(sectorsPerCommand, numSectors);
+		sectorsPerCommand = min(maxSectors, numSectors);
+
+		if (bounce && !read)
+			memcpy(bounce, buffer, (sectorsPerCommand * 512));
 
 		// Set up the DMA transfer
 		kernelDebug(debug_io, "IDE setting up DMA transfer");
-		status = dmaSetup(diskNum, buffer, (sectorsPerCommand * 512), read,
-			&dmaBytes);
+		status = dmaSetup(diskNum, (bounce? bounce : buffer),
+			(sectorsPerCommand * 512), read, &dmaBytes);
 		if (status < 0)
-			return (status);
+			break;
 
 		if (dmaBytes < (sectorsPerCommand * 512))
 		{
@@ -1395,7 +1420,7 @@ static int readWriteDma(int diskNum, uquad_t logicalSector,
 		if (status < 0)
 		{
 			kernelError(kernel_error, "%s", errorMessages[IDE_TIMEOUT]);
-			return (status);
+			break;
 		}
 
 		// We always use LBA.  Break up the sector count and LBA value and
@@ -1435,11 +1460,17 @@ static int readWriteDma(int diskNum, uquad_t logicalSector,
 			break;
 		}
 
+		if (bounce && read)
+			memcpy(buffer, bounce, (sectorsPerCommand * 512));
+
 		buffer += (sectorsPerCommand * 512);
 		numSectors -= sectorsPerCommand;
 		logicalSector += sectorsPerCommand;
 	}
 
+	if (bounce)
+		kernelMemoryReleaseSystem(bounce);
+
 	return (status);
 }
 
@@ -1796,7 +1827,7 @@ static void pciIdeInterrupt(void)
 	int serviced = 0;
 	int count1, count2;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 
 	// Which interrupt number is active?
 	interruptNum = kernelPicGetActive();
@@ -1865,7 +1896,7 @@ static void pciIdeInterrupt(void)
 	}
 
 out:
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
@@ -1881,7 +1912,7 @@ static void primaryIdeInterrupt(void)
 	int interruptNum = 0;
 	int count;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 
 	// Which interrupt number is active?
 	interruptNum = kernelPicGetActive();
@@ -1927,7 +1958,7 @@ static void primaryIdeInterrupt(void)
 
 out:
 	kernelInterruptClearCurrent();
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
@@ -1943,7 +1974,7 @@ static void secondaryIdeInterrupt(void)
 	int interruptNum = 0;
 	int count;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 
 	// Which interrupt number is active?
 	interruptNum = kernelPicGetActive();
@@ -1989,7 +2020,7 @@ static void secondaryIdeInterrupt(void)
 
 out:
 	kernelInterruptClearCurrent();
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
@@ -2417,6 +2448,111 @@ out:
 }
 
 
+static int driverDiscardSectors(int diskNum, uquad_t logicalSector,
+	uquad_t numSectors)
+{
+	// Tell a solid state disk that the contents of some sectors are no
+	// longer needed, using the TRIM function of DATA SET MANAGEMENT
+
+	int status = 0;
+	unsigned long long *ranges = NULL;
+	unsigned dmaBytes = 0;
+	int dmaStatus = 0;
+
+	kernelDebug(debug_io, "IDE disk %02x discard %llu at %llu", diskNum,
+		numSectors, logicalSector);
+
+	if (!DISK(diskNum).physical.name[0])
+	{
+		kernelError(kernel_error, "No such disk %02x", diskNum);
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	if (!DISKISTRIM(diskNum))
+		return (status = ERR_NOTIMPLEMENTED);
+
+	// The range list is transferred by DMA, so it needs to be physically
+	// contiguous
+	ranges = kernelMemoryGetSystem(512, "ide trim ranges");
+	if (!ranges)
+		return (status = ERR_MEMORY);
+
+	// Wait for a lock on the controller
+	status = kernelLockGet(&DISK_CHAN(diskNum).lock);
+	if (status < 0)
+		goto out;
+
+	// Select the disk
+	status = select(diskNum);
+	if (status < 0)
+		goto unlock;
+
+	while (numSectors > 0)
+	{
+		kernelAtaTrimRanges(ranges, &logicalSector, &numSectors);
+
+		// Set up the DMA transfer of the range list
+		status = dmaSetup(diskNum, ranges, 512, 0 /* write */, &dmaBytes);
+		if (status < 0)
+			break;
+
+		// Wait for the controller to be ready
+		status = pollStatus(diskNum, ATA_STAT_BSY, 0);
+		if (status < 0)
+		{
+			kernelError(kernel_error, "%s", errorMessages[IDE_TIMEOUT]);
+			break;
+		}
+
+		// One 512-byte block of ranges, and the TRIM function in the
+		// features register
+		lbaSetup(diskNum, 0, 1);
+		processorOutPort8(DISK_CHAN(diskNum).ports.featErr, ATA_DSM_TRIM);
+
+		expectInterrupt(diskNum);
+
+		// Issue the command
+		kernelDebug(debug_io, "IDE sending 'trim' command");
+		processorOutPort8(DISK_CHAN(diskNum).ports.comStat, ATA_DATASETMGMT);
+
+		// Start DMA
+		dmaStartStop(diskNum, 1);
+
+		// Wait for the controller to finish the operation
+		status = waitOperationComplete(diskNum, 1 /* yield */,
+			0 /* no data wait */, 0 /* no ack */,
+			(10 * MS_PER_SEC) /* timeout 10s */);
+
+		// Stop DMA
+		dmaStartStop(diskNum, 0);
+
+		if (status >= 0)
+			dmaStatus = dmaCheckStatus(diskNum);
+
+		ackInterrupt(diskNum);
+
+		if ((status < 0) || (dmaStatus < 0))
+		{
+			kernelError(kernel_error, "Disk %02x, trim failed: %s", diskNum,
+				((status < 0)? errorMessages[evaluateError(diskNum)] :
+					 "DMA error"));
+			if (status >= 0)
+				status = dmaStatus;
+			break;
+		}
+	}
+
+unlock:
+	// Unlock the controller
+	kernelLockRelease(&DISK_CHAN(diskNum).lock);
+
+out:
+	kernelMemoryReleaseSystem(ranges);
+
+	return (status);
+}
+
+
 static int detectPciControllers(kernelDevice *controllerDevices[],
 	kernelDriver *driver)
 {
@@ -2673,10 +2809,10 @@ static int detectPciControllers(kernelDevice *controllerDevices[],
 
 		for (count = 0; count < 2; count ++)
 		{
-			// 65K max per PRD, max 65K 512-byte sectors per command equals
-			// maximum 512 PRDs
+			// Enough PRDs for a maximum-sized (65536-sector) command in a
+			// physically contiguous buffer, or 8MB of scattered pages
 
-			CHANNEL(numControllers, count).prdEntries = 512;
+			CHANNEL(numControllers, count).prdEntries = IDE_PRD_ENTRIES;
 
 			prdMemorySize = (CHANNEL(numControllers, count).prdEntries *
 				sizeof(idePrd));
@@ -3360,6 +3496,17 @@ static int driverDetect(void *parent __attribute__((unused)),
 					}
 				}
 
+				// TRIM is a 48-bit DMA command, and only makes sense for
+				// (solid state) hard disks
+				if ((DISK(diskNum).physical.type & DISKTYPE_IDECDROM) ||
+					!DISKISDMA(diskNum) || !DISKIS48(diskNum))
+				{
+					DISK(diskNum).featureFlags &= ~ATA_FEATURE_TRIM;
+				}
+
+				if (DISKISTRIM(diskNum))
+					DISK(diskNum).physical.flags |= DISKFLAG_DISCARD;
+
 				devices[deviceCount].device.class =
 					kernelDeviceGetClass(DEVICECLASS_DISK);
 				devices[deviceCount].device.subClass =
@@ -3419,6 +3566,9 @@ static int driverDetect(void *parent __attribute__((unused)),
 					if (DISKIS48(diskNum))
 						strcat(value, ",48-bit");
 
+					if (DISKISTRIM(diskNum))
+						strcat(value, ",TRIM");
+
 					variableListSet(&devices[deviceCount].device.attrs,
 						"disk.features", value);
 				}
@@ -3447,7 +3597,8 @@ static kernelDiskOps ideOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	driverWriteSectors,
-	driverFlush
+	driverFlush,
+	driverDiscardSectors
 };
 
 
@@ -32,6 +32,13 @@
 #define IDE_MAX_DISKS			4
 #define IDE_MAX_CONTROLLERS		(DISK_MAXDEVICES / IDE_MAX_DISKS)
 
+// Bus master DMA.  Each PRD covers up to IDE_PRD_MAXBYTES of physically
+// contiguous memory.  Buffers that aren't dword-aligned go through a bounce
+// buffer of IDE_BOUNCE_SECTORS.
+#define IDE_PRD_ENTRIES			2048
+#define IDE_PRD_MAXBYTES		0x8000
+#define IDE_BOUNCE_SECTORS		128
+
 // Error codes
 #define IDE_ADDRESSMARK			0
 #define IDE_CYLINDER0			1
@@ -20,6 +20,7 @@
 //
 
 #include "kernelInitialize.h"
+#include "kernelApi.h"
 #include "kernelDebug.h"
 #include "kernelDescriptor.h"
 #include "kernelDisk.h"
@@ -42,6 +43,8 @@
 #include "kernelParameters.h"
 #include "kernelRamDiskDriver.h"
 #include "kernelRandom.h"
+#include "kernelSlab.h"
+#include "kernelSmp.h"
 #include "kernelText.h"
 #include "kernelTouch.h"
 #include "kernelUsbDriver.h"
@@ -299,6 +302,8 @@ int kernelInitialize(unsigned kernelMemory, void *kernelStack,
 	kernLibOps.memoryReleaseSystem = &kernelMemoryReleaseSystem;
 	kernLibOps.multitaskerGetCurrentProcessId =
 		&kernelMultitaskerGetCurrentProcessId;
+	kernLibOps.listItemGet = &kernelSlabListItemGet;
+	kernLibOps.listItemRelease = &kernelSlabListItemRelease;
 
 	// Initialize the page manager
 	status = kernelPageInitialize(kernelMemory);
@@ -310,6 +315,11 @@ int kernelInitialize(unsigned kernelMemory, void *kernelStack,
 	if (status < 0)
 		return (status);
 
+	// Initialize the kernel's object caches
+	status = kernelSlabInitialize();
+	if (status < 0)
+		return (status);
+
 #ifdef ARCH_X86
 	// Initialize the descriptor tables (GDT and IDT)
 	status = kernelDescriptorInitialize();
@@ -402,6 +412,19 @@ int kernelInitialize(unsigned kernelMemory, void *kernelStack,
 		return (status);
 	}
 
+	// Initialize the kernel API dispatch table
+	status = kernelApiInitialize();
+	if (status < 0)
+	{
+		kernelError(kernel_error, "API initialization failed");
+		return (status);
+	}
+
+	// Start any other processors.  We can carry on without them.
+	status = kernelSmpInitialize();
+	if (status < 0)
+		kernelError(kernel_warn, "Multiprocessor initialization failed");
+
 	// Initialize keyboard operations
 	status = kernelKeyboardInitialize();
 	if (status < 0)
@@ -531,6 +554,21 @@ int kernelInitialize(unsigned kernelMemory, void *kernelStack,
 		if (value)
 			kernelSetLocale(LC_ALL, value);
 
+		// Get the number of scheduler time slices per second
+		value = variableListGet(kernelVariables, KERNELVAR_SCHED_SLICES);
+		if (value)
+			kernelMultitaskerSetTimeSlices(atoi(value));
+
+		// Get the disk cache budget, as a percentage of free memory
+		value = variableListGet(kernelVariables, KERNELVAR_DISK_CACHE);
+		if (value)
+			kernelDiskSetCachePercent(atoi(value));
+
+		// Get how long dirty disk data can wait to be written, in seconds
+		value = variableListGet(kernelVariables, KERNELVAR_DISK_WRITEBACK);
+		if (value)
+			kernelDiskSetWritebackAge(atoi(value));
+
 		if (graphics)
 		{
 			// Get the default color values, if they're set in this file
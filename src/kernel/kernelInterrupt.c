@@ -38,14 +38,15 @@ typedef struct {
 } interruptHook;
 
 static linkedList hookList;
-static volatile int processingInterrupt = 0;
+// The interrupt being serviced by each CPU, if any
+static volatile int processingInterrupt[MAX_CPUS];
 static int initialized = 0;
 
 #define EXHANDLERX(exceptionNum) {	\
 	unsigned exAddress = 0;			\
 	int exInterrupts = 0;			\
 	processorExceptionEnter(exAddress, exInterrupts);	\
-	kernelException(exceptionNum, exAddress);	\
+	kernelException(exceptionNum, exAddress, 0);	\
 	processorExceptionExit(exInterrupts);	\
 }
 
@@ -64,7 +65,27 @@ static void exHandler10(void) EXHANDLERX(EXCEPTION_INVALIDTSS)
 static void exHandler11(void) EXHANDLERX(EXCEPTION_SEGNOTPRES)
 static void exHandler12(void) EXHANDLERX(EXCEPTION_STACK)
 static void exHandler13(void) EXHANDLERX(EXCEPTION_GENPROTECT)
-static void exHandler14(void) EXHANDLERX(EXCEPTION_PAGE)
+
+
+static void exHandler14(void)
+{
+	// Page faults can be handled and returned from (for example, when a page
+	// of a lazily-backed memory region is first touched), so we need to
+	// discard the error code that the processor pushed, and we pass along
+	// the faulting address, which must be read before anything else can
+	// change it.
+
+	unsigned exAddress = 0;
+	unsigned faultAddress = 0;
+	int exInterrupts = 0;
+
+	processorExceptionErrorEnter(exAddress, exInterrupts);
+	processorGetCR2(faultAddress);
+	kernelException(EXCEPTION_PAGE, exAddress, faultAddress);
+	processorExceptionErrorExit(exInterrupts);
+}
+
+
 static void exHandler15(void) EXHANDLERX(EXCEPTION_RESERVED)
 static void exHandler16(void) EXHANDLERX(EXCEPTION_FLOAT)
 static void exHandler17(void) EXHANDLERX(EXCEPTION_ALIGNCHECK)
@@ -78,7 +99,7 @@ static void intHandlerUnimp(void)
 	void *address = NULL;
 	int intNumber = 0;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 
 	kernelError(kernel_warn, "Unimplemented interrupt handler called");
 
@@ -94,7 +115,7 @@ static void intHandlerUnimp(void)
 		kernelInterruptClearCurrent();
 	}
 
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 #endif
@@ -263,24 +284,24 @@ void kernelInterruptNextHandler(int intNumber, void *currHandler)
 
 int kernelProcessingInterrupt(void)
 {
-	return (processingInterrupt & 1);
+	return (processingInterrupt[kernelSmpCpuNumber()] & 1);
 }
 
 
 int kernelInterruptGetCurrent(void)
 {
-	return (processingInterrupt >> 16);
+	return (processingInterrupt[kernelSmpCpuNumber()] >> 16);
 }
 
 
 void kernelInterruptSetCurrent(int intNumber)
 {
-	processingInterrupt = ((intNumber << 16) | 1);
+	processingInterrupt[kernelSmpCpuNumber()] = ((intNumber << 16) | 1);
 }
 
 
 void kernelInterruptClearCurrent(void)
 {
-	processingInterrupt = 0;
+	processingInterrupt[kernelSmpCpuNumber()] = 0;
 }
 
@@ -24,6 +24,9 @@
 #ifndef _KERNELINTERRUPT_H
 #define _KERNELINTERRUPT_H
 
+#include "kernelSmp.h"
+#include <sys/processor.h>
+
 #define INTERRUPT_VECTORSTART			0x20
 
 // ISA/PIC interrupt numbers
@@ -44,6 +47,18 @@
 #define INTERRUPT_NUM_PRIMARYIDE		14
 #define INTERRUPT_NUM_SECONDARYIDE		15
 
+// Interrupt service routines begin and end with these.  They save and
+// restore the registers, and hold the kernel lock while the handler runs.
+#define kernelInterruptEnter(address) do { \
+	processorIsrEnter(address); \
+	kernelSmpLock(); \
+} while (0)
+
+#define kernelInterruptExit(address) do { \
+	kernelSmpUnlock(); \
+	processorIsrExit(address); \
+} while (0)
+
 int kernelInterruptInitialize(void);
 int kernelInterruptHook(int, void *);
 void kernelInterruptNextHandler(int, void *);
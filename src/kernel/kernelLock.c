@@ -28,10 +28,108 @@
 #include "kernelInterrupt.h"
 #include "kernelMisc.h"
 #include "kernelMultitasker.h"
+#include "kernelParameters.h"
 #include "kernelShutdown.h"
 #include <string.h>
 #include <sys/processor.h>
 
+// The wait queue for a lock that has (or recently had) processes waiting
+// for it.  Locks in user space are only the same lock if they're in the same
+// address space.
+typedef volatile struct _lockWaiters {
+	spinLock *lock;
+	void *space;
+	kernelWaitQueue queue;
+	volatile struct _lockWaiters *next;
+
+} lockWaiters;
+
+static lockWaiters waitersPool[LOCK_MAX_CONTENDED];
+static lockWaiters *waitersBucket[LOCK_WAIT_BUCKETS];
+static lockWaiters *freeWaiters = NULL;
+static int waitersInitialized = 0;
+
+
+static inline unsigned hashLock(spinLock *lock)
+{
+	// Locks are usually embedded in structures, so ignore the low bits
+	return ((((unsigned) lock) >> 4) % LOCK_WAIT_BUCKETS);
+}
+
+
+static inline void *lockSpace(spinLock *lock)
+{
+	// Returns the address space that the lock lives in, or NULL for the
+	// kernel's
+	if (((unsigned) lock >= KERNEL_VIRTUAL_ADDRESS) || !kernelCurrentProcess)
+		return (NULL);
+	else
+		return ((void *) kernelCurrentProcess->pageDirectory);
+}
+
+
+static lockWaiters *getWaiters(spinLock *lock, int create)
+{
+	// Find the wait queue for a lock, or optionally create one.  Entries
+	// whose queues have emptied (which can happen any time a waiter changes
+	// state, for example if it's killed or its sleep times out) are
+	// recycled as we go.  Interrupts must be disabled.
+
+	lockWaiters **prev = NULL;
+	lockWaiters *waiters = NULL;
+	lockWaiters *found = NULL;
+	void *space = lockSpace(lock);
+	int count;
+
+	if (!waitersInitialized)
+	{
+		for (count = 0; count < LOCK_MAX_CONTENDED; count ++)
+		{
+			waitersPool[count].next = freeWaiters;
+			freeWaiters = &waitersPool[count];
+		}
+
+		waitersInitialized = 1;
+	}
+
+	prev = &waitersBucket[hashLock(lock)];
+
+	while ((waiters = *prev))
+	{
+		if ((waiters->lock == lock) && (waiters->space == space))
+		{
+			found = waiters;
+		}
+		else if (!waiters->queue.first)
+		{
+			// Recycle it
+			*prev = waiters->next;
+			waiters->next = freeWaiters;
+			freeWaiters = waiters;
+			continue;
+		}
+
+		prev = (lockWaiters **) &waiters->next;
+	}
+
+	if (found || !create || !freeWaiters)
+		return (found);
+
+	// Make a new one, at the head of the bucket
+	found = freeWaiters;
+	freeWaiters = found->next;
+
+	memset((void *) found, 0, sizeof(lockWaiters));
+	found->lock = lock;
+	found->space = space;
+
+	prev = &waitersBucket[hashLock(lock)];
+	found->next = *prev;
+	*prev = found;
+
+	return (found);
+}
+
 
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
@@ -52,19 +150,15 @@ int kernelLockGet(spinLock *lock)
 	// is filled and the lock is granted.
 
 	// If a lock is already held by another process at the time of the
-	// request, this function will add the requesting process' id to the list
-	// of 'waiters' in the lock structure, and go into a multitasker yield()
-	// loop until the lock can be obtained -- on a first come, first served
-	// basis for the time being.  Waiters wait in a queue.
-
-	// As a safeguard, this loop will make sure that the holding process is
-	// still viable (i.e. it still exists, and is not stopped or anything like
-	// that).
+	// request, the requesting process goes to sleep on the lock's wait queue
+	// until the holder releases it.  The lock is then handed directly to the
+	// process at the front of the queue, so waiters get it on a first come,
+	// first served basis, and they don't compete with the holder for
+	// processor time while they wait.
 
-	// This yielding loop serves the dual purpose of maintaining exclusivity
-	// and also allows the first process to terminate more quickly, since it
-	// will not be contending with other resource-bound processes for processor
-	// time.
+	// As a safeguard, waiters wake up every so often to make sure that the
+	// holding process is still viable (i.e. it still exists, and is not
+	// stopped or anything like that).
 
 	// The void* argument passed to the function must be a pointer to some
 	// identifiable part of the resource (shared by all requesting processes)
@@ -73,6 +167,7 @@ int kernelLockGet(spinLock *lock)
 	int status = 0;
 	int interrupts = 0;
 	int currentProcId = 0;
+	lockWaiters *waiters = NULL;
 
 	// Make sure the pointer we were given is not NULL
 	if (!lock)
@@ -127,9 +222,36 @@ int kernelLockGet(spinLock *lock)
 		// This process will now have to continue waiting until the lock has
 		// been released or becomes invalid
 
-		// Yield this time slice back to the scheduler while the process
-		// waits for the lock
-		kernelMultitaskerYield();
+		processorSuspendInts(interrupts);
+
+		// Try once more, now that interrupts are off.  After this, the
+		// holder can't release the lock until we're on the wait queue.
+		processorLock(lock->processId, currentProcId);
+
+		if (lock->processId != currentProcId)
+		{
+			waiters = getWaiters(lock, 1 /* create */);
+			if (waiters)
+			{
+				// Sleep until the lock is handed to us (or it's time to check
+				// on the holder again)
+				kernelMultitaskerWaitQueueSleep(&waiters->queue,
+					LOCK_VERIFY_MS);
+			}
+			else
+			{
+				// Too many contended locks.  Yield this time slice back to
+				// the scheduler while the process waits for the lock.
+				processorRestoreInts(interrupts);
+				kernelMultitaskerYield();
+				continue;
+			}
+		}
+
+		processorRestoreInts(interrupts);
+
+		if (lock->processId == currentProcId)
+			break;
 
 		// Loop again
 	}
@@ -138,13 +260,50 @@ int kernelLockGet(spinLock *lock)
 }
 
 
+int kernelLockTry(spinLock *lock)
+{
+	// Like kernelLockGet(), but never waits.  If some other process has the
+	// lock, returns ERR_BUSY.  This is for code that mustn't sleep, such as
+	// the idle threads.
+
+	int status = 0;
+	int interrupts = 0;
+	int currentProcId = 0;
+
+	// Make sure the pointer we were given is not NULL
+	if (!lock)
+		return (status = ERR_NULLPARAMETER);
+
+	// Get the process Id of the current process
+	currentProcId = kernelMultitaskerGetCurrentProcessId();
+	if (currentProcId < 0)
+		return (currentProcId);
+
+	if (lock->processId == currentProcId)
+		return (status = 0);
+
+	processorSuspendInts(interrupts);
+
+	processorLock(lock->processId, currentProcId);
+
+	processorRestoreInts(interrupts);
+
+	if (lock->processId != currentProcId)
+		return (status = ERR_BUSY);
+
+	return (status = 0);
+}
+
+
 int kernelLockRelease(spinLock *lock)
 {
 	// This function corresponds to the lock function.  It enables a process
 	// to release a resource that it had previously locked.
 
 	int status = 0;
+	int interrupts = 0;
 	int currentProcId = 0;
+	lockWaiters *waiters = NULL;
 
 	// Make sure the pointer we were given is not NULL
 	if (!lock)
@@ -158,17 +317,25 @@ int kernelLockRelease(spinLock *lock)
 		return (currentProcId);
 
 	// Make sure that the current lock, if any, really belongs to this process
-
-	if (lock->processId == currentProcId)
-	{
-		lock->processId = 0;
-		return (status = 0);
-	}
-	else
+	if (lock->processId != currentProcId)
 	{
 		// It is not locked by this process
 		return (status = ERR_NOLOCK);
 	}
+
+	processorSuspendInts(interrupts);
+
+	// If anyone is waiting for the lock, hand it straight to the first
+	// waiter.  Otherwise, it's free.
+	waiters = getWaiters(lock, 0 /* don't create */);
+	if (waiters && waiters->queue.first)
+		lock->processId = kernelMultitaskerWaitQueueWakeOne(&waiters->queue);
+	else
+		lock->processId = 0;
+
+	processorRestoreInts(interrupts);
+
+	return (status = 0);
 }
 
 
@@ -27,8 +27,16 @@
 
 #include <sys/lock.h>
 
+// Processes waiting for locks sleep on wait queues, which are found by
+// hashing the address of the lock
+#define LOCK_WAIT_BUCKETS		64
+#define LOCK_MAX_CONTENDED		256
+// How often sleeping waiters make sure the lock holder is still viable
+#define LOCK_VERIFY_MS			100
+
 // Functions exported by kernelLock.c
 int kernelLockGet(spinLock *);
+int kernelLockTry(spinLock *);
 int kernelLockRelease(spinLock *);
 int kernelLockVerify(spinLock *);
 
@@ -19,11 +19,21 @@
 //  kernelMemory.c
 //
 
-// These functions comprise Visopsys' memory management subsystem.  This
-// memory manager is implemented using a "first-fit" strategy because it's a
-// speedy algorithm, and because supposedly "best-fit" and "worst-fit" don't
-// really provide a significant memory utilization advantage but do imply
-// significant overhead.
+// These functions comprise Visopsys' memory management subsystem.  Physical
+// memory is allocated by a binary buddy allocator: free memory is kept in
+// naturally-aligned runs of (2^order) memory blocks, with one free list per
+// order, so that allocating and releasing take a number of steps that
+// depends only on the number of orders, and released memory is coalesced
+// with its free neighbours.  Each allocation is also recorded in the used
+// block list, with its owner and description.
+//
+// Memory can also be reserved in a process, as a lazily-backed region of
+// virtual address space.  Physical memory is only committed to each page of
+// such a region (by the page fault handler) the first time it's touched.
+//
+// When there's nothing else to do, the idle threads clear free memory ahead
+// of time, into a limited pool that allocations of cleared memory draw from
+// first.
 
 #include "kernelMemory.h"
 #include "kernelError.h"
@@ -34,19 +44,81 @@
 #include "kernelMultitasker.h"
 #include "kernelPage.h"
 #include "kernelParameters.h"
+#include "kernelSmp.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/processor.h>
 
 static volatile int initialized = 0;
 static spinLock memoryLock;
 static volatile unsigned totalMemory = 0;
 static memoryBlock * volatile usedBlockList[MAXMEMORYBLOCKS];
 static volatile int usedBlocks = 0;
-static unsigned char * volatile freeBlockBitmap = NULL;
 static volatile int totalBlocks = 0;
 static volatile unsigned totalFree = 0;
 static volatile unsigned totalUsed = 0;
 
+// The buddy allocator's data.  Every memory block has an entry in
+// frameOrder, which is the order of the free run that starts there, or else
+// FRAME_NOTFREE or FRAME_USED (the start of an allocated run), and in
+// frameLinks, which links the starts of free runs into their free lists, or
+// holds the used block list index of an allocated run.  Memory below 1MB
+// and above it are separate zones, so that low memory isn't handed out
+// while there's other memory available, and runs never straddle them.
+#define FRAME_NOTFREE		0xFF
+#define FRAME_USED			0xFE
+#define LOWMEM_FRAMES		((1024 * 1024) / MEMORY_BLOCK_SIZE)
+
+typedef struct {
+	int next;
+	int prev;
+
+} frameLink;
+
+static unsigned char * volatile frameOrder = NULL;
+static frameLink * volatile frameLinks = NULL;
+static volatile struct {
+	int start;
+	int end;
+	int freeList[MEMORY_MAX_ORDER + 1];
+	int freeCount[MEMORY_MAX_ORDER + 1];
+	unsigned freeBitmap;
+
+} zones[MEMORY_ZONES];
+
+// Lazily-backed memory regions.  The memory committed to them comes from the
+// buddy allocator a block at a time, and isn't in the used block list.
+typedef struct {
+	int processId;
+	kernelPageDirectory *directory;
+	void *virtual;
+	unsigned size;
+	unsigned committed;
+	char description[MEMORY_MAX_DESC_LENGTH + 1];
+
+} memoryRegion;
+
+static memoryRegion regionList[MAXMEMORYREGIONS];
+static volatile int numRegions = 0;
+
+// Runs of memory blocks that the idle threads have cleared, for each order.
+// They're taken out of the buddy allocator, but still count as free, and
+// they're given back if the buddy allocator runs out.
+static int zeroPool[ZEROPOOL_ORDERS][ZEROPOOL_RUNS];
+static volatile int zeroPoolRuns[ZEROPOOL_ORDERS];
+static int zeroPoolTarget[ZEROPOOL_ORDERS];
+static volatile unsigned zeroPoolBlocks = 0;
+static volatile unsigned zeroPoolHits = 0;
+static volatile unsigned zeroPoolMisses = 0;
+
+// The run that the idle threads are in the middle of clearing, and the
+// kernel pages they clear it through
+static volatile int zeroingFrame = -1;
+static volatile int zeroingOrder = 0;
+static volatile int zeroingDone = 0;
+static void *zeroWindow = NULL;
+
 // This structure can be used to "reserve" memory blocks so that they will be
 // marked as "used" by the memory manager and then left alone.  It should be
 // terminated with a NULL entry.  The addresses used here are defined in
@@ -72,24 +144,235 @@ static memoryBlock reservedBlocks[] =
 	// variable and dependent upon the previous two.
 	{ KERNELPROCID, MEMORYDESC_USEDBLOCKS, 0, 0 },
 
-	// The bitmap for free memory.  This one is also completely variable and
+	// The buddy allocator's data.  This one is also completely variable and
 	// dependent upon the previous three.
-	{ KERNELPROCID, MEMORYDESC_FREEBITMAP, 0, 0 },
+	{ KERNELPROCID, MEMORYDESC_BUDDYDATA, 0, 0 },
 
 	{ 0, "", 0, 0 }
 };
 
 
+static inline int frameZone(int frame)
+{
+	return ((frame < zones[1].start)? 0 : 1);
+}
+
+
+static void freeListAdd(int zone, int frame, int order)
+{
+	// Put a free run on the front of the free list for its order
+
+	frameOrder[frame] = order;
+	frameLinks[frame].prev = -1;
+	frameLinks[frame].next = zones[zone].freeList[order];
+
+	if (zones[zone].freeList[order] >= 0)
+		frameLinks[zones[zone].freeList[order]].prev = frame;
+
+	zones[zone].freeList[order] = frame;
+	zones[zone].freeCount[order] += 1;
+	zones[zone].freeBitmap |= (1 << order);
+}
+
+
+static void freeListRemove(int zone, int frame)
+{
+	// Take a free run off of its free list
+
+	int order = frameOrder[frame];
+
+	if (frameLinks[frame].prev >= 0)
+		frameLinks[frameLinks[frame].prev].next = frameLinks[frame].next;
+	else
+		zones[zone].freeList[order] = frameLinks[frame].next;
+
+	if (frameLinks[frame].next >= 0)
+		frameLinks[frameLinks[frame].next].prev = frameLinks[frame].prev;
+
+	zones[zone].freeCount[order] -= 1;
+	if (zones[zone].freeList[order] < 0)
+		zones[zone].freeBitmap &= ~(1 << order);
+
+	frameOrder[frame] = FRAME_NOTFREE;
+}
+
+
+static void freeFrames(int frame, int order)
+{
+	// Free a naturally-aligned run of (2^order) memory blocks, merging it
+	// with its buddy for as long as the buddy is also free
+
+	int zone = frameZone(frame);
+	int buddy = 0;
+	int merged = 0;
+
+	while (order < MEMORY_MAX_ORDER)
+	{
+		buddy = (frame ^ (1 << order));
+		merged = (frame & ~(1 << order));
+
+		if ((merged < zones[zone].start) ||
+			((merged + (2 << order)) > zones[zone].end) ||
+			(frameOrder[buddy] != order))
+		{
+			break;
+		}
+
+		freeListRemove(zone, buddy);
+		frame = merged;
+		order += 1;
+	}
+
+	freeListAdd(zone, frame, order);
+}
+
+
+static void freeFrameRange(int frame, int count)
+{
+	// Free any run of memory blocks, by breaking it up into the largest
+	// naturally-aligned pieces possible
+
+	int zoneEnd = 0;
+	int order = 0;
+
+	while (count > 0)
+	{
+		zoneEnd = zones[frameZone(frame)].end;
+
+		for (order = 0; ((order < MEMORY_MAX_ORDER) &&
+			!(frame & ((2 << order) - 1)) && ((2 << order) <= count) &&
+			((frame + (2 << order)) <= zoneEnd)); order ++);
+
+		freeFrames(frame, order);
+		frame += (1 << order);
+		count -= (1 << order);
+	}
+}
+
+
+static int allocFrames(int zone, int count, int alignment)
+{
+	// Take a run of memory blocks from a zone, starting at a multiple of
+	// the alignment (in blocks, if non-zero).  The smallest free run that's
+	// big enough is split, and the leftovers are freed again.  Returns the
+	// first block of the run, or negative if there isn't one.
+
+	int need = count;
+	int order = 0;
+	int fitOrder = 0;
+	int frame = 0;
+	int start = 0;
+	int powerOfTwo = (alignment && !(alignment & (alignment - 1)));
+
+	// Runs are naturally aligned, so a power-of-two alignment just means a
+	// big enough run.  Any other alignment needs room to be adjusted.
+	if (powerOfTwo && (need < alignment))
+		need = alignment;
+	else if (alignment > 1)
+		need += (alignment - 1);
+
+	while ((order <= MEMORY_MAX_ORDER) && ((1 << order) < need))
+		order += 1;
+
+	for (fitOrder = order; ((fitOrder <= MEMORY_MAX_ORDER) &&
+		!(zones[zone].freeBitmap & (1 << fitOrder))); fitOrder ++);
+
+	if (fitOrder > MEMORY_MAX_ORDER)
+		return (ERR_MEMORY);
+
+	frame = zones[zone].freeList[fitOrder];
+	freeListRemove(zone, frame);
+
+	// Split it, freeing the upper halves, until it's the size we want
+	while (fitOrder > order)
+	{
+		fitOrder -= 1;
+		freeListAdd(zone, (frame + (1 << fitOrder)), fitOrder);
+	}
+
+	start = frame;
+	if ((alignment > 1) && !powerOfTwo)
+		start = (((frame + (alignment - 1)) / alignment) * alignment);
+
+	// Give back what we don't need at either end
+	freeFrameRange(frame, (start - frame));
+	freeFrameRange((start + count), ((frame + (1 << order)) -
+		(start + count)));
+
+	frameOrder[start] = FRAME_USED;
+	return (start);
+}
+
+
+static int zeroPoolGet(int count, int alignment)
+{
+	// Take a cleared run from the pool, for an allocation of 'count' memory
+	// blocks (aligned to 'alignment' blocks, if non-zero), and give back
+	// whatever's past the end of the allocation.  Returns the first block of
+	// the run, or negative if there isn't a suitable one.
+
+	int order = 0;
+	int frame = 0;
+
+	while ((order < ZEROPOOL_ORDERS) && ((1 << order) < count))
+		order += 1;
+
+	// Runs are naturally aligned, so they only satisfy power-of-two
+	// alignments up to their size
+	if ((order >= ZEROPOOL_ORDERS) || ((alignment > 1) &&
+		((alignment & (alignment - 1)) || (alignment > (1 << order)))))
+	{
+		return (ERR_NOSUCHENTRY);
+	}
+
+	if (!zeroPoolRuns[order])
+	{
+		zeroPoolMisses += 1;
+		return (ERR_NOFREE);
+	}
+
+	zeroPoolRuns[order] -= 1;
+	frame = zeroPool[order][zeroPoolRuns[order]];
+	zeroPoolBlocks -= (1 << order);
+	zeroPoolHits += 1;
+
+	freeFrameRange((frame + count), ((1 << order) - count));
+
+	return (frame);
+}
+
+
+static void zeroPoolDrain(void)
+{
+	// Give all of the cleared runs back to the buddy allocator, because it's
+	// run out of memory
+
+	int frame = 0;
+	int order;
+
+	for (order = 0; order < ZEROPOOL_ORDERS; order ++)
+	{
+		while (zeroPoolRuns[order])
+		{
+			zeroPoolRuns[order] -= 1;
+			frame = zeroPool[order][zeroPoolRuns[order]];
+			frameOrder[frame] = FRAME_NOTFREE;
+			freeFrames(frame, order);
+		}
+	}
+
+	zeroPoolBlocks = 0;
+}
+
+
 static int allocateBlock(int processId, unsigned start, unsigned end,
 	const char *description)
 {
-	// This function will allocate a block in the used block list, mark the
-	// corresponding blocks as allocated in the free-block bitmap, and adjust
-	// the totalUsed and totalFree values accordingly
+	// This function will add a block to the used block list.  The caller
+	// takes care of the buddy allocator and the totalUsed and totalFree
+	// values.
 
 	int status = 0;
-	unsigned lastBit = 0;
-	unsigned count;
 
 	// The description pointer is allowed to be NULL
 
@@ -124,43 +407,32 @@ static int allocateBlock(int processId, unsigned start, unsigned end,
 		usedBlockList[usedBlocks]->description[0] = '\0';
 	}
 
+	// Remember where it is in the list, so we can find it again quickly
+	frameLinks[start / MEMORY_BLOCK_SIZE].next = usedBlocks;
+
 	// Increment the count of used memory blocks
 	usedBlocks += 1;
 
-	// Take the whole range of memory covered by this new block, and mark each
-	// of its physical memory blocks as "used" in the free-block bitmap,
-	// adjusting the totalUsed and totalFree values as we go
-	lastBit = ((end + (MEMORY_BLOCK_SIZE - 1)) / MEMORY_BLOCK_SIZE);
-	for (count = (start / MEMORY_BLOCK_SIZE); count <= lastBit; count ++)
-	{
-		if (!(freeBlockBitmap[count / 8] & (0x80 >> (count % 8))))
-		{
-			freeBlockBitmap[count / 8] |= (0x80 >> (count % 8));
-			totalUsed += MEMORY_BLOCK_SIZE;
-			totalFree -= MEMORY_BLOCK_SIZE;
-		}
-	}
-
 	// Return success
 	return (status = 0);
 }
 
 
 static int requestBlock(int processId, unsigned size, unsigned alignment,
-	int lowMem, const char *description, unsigned *memory)
+	int lowMem, const char *description, unsigned *memory, int *zeroed)
 {
 	// This function takes a size and some other parameters, and allocates a
 	// memory block.  The alignment parameter allows the caller to request the
 	// physical alignment of the block (but only on a MEMORY_BLOCK_SIZE
 	// boundary, otherwise an error will result).  If no particular alignment
 	// is needed, specifying this parameter as 0 will effectively nullify
-	// this.
+	// this.  If the caller is going to clear the memory, it can pass a
+	// 'zeroed' pointer, in which case the memory might come from the pool of
+	// cleared memory, and *zeroed is set if it did.
 
 	int status = 0;
-	int startBlock = 0;
-	unsigned blockPointer = 0;
-	unsigned consecutiveBlocks = 0;
-	int foundBlock = 0;
+	int zoneOrder[MEMORY_ZONES] = { 1, 0 };
+	int frame = ERR_MEMORY;
 	int count;
 
 	// If the requested block size is zero, forget it.  We can probably assume
@@ -206,85 +478,70 @@ static int requestBlock(int processId, unsigned size, unsigned alignment,
 		return (status = ERR_MEMORY);
 	}
 
-	// Adjust "alignment" so that it is expressed in blocks
-	alignment /= MEMORY_BLOCK_SIZE;
-
-	// If the caller didn't request low memory, we will start our search after
-	// 1MB
-	if (!lowMem)
-		startBlock = ((1024 * 1024) / MEMORY_BLOCK_SIZE);
-
-retry:
-	// Iterate through the free-block bitmap and find the first block large
-	// enough to fit the requested size, plus the alignment value, if
-	// applicable.
-	for (count = startBlock; count < totalBlocks; count ++)
+	// If the caller requested low memory, we try that zone first.
+	// Otherwise, we only use it when there's nothing else.
+	if (lowMem)
 	{
-		// Is the current block used or free?
-		if (freeBlockBitmap[count / 8] & (0x80 >> (count % 8)))
-		{
-			// This block is allocated.  We're not there yet.
-			consecutiveBlocks = 0;
-
-			// If alignment is desired, we need to advance "count" to the next
-			// multiple of the alignment size
-			if (alignment)
-			{
-				// Subract one from the expected number because count will get
-				// incremented by the loop
-				count += ((alignment - (count % alignment)) - 1);
-			}
-
-			continue;
-		}
+		zoneOrder[0] = 0;
+		zoneOrder[1] = 1;
+	}
 
-		// This block is free
-		consecutiveBlocks += 1;
+	if (zeroed)
+	{
+		*zeroed = 0;
 
-		// Do we have enough yet?
-		if ((consecutiveBlocks * MEMORY_BLOCK_SIZE) >= size)
+		// The pool only has memory above 1MB
+		if (!lowMem)
 		{
-			blockPointer = ((count - (consecutiveBlocks - 1)) *
-				MEMORY_BLOCK_SIZE);
-			foundBlock = 1;
-			break;
+			frame = zeroPoolGet((size / MEMORY_BLOCK_SIZE),
+				(alignment / MEMORY_BLOCK_SIZE));
+			if (frame >= 0)
+				*zeroed = 1;
 		}
 	}
 
-	// Did we find an appropriate block?
-	if (!foundBlock)
+	for (count = 0; ((frame < 0) && (count < MEMORY_ZONES)); count ++)
 	{
-		if (!lowMem)
+		frame = allocFrames(zoneOrder[count], (size / MEMORY_BLOCK_SIZE),
+			(alignment / MEMORY_BLOCK_SIZE));
+	}
+
+	// The memory we need might be in the pool of cleared memory
+	if ((frame < 0) && zeroPoolBlocks)
+	{
+		zeroPoolDrain();
+
+		for (count = 0; ((frame < 0) && (count < MEMORY_ZONES)); count ++)
 		{
-			// Retry, including low memory
-			lowMem = 1;
-			startBlock = 0;
-			goto retry;
+			frame = allocFrames(zoneOrder[count],
+				(size / MEMORY_BLOCK_SIZE), (alignment / MEMORY_BLOCK_SIZE));
 		}
-
-		return (status = ERR_MEMORY);
 	}
 
-	// It looks like we will be able to satisfy this request.  We found a
-	// block in the loop above.  We now have to allocate the new "used" block.
-
-	// blockPointer should point to the start of the memory area
-	status = allocateBlock(processId, blockPointer, (blockPointer + size - 1),
-		description);
+	if (frame < 0)
+		return (status = ERR_MEMORY);
 
-	// Make sure we were successful with the allocation, above
+	// We now have to allocate the new "used" block
+	status = allocateBlock(processId, (frame * MEMORY_BLOCK_SIZE),
+		((frame * MEMORY_BLOCK_SIZE) + size - 1), description);
 	if (status < 0)
+	{
+		frameOrder[frame] = FRAME_NOTFREE;
+		freeFrameRange(frame, (size / MEMORY_BLOCK_SIZE));
 		return (status);
+	}
+
+	totalUsed += size;
+	totalFree -= size;
 
 	// Assign the start location of the new memory
-	*memory = blockPointer;
+	*memory = (frame * MEMORY_BLOCK_SIZE);
 
 	// Success
 	return (status = 0);
 }
 
 
-
 static int findBlock(unsigned memory)
 {
 	// Search the used block list for one with the supplied physical starting
@@ -293,8 +550,22 @@ static int findBlock(unsigned memory)
 
 	int index = 0;
 
-	// Now we can go through the "used" block list watching for a start value
-	// that matches this pointer
+	if ((memory % MEMORY_BLOCK_SIZE) || (memory >= totalMemory))
+		return (ERR_NOSUCHENTRY);
+
+	// The first memory block of a used block normally knows its index
+	if (frameOrder[memory / MEMORY_BLOCK_SIZE] > MEMORY_MAX_ORDER)
+	{
+		index = frameLinks[memory / MEMORY_BLOCK_SIZE].next;
+		if ((index >= 0) && (index < usedBlocks) &&
+			(usedBlockList[index]->startLocation == memory))
+		{
+			return (index);
+		}
+	}
+
+	// Reserved blocks can overlap, so they might not.  Go through the "used"
+	// block list watching for a start value that matches this pointer.
 	for (index = 0; ((index < usedBlocks) && (index < MAXMEMORYBLOCKS));
 		index ++)
 	{
@@ -312,53 +583,367 @@ static int findBlock(unsigned memory)
 
 static int releaseBlock(int index)
 {
-	// This function will remove a block from the used block list, mark the
-	// corresponding blocks as free in the free-block bitmap, and adjust the
-	// totalUsed and totalFree values accordingly.  Returns 0 on success,
-	// negative otherwise.
+	// This function will remove a block from the used block list, give its
+	// memory back to the buddy allocator, and adjust the totalUsed and
+	// totalFree values accordingly.  Returns 0 on success, negative
+	// otherwise.
 
 	int status = 0;
 	memoryBlock *unused;
-	unsigned temp = 0;
-	unsigned lastBit = 0;
+	int frame = 0;
+	unsigned size = 0;
 
 	// Make sure the block location is reasonable
 	if (index > (usedBlocks - 1))
 		return (status = ERR_NOSUCHENTRY);
 
-	// Mark all of the applicable blocks in the free block bitmap as unused
-	lastBit = (usedBlockList[index]->endLocation / MEMORY_BLOCK_SIZE);
-	for (temp = (usedBlockList[index]->startLocation /
-		MEMORY_BLOCK_SIZE); temp <= lastBit; temp ++)
+	frame = (usedBlockList[index]->startLocation / MEMORY_BLOCK_SIZE);
+	size = ((usedBlockList[index]->endLocation -
+		usedBlockList[index]->startLocation) + 1);
+
+	// Reserved memory ranges can overlap one another, and never belonged to
+	// the allocator, so they can't be given to it
+	if (frameOrder[frame] != FRAME_USED)
+	{
+		kernelError(kernel_error, "Memory block %s at %08x is reserved",
+			usedBlockList[index]->description,
+			usedBlockList[index]->startLocation);
+		return (status = ERR_PERMISSION);
+	}
+
+	frameOrder[frame] = FRAME_NOTFREE;
+	freeFrameRange(frame, (size / MEMORY_BLOCK_SIZE));
+
+	// Adjust the total used and free memory quantities
+	totalUsed -= size;
+	totalFree += size;
+
+	// Remove this element from the "used" part of the list.  What we have to
+	// do is this: Since this is an unordered list, the way we accomplish this
+	// is by copying the last entry into the place of the current entry and
+	// reducing the total block count, unless the entry we're removing happens
+	// to be the only item, or the last item in the list.  In those cases we
+	// simply reduce the total number
+
+	if ((usedBlocks > 1) && (index < (usedBlocks - 1)))
+	{
+		unused = usedBlockList[index];
+		usedBlockList[index] = usedBlockList[usedBlocks - 1];
+		usedBlockList[usedBlocks - 1] = unused;
+
+		frameLinks[usedBlockList[index]->startLocation /
+			MEMORY_BLOCK_SIZE].next = index;
+	}
+
+	// Now reduce the total count
+	usedBlocks -= 1;
+
+	// Return success
+	return (status = 0);
+}
+
+
+static void sortBlocks(void)
+{
+	// Sort the used block list by start address, and update the indexes
+	// that the first memory block of each one remembers.  Just a bubble sort.
+
+	memoryBlock *temp = NULL;
+	int count1, count2;
+
+	for (count1 = 0; count1 < usedBlocks; count1 ++)
+	{
+		for (count2 = 0;  count2 < (usedBlocks - 1); count2 ++)
+		{
+			if (usedBlockList[count2]->startLocation >
+				usedBlockList[count2 + 1]->startLocation)
+			{
+				temp = usedBlockList[count2 + 1];
+				usedBlockList[count2 + 1] = usedBlockList[count2];
+				usedBlockList[count2] = temp;
+			}
+		}
+	}
+
+	for (count1 = 0; count1 < usedBlocks; count1 ++)
+	{
+		frameLinks[usedBlockList[count1]->startLocation /
+			MEMORY_BLOCK_SIZE].next = count1;
+	}
+}
+
+
+static int findRegion(kernelPageDirectory *directory, void *virtual,
+	int start)
+{
+	// Find the lazily-backed region in the page directory that contains the
+	// virtual address (or that starts at it, if 'start' is set).  Returns
+	// its index, or negative if there isn't one.
+
+	int count;
+
+	for (count = 0; count < numRegions; count ++)
+	{
+		if (regionList[count].directory != directory)
+			continue;
+
+		if (start)
+		{
+			if (regionList[count].virtual == virtual)
+				return (count);
+		}
+		else if ((virtual >= regionList[count].virtual) &&
+			(virtual < (regionList[count].virtual + regionList[count].size)))
+		{
+			return (count);
+		}
+	}
+
+	// Not found
+	return (ERR_NOSUCHENTRY);
+}
+
+
+static void removeRegion(int index)
+{
+	// Remove a region from the list.  It's an unordered list, so the last
+	// entry is copied into its place.
+
+	if (index < (numRegions - 1))
+	{
+		memcpy(&regionList[index], &regionList[numRegions - 1],
+			sizeof(memoryRegion));
+	}
+
+	numRegions -= 1;
+}
+
+
+static unsigned commitBlock(int *zeroed)
+{
+	// Take a single memory block for a page of a lazily-backed region,
+	// preferably one that's already been cleared, in which case *zeroed is
+	// set.  Returns its physical address, or 0 if there isn't any free
+	// memory.
+
+	int zone = 0;
+	int frame = ERR_MEMORY;
+
+	*zeroed = 0;
+
+	if (totalFree < MEMORY_BLOCK_SIZE)
+		return (0);
+
+	frame = zeroPoolGet(1, 0 /* no alignment */);
+	if (frame >= 0)
+		*zeroed = 1;
+
+	// Prefer memory above 1MB, as requestBlock() does
+	for (zone = (MEMORY_ZONES - 1); ((frame < 0) && (zone >= 0)); zone --)
+		frame = allocFrames(zone, 1, 0 /* no alignment */);
+
+	if ((frame < 0) && zeroPoolBlocks)
+	{
+		zeroPoolDrain();
+
+		for (zone = (MEMORY_ZONES - 1); ((frame < 0) && (zone >= 0));
+			zone --)
+		{
+			frame = allocFrames(zone, 1, 0 /* no alignment */);
+		}
+	}
+
+	if (frame < 0)
+		return (0);
+
+	// It doesn't have a used block list index
+	frameLinks[frame].next = -1;
+
+	totalUsed += MEMORY_BLOCK_SIZE;
+	totalFree -= MEMORY_BLOCK_SIZE;
+
+	return (frame * MEMORY_BLOCK_SIZE);
+}
+
+
+static void decommitBlock(unsigned physical)
+{
+	// Give back a memory block that was committed to a lazily-backed region
+
+	int frame = (physical / MEMORY_BLOCK_SIZE);
+
+	if ((physical >= totalMemory) || (frameOrder[frame] != FRAME_USED))
+	{
+		kernelError(kernel_error, "Memory block %08x was not committed",
+			physical);
+		return;
+	}
+
+	frameOrder[frame] = FRAME_NOTFREE;
+	freeFrames(frame, 0);
+
+	totalUsed -= MEMORY_BLOCK_SIZE;
+	totalFree += MEMORY_BLOCK_SIZE;
+}
+
+
+static int releaseRegion(memoryRegion *region)
+{
+	// Unmap a lazily-backed region that has already been removed from the
+	// list, and give back the memory that was committed to it.  This is done
+	// a piece at a time, since the memory can't be freed until it's
+	// unmapped, and we don't hold the memory lock while unmapping (which can
+	// release page tables).
+
+	int status = 0;
+	unsigned physical[REGION_RELEASE_PAGES];
+	void *virtual = NULL;
+	unsigned pages = 0;
+	unsigned count;
+
+	for (virtual = region->virtual; virtual < (region->virtual +
+		region->size); virtual += (pages * MEMORY_PAGE_SIZE))
+	{
+		pages = min(REGION_RELEASE_PAGES, (unsigned)((region->virtual +
+			region->size - virtual) / MEMORY_PAGE_SIZE));
+
+		for (count = 0; count < pages; count ++)
+		{
+			physical[count] = kernelPageGetPhysical(region->processId,
+				(virtual + (count * MEMORY_PAGE_SIZE)));
+		}
+
+		status = kernelPageUnmap(region->processId, virtual,
+			(pages * MEMORY_PAGE_SIZE));
+		if (status < 0)
+		{
+			kernelError(kernel_error, "Unable to unmap memory from the "
+				"virtual address space");
+			return (status);
+		}
+
+		status = kernelLockGet(&memoryLock);
+		if (status < 0)
+			return (status);
+
+		for (count = 0; count < pages; count ++)
+		{
+			if (physical[count])
+			{
+				decommitBlock(physical[count]);
+				region->committed -= MEMORY_BLOCK_SIZE;
+			}
+		}
+
+		kernelLockRelease(&memoryLock);
+	}
+
+	return (status = 0);
+}
+
+
+static int releaseRegionAt(int processId, void *virtual)
+{
+	// If a lazily-backed region starts at the virtual address, in the
+	// address space of the process, remove it from the list and release it.
+	// Returns ERR_NOSUCHENTRY if there isn't one.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	memoryRegion region;
+	int index = 0;
+
+	directory = kernelMultitaskerGetPageDir(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&memoryLock);
+	if (status < 0)
+		return (status);
+
+	index = findRegion(directory, virtual, 1 /* start */);
+	if (index >= 0)
+	{
+		memcpy(&region, &regionList[index], sizeof(memoryRegion));
+		removeRegion(index);
+	}
+
+	kernelLockRelease(&memoryLock);
+
+	if (index < 0)
+		return (status = index);
+
+	status = releaseRegion(&region);
+
+	return (status);
+}
+
+
+static void *reserveRegion(int processId, unsigned size,
+	const char *description)
+{
+	// Reserve virtual address space for a lazily-backed region in the
+	// address space of the process, and record it
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	void *virtual = NULL;
+
+	if (!initialized)
+		return (virtual = NULL);
+
+	if (kernelProcessingInterrupt())
+		return (virtual = NULL);
+
+	if (!size)
+	{
+		kernelError(kernel_error, "Can't reserve 0 bytes");
+		return (virtual = NULL);
+	}
+
+	directory = kernelMultitaskerGetPageDir(processId);
+	if (!directory)
+		return (virtual = NULL);
+
+	size = (((size + (MEMORY_PAGE_SIZE - 1)) / MEMORY_PAGE_SIZE) *
+		MEMORY_PAGE_SIZE);
+
+	status = kernelPageReserve(processId, &virtual, size);
+	if (status < 0)
+		return (virtual = NULL);
+
+	status = kernelLockGet(&memoryLock);
+	if (status < 0)
+	{
+		kernelPageUnmap(processId, virtual, size);
+		return (virtual = NULL);
+	}
+
+	if (numRegions >= MAXMEMORYREGIONS)
 	{
-		freeBlockBitmap[temp / 8] &= (0xFF7F >> (temp % 8));
+		kernelLockRelease(&memoryLock);
+		kernelError(kernel_error, "The number of memory regions has been "
+			"exhausted");
+		kernelPageUnmap(processId, virtual, size);
+		return (virtual = NULL);
 	}
 
-	// Adjust the total used and free memory quantities
-	temp = ((usedBlockList[index]->endLocation -
-		usedBlockList[index]->startLocation) + 1);
-	totalUsed -= temp;
-	totalFree += temp;
-
-	// Remove this element from the "used" part of the list.  What we have to
-	// do is this: Since this is an unordered list, the way we accomplish this
-	// is by copying the last entry into the place of the current entry and
-	// reducing the total block count, unless the entry we're removing happens
-	// to be the only item, or the last item in the list.  In those cases we
-	// simply reduce the total number
-
-	if ((usedBlocks > 1) && (index < (usedBlocks - 1)))
+	memset(&regionList[numRegions], 0, sizeof(memoryRegion));
+	regionList[numRegions].processId = processId;
+	regionList[numRegions].directory = directory;
+	regionList[numRegions].virtual = virtual;
+	regionList[numRegions].size = size;
+	if (description)
 	{
-		unused = usedBlockList[index];
-		usedBlockList[index] = usedBlockList[usedBlocks - 1];
-		usedBlockList[usedBlocks - 1] = unused;
+		strncpy(regionList[numRegions].description, description,
+			MEMORY_MAX_DESC_LENGTH);
 	}
 
-	// Now reduce the total count
-	usedBlocks -= 1;
+	numRegions += 1;
 
-	// Return success
-	return (status = 0);
+	kernelLockRelease(&memoryLock);
+
+	return (virtual);
 }
 
 
@@ -381,11 +966,14 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 	unsigned blockListPhysical = 0;
 	unsigned blockListSize = 0;
 	void *blockListVirtual = NULL;
-	unsigned bitmapPhysical = 0;
-	unsigned bitmapSize = 0;
+	unsigned buddyPhysical = 0;
+	unsigned buddySize = 0;
+	void *buddyVirtual = NULL;
 	const char *desc = NULL;
 	unsigned start = 0, end = 0;
-	int count;
+	unsigned freeStart = 0;
+	unsigned blocks = 0;
+	int count, order;
 
 	// Make sure that this initialization function only gets called once
 	if (initialized)
@@ -393,6 +981,7 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 
 	// Clear the static memory manager lock
 	memset((void *) &memoryLock, 0, sizeof(spinLock));
+	numRegions = 0;
 
 	// Calculate the amount of total memory we're managing.  First, count 1024
 	// kilobytes for standard and high memory (first "megabyte")
@@ -407,7 +996,7 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 		totalMemory = ((totalMemory / MEMORY_BLOCK_SIZE) * MEMORY_BLOCK_SIZE);
 
 	totalUsed = 0;
-	totalFree = totalMemory;
+	totalFree = 0;
 
 	// Define memory for the used memory block list.  However, we will have to
 	// do it manually since we can't do a "normal" block allocation.  We don't
@@ -439,29 +1028,42 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 	totalBlocks = (totalMemory / MEMORY_BLOCK_SIZE);
 	usedBlocks = 0;
 
-	// Like the used memory block list, we need to define memory for the free-
-	// block bitmap.  This is a physical address.
-	bitmapPhysical = (KERNEL_LOAD_ADDRESS + kernelMemory +
+	// Like the used memory block list, we need to define memory for the
+	// buddy allocator's data.  This is a physical address.
+	buddyPhysical = (KERNEL_LOAD_ADDRESS + kernelMemory +
 		KERNEL_PAGING_DATA_SIZE + blockListSize);
 
-	// Calculate the size of the free-block bitmap, based on the total number
-	// of memory blocks we'll be managing
-	bitmapSize = ((totalBlocks + 7) / 8);
+	// Calculate the size of the buddy allocator's data, based on the total
+	// number of memory blocks we'll be managing
+	buddySize = (totalBlocks * (sizeof(frameLink) + 1));
 
-	// Make sure the bitmap is allocated to block boundaries
-	bitmapSize += (MEMORY_BLOCK_SIZE - (bitmapSize % MEMORY_BLOCK_SIZE));
+	// Make sure it's allocated to block boundaries
+	buddySize += (MEMORY_BLOCK_SIZE - (buddySize % MEMORY_BLOCK_SIZE));
 
 	// Map it into the kernel's address space
-	status = kernelPageMapToFree(KERNELPROCID, bitmapPhysical,
-		(void **) &freeBlockBitmap, bitmapSize);
+	status = kernelPageMapToFree(KERNELPROCID, buddyPhysical,
+		&buddyVirtual, buddySize);
 	if (status < 0)
 		return (status);
 
-	// Clear the memory we use for the bitmap
-	memset((void *) freeBlockBitmap, 0, bitmapSize);
+	frameLinks = buddyVirtual;
+	frameOrder = (buddyVirtual + (totalBlocks * sizeof(frameLink)));
+
+	// To start with, nothing is free
+	memset((void *) frameOrder, FRAME_NOTFREE, totalBlocks);
+
+	for (count = 0; count < MEMORY_ZONES; count ++)
+	{
+		memset((void *) &zones[count], 0, sizeof(zones[count]));
+		for (order = 0; order <= MEMORY_MAX_ORDER; order ++)
+			zones[count].freeList[order] = -1;
+	}
+
+	zones[0].end = zones[1].start = min(LOWMEM_FRAMES, totalBlocks);
+	zones[1].end = totalBlocks;
 
 	// The list of reserved memory blocks needs to be completed here, before
-	// we attempt to use it to calculate the location of the free-block bitmap
+	// we attempt to use it to record the reserved memory
 	for (count = 0; reservedBlocks[count].processId; count ++)
 	{
 		// Set the end value for the kernel memory reserved block
@@ -493,14 +1095,14 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 				(reservedBlocks[count].startLocation + blockListSize - 1);
 		}
 
-		// Set the start and end values for the "free memory bitmap" reserved
-		// block
+		// Set the start and end values for the buddy allocator's data
+		// reserved block
 		if (!strcmp((char *) reservedBlocks[count].description,
-			MEMORYDESC_FREEBITMAP))
+			MEMORYDESC_BUDDYDATA))
 		{
-			reservedBlocks[count].startLocation = bitmapPhysical;
+			reservedBlocks[count].startLocation = buddyPhysical;
 			reservedBlocks[count].endLocation =
-				(reservedBlocks[count].startLocation + bitmapSize - 1);
+				(reservedBlocks[count].startLocation + buddySize - 1);
 		}
 	}
 
@@ -554,6 +1156,50 @@ int kernelMemoryInitialize(unsigned kernelMemory)
 				(end % MEMORY_BLOCK_SIZE)) - 1)), desc);
 	}
 
+	// Everything in between the reserved blocks is free memory.  Reserved
+	// blocks can overlap, so keep track of the furthest one reaches.
+	sortBlocks();
+	for (count = 0; count <= usedBlocks; count ++)
+	{
+		end = totalMemory;
+		if (count < usedBlocks)
+			end = usedBlockList[count]->startLocation;
+
+		if (end > freeStart)
+		{
+			freeFrameRange((freeStart / MEMORY_BLOCK_SIZE),
+				((end - freeStart) / MEMORY_BLOCK_SIZE));
+			totalFree += (end - freeStart);
+		}
+
+		if ((count < usedBlocks) &&
+			((usedBlockList[count]->endLocation + 1) > freeStart))
+		{
+			freeStart = (usedBlockList[count]->endLocation + 1);
+		}
+	}
+
+	totalUsed = (totalMemory - totalFree);
+
+	// Decide how much cleared memory the idle threads should keep for each
+	// order of run, and get the kernel pages they clear it through
+	blocks = min(ZEROPOOL_MAX_BLOCKS, (totalBlocks / ZEROPOOL_FRACTION));
+	for (order = 0; order < ZEROPOOL_ORDERS; order ++)
+	{
+		zeroPoolRuns[order] = 0;
+		zeroPoolTarget[order] = ((blocks / ZEROPOOL_ORDERS) >> order);
+	}
+
+	zeroPoolBlocks = zeroPoolHits = zeroPoolMisses = 0;
+	zeroingFrame = -1;
+
+	if (kernelPageReserve(KERNELPROCID, &zeroWindow,
+		(ZEROPOOL_WINDOW_BLOCKS * MEMORY_BLOCK_SIZE)) < 0)
+	{
+		// No pool, then
+		zeroWindow = NULL;
+	}
+
 	// Make note of the fact that we've now been initialized
 	initialized = 1;
 
@@ -585,7 +1231,7 @@ unsigned kernelMemoryGetPhysical(unsigned size, unsigned alignment,
 
 	// Call requestBlock to find a free memory region
 	status = requestBlock(KERNELPROCID, size, alignment, lowMem, description,
-		&physical);
+		&physical, NULL /* not cleared */);
 
 	// Release the lock on the memory data
 	kernelLockRelease(&memoryLock);
@@ -651,11 +1297,28 @@ void *kernelMemoryGetSystem(unsigned size, const char *description)
 	int status = 0;
 	unsigned physical = 0;
 	void *virtual = NULL;
+	int zeroed = 0;
 
-	// This function will check initialization, etc
-	physical = kernelMemoryGetPhysical(size, 0 /* no alignment */,
-		0 /* not low memory */, description);
-	if (!physical)
+	// Make sure the memory manager has been initialized
+	if (!initialized)
+		return (virtual = NULL);
+
+	if (kernelProcessingInterrupt())
+		return (virtual = NULL);
+
+	// Obtain a lock on the memory data
+	status = kernelLockGet(&memoryLock);
+	if (status < 0)
+		return (virtual = NULL);
+
+	// Call requestBlock to find a free memory region
+	status = requestBlock(KERNELPROCID, size, 0 /* no alignment */,
+		0 /* not low memory */, description, &physical, &zeroed);
+
+	// Release the lock on the memory data
+	kernelLockRelease(&memoryLock);
+
+	if (status < 0)
 		return (virtual = NULL);
 
 	// Now we will ask the page manager to map this physical memory to virtual
@@ -669,8 +1332,9 @@ void *kernelMemoryGetSystem(unsigned size, const char *description)
 		return (virtual = NULL);
 	}
 
-	// Clear the memory area we allocated
-	memset(virtual, 0, size);
+	// Clear the memory area we allocated, unless it already is
+	if (!zeroed)
+		memset(virtual, 0, size);
 
 	return (virtual);
 }
@@ -848,6 +1512,7 @@ void *kernelMemoryGet(unsigned size, const char *description)
 	int processId = 0;
 	unsigned physical = 0;
 	void *virtual = NULL;
+	int zeroed = 0;
 
 	// Make sure the memory manager has been initialized
 	if (!initialized)
@@ -871,7 +1536,7 @@ void *kernelMemoryGet(unsigned size, const char *description)
 
 	// Call requestBlock to find a free memory region
 	status = requestBlock(processId, size, 0 /* no alignment */,
-		0 /* not low memory */, description, &physical);
+		0 /* not low memory */, description, &physical, &zeroed);
 
 	// Release the lock on the memory data
 	kernelLockRelease(&memoryLock);
@@ -889,13 +1554,44 @@ void *kernelMemoryGet(unsigned size, const char *description)
 		return (virtual = NULL);
 	}
 
-	// Clear the memory area we allocated
-	memset(virtual, 0, size);
+	// Clear the memory area we allocated, unless it already is
+	if (!zeroed)
+		memset(virtual, 0, size);
 
 	return (virtual);
 }
 
 
+void *kernelMemoryReserve(unsigned size, const char *description)
+{
+	// Reserve a lazily-backed region of memory in the address space of the
+	// current process.  No physical memory is used until each page is first
+	// touched, at which point a cleared page is committed to it.  Released
+	// with kernelMemoryRelease(), like any other memory.
+
+	int processId = 0;
+
+	// Get the current process Id
+	processId = kernelMultitaskerGetCurrentProcessId();
+	if (processId < 0)
+	{
+		kernelError(kernel_error, "Unable to determine the current process");
+		return (NULL);
+	}
+
+	return (reserveRegion(processId, size, description));
+}
+
+
+void *kernelMemoryReserveProcess(int processId, unsigned size,
+	const char *description)
+{
+	// Reserve a lazily-backed region of memory in the address space of the
+	// specified process, which will own it
+	return (reserveRegion(processId, size, description));
+}
+
+
 int kernelMemoryRelease(void *virtual)
 {
 	// This function will determine the physical block that contains the
@@ -933,7 +1629,16 @@ int kernelMemoryRelease(void *virtual)
 	}
 
 	if (virtual >= (void *) KERNEL_VIRTUAL_ADDRESS)
+	{
 		pid = KERNELPROCID;
+	}
+	else
+	{
+		// Is it a lazily-backed region?
+		status = releaseRegionAt(pid, virtual);
+		if (status != ERR_NOSUCHENTRY)
+			return (status);
+	}
 
 	// Get the memory's physical address.  We could simply unmap it here,
 	// except that we don't yet know the size of the block.
@@ -980,6 +1685,32 @@ int kernelMemoryRelease(void *virtual)
 }
 
 
+int kernelMemoryReleaseProcess(int processId, void *virtual)
+{
+	// Release a lazily-backed region from the address space of the process,
+	// along with whatever memory has been committed to it
+
+	int status = 0;
+
+	// Make sure the memory manager has been initialized
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	// Check params
+	if (!virtual)
+		return (status = ERR_NULLPARAMETER);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	status = releaseRegionAt(processId, virtual);
+	if (status == ERR_NOSUCHENTRY)
+		kernelError(kernel_error, "No memory region at %p", virtual);
+
+	return (status);
+}
+
+
 int kernelMemoryReleaseAllByProcId(int processId)
 {
 	// This function will find all memory blocks owned by a particular process
@@ -987,6 +1718,7 @@ int kernelMemoryReleaseAllByProcId(int processId)
 	// negative otherwise.
 
 	int status = 0;
+	memoryRegion region;
 	int count;
 
 	// Make sure the memory manager has been initialized
@@ -996,6 +1728,36 @@ int kernelMemoryReleaseAllByProcId(int processId)
 	if (kernelProcessingInterrupt())
 		return (status = ERR_INVALID);
 
+	// Release any lazily-backed regions first, while the process' page
+	// directory still tells us which memory was committed to them
+	while (1)
+	{
+		status = kernelLockGet(&memoryLock);
+		if (status < 0)
+			return (status);
+
+		for (count = 0; count < numRegions; count ++)
+		{
+			if (regionList[count].processId == processId)
+				break;
+		}
+
+		if (count >= numRegions)
+		{
+			kernelLockRelease(&memoryLock);
+			break;
+		}
+
+		memcpy(&region, &regionList[count], sizeof(memoryRegion));
+		removeRegion(count);
+
+		kernelLockRelease(&memoryLock);
+
+		status = releaseRegion(&region);
+		if (status < 0)
+			return (status);
+	}
+
 	// Obtain a lock on the memory data
 	status = kernelLockGet(&memoryLock);
 	if (status < 0)
@@ -1028,6 +1790,211 @@ int kernelMemoryReleaseAllByProcId(int processId)
 }
 
 
+int kernelMemoryCommit(int processId, void *virtual)
+{
+	// Commit a cleared page of memory to the page of a lazily-backed region
+	// that contains the virtual address, in the address space of the
+	// process.  This is called by the page fault handler, the first time the
+	// page is touched.  Returns ERR_NOSUCHENTRY if the address isn't in such
+	// a region.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	unsigned physical = 0;
+	int zeroed = 0;
+	void *clear = NULL;
+	int index = 0;
+
+	// Make sure the memory manager has been initialized
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	// Regions are only ever in the user part of an address space
+	if (virtual >= (void *) KERNEL_VIRTUAL_ADDRESS)
+		return (status = ERR_NOSUCHENTRY);
+
+	virtual = (void *) kernelPageRoundDown(virtual);
+
+	directory = kernelMultitaskerGetPageDir(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHPROCESS);
+
+	// Obtain a lock on the memory data
+	status = kernelLockGet(&memoryLock);
+	if (status < 0)
+		return (status);
+
+	if (findRegion(directory, virtual, 0 /* containing */) < 0)
+	{
+		kernelLockRelease(&memoryLock);
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	physical = commitBlock(&zeroed);
+
+	kernelLockRelease(&memoryLock);
+
+	if (!physical)
+	{
+		kernelError(kernel_error, "The computer is out of physical memory");
+		return (status = ERR_MEMORY);
+	}
+
+	// Clear the memory before it's visible to the process, unless it
+	// came from the pool of cleared memory
+	if (!zeroed)
+	{
+		status = kernelPageMapToFree(KERNELPROCID, physical, &clear,
+			MEMORY_PAGE_SIZE);
+		if (status >= 0)
+		{
+			memset(clear, 0, MEMORY_PAGE_SIZE);
+			kernelPageUnmap(KERNELPROCID, clear, MEMORY_PAGE_SIZE);
+		}
+	}
+
+	if (kernelLockGet(&memoryLock) < 0)
+		return (status = ERR_NOLOCK);
+
+	if (status >= 0)
+	{
+		// The region might have been released in the meantime (by another
+		// thread sharing the address space), so look again
+		index = findRegion(directory, virtual, 0 /* containing */);
+		if (index >= 0)
+			status = kernelPageCommit(processId, virtual, physical);
+		else
+			status = ERR_NOSUCHENTRY;
+	}
+
+	if (status >= 0)
+	{
+		regionList[index].committed += MEMORY_PAGE_SIZE;
+	}
+	else
+	{
+		decommitBlock(physical);
+
+		// If another thread committed the page first, that's fine
+		if (status == ERR_ALREADY)
+			status = 0;
+	}
+
+	// Release the lock on the memory data
+	kernelLockRelease(&memoryLock);
+
+	return (status);
+}
+
+
+int kernelMemoryZeroIdle(void)
+{
+	// Called by the idle threads, to do a small piece of the work of keeping
+	// the pool of cleared memory full.  This mustn't sleep, so it gives up
+	// if the memory data is locked.  Returns 1 if there's more to do, or 0 if
+	// the caller can idle the processor.
+
+	int more = 0;
+	int interrupts = 0;
+	int order = -1;
+	int blocks = 0;
+	int count;
+
+	if (!initialized || (!zeroWindow && (zeroingFrame < 0)))
+		return (more = 0);
+
+	kernelSmpLock();
+
+	// Keep interrupts off, so that we're never descheduled while we have
+	// the memory lock (or the window).  Each piece of work is small.
+	processorSuspendInts(interrupts);
+
+	if ((zeroingFrame < 0) && zeroWindow)
+	{
+		// Start clearing a new run, of the smallest order that's short
+		for (count = 0; count < ZEROPOOL_ORDERS; count ++)
+		{
+			if (zeroPoolRuns[count] < zeroPoolTarget[count])
+			{
+				order = count;
+				break;
+			}
+		}
+
+		if ((order >= 0) && (kernelLockTry(&memoryLock) >= 0))
+		{
+			zeroingFrame = allocFrames((MEMORY_ZONES - 1), (1 << order),
+				0 /* no alignment */);
+			if (zeroingFrame >= 0)
+			{
+				// It doesn't have a used block list index
+				frameLinks[zeroingFrame].next = -1;
+				zeroingOrder = order;
+				zeroingDone = 0;
+			}
+
+			kernelLockRelease(&memoryLock);
+		}
+	}
+
+	if (zeroingFrame >= 0)
+	{
+		more = 1;
+
+		if (zeroWindow && (zeroingDone < (1 << zeroingOrder)))
+		{
+			blocks = min(ZEROPOOL_WINDOW_BLOCKS, ((1 << zeroingOrder) -
+				zeroingDone));
+
+			if (kernelPageSetWindow(zeroWindow, ((zeroingFrame +
+				zeroingDone) * MEMORY_BLOCK_SIZE),
+				(blocks * MEMORY_BLOCK_SIZE)) >= 0)
+			{
+				memset(zeroWindow, 0, (blocks * MEMORY_BLOCK_SIZE));
+				zeroingDone += blocks;
+			}
+			else
+			{
+				// Don't try again
+				zeroWindow = NULL;
+			}
+		}
+
+		if (kernelLockTry(&memoryLock) >= 0)
+		{
+			if (zeroingDone >= (1 << zeroingOrder))
+			{
+				// Finished, so it goes in the pool
+				zeroPool[zeroingOrder][zeroPoolRuns[zeroingOrder]] =
+					zeroingFrame;
+				zeroPoolRuns[zeroingOrder] += 1;
+				zeroPoolBlocks += (1 << zeroingOrder);
+				zeroingFrame = -1;
+			}
+			else if (!zeroWindow)
+			{
+				// We can't finish it, so give it back
+				frameOrder[zeroingFrame] = FRAME_NOTFREE;
+				freeFrames(zeroingFrame, zeroingOrder);
+				zeroingFrame = -1;
+				more = 0;
+			}
+
+			kernelLockRelease(&memoryLock);
+		}
+	}
+
+	processorRestoreInts(interrupts);
+
+	kernelSmpUnlock();
+
+	return (more);
+}
+
+
 int kernelMemoryChangeOwner(int oldPid, int newPid, int remap,
 	void *oldVirtual, void **newVirtual)
 {
@@ -1200,6 +2167,7 @@ int kernelMemoryGetStats(memoryStats *stats, int kernel)
 	// Return overall memory usage statistics
 
 	int status = 0;
+	int zone, order;
 
 	// Make sure the memory manager has been initialized
 	if (!initialized)
@@ -1223,6 +2191,28 @@ int kernelMemoryGetStats(memoryStats *stats, int kernel)
 	stats->totalMemory = totalMemory;
 	stats->usedMemory = totalUsed;
 
+	// Fragmentation: the number of free runs, and the size of the largest
+	stats->freeRanges = 0;
+	stats->largestFree = 0;
+	for (zone = 0; zone < MEMORY_ZONES; zone ++)
+	{
+		for (order = 0; order <= MEMORY_MAX_ORDER; order ++)
+		{
+			if (!zones[zone].freeCount[order])
+				continue;
+
+			stats->freeRanges += zones[zone].freeCount[order];
+			if ((unsigned)(MEMORY_BLOCK_SIZE << order) > stats->largestFree)
+				stats->largestFree = (MEMORY_BLOCK_SIZE << order);
+		}
+	}
+
+	// The pool of cleared memory, and how often allocations found what they
+	// needed in it
+	stats->zeroedMemory = (zeroPoolBlocks * MEMORY_BLOCK_SIZE);
+	stats->zeroedHits = zeroPoolHits;
+	stats->zeroedMisses = zeroPoolMisses;
+
 	return (status = 0);
 }
 
@@ -1235,8 +2225,7 @@ int kernelMemoryGetBlocks(memoryBlock *blocksArray, unsigned buffSize,
 
 	int status = 0;
 	int doBlocks = 0;
-	memoryBlock *temp = NULL;
-	int count1, count2;
+	int count1;
 
 	// Make sure the memory manager has been initialized
 	if (!initialized)
@@ -1271,20 +2260,8 @@ int kernelMemoryGetBlocks(memoryBlock *blocksArray, unsigned buffSize,
 	// Before we return the list of used memory blocks, we should sort it so
 	// that it's a little easier to see the distribution of memory.  This will
 	// not help the memory manager to function more efficiently or anything,
-	// it's purely cosmetic.  Just a bubble sort.
-	for (count1 = 0; count1 < usedBlocks; count1 ++)
-	{
-		for (count2 = 0;  count2 < (usedBlocks - 1); count2 ++)
-		{
-			if (usedBlockList[count2]->startLocation >
-				usedBlockList[count2 + 1]->startLocation)
-			{
-				temp = usedBlockList[count2 + 1];
-				usedBlockList[count2 + 1] = usedBlockList[count2];
-				usedBlockList[count2] = temp;
-			}
-		}
-	}
+	// it's purely cosmetic.
+	sortBlocks();
 
 	// Release the lock on the memory data
 	kernelLockRelease(&memoryLock);
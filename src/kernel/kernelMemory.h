@@ -26,6 +26,10 @@
 
 // Maximum number of raw memory allocations
 #define MAXMEMORYBLOCKS			2048
+// Maximum number of lazily-backed memory regions, and how many of a region's
+// pages are unmapped at a time when releasing it
+#define MAXMEMORYREGIONS		1024
+#define REGION_RELEASE_PAGES	64
 
 // Descriptions for standard reserved memory areas
 #define MEMORYDESC_IVT_BDA		"real mode ivt and bda"
@@ -34,7 +38,22 @@
 #define MEMORYDESC_KERNEL		"kernel memory"
 #define MEMORYDESC_PAGING		"kernel paging data"
 #define MEMORYDESC_USEDBLOCKS	"used memory block list"
-#define MEMORYDESC_FREEBITMAP	"free memory bitmap"
+#define MEMORYDESC_BUDDYDATA	"buddy allocator data"
+
+// Memory zones, and the largest order of free run (2^order memory blocks)
+// the buddy allocator keeps
+#define MEMORY_ZONES			2
+#define MEMORY_MAX_ORDER		19
+
+// The idle threads clear free memory ahead of time: runs of up to
+// 2^(ZEROPOOL_ORDERS - 1) memory blocks, up to ZEROPOOL_MAX_BLOCKS in all
+// (or 1/ZEROPOOL_FRACTION of memory, if that's less), through a window of
+// ZEROPOOL_WINDOW_BLOCKS at a time
+#define ZEROPOOL_ORDERS			8
+#define ZEROPOOL_MAX_BLOCKS		2048
+#define ZEROPOOL_FRACTION		32
+#define ZEROPOOL_RUNS			(ZEROPOOL_MAX_BLOCKS / ZEROPOOL_ORDERS)
+#define ZEROPOOL_WINDOW_BLOCKS	16
 
 typedef struct {
 	unsigned size;
@@ -54,9 +73,14 @@ int kernelMemoryGetIo(unsigned, unsigned, int, const char *,
 int kernelMemoryReleaseIo(kernelIoMemory *);
 int kernelMemoryChangeOwner(int, int, int, void *, void **);
 int kernelMemoryShare(int, int, void *, void **);
+void *kernelMemoryReserveProcess(int, unsigned, const char *);
+int kernelMemoryReleaseProcess(int, void *);
+int kernelMemoryCommit(int, void *);
+int kernelMemoryZeroIdle(void);
 
 // Functions exported to userspace
 void *kernelMemoryGet(unsigned, const char *);
+void *kernelMemoryReserve(unsigned, const char *);
 int kernelMemoryRelease(void *);
 int kernelMemoryReleaseAllByProcId(int);
 int kernelMemoryGetStats(memoryStats *, int);
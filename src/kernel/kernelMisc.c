@@ -97,12 +97,48 @@ char *kernelVersion[] = {
 };
 
 
+static int readStack(kernelProcess *traceProcess, void *address,
+	unsigned long *value)
+{
+	// Read a word from the stack of the process being traced.  If it's some
+	// other process, its stack isn't mapped in our address space, and its
+	// pages aren't necessarily physically contiguous (or even committed), so
+	// we map the page that holds the word.
+
+	int status = 0;
+	unsigned physical = 0;
+	void *mapped = NULL;
+
+	if (traceProcess == kernelCurrentProcess)
+	{
+		*value = *((unsigned long *) address);
+		return (status = 0);
+	}
+
+	physical = kernelPageGetPhysical(traceProcess->processId, address);
+	if (!physical)
+		return (status = ERR_BADADDRESS);
+
+	status = kernelPageMapToFree(kernelCurrentProcess->processId, physical,
+		&mapped, sizeof(unsigned long));
+	if (status < 0)
+		return (status);
+
+	*value = *((unsigned long *) mapped);
+
+	kernelPageUnmap(kernelCurrentProcess->processId, mapped,
+		sizeof(unsigned long));
+
+	return (status = 0);
+}
+
+
 static void walkStack(kernelProcess *traceProcess, void *stackMemory,
-	unsigned stackSize, long memoryOffset, void **framePointer, char *buffer,
-	int len)
+	unsigned stackSize, void **framePointer, char *buffer, int len)
 {
 	void *oldFramePointer = 0;
 	void *stackBase = (stackMemory + stackSize - sizeof(void *));
+	unsigned long value = 0;
 	void *returnAddress = NULL;
 	const char *symbolName = NULL;
 
@@ -112,13 +148,20 @@ static void walkStack(kernelProcess *traceProcess, void *stackMemory,
 	{
 		// The return address of each frame is sizeof(void *) bytes past the
 		// frame pointer
-		returnAddress = (void *) *((unsigned long *)
-			(*framePointer + memoryOffset + sizeof(void *)));
+		if (readStack(traceProcess, (*framePointer + sizeof(void *)),
+			&value) < 0)
+		{
+			break;
+		}
+
+		returnAddress = (void *) value;
 
 		// Walk to the next frame
+		if (readStack(traceProcess, *framePointer, &value) < 0)
+			break;
+
 		oldFramePointer = *framePointer;
-		*framePointer = (void *)
-		*((unsigned long *)(*framePointer + memoryOffset));
+		*framePointer = (void *) value;
 
 		if (returnAddress &&
 			STILLWALKING(stackMemory, stackBase, *framePointer,
@@ -324,16 +367,11 @@ const char *kernelLookupClosestSymbol(kernelProcess *lookupProcess,
 int kernelStackTrace(kernelProcess *traceProcess, char *buffer, int len)
 {
 	// Will try to do a stack trace of the return addresses between for each
-	// stack frame between the current stack pointer and stack base.  The
-	// stack memory in question must already be mapped in the current address
-	// space.
+	// stack frame between the current stack pointer and stack base.
 
 	int status = 0;
 	void *instPointer = 0;
 	void *framePointer = NULL;
-	unsigned stackPhysical = 0;
-	void *stackVirtual = NULL;
-	long memoryOffset = 0;
 	const char *symbolName = NULL;
 
 	// Check params
@@ -382,32 +420,9 @@ int kernelStackTrace(kernelProcess *traceProcess, char *buffer, int len)
 	else
 	{
 #ifdef ARCH_X86
-		instPointer = (void *) traceProcess->context.taskStateSegment.EIP;
-		framePointer = (void *) traceProcess->context.taskStateSegment.EBP;
+		instPointer = (void *) traceProcess->context.EIP;
+		framePointer = (void *) traceProcess->context.EBP;
 #endif
-
-		// If we're tracing some other process, we need to map its stack into
-		// our address space
-		if (traceProcess != kernelCurrentProcess)
-		{
-			stackPhysical = kernelPageGetPhysical(traceProcess->processId,
-				traceProcess->userStack);
-			if (!stackPhysical)
-				return (status = ERR_BADADDRESS);
-
-			status = kernelPageMapToFree(kernelCurrentProcess->processId,
-				stackPhysical, &stackVirtual, (traceProcess->userStackSize +
-					traceProcess->superStackSize));
-			if (status < 0)
-				return (status);
-
-			// Calculate the difference between the process' stack addresses
-			// and the memory we mapped
-			if (stackVirtual > traceProcess->userStack)
-				memoryOffset = (stackVirtual - traceProcess->userStack);
-			else
-				memoryOffset = -(traceProcess->userStack - stackVirtual);
-		}
 	}
 
 	// First try and figure out the current function
@@ -425,7 +440,7 @@ int kernelStackTrace(kernelProcess *traceProcess, char *buffer, int len)
 		snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
 			" supervisor stack:\n");
 		walkStack(traceProcess, traceProcess->superStack,
-			traceProcess->superStackSize, memoryOffset, &framePointer,
+			traceProcess->superStackSize, &framePointer,
 			(buffer + strlen(buffer)), (len - strlen(buffer)));
 	}
 
@@ -437,18 +452,12 @@ int kernelStackTrace(kernelProcess *traceProcess, char *buffer, int len)
 		snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
 			" user stack:\n");
 		walkStack(traceProcess, traceProcess->userStack,
-			traceProcess->userStackSize, memoryOffset, &framePointer,
+			traceProcess->userStackSize, &framePointer,
 			(buffer + strlen(buffer)), (len - strlen(buffer)));
 	}
 
 	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)), "<--\n");
 
-	if (stackVirtual)
-	{
-		kernelPageUnmap(kernelCurrentProcess->processId, stackVirtual,
-			(traceProcess->userStackSize + traceProcess->superStackSize));
-	}
-
 	return (status = 0);
 }
 
@@ -22,6 +22,8 @@
 // This file contains the C functions belonging to the kernel's multitasker
 
 #include "kernelMultitasker.h"
+#include "kernelApi.h"
+#include "kernelApicDriver.h"
 #include "kernelCpu.h"
 #include "kernelDebug.h"
 #include "kernelEnvironment.h"
@@ -38,6 +40,7 @@
 #include "kernelParameters.h"
 #include "kernelPic.h"
 #include "kernelShutdown.h"
+#include "kernelSmp.h"
 #include "kernelSysTimer.h"
 #include <signal.h>
 #include <stdio.h>
@@ -49,7 +52,7 @@
 
 #define PROC_KILLABLE(proc) ((proc != kernelProc) && \
 	(proc != exceptionProc) && \
-	(proc != idleProc) && \
+	(proc != cpus[proc->cpu].idleProc) && \
 	(proc != kernelCurrentProcess))
 
 #define SET_PORT_BIT(bitmap, port) \
@@ -62,25 +65,63 @@
 static int multitaskingEnabled = 0;
 static volatile int processIdCounter = KERNELPROCID;
 static kernelProcess *kernelProc = NULL;
-static kernelProcess *idleProc = NULL;
 static kernelProcess *exceptionProc = NULL;
-static kernelProcess *fpuProcess = NULL;
 
-// We allow the pointer to the current process to be exported, so that when a
-// process uses system calls, there is an easy way for the process to get
-// information about itself
-kernelProcess *kernelCurrentProcess = NULL;
+// We allow the pointers to the current processes to be exported, so that
+// when a process uses system calls, there is an easy way for the process to
+// get information about itself
+kernelProcess *kernelCurrentProcesses[MAX_CPUS];
 
 // Process list for CPU execution
 static linkedList processList;
 
-// Global data required by the scheduler
+// Per-CPU scheduler state.  Each CPU has its own idle thread, its own queues
+// of runnable processes (one per priority level, plus queues for processes
+// which have yielded during the current time slice), and remembers which
+// process's state is in its FPU.  The bitmaps have bit N set when queue N is
+// non-empty.
+//
+// On x86 there's one TSS per CPU.  Processes are switched in software, and
+// only the supervisor stack pointer and I/O permissions in the TSS change,
+// when switching to a user process.  startStack is a small temporary stack
+// used to launch new processes.
+static struct {
+	kernelProcess *idleProc;
+	kernelProcess *fpuProcess;
+	kernelProcessQueue readyQueue[PRIORITY_LEVELS];
+	kernelProcessQueue yieldQueue[PRIORITY_LEVELS];
+	volatile unsigned readyBitmap;
+	volatile unsigned yieldBitmap;
+	volatile unsigned timeSlices;
+	volatile unsigned sliceLength;
+#ifdef ARCH_X86
+	x86TSS tss;
+	kernelProcess *ioMapProcess;
+	unsigned startStack[64];
+#endif
+
+} cpus[MAX_CPUS];
+
+#ifdef ARCH_X86
+// Whether user processes can make API calls with SYSENTER
+static int fastApi = 0;
+#endif
+
+
+// Global data required by the scheduler.  sliceLength is the length of a
+// time slice in system timer ticks, and cpuPercentSlices is the number of
+// time slices in each period for calculating %CPU values (1/2 second).
 static volatile struct {
 	int stop;
+	unsigned sliceLength;
+	unsigned cpuPercentSlices;
 	unsigned timeSlices;
 	unsigned systemTime;
 	unsigned schedulerTime;
 	unsigned sliceCount;
+	unsigned decisions;
+	unsigned cpuPeriod;
+	unsigned cpuPeriodTime;
 
 } schedData = { 0 };
 
@@ -89,6 +130,8 @@ static volatile struct {
 	int number;
 	kernelProcess *process;
 	unsigned address;
+	unsigned faultAddress;
+	int cpu;
 
 } exception = { 0 };
 
@@ -98,7 +141,7 @@ static struct {
 	kernelSelector tssSelector;
 	const char *a;
 	const char *name;
-	int (*handler)(void);
+	int (*handler)(kernelProcess *, unsigned);
 
 } exceptionVector[19] = {
 	{ EXCEPTION_DIVBYZERO, 0, "a", "divide-by-zero", NULL },
@@ -122,6 +165,8 @@ static struct {
 	{ EXCEPTION_MACHCHECK, 0, "a", "machine check", NULL }
 };
 
+static void setProcessState(kernelProcess *, processState);
+
 
 static void debugContext(kernelProcess *proc, char *buffer, int len)
 {
@@ -129,50 +174,22 @@ static void debugContext(kernelProcess *proc, char *buffer, int len)
 		return;
 
 #ifdef ARCH_X86
-	snprintf(buffer, len, "Multitasker debug TSS selector:\n");
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  oldTss=%08x", proc->context.taskStateSegment.oldTss);
-
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ESP0=%08x SS0=%08x\n", proc->context.taskStateSegment.ESP0,
-		proc->context.taskStateSegment.SS0);
+	snprintf(buffer, len, "Multitasker debug context:\n");
 
 	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ESP1=%08x SS1=%08x\n", proc->context.taskStateSegment.ESP1,
-		proc->context.taskStateSegment.SS1);
+		"  stackPointer=%08x EIP=%08x EFLAGS=%08x\n",
+		proc->context.stackPointer, proc->context.EIP,
+		proc->context.EFLAGS);
 
 	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ESP2=%08x SS2=%08x\n", proc->context.taskStateSegment.ESP2,
-		proc->context.taskStateSegment.SS2);
+		"  ESP=%08x EBP=%08x ESP0=%08x\n", proc->context.ESP,
+		proc->context.EBP, ((proc->processorPrivilege !=
+			PRIVILEGE_SUPERVISOR)? ((unsigned) proc->superStack +
+			(proc->superStackSize - sizeof(int))) : 0));
 
 	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  CR3=%08x EIP=%08x EFLAGS=%08x\n",
-		proc->context.taskStateSegment.CR3,
-		proc->context.taskStateSegment.EIP,
-		proc->context.taskStateSegment.EFLAGS);
-
-	// Skip general-purpose registers for now -- not terribly interesting
-
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ESP=%08x EBP=%08x ESI=%08x EDI=%08x\n",
-		proc->context.taskStateSegment.ESP,
-		proc->context.taskStateSegment.EBP,
-		proc->context.taskStateSegment.ESI,
-		proc->context.taskStateSegment.EDI);
-
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  CS=%08x SS=%08x\n", proc->context.taskStateSegment.CS,
-		proc->context.taskStateSegment.SS);
-
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  ES=%08x DS=%08x FS=%08x GS=%08x\n",
-		proc->context.taskStateSegment.ES, proc->context.taskStateSegment.DS,
-		proc->context.taskStateSegment.FS, proc->context.taskStateSegment.GS);
-
-	snprintf((buffer + strlen(buffer)), (len - strlen(buffer)),
-		"  LDTSelector=%08x IOMapBase=%04x\n",
-		proc->context.taskStateSegment.LDTSelector,
-		proc->context.taskStateSegment.IOMapBase);
+		"  CR3=%08x ioMap=%s\n", (unsigned) proc->pageDirectory->physical,
+		(proc->context.ioMap? "yes" : "no"));
 #endif
 }
 
@@ -222,6 +239,270 @@ static kernelProcess *getProcessByName(const char *name)
 }
 
 
+static void queueAppend(kernelProcessQueue *queue, kernelProcess *proc)
+{
+	// Add a process to the back of a process queue.  Interrupts must be
+	// disabled.
+
+	proc->queue = queue;
+	proc->queuePrev = queue->last;
+	proc->queueNext = NULL;
+
+	if (queue->last)
+		queue->last->queueNext = proc;
+	else
+		queue->first = proc;
+
+	queue->last = proc;
+	queue->numProcesses += 1;
+}
+
+
+static void queueRemove(kernelProcess *proc)
+{
+	// Remove a process from whichever process queue it's on, if any.
+	// Interrupts must be disabled.
+
+	kernelProcessQueue *queue = proc->queue;
+
+	if (!queue)
+		return;
+
+	if (proc->queuePrev)
+		proc->queuePrev->queueNext = proc->queueNext;
+	else
+		queue->first = proc->queueNext;
+
+	if (proc->queueNext)
+		proc->queueNext->queuePrev = proc->queuePrev;
+	else
+		queue->last = proc->queuePrev;
+
+	queue->numProcesses -= 1;
+
+	proc->queue = NULL;
+	proc->queuePrev = proc->queueNext = NULL;
+}
+
+
+static int readyQueued(kernelProcess *proc)
+{
+	// Returns 1 if the process is on one of its CPU's ready or yield queues
+
+	kernelProcessQueue *readyQueue = cpus[proc->cpu].readyQueue;
+	kernelProcessQueue *yieldQueue = cpus[proc->cpu].yieldQueue;
+
+	return (proc->queue && (((proc->queue >= readyQueue) &&
+		(proc->queue < &readyQueue[PRIORITY_LEVELS])) ||
+		((proc->queue >= yieldQueue) &&
+		(proc->queue < &yieldQueue[PRIORITY_LEVELS]))));
+}
+
+
+static int cpuIdle(int cpu)
+{
+	// Returns 1 if the CPU is online, running its idle thread, and has
+	// nothing but background processes waiting
+
+	return (cpus[cpu].idleProc &&
+		(kernelCurrentProcesses[cpu] == cpus[cpu].idleProc) &&
+		!(cpus[cpu].readyBitmap & ~(1 << (PRIORITY_LEVELS - 1))));
+}
+
+
+static void chooseCpu(kernelProcess *proc)
+{
+	// If the process's CPU is busy, and another is idle, move the process
+	// there.  Processes that are running, or whose state is still in their
+	// CPU's FPU, stay where they are.
+
+	int count;
+
+	if ((kernelSmpNumCpus() < 2) || (proc == cpus[proc->cpu].idleProc) ||
+		(proc == kernelCurrentProcesses[proc->cpu]) ||
+		(proc == cpus[proc->cpu].fpuProcess) || cpuIdle(proc->cpu))
+	{
+		return;
+	}
+
+	for (count = 0; count < MAX_CPUS; count ++)
+	{
+		if (cpuIdle(count))
+		{
+			proc->cpu = count;
+			return;
+		}
+	}
+}
+
+
+static void readyAdd(kernelProcess *proc, int yielded, int keepAge)
+{
+	// Put a ready process on the appropriate ready queue of its CPU.
+	// Interrupts must be disabled.  See chooseNextProcess() for how the
+	// queues are used.
+
+	int level = proc->priority;
+
+	if (!keepAge)
+		proc->readySince = schedData.decisions;
+
+	if (!yielded)
+		chooseCpu(proc);
+
+	// Real-time and background processes always stay at their own levels
+	if (level && (level < (PRIORITY_LEVELS - 1)))
+	{
+		if (proc->state == proc_ioready)
+		{
+			// A process that was waiting for I/O which has now arrived gets a
+			// high (1) temporary priority level
+			level = 1;
+		}
+		else if (yielded)
+		{
+			// A process that has yielded gets no weight until the next time
+			// slice, so that a bunch of yielding processes don't gobble up
+			// all the CPU time
+			queueAppend(&cpus[proc->cpu].yieldQueue[level], proc);
+			cpus[proc->cpu].yieldBitmap |= (1 << level);
+			return;
+		}
+	}
+
+	queueAppend(&cpus[proc->cpu].readyQueue[level], proc);
+	cpus[proc->cpu].readyBitmap |= (1 << level);
+
+	// If the CPU is idling, get it to notice
+	if ((kernelCurrentProcesses[proc->cpu] == cpus[proc->cpu].idleProc) &&
+		(level < (PRIORITY_LEVELS - 1)))
+	{
+		kernelSmpReschedule(proc->cpu);
+	}
+}
+
+
+static void readyRemove(kernelProcess *proc)
+{
+	// Take a process off of whichever queue it's on, and keep its CPU's
+	// ready bitmaps up to date.  Interrupts must be disabled.
+
+	kernelProcessQueue *queue = proc->queue;
+	kernelProcessQueue *readyQueue = cpus[proc->cpu].readyQueue;
+	kernelProcessQueue *yieldQueue = cpus[proc->cpu].yieldQueue;
+	int level = 0;
+
+	if (!queue)
+		return;
+
+	queueRemove(proc);
+
+	if ((queue >= readyQueue) && (queue < &readyQueue[PRIORITY_LEVELS]))
+	{
+		level = (queue - readyQueue);
+		if (!queue->first)
+			cpus[proc->cpu].readyBitmap &= ~(1 << level);
+	}
+	else if ((queue >= yieldQueue) && (queue < &yieldQueue[PRIORITY_LEVELS]))
+	{
+		level = (queue - yieldQueue);
+		if (!queue->first)
+			cpus[proc->cpu].yieldBitmap &= ~(1 << level);
+	}
+}
+
+
+static void waitTimerExpired(kernelTimer *timer)
+{
+	// Called by the timer code, from the scheduler, when a waiting process'
+	// waitUntil time has come
+
+	kernelProcess *proc = timer->data;
+
+	// The process is ready to run
+	if (proc->state == proc_waiting)
+		setProcessState(proc, proc_ready);
+}
+
+
+static void setProcessState(kernelProcess *proc, processState newState)
+{
+	// All changes to process states go through here, so that the scheduler's
+	// queues always agree with them.  Only ready processes are on the ready
+	// queues, and only waiting processes with a timeout have their wait
+	// timers armed.
+
+	int interrupts = 0;
+	int wasReady = 0;
+
+	processorSuspendInts(interrupts);
+
+	wasReady = readyQueued(proc);
+	readyRemove(proc);
+	kernelTimerCancel(&proc->waitTimer);
+
+	proc->state = newState;
+
+	switch (newState)
+	{
+		case proc_ready:
+		case proc_ioready:
+			// Processes that are already waiting to run keep their age
+			readyAdd(proc, 0 /* not yielded */, wasReady);
+			break;
+
+		case proc_waiting:
+			// The timer heap has room for every process's wait timer, so
+			// this can't fail
+			if (proc->waitUntil && (kernelTimerSet(&proc->waitTimer,
+				proc->waitUntil, &waitTimerExpired, (void *) proc) < 0))
+			{
+				kernelPanic("Can't set the wait timer of process %d",
+					proc->processId);
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	processorRestoreInts(interrupts);
+}
+
+
+static void updateCpuPercent(kernelProcess *proc)
+{
+	// The CPU percentage of each process is calculated lazily, only when a
+	// process runs or when someone asks for it, so that the scheduler never
+	// has to visit processes that aren't running.  If the process's CPU time
+	// counter belongs to an earlier period, roll it over.
+
+	int interrupts = 0;
+
+	processorSuspendInts(interrupts);
+
+	if (proc->cpuPeriod != schedData.cpuPeriod)
+	{
+		if (((proc->cpuPeriod + 1) == schedData.cpuPeriod) &&
+			schedData.cpuPeriodTime)
+		{
+			proc->cpuPercent = ((proc->cpuTime * 100) /
+				schedData.cpuPeriodTime);
+		}
+		else
+		{
+			proc->cpuPercent = 0;
+		}
+
+		// Reset the process's cpuTime counter
+		proc->cpuTime = 0;
+		proc->cpuPeriod = schedData.cpuPeriod;
+	}
+
+	processorRestoreInts(interrupts);
+}
+
+
 static inline int allocProcess(kernelProcess **procPointer)
 {
 	// Allocate new process control memory.  It should be passed a reference
@@ -338,87 +619,70 @@ static int removeProcessFromList(kernelProcess *proc)
 
 static int createProcessContext(kernelProcess *proc)
 {
-	// This function will create a processor context (for x86 it's a TSS -
-	// Task State Segment) for a new process based on the attributes of the
-	// process.  This function relies on the privilege, userStackSize, and
-	// superStackSize attributes having been previously set.  Returns 0 on
-	// success, negative on error.
+	// This function will set up the processor context for a new process,
+	// based on the attributes of the process.  This function relies on the
+	// privilege, userStackSize, and superStackSize attributes having been
+	// previously set.  The process is launched the first time it's switched
+	// to, by processStart().  Returns 0 on success, negative on error.
 
 	int status = 0;
 
 #ifdef ARCH_X86
-	// Get a free descriptor for the process's TSS
-	status = kernelDescriptorRequest(&proc->context.tssSelector);
-	if ((status < 0) || !proc->context.tssSelector)
-		return (status);
+	memset((void *) &proc->context, 0, sizeof(kernelProcessContext));
 
-	// Fill in the process's Task State Segment descriptor
-	status = kernelDescriptorSet(
-		proc->context.tssSelector,		// TSS selector number
-		&proc->context.taskStateSegment, // Starts at...
-		sizeof(x86TSS),					// Limit of a TSS segment
-		1,								// Present in memory
-		PRIVILEGE_SUPERVISOR,			// TSSes are supervisor priv level
-		0,								// TSSes are system segs
-		0xB,							// TSS, 32-bit, busy
-		0,								// 0 for SMALL size granularity
-		0);								// Must be 0 in TSS
-	if (status < 0)
-	{
-		kernelDescriptorRelease(proc->context.tssSelector);
-		return (status);
-	}
+	// A user process has no I/O port permissions until it's given some, and
+	// a supervisor one doesn't need any
 
-	// Now, fill in the TSS (Task State Segment) for the new process.  Parts
-	// of this will be different depending on whether this is a user or
-	// supervisor mode process.
+	proc->context.ESP = ((unsigned) proc->userStack +
+		(proc->userStackSize - sizeof(void *)));
 
-	memset((void *) &proc->context.taskStateSegment, 0, sizeof(x86TSS));
+	proc->context.EFLAGS = 0x00000202; // Interrupts enabled
 
-	// Set the IO bitmap's offset
-	proc->context.taskStateSegment.IOMapBase = X86_IOBITMAP_OFFSET;
+	// All remaining values will be NULL from initialization.  Note that this
+	// includes the EIP.
+#endif
 
-	if (proc->processorPrivilege == PRIVILEGE_SUPERVISOR)
-	{
-		proc->context.taskStateSegment.CS = PRIV_CODE;
-		proc->context.taskStateSegment.DS = PRIV_DATA;
-		proc->context.taskStateSegment.SS = PRIV_STACK;
-	}
-	else
-	{
-		proc->context.taskStateSegment.CS = USER_CODE;
-		proc->context.taskStateSegment.DS = USER_DATA;
-		proc->context.taskStateSegment.SS = USER_STACK;
+	// Return success
+	return (status = 0);
+}
 
-		// Turn off access to all I/O ports by default
-		memset((void *) proc->context.taskStateSegment.IOMap, 0xFF,
-			X86_PORTS_BYTES);
-	}
 
-	// All other data segments same as DS
-	proc->context.taskStateSegment.ES = proc->context.taskStateSegment.FS =
-		proc->context.taskStateSegment.GS = proc->context.taskStateSegment.DS;
+static int reserveStack(kernelProcess *proc, void **topPage)
+{
+	// A user process' stack is reserved in its own address space, and only
+	// gets memory as it's used.  The supervisor stack, which the processor
+	// switches to for interrupts and exceptions, and the top page of the user
+	// stack, where the arguments go, are committed now.  The top page is also
+	// mapped into the kernel's address space, so that the caller can write
+	// the arguments, and must be unmapped afterwards.
 
-	proc->context.taskStateSegment.ESP = ((unsigned) proc->userStack +
-		(proc->userStackSize - sizeof(void *)));
+	int status = 0;
+	void *page = NULL;
+	unsigned physical = 0;
 
-	if (proc->processorPrivilege != PRIVILEGE_SUPERVISOR)
+	proc->userStack = kernelMemoryReserveProcess(proc->processId,
+		(proc->userStackSize + proc->superStackSize), "process stack");
+	if (!proc->userStack)
+		return (status = ERR_MEMORY);
+
+	for (page = (proc->userStack + proc->userStackSize - MEMORY_PAGE_SIZE);
+		page < (proc->userStack + proc->userStackSize +
+			proc->superStackSize); page += MEMORY_PAGE_SIZE)
 	{
-		proc->context.taskStateSegment.SS0 = PRIV_STACK;
-		proc->context.taskStateSegment.ESP0 = ((unsigned) proc->superStack +
-			(proc->superStackSize - sizeof(int)));
+		status = kernelMemoryCommit(proc->processId, page);
+		if (status < 0)
+			return (status);
 	}
 
-	proc->context.taskStateSegment.EFLAGS = 0x00000202; // Interrupts enabled
-	proc->context.taskStateSegment.CR3 = (unsigned)
-		proc->pageDirectory->physical;
+	physical = kernelPageGetPhysical(proc->processId, (proc->userStack +
+		proc->userStackSize - MEMORY_PAGE_SIZE));
+	if (!physical)
+		return (status = ERR_MEMORY);
 
-	// All remaining values will be NULL from initialization.  Note that this
-	// includes the EIP.
-#endif
+	status = kernelPageMapToFree(KERNELPROCID, physical, topPage,
+		MEMORY_PAGE_SIZE);
 
-	// Return success
-	return (status = 0);
+	return (status);
 }
 
 
@@ -435,6 +699,7 @@ static int createNewProcess(const char *name, int priority, int privilege,
 	int status = 0;
 	kernelProcess *proc = NULL;
 	void *stackMemoryAddr = NULL;
+	void *stackTopPage = NULL;
 	unsigned physicalCodeData = 0;
 	int argMemorySize = 0;
 	char *argMemory = NULL;
@@ -520,6 +785,13 @@ static int createNewProcess(const char *name, int priority, int privilege,
 	// The thread's initial state will be "stopped"
 	proc->state = proc_stopped;
 
+	// It starts out on this CPU, holding the kernel lock
+	proc->cpu = kernelSmpCpuNumber();
+	proc->lockDepth = 1;
+
+	// Start counting CPU time in the current period
+	proc->cpuPeriod = schedData.cpuPeriod;
+
 	// Add the process to the process list so we can continue whilst doing
 	// things like changing memory ownerships
 	status = addProcessToList(proc);
@@ -589,12 +861,21 @@ static int createNewProcess(const char *name, int priority, int privilege,
 	if (proc->processorPrivilege != PRIVILEGE_SUPERVISOR)
 		proc->superStackSize = DEFAULT_SUPER_STACK_SIZE;
 
-	stackMemoryAddr = kernelMemoryGet((proc->userStackSize +
-		proc->superStackSize), "process stack");
-	if (!stackMemoryAddr)
+	if (proc->processorPrivilege != PRIVILEGE_SUPERVISOR)
 	{
-		status = ERR_MEMORY;
-		goto out;
+		status = reserveStack(proc, &stackTopPage);
+		if (status < 0)
+			goto out;
+	}
+	else
+	{
+		stackMemoryAddr = kernelMemoryGet((proc->userStackSize +
+			proc->superStackSize), "process stack");
+		if (!stackMemoryAddr)
+		{
+			status = ERR_MEMORY;
+			goto out;
+		}
 	}
 
 	// Copy 'argc' and 'argv' arguments to the new process's stack while we
@@ -647,7 +928,11 @@ static int createNewProcess(const char *name, int priority, int privilege,
 	oldArgPtr = argMemory;
 
 	// Set pointers to the beginning stack location for the arguments
-	stackArgs = (stackMemoryAddr + proc->userStackSize - (2 * sizeof(int)));
+	if (stackTopPage)
+		stackArgs = (stackTopPage + MEMORY_PAGE_SIZE - (2 * sizeof(int)));
+	else
+		stackArgs = (stackMemoryAddr + proc->userStackSize -
+			(2 * sizeof(int)));
 	stackArgs[0] = execImage->argc;
 	stackArgs[1] = (int) newArgPtr;
 
@@ -677,13 +962,23 @@ static int createNewProcess(const char *name, int priority, int privilege,
 		argMemory = NULL;
 	}
 
-	// Make the process own its stack memory
-	status = kernelMemoryChangeOwner(proc->parentProcessId, proc->processId,
-		1 /* remap */, stackMemoryAddr, (void **) &proc->userStack);
-	if (status < 0)
-		goto out;
+	if (stackTopPage)
+	{
+		// The process already owns its stack memory
+		kernelPageUnmap(KERNELPROCID, stackTopPage, MEMORY_PAGE_SIZE);
+		stackTopPage = NULL;
+	}
+	else
+	{
+		// Make the process own its stack memory
+		status = kernelMemoryChangeOwner(proc->parentProcessId,
+			proc->processId, 1 /* remap */, stackMemoryAddr,
+			(void **) &proc->userStack);
+		if (status < 0)
+			goto out;
 
-	stackMemoryAddr = NULL;
+		stackMemoryAddr = NULL;
+	}
 
 	// Make the topmost page of the user stack privileged, so that we have a
 	// 'guard page' that produces a page fault in case of (userspace) stack
@@ -709,10 +1004,10 @@ static int createNewProcess(const char *name, int priority, int privilege,
 #ifdef ARCH_X86
 	// Adjust the stack pointer to account for the arguments that we copied to
 	// the process's stack
-	proc->context.taskStateSegment.ESP -= sizeof(int);
+	proc->context.ESP -= sizeof(int);
 
 	// Set the EIP to the entry point
-	proc->context.taskStateSegment.EIP = (unsigned) execImage->entryPoint;
+	proc->context.EIP = (unsigned) execImage->entryPoint;
 #endif
 
 	// Get memory for the user process environment structure
@@ -729,8 +1024,16 @@ static int createNewProcess(const char *name, int priority, int privilege,
 out:
 	if (status < 0)
 	{
+		if (stackTopPage)
+			kernelPageUnmap(KERNELPROCID, stackTopPage, MEMORY_PAGE_SIZE);
+
 		if (stackMemoryAddr)
 			kernelMemoryRelease(stackMemoryAddr);
+		else if (proc->userStack &&
+			(proc->processorPrivilege != PRIVILEGE_SUPERVISOR))
+		{
+			kernelMemoryReleaseProcess(proc->processId, proc->userStack);
+		}
 
 		if (argMemory)
 			kernelMemoryRelease(argMemory);
@@ -749,6 +1052,7 @@ static int deleteProcess(kernelProcess *proc)
 	// descendent threads have terminated, for example.
 
 	int status = 0;
+	int count;
 
 	// Processes cannot delete themselves
 	if (proc == kernelCurrentProcess)
@@ -759,18 +1063,17 @@ static int deleteProcess(kernelProcess *proc)
 	}
 
 #ifdef ARCH_X86
-	// We need to deallocate the TSS descriptor allocated to the process, if
-	// it has one
-	if (proc->context.tssSelector)
+	// Release the process's I/O permission bitmap, if it has one
+	if (proc->context.ioMap)
 	{
-		status = kernelDescriptorRelease(proc->context.tssSelector);
-		if (status < 0)
+		for (count = 0; count < MAX_CPUS; count ++)
 		{
-			// If this was unsuccessful, we don't want to continue and "lose"
-			// the descriptor
-			kernelError(kernel_error, "Can't release TSS");
-			return (status);
+			if (cpus[count].ioMapProcess == proc)
+				cpus[count].ioMapProcess = NULL;
 		}
+
+		kernelFree((void *) proc->context.ioMap);
+		proc->context.ioMap = NULL;
 	}
 #endif
 
@@ -825,9 +1128,15 @@ static int deleteProcess(kernelProcess *proc)
 		}
 	}
 
-	// If this process was using the FPU, it's not any more
-	if (fpuProcess == proc)
-		fpuProcess = NULL;
+	// If this process was using an FPU, it's not any more
+	for (count = 0; count < MAX_CPUS; count ++)
+	{
+		if (cpus[count].fpuProcess == proc)
+			cpus[count].fpuProcess = NULL;
+	}
+
+	// Make sure the process isn't on any of the scheduler's queues
+	setProcessState(proc, proc_stopped);
 
 	// Remove the process from the multitasker's process list
 	status = removeProcessFromList(proc);
@@ -888,7 +1197,7 @@ static void exceptionHandler(void)
 			}
 			else
 			{
-				exception.process->state = proc_stopped;
+				setProcessState(exception.process, proc_stopped);
 			}
 		}
 
@@ -929,6 +1238,12 @@ static void exceptionHandler(void)
 				kernOrApp, exception.address);
 		}
 
+		if (exception.number == EXCEPTION_PAGE)
+		{
+			sprintf((message + strlen(message)), " accessing address %08x",
+				exception.faultAddress);
+		}
+
 		if (kernelProcessingInterrupt())
 		{
 			sprintf((message + strlen(message)), " while processing "
@@ -973,7 +1288,7 @@ static void exceptionHandler(void)
 		}
 
 		// The collector thread may now dismantle the process
-		exception.process->state = proc_finished;
+		setProcessState(exception.process, proc_finished);
 
 		kernelInterruptClearCurrent();
 		memset((void *) &exception, 0, sizeof(exception));
@@ -1012,24 +1327,11 @@ static int spawnExceptionThread(void)
 		return (status = ERR_NOCREATE);
 
 	// Set the thread state to sleeping
-	exceptionProc->state = proc_sleeping;
+	setProcessState(exceptionProc, proc_sleeping);
 
 #ifdef ARCH_X86
-	status = kernelDescriptorSet(
-		exceptionProc->context.tssSelector,	// TSS selector
-		&exceptionProc->context.taskStateSegment, // Starts at...
-		sizeof(x86TSS),						// Maximum size of a TSS selector
-		1,									// Present in memory
-		PRIVILEGE_SUPERVISOR,				// Highest privilege level
-		0,									// TSSes are system segs
-		0x9,								// TSS, 32-bit, non-busy
-		0,									// 0 for SMALL size granularity
-		0);									// Must be 0 in TSS
-	if (status < 0)
-		return (status);
-
-	// Interrupts should always be disabled for this task
-	exceptionProc->context.taskStateSegment.EFLAGS = 0x00000002;
+	// Interrupts should always be disabled for this thread
+	exceptionProc->context.EFLAGS = 0x00000002;
 #endif
 
 	return (status = 0);
@@ -1058,7 +1360,7 @@ static void collectorThread(void)
 				{
 					// We couldn't kill it, so we will mark it as a zombie
 					// process
-					proc->state = proc_zombie;
+					setProcessState(proc, proc_zombie);
 				}
 			}
 
@@ -1091,53 +1393,51 @@ static void idleThread(void)
 	// This is the idle thread.  It runs in this loop whenever no other
 	// processes need the CPU.  This should be run at the absolute lowest
 	// possible priority so that it will not be chosen to run unless there is
-	// nothing else.
+	// nothing else.  Each CPU has one, and it runs without the kernel lock.
 
-	kernelProcess *proc = NULL;
-	linkedListItem *iter = NULL;
+	int cpu = kernelSmpCpuNumber();
 
 	while (1)
 	{
-		// Idle the processor until something happens
-		processorIdle();
-
-		// Loop through the process list looking for any that have changed
-		// state to "I/O ready"
-
-		proc = linkedListIterStart(&processList, &iter);
+		// Clear some free memory ahead of time, if there's any to do.
+		// Otherwise, idle the processor until something happens.
+		if (!kernelMemoryZeroIdle())
+			processorIdle();
 
-		while (proc)
+		// If anything other than a background process has become ready (for
+		// example, one whose I/O has arrived), give up the processor
+		if (cpus[cpu].readyBitmap & ~(1 << (PRIORITY_LEVELS - 1)))
 		{
-			if (proc->state == proc_ioready)
-			{
-				kernelMultitaskerYield();
-				break;
-			}
-
-			proc = linkedListIterNext(&processList, &iter);
+			kernelSmpLock();
+			kernelMultitaskerYield();
+			kernelSmpUnlock();
 		}
 	}
 }
 
 
-static int spawnIdleThread(void)
+static int spawnIdleThread(int cpu)
 {
-	// This function will create the idle thread at initialization time.
-	// Returns 0 on success, negative otherwise.
+	// This function will create the idle thread for a CPU.  The caller makes
+	// it runnable.  Returns 0 on success, negative otherwise.
 
 	int status = 0;
 	int procId = 0;
+	kernelProcess *proc = NULL;
 
 	// The idle thread needs to be a child of the kernel
 	procId = kernelMultitaskerSpawn(&idleThread, "idle thread",
-		0 /* no args */, NULL /* no args */, 1 /* run */);
+		0 /* no args */, NULL /* no args */, 0 /* don't run */);
 	if (procId < 0)
 		return (procId);
 
-	idleProc = getProcessById(procId);
-	if (!idleProc)
+	proc = getProcessById(procId);
+	if (!proc)
 		return (status = ERR_NOSUCHPROCESS);
 
+	proc->cpu = cpu;
+	cpus[cpu].idleProc = proc;
+
 	// Set it to the lowest priority
 	status = kernelMultitaskerSetProcessPriority(procId,
 		(PRIORITY_LEVELS - 1));
@@ -1153,57 +1453,140 @@ static int spawnIdleThread(void)
 }
 
 
-static int markProcessBusy(kernelProcess *proc, int busy)
+#ifdef ARCH_X86
+static inline unsigned superStackTop(kernelProcess *proc)
 {
-	// This function gets the requested TSS selector from the GDT and marks it
-	// as busy/not busy.  Returns negative on error.
+	return ((unsigned) proc->superStack + (proc->superStackSize -
+		sizeof(int)));
+}
 
-	int status = 0;
 
-#ifdef ARCH_X86
-	kernelDescriptor descriptor;
+static void setIoMap(int cpu, kernelProcess *proc)
+{
+	// Set up the I/O permission bitmap in the CPU's TSS for a user process.
+	// Most don't have any permissions, so the bitmap is simply switched off.
+	// The bitmap is only copied when switching to a process with permissions
+	// that aren't already loaded.
 
-	status = kernelDescriptorGet(proc->context.tssSelector, &descriptor);
-	if (status < 0)
-		return (status);
+	if (!proc->context.ioMap)
+	{
+		cpus[cpu].tss.IOMapBase = X86_IOBITMAP_NONE;
+		return;
+	}
+
+	if (cpus[cpu].ioMapProcess != proc)
+	{
+		memcpy((void *) cpus[cpu].tss.IOMap, (void *) proc->context.ioMap,
+			X86_PORTS_BYTES);
+		cpus[cpu].ioMapProcess = proc;
+	}
+
+	cpus[cpu].tss.IOMapBase = X86_IOBITMAP_OFFSET;
+}
+
+
+__attribute__((noreturn))
+static void processStart(void)
+{
+	// A new process starts here, on the temporary start stack, the first time
+	// it's switched to.  The page directory has already been loaded, so
+	// set up the initial registers and jump to the entry point at the
+	// appropriate privilege level.
+
+	kernelProcess *proc = kernelCurrentProcess;
 
-	if (busy)
-		descriptor.attributes1 |= 0x2;
+	// New processes are started holding the kernel lock.  Kernel threads
+	// keep it, but user processes and idle threads run without it.
+	if ((proc->processorPrivilege != PRIVILEGE_SUPERVISOR) ||
+		(proc == cpus[proc->cpu].idleProc))
+	{
+		kernelSmpUnlock();
+	}
+
+	if (proc->processorPrivilege == PRIVILEGE_SUPERVISOR)
+	{
+		processorTaskStart(proc->context.ESP, proc->context.EIP, PRIV_CODE,
+			proc->context.EFLAGS, PRIV_DATA);
+	}
 	else
-		descriptor.attributes1 &= ~0x2;
-
-	// Re-set the descriptor in the GDT
-	status =  kernelDescriptorSetUnformatted(proc->context.tssSelector,
-		descriptor.segSizeByte1, descriptor.segSizeByte2,
-		descriptor.baseAddress1, descriptor.baseAddress2,
-		descriptor.baseAddress3, descriptor.attributes1,
-		descriptor.attributes2, descriptor.baseAddress4);
-	if (status < 0)
-		return (status);
-#else
-	if (proc && busy) { }
-#endif
+	{
+		processorTaskStartUser(superStackTop(proc), proc->context.EIP,
+			USER_CODE, proc->context.EFLAGS, proc->context.ESP, USER_STACK,
+			USER_DATA);
+	}
 
-	// Return success
-	return (status = 0);
+	while (1);
 }
+#endif
 
 
 static void contextSwitch(kernelProcess *nextProc)
 {
+	// Switch from the current process to the next one, on this CPU.
+	// Interrupts must be disabled, and the kernel lock held.  The current
+	// process is suspended right here, and the next one resumes from
+	// wherever it was suspended in this function, or is launched by
+	// processStart() if it's never run.
+
+	int cpu = kernelSmpCpuNumber();
+	kernelProcess *prevProc = kernelCurrentProcesses[cpu];
+#ifdef ARCH_X86
+	unsigned stackPointer = 0;
+#endif
+
 	// Check params
 	if (!nextProc)
 		return;
 
-	// Mark the next process as not busy
-	markProcessBusy(nextProc, 0);
-
 	// Export (to the rest of the multitasker) the pointer to the selected
 	// process
-	kernelCurrentProcess = nextProc;
+	kernelCurrentProcesses[cpu] = nextProc;
+	nextProc->cpu = cpu;
+
+	// The CPU keeps the kernel lock, but the depth belongs to the process
+	prevProc->lockDepth = kernelSmpGetLockDepth();
+	kernelSmpSetLockDepth(nextProc->lockDepth);
 
 #ifdef ARCH_X86
-	processorFarJump(nextProc->context.tssSelector);
+	// Remember where the previous process was, for stack traces.  A user
+	// process is suspended on its supervisor stack, which can't be traced
+	// from its user stack, so it keeps its starting values.
+	if (prevProc->processorPrivilege == PRIVILEGE_SUPERVISOR)
+	{
+		processorGetInstructionPointer(prevProc->context.EIP);
+		processorGetFramePointer(prevProc->context.EBP);
+	}
+
+	if (nextProc->processorPrivilege != PRIVILEGE_SUPERVISOR)
+	{
+		// Interrupts and API calls from user mode will use the process's
+		// supervisor stack
+		cpus[cpu].tss.ESP0 = superStackTop(nextProc);
+		if (fastApi)
+		{
+			processorWriteMsr(X86_MSR_SYSENTER_ESP, cpus[cpu].tss.ESP0,
+				0);
+		}
+		setIoMap(cpu, nextProc);
+	}
+
+	// Lazy FPU switching.  If the next process doesn't own the FPU state,
+	// its first FPU instruction will cause an EXCEPTION_DEVNOTAVAIL and
+	// fpuExceptionHandler() will swap the state.
+	if (nextProc == cpus[cpu].fpuProcess)
+		processorClearTaskSwitched();
+	else
+		processorSetTaskSwitched();
+
+	stackPointer = nextProc->context.stackPointer;
+	if (!stackPointer)
+	{
+		cpus[cpu].startStack[63] = (unsigned) &processStart;
+		stackPointer = (unsigned) &cpus[cpu].startStack[63];
+	}
+
+	processorContextSwitch(&prevProc->context.stackPointer, stackPointer,
+		nextProc->pageDirectory->physical);
 #endif
 }
 
@@ -1240,17 +1623,94 @@ static int schedulerShutdown(void)
 }
 
 
-static kernelProcess *chooseNextProcess(void)
+static void requeueYielded(int cpu)
+{
+	// A new time slice has started, so processes that yielded on this CPU
+	// during the previous one are no longer penalized.  Move them back to the
+	// ends of their normal ready queues.  Each of these processes cost a call
+	// to the scheduler when it yielded, so this is constant time per yield.
+
+	kernelProcess *proc = NULL;
+	int level;
+
+	for (level = 0; cpus[cpu].yieldBitmap && (level < PRIORITY_LEVELS);
+		level ++)
+	{
+		while ((proc = cpus[cpu].yieldQueue[level].first))
+		{
+			queueRemove(proc);
+			queueAppend(&cpus[cpu].readyQueue[level], proc);
+			cpus[cpu].readyBitmap |= (1 << level);
+		}
+
+		cpus[cpu].yieldBitmap &= ~(1 << level);
+	}
+}
+
+
+static void stealProcess(int cpu)
+{
+	// This CPU has nothing to do but background work.  Take the most
+	// urgent ready process from the CPU that has the most of them waiting.
+	// Processes whose state is still in their CPU's FPU are left alone.
+
+	kernelProcess *proc = NULL;
+	int busiestCpu = -1;
+	int busiest = 0;
+	int waiting = 0;
+	int count, level;
+
+	for (count = 0; count < MAX_CPUS; count ++)
+	{
+		if ((count == cpu) || !cpus[count].idleProc)
+			continue;
+
+		for (waiting = 0, level = 0; level < (PRIORITY_LEVELS - 1); level ++)
+			waiting += cpus[count].readyQueue[level].numProcesses;
+
+		if (waiting > busiest)
+		{
+			busiest = waiting;
+			busiestCpu = count;
+		}
+	}
+
+	if (busiestCpu < 0)
+		return;
+
+	for (level = 0; level < (PRIORITY_LEVELS - 1); level ++)
+	{
+		for (proc = cpus[busiestCpu].readyQueue[level].first; proc;
+			proc = proc->queueNext)
+		{
+			if (proc != cpus[busiestCpu].fpuProcess)
+			{
+				readyRemove(proc);
+				proc->cpu = cpu;
+				readyAdd(proc, 0 /* not yielded */, 1 /* keep age */);
+				return;
+			}
+		}
+	}
+}
+
+
+static kernelProcess *chooseNextProcess(int cpu)
 {
-	// Loops through the process list, and determines which process to run
-	// next
+	// Looks at the heads of this CPU's ready queues, and determines which
+	// process to run next
 
-	unsigned long long cpuTime = 0;
-	kernelProcess *miscProc = NULL;
+	kernelProcessQueue *readyQueue = cpus[cpu].readyQueue;
+	kernelProcessQueue *yieldQueue = cpus[cpu].yieldQueue;
+	unsigned readyBitmap = 0;
+	unsigned yieldBitmap = 0;
+	kernelProcess *proc = NULL;
 	kernelProcess *nextProc = NULL;
-	linkedListItem *iter = NULL;
+	unsigned waitTime = 0;
+	unsigned topWaitTime = 0;
 	unsigned processWeight = 0;
 	unsigned topProcessWeight = 0;
+	int level;
 
 	// Here is where we make decisions about which tasks to schedule, and
 	// when.  Below is a brief description of the scheduling algorithm.
@@ -1315,119 +1775,121 @@ static kernelProcess *chooseNextProcess(void)
 	// give higher-priority processes no advantage over lower-priority, and
 	// waiting time would determine execution order.
 	//
-	// A tie beteen the highest-weighted tasks is broken based on list order.
-	// The list is neither FIFO nor LIFO (it's unordered), but closer to LIFO.
+	// The waiting time of a process is the number of scheduling decisions
+	// that have been made since it became ready.  Each priority level has a
+	// FIFO queue of ready processes, so the process at the front of a queue
+	// is always the one that has been waiting the longest, and thus has the
+	// greatest weight at that level.  That means we only need to compare the
+	// heads of the non-empty queues, and the cost of choosing doesn't depend
+	// on the number of processes.  A tie between the highest-weighted tasks
+	// is broken in favour of the one that has been waiting longer, and then
+	// the higher priority.
+	//
+	// Processes which were waiting for I/O which has now arrived are queued
+	// at level 1 rather than their own level, and processes which have
+	// yielded during the current time slice are kept on separate queues and
+	// get a weight of zero, like background processes.
+	//
+	// Each CPU has its own set of queues.  A CPU with nothing but background
+	// work steals a process from the busiest one.
 
-	miscProc = linkedListIterStart(&processList, &iter);
+	// Wake up any waiting processes whose time has come
+	kernelTimerExpire();
 
-	while (miscProc)
-	{
-		if (miscProc->state == proc_waiting)
-		{
-			// This will change the state of a waiting process to "ready" if
-			// the specified "waiting reason" has come to pass
+	schedData.decisions += 1;
 
-			// Get the CPU time
-			if (miscProc->waitUntil && !cpuTime)
-				cpuTime = kernelCpuGetMs();
+	if (!(cpus[cpu].readyBitmap & ~(1 << (PRIORITY_LEVELS - 1))))
+		stealProcess(cpu);
 
-			// If the process is waiting for a specified time.  Has the
-			// requested time come?
-			if (miscProc->waitUntil && (miscProc->waitUntil < cpuTime))
-			{
-				// The process is ready to run
-				miscProc->state = proc_ready;
-			}
-			else
-			{
-				// The process must continue waiting
-				goto checkNext;
-			}
-		}
+	readyBitmap = cpus[cpu].readyBitmap;
+	yieldBitmap = cpus[cpu].yieldBitmap;
 
-		if ((miscProc->state != proc_ready) &&
-			(miscProc->state != proc_ioready))
-		{
-			// This process is not ready (might be stopped, sleeping, or
-			// zombie)
-			goto checkNext;
-		}
+	// Real-time processes get an infinite weight
+	if (readyBitmap & 1)
+		return (readyQueue[0].first);
 
-		// This process is ready to run.  Determine its weight.
+	for (level = 1; level < (PRIORITY_LEVELS - 1); level ++)
+	{
+		if (!(readyBitmap & (1 << level)))
+			continue;
 
-		if (!miscProc->priority)
-		{
-			// If the process is of the highest (real-time) priority, it
-			// should get an infinite weight
-			processWeight = 0xFFFFFFFF;
-		}
-		else if (miscProc->priority == (PRIORITY_LEVELS - 1))
-		{
-			// Else if the process is of the lowest priority, it should get a
-			// weight of zero
-			processWeight = 0;
-		}
-		else if (miscProc->state == proc_ioready)
-		{
-			// If this process was waiting for I/O which has now arrived, give
-			// it a high (1) temporary priority level
-			processWeight = (((PRIORITY_LEVELS - 1) * PRIORITY_RATIO) +
-				miscProc->waitTime);
-		}
-		else if (miscProc->switchedByCall && (miscProc->lastSlice ==
-			schedData.timeSlices))
-		{
-			// If this process has yielded this timeslice already, we should
-			// give it no weight this time so that a bunch of yielding
-			// processes don't gobble up all the CPU time.
-			processWeight = 0;
-		}
-		else
+		proc = readyQueue[level].first;
+		waitTime = (schedData.decisions - proc->readySince);
+		processWeight = (((PRIORITY_LEVELS - level) * PRIORITY_RATIO) +
+			waitTime);
+
+		// Did this process win?
+		if (!nextProc || (processWeight > topProcessWeight) ||
+			((processWeight == topProcessWeight) && (waitTime > topWaitTime)))
 		{
-			// Otherwise, calculate the weight of this task, using the
-			// algorithm described above
-			processWeight = (((PRIORITY_LEVELS - miscProc->priority) *
-				PRIORITY_RATIO) + miscProc->waitTime);
+			topProcessWeight = processWeight;
+			topWaitTime = waitTime;
+			nextProc = proc;
 		}
+	}
 
-		// Did this process win?
+	if (nextProc)
+		return (nextProc);
 
-		if (processWeight < topProcessWeight)
+	// Nothing with any weight is ready.  Choose whichever of the background
+	// processes and processes that yielded this time slice has been waiting
+	// the longest.
+
+	if (readyBitmap & (1 << (PRIORITY_LEVELS - 1)))
+	{
+		nextProc = readyQueue[PRIORITY_LEVELS - 1].first;
+		topWaitTime = (schedData.decisions - nextProc->readySince);
+	}
+
+	for (level = 1; yieldBitmap && (level < (PRIORITY_LEVELS - 1)); level ++)
+	{
+		if (!(yieldBitmap & (1 << level)))
+			continue;
+
+		proc = yieldQueue[level].first;
+		waitTime = (schedData.decisions - proc->readySince);
+
+		if (!nextProc || (waitTime > topWaitTime))
 		{
-			// No.  Increase the waiting time of this process, since it's not
-			// the one we're selecting.
-			miscProc->waitTime += 1;
+			topWaitTime = waitTime;
+			nextProc = proc;
 		}
-		else
-		{
-			if (nextProc)
-			{
-				if ((processWeight == topProcessWeight) &&
-					(nextProc->waitTime >= miscProc->waitTime))
-				{
-					// If the process's weight is tied with that of the
-					// previously winning process, it will NOT win if the
-					// other process has been waiting as long or longer
-					miscProc->waitTime += 1;
-					goto checkNext;
-				}
-				else
-				{
-					// We have a new winning process.  Increase the waiting
-					// time of the previous winner this one is replacing.
-					nextProc->waitTime += 1;
-				}
-			}
+	}
 
-			topProcessWeight = processWeight;
-			nextProc = miscProc;
-		}
+	return (nextProc);
+}
 
-	checkNext:
-		miscProc = linkedListIterNext(&processList, &iter);
+
+static unsigned idleSliceLength(int cpu)
+{
+	// When a CPU has nothing to do but idle, there's no point interrupting it
+	// every time slice.  Instead it wakes up in time for the next kernel
+	// timer deadline, if there is one.  Otherwise the boot CPU wakes up after
+	// the longest time the system timer can count, to keep the system time,
+	// and the others sleep until another CPU gives them some work.  Returns
+	// the length in system timer ticks, or zero for no limit.
+
+	uquad_t deadline = 0;
+	uquad_t now = 0;
+	uquad_t ticks = 0;
+
+	if (!cpu)
+		ticks = SYSTIMER_FULLCOUNT;
+
+	deadline = kernelTimerNextDeadline();
+	if (deadline)
+	{
+		// Deadlines expire once the millisecond count is past them
+		now = kernelCpuGetMs();
+		if (deadline < now)
+			deadline = now;
+
+		deadline = ((((deadline - now) + 1) * SYSTIMER_FREQ_HZ) / 1000);
+		if (!ticks || (deadline < ticks))
+			ticks = deadline;
 	}
 
-	return (nextProc);
+	return ((unsigned) ticks);
 }
 
 
@@ -1451,14 +1913,18 @@ static void scheduler(void)
 
 	unsigned timeUsed = 0;
 	unsigned sliceCount = 0;
-	kernelProcess *listProc = NULL;
-	linkedListItem *iter = NULL;
 	kernelProcess *nextProc = NULL;
+	int cpu = 0;
 
 	// Were we invoked by an interrupt, or a call?
 	if (kernelCurrentProcess->switchedByCall)
 		processorSuspendInts(interrupts);
 
+	// Give any other CPUs that are waiting for the kernel lock a turn
+	kernelSmpLockBreak();
+
+	cpu = kernelSmpCpuNumber();
+
 	if (schedData.stop)
 	{
 		// If we get here, then the scheduler is supposed to shut down
@@ -1469,83 +1935,93 @@ static void scheduler(void)
 	// Calculate how many timer ticks were used in the previous time slice.
 	// This will be different depending on whether the previous timeslice
 	// actually expired, or whether we were called for some other reason (for
-	// example a yield()).
+	// example a yield()).  The boot CPU's slices are timed by the system
+	// timer, and the others' by their local APIC timers.
 
 	if (!kernelCurrentProcess->switchedByCall)
-		timeUsed = TIME_SLICE_LENGTH;
+	{
+		timeUsed = cpus[cpu].sliceLength;
+	}
+	else if (!cpu)
+	{
+		timeUsed = kernelSysTimerReadValue(0);
+		if (timeUsed <= cpus[cpu].sliceLength)
+			timeUsed = (cpus[cpu].sliceLength - timeUsed);
+		else
+			timeUsed = cpus[cpu].sliceLength;
+	}
 	else
-		timeUsed = (TIME_SLICE_LENGTH - kernelSysTimerReadValue(0));
-
-	// Count the time used for legacy system timer purposes
-	schedData.systemTime += timeUsed;
-
-	// Have we had the equivalent of a full timer revolution?  If so, we need
-	// to call the standard timer interrupt handler.
-	if (schedData.systemTime >= SYSTIMER_FULLCOUNT)
 	{
-		// Reset to zero
-		schedData.systemTime = 0;
-
-		// Artifically register a system timer tick
-		kernelSysTimerTick();
+		timeUsed = kernelSmpTimerUsed();
 	}
 
-	// Count the time used for the purpose of tracking CPU usage
-	schedData.schedulerTime += timeUsed;
-	sliceCount = (schedData.schedulerTime / TIME_SLICE_LENGTH);
-	if (sliceCount > schedData.sliceCount)
+	// The boot CPU keeps the system time, and counts the time slices
+	if (!cpu)
 	{
-		// Increment the count of time slices.  This can just keep going up
-		// until it wraps, which is no problem.
-		schedData.timeSlices += 1;
-		schedData.sliceCount = sliceCount;
+		// Count the time used for legacy system timer purposes
+		schedData.systemTime += timeUsed;
+
+		// Have we had the equivalent of a full timer revolution?  If so, we
+		// need to call the standard timer interrupt handler.  An idle slice
+		// can be a full revolution by itself, so keep the remainder.
+		while (schedData.systemTime >= SYSTIMER_FULLCOUNT)
+		{
+			schedData.systemTime -= SYSTIMER_FULLCOUNT;
+
+			// Artifically register a system timer tick
+			kernelSysTimerTick();
+		}
+
+		// Count the time used for the purpose of tracking CPU usage
+		schedData.schedulerTime += timeUsed;
+		sliceCount = (schedData.schedulerTime / schedData.sliceLength);
+		if (sliceCount > schedData.sliceCount)
+		{
+			// Increment the count of time slices.  This can just keep going
+			// up until it wraps, which is no problem.
+			schedData.timeSlices += 1;
+			schedData.sliceCount = sliceCount;
+		}
 	}
 
-	if (kernelCurrentProcess->state == proc_running)
+	if (cpus[cpu].timeSlices != schedData.timeSlices)
 	{
-		// Change the state of the previous process to ready, since it was
-		// interrupted while still on the CPU
-		kernelCurrentProcess->state = proc_ready;
+		// Processes that yielded in the previous time slice are no longer
+		// penalized
+		cpus[cpu].timeSlices = schedData.timeSlices;
+		requeueYielded(cpu);
 	}
 
 	// Add the last timeslice to the process's CPU time
+	updateCpuPercent(kernelCurrentProcess);
 	kernelCurrentProcess->cpuTime += timeUsed;
 
 	// Record the current timeslice number, so we can remember when this
-	// process was last active (see chooseNextProcess())
+	// process was last active
 	kernelCurrentProcess->lastSlice = schedData.timeSlices;
 
-	// Every CPU_PERCENT_TIMESLICES timeslices we will update the %CPU value
-	// for each process currently in the list
-	if (sliceCount >= CPU_PERCENT_TIMESLICES)
+	if (kernelCurrentProcess->state == proc_running)
 	{
-		// Calculate the CPU percentage
-
-		listProc = linkedListIterStart(&processList, &iter);
-
-		while (listProc)
-		{
-			if (!schedData.schedulerTime)
-			{
-				listProc->cpuPercent = 0;
-			}
-			else
-			{
-				listProc->cpuPercent = ((listProc->cpuTime * 100) /
-					schedData.schedulerTime);
-			}
-
-			// Reset the process's cpuTime counter
-			listProc->cpuTime = 0;
+		// Change the state of the previous process to ready, since it was
+		// interrupted while still on the CPU (or it yielded)
+		kernelCurrentProcess->state = proc_ready;
+		readyAdd(kernelCurrentProcess,
+			kernelCurrentProcess->switchedByCall, 0 /* new age */);
+	}
 
-			listProc = linkedListIterNext(&processList, &iter);
-		}
+	// Every cpuPercentSlices timeslices we start a new period for
+	// calculating the %CPU value of each process.  The values themselves are
+	// calculated lazily by updateCpuPercent().
+	if (!cpu && (sliceCount >= schedData.cpuPercentSlices))
+	{
+		schedData.cpuPeriodTime = schedData.schedulerTime;
+		schedData.cpuPeriod += 1;
 
 		// Reset the schedulerTime and slice counters
 		schedData.schedulerTime = schedData.sliceCount = 0;
 	}
 
-	if (exception.number)
+	if (exception.number && (exception.cpu == cpu))
 	{
 		// If we were processing an exception (either the exception thread or
 		// another exception handler), keep it active
@@ -1555,7 +2031,7 @@ static void scheduler(void)
 	else
 	{
 		// Choose the next process to run
-		nextProc = chooseNextProcess();
+		nextProc = chooseNextProcess(cpu);
 	}
 
 	// We should now have selected a process to run.  If not, we should
@@ -1564,23 +2040,38 @@ static void scheduler(void)
 	if (!nextProc)
 		nextProc = kernelCurrentProcess;
 
-	// Update some info about the next process
-	nextProc->waitTime = 0;
-	nextProc->state = proc_running;
+	// Update some info about the next process.  This takes it off of its
+	// ready queue.
+	setProcessState(nextProc, proc_running);
+
+	// A normal time slice ends in time for other processes to get a turn.
+	// If we're going idle, wait for the next thing that needs doing instead.
+	if (nextProc == cpus[cpu].idleProc)
+		cpus[cpu].sliceLength = idleSliceLength(cpu);
+	else
+		cpus[cpu].sliceLength = schedData.sliceLength;
 
-	// Set up a new time slice - PIT single countdown
-	while (kernelSysTimerSetupTimer(0 /* timer */, 0 /* mode */,
-		TIME_SLICE_LENGTH) < 0)
+	if (!cpu)
 	{
-		kernelError(kernel_warn, "The scheduler was unable to control the "
-			"system timer");
-	}
+		// Set up a new time slice - PIT single countdown
+		while (kernelSysTimerSetupTimer(0 /* timer */, 0 /* mode */,
+			cpus[cpu].sliceLength) < 0)
+		{
+			kernelError(kernel_warn, "The scheduler was unable to control "
+				"the system timer");
+		}
 
-	// Acknowledge the timer interrupt if one occurred
-	if (kernelProcessingInterrupt())
+		// Acknowledge the timer interrupt if one occurred
+		if (kernelProcessingInterrupt())
+		{
+			kernelPicEndOfInterrupt(INTERRUPT_NUM_SYSTIMER);
+			kernelInterruptClearCurrent();
+		}
+	}
+	else
 	{
-		kernelPicEndOfInterrupt(INTERRUPT_NUM_SYSTIMER);
-		kernelInterruptClearCurrent();
+		// Set up a new time slice - local APIC timer single countdown
+		kernelSmpTimerStart(cpus[cpu].sliceLength);
 	}
 
 	// Do the actual context switch
@@ -1588,7 +2079,8 @@ static void scheduler(void)
 		contextSwitch(nextProc);
 
 	// Consider kernelCurrentProcess and any values on the stack to be from
-	// the new process (and previous switch) from this point onward
+	// the new process (and previous switch) from this point onward.  That
+	// includes the CPU number, since it might have resumed on another one.
 
 out:
 	if (kernelCurrentProcess->switchedByCall)
@@ -1606,12 +2098,30 @@ static void schedulerInterrupt(void)
 	// This will be changed by a context switch, thus 'volatile'
 	volatile void *address = NULL;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 	kernelInterruptSetCurrent(INTERRUPT_NUM_SYSTIMER);
 
 	scheduler();
 
-	processorIsrExit(address);
+	kernelInterruptExit(address);
+}
+
+
+static void cpuTimerInterrupt(void)
+{
+	// This is the local APIC timer interrupt handler that invokes the
+	// scheduler on the application processors.  The timer is one-shot, and
+	// the scheduler starts it again, so it can be acknowledged right away.
+
+	// This will be changed by a context switch, thus 'volatile'
+	volatile void *address = NULL;
+
+	kernelInterruptEnter(address);
+
+	kernelApicEndOfInterrupt();
+	scheduler();
+
+	kernelInterruptExit(address);
 }
 
 
@@ -1625,6 +2135,9 @@ static int schedulerInitialize(void)
 
 	int status = 0;
 	int interrupts = 0;
+#ifdef ARCH_X86
+	x86CpuFeatures cpuFeatures;
+#endif
 
 	kernelDebug(debug_multitasker, "Multitasker initialize scheduler");
 
@@ -1644,20 +2157,34 @@ static int schedulerInitialize(void)
 		return (status);
 	}
 
-	// Before we load the kernel's selector into the task reg, mark it as not
-	// busy, since one cannot load the task register with a busy TSS selector
-	markProcessBusy(kernelProc, 0);
-
 #ifdef ARCH_X86
-	// Make the kernel's Task State Segment be the current one
-	processorLoadTaskReg(kernelProc->context.tssSelector);
+	// If the processor supports SYSENTER/SYSEXIT, user processes can use
+	// them to make API calls instead of the call gate
+	memset(&cpuFeatures, 0, sizeof(x86CpuFeatures));
+	kernelCpuGetFeatures(&cpuFeatures, sizeof(x86CpuFeatures));
+	if (cpuFeatures.cpuid1 && X86_CPUID1_SEP(cpuFeatures.cpuid1Eax,
+		cpuFeatures.cpuid1Edx))
+	{
+		fastApi = 1;
+		kernelLog("Fast API calls enabled");
+	}
 #endif
 
+	// Set up the boot CPU
+	status = kernelMultitaskerCpuInitialize(0);
+	if (status < 0)
+	{
+		processorRestoreInts(interrupts);
+		return (status);
+	}
+
 	// Make note that the multitasker has been enabled
 	multitaskingEnabled = 1;
 
 	// Set up the initial timer countdown
-	kernelSysTimerSetupTimer(0 /* timer */, 0 /* mode */, TIME_SLICE_LENGTH);
+	cpus[0].sliceLength = schedData.sliceLength;
+	kernelSysTimerSetupTimer(0 /* timer */, 0 /* mode */,
+		cpus[0].sliceLength);
 
 	processorRestoreInts(interrupts);
 
@@ -1711,11 +2238,6 @@ static int createKernelProcess(void *kernelStack, unsigned kernelStackSize)
 	if (!kernelProc)
 		return (status = ERR_NOSUCHPROCESS);
 
-#ifdef ARCH_X86
-	// Interrupts are initially disabled for the kernel
-	kernelProc->context.taskStateSegment.EFLAGS = 0x00000002;
-#endif
-
 	// Deallocate the stack that was allocated, since the kernel already has
 	// one set up by the OS loader
 	kernelMemoryRelease(kernelProc->userStack);
@@ -1728,7 +2250,7 @@ static int createKernelProcess(void *kernelStack, unsigned kernelStackSize)
 	kernelProc->textOutputStream = kernelTextGetConsoleOutput();
 
 	// Make the kernel process runnable
-	kernelProc->state = proc_ready;
+	setProcessState(kernelProc, proc_ready);
 
 	// Return success
 	return (status = 0);
@@ -1809,12 +2331,15 @@ static void kernelProcess2Process(kernelProcess *kernProc, process *userProc)
 	userProc->privilege = kernProc->privilege;
 	userProc->parentProcessId = kernProc->parentProcessId;
 	userProc->descendentThreads = kernProc->descendentThreads;
+	updateCpuPercent(kernProc);
 	userProc->cpuPercent = kernProc->cpuPercent;
+	userProc->cpu = kernProc->cpu;
 	userProc->state = kernProc->state;
 }
 
 
-static int fpuExceptionHandler(void)
+static int fpuExceptionHandler(kernelProcess *proc __attribute__((unused)),
+	unsigned faultAddress __attribute__((unused)))
 {
 	// This function gets called when a EXCEPTION_DEVNOTAVAIL (7) exception
 	// occurs.  It can happen under two circumstances:
@@ -1827,13 +2352,15 @@ static int fpuExceptionHandler(void)
 
 #ifdef ARCH_X86
 
+	int cpu = kernelSmpCpuNumber();
 	unsigned short fpuReg = 0;
 
 	//kernelDebug(debug_multitasker, "Multitasker FPU exception start");
 
 	processorClearTaskSwitched();
 
-	if (fpuProcess && (fpuProcess == kernelCurrentProcess))
+	if (cpus[cpu].fpuProcess &&
+		(cpus[cpu].fpuProcess == kernelCurrentProcess))
 	{
 		// This was the last process to use the FPU.  The state should be the
 		// same as it was, so there's nothing to do.
@@ -1850,16 +2377,16 @@ static int fpuExceptionHandler(void)
 	}
 
 	// Save the FPU state for the previous process
-	if (fpuProcess)
+	if (cpus[cpu].fpuProcess)
 	{
 		// Save FPU state
 		//kernelDebug(debug_multitasker, "Multitasker switch FPU ownership "
-		//	"from %s to %s", fpuProcess->name,
+		//	"from %s to %s", cpus[cpu].fpuProcess->name,
 		//	kernelCurrentProcess->name);
 		//kernelDebug(debug_multitasker, "Multitasker save FPU state for %s",
-		//	fpuProcess->name);
-		processorFpuStateSave(fpuProcess->context.fpuState[0]);
-		fpuProcess->context.fpuStateSaved = 1;
+		//	cpus[cpu].fpuProcess->name);
+		processorFpuStateSave(cpus[cpu].fpuProcess->context.fpuState[0]);
+		cpus[cpu].fpuProcess->context.fpuStateSaved = 1;
 	}
 
 	if (kernelCurrentProcess->context.fpuStateSaved)
@@ -1885,7 +2412,7 @@ static int fpuExceptionHandler(void)
 
 	processorFpuClearEx();
 
-	fpuProcess = kernelCurrentProcess;
+	cpus[cpu].fpuProcess = kernelCurrentProcess;
 
 #endif
 
@@ -1894,6 +2421,25 @@ static int fpuExceptionHandler(void)
 }
 
 
+static int pageFaultHandler(kernelProcess *proc, unsigned faultAddress)
+{
+	// This function gets called when a EXCEPTION_PAGE (14) exception occurs.
+	// If the faulting address is in a lazily-backed memory region of the
+	// process, the memory manager commits a page of memory there, and the
+	// process can carry on.  Otherwise it's a real fault.  This can sleep,
+	// waiting for the memory manager's lock.
+
+	int status = 0;
+
+	if (!multitaskingEnabled || !proc)
+		return (status = ERR_NOTINITIALIZED);
+
+	status = kernelMemoryCommit(proc->processId, (void *) faultAddress);
+
+	return (status);
+}
+
+
 static int propagateEnvironmentRecursive(kernelProcess *parentProc,
 	variableList *srcEnv, const char *variable)
 {
@@ -1975,8 +2521,13 @@ int kernelMultitaskerInitialize(void *kernelStack, unsigned kernelStackSize)
 	if (multitaskingEnabled)
 		return (status = ERR_ALREADY);
 
-	// Initialize the process list
+	// Initialize the process list and the scheduler's queues
 	memset(&processList, 0, sizeof(linkedList));
+	memset((void *) cpus, 0, sizeof(cpus));
+
+	// The default time slice length, unless the kernel configuration changes
+	// it later
+	kernelMultitaskerSetTimeSlices(TIME_SLICES_PER_SEC);
 
 	// Initialize floating point handling
 	floatingPointInitialize();
@@ -1986,8 +2537,10 @@ int kernelMultitaskerInitialize(void *kernelStack, unsigned kernelStackSize)
 	if (status < 0)
 		return (status);
 
-	// Set the current process to initially be the kernel process
-	kernelCurrentProcess = kernelProc;
+	// Set the current process to initially be the kernel process.  It holds
+	// the kernel lock from boot.
+	kernelCurrentProcesses[0] = kernelProc;
+	kernelProc->lockDepth = 1;
 
 	// Now start the scheduler
 	status = schedulerInitialize();
@@ -2003,12 +2556,15 @@ int kernelMultitaskerInitialize(void *kernelStack, unsigned kernelStackSize)
 		return (status);
 
 	// Create an "idle" thread to consume all unused cycles
-	status = spawnIdleThread();
+	status = spawnIdleThread(0);
 	if (status < 0)
 		return (status);
 
+	setProcessState(cpus[0].idleProc, proc_ready);
+
 	// Set up any specific exception handlers
 	exceptionVector[EXCEPTION_DEVNOTAVAIL].handler = fpuExceptionHandler;
+	exceptionVector[EXCEPTION_PAGE].handler = pageFaultHandler;
 
 	// Start the exception handler thread
 	status = spawnExceptionThread();
@@ -2062,8 +2618,181 @@ int kernelMultitaskerShutdown(int nice)
 }
 
 
-void kernelException(int num, unsigned address)
+int kernelMultitaskerCpuInitialize(int cpu)
+{
+	// Set up the multitasker's per-CPU processor state for a CPU.  This is
+	// called on the CPU itself: by the scheduler initialization for the boot
+	// CPU, and by the SMP code for the others.  Returns 0 on success,
+	// negative otherwise.
+
+	int status = 0;
+
+	if ((cpu < 0) || (cpu >= MAX_CPUS))
+		return (status = ERR_RANGE);
+
+#ifdef ARCH_X86
+	// Set up the TSS.  The processor uses it for the supervisor stack and
+	// I/O permissions of user processes.
+	memset((void *) &cpus[cpu].tss, 0, sizeof(x86TSS));
+	cpus[cpu].tss.SS0 = PRIV_STACK;
+	cpus[cpu].tss.IOMapBase = X86_IOBITMAP_NONE;
+
+	status = kernelDescriptorSet(
+		CPU_TSS_SELECTOR(cpu),			// TSS selector number
+		&cpus[cpu].tss,					// Starts at...
+		sizeof(x86TSS),					// Limit of a TSS segment
+		1,								// Present in memory
+		PRIVILEGE_SUPERVISOR,			// TSSes are supervisor priv level
+		0,								// TSSes are system segs
+		0x9,							// TSS, 32-bit, non-busy
+		0,								// 0 for SMALL size granularity
+		0);								// Must be 0 in TSS
+	if (status < 0)
+		return (status);
+
+	// Make it the current one.  This also tells us which CPU we are.
+	processorLoadTaskReg(CPU_TSS_SELECTOR(cpu));
+
+	if (fastApi)
+	{
+		processorWriteMsr(X86_MSR_SYSENTER_CS, SYSENTER_CODE, 0);
+		processorWriteMsr(X86_MSR_SYSENTER_EIP, (unsigned) &kernelApiFast,
+			0);
+		processorWriteMsr(X86_MSR_SYSENTER_ESP, 0, 0);
+	}
+#endif
+
+	return (status = 0);
+}
+
+
+int kernelMultitaskerCpuStart(int cpu)
+{
+	// Called by an application processor, holding the kernel lock, once it's
+	// ready to run processes.  Creates its idle thread and starts running
+	// it.  Doesn't return unless there's an error.
+
+	int status = 0;
+	kernelProcess *proc = NULL;
+
+	if (!multitaskingEnabled)
+		return (status = ERR_NOTINITIALIZED);
+
+	if ((cpu < 1) || (cpu >= MAX_CPUS))
+		return (status = ERR_RANGE);
+
+	floatingPointInitialize();
+
+#ifdef ARCH_X86
+	// The local APIC timer interrupt drives the scheduler on this CPU
+	status = kernelDescriptorSetIDTInterruptGate(SMP_VECTOR_TIMER,
+		&cpuTimerInterrupt);
+	if (status < 0)
+		return (status);
+#endif
+
+	// The idle thread is spawned on behalf of the kernel process
+	kernelCurrentProcesses[cpu] = kernelProc;
+
+	status = spawnIdleThread(cpu);
+	if (status < 0)
+	{
+		kernelCurrentProcesses[cpu] = NULL;
+		return (status);
+	}
+
+	proc = cpus[cpu].idleProc;
+	setProcessState(proc, proc_running);
+	kernelCurrentProcesses[cpu] = proc;
+
+#ifdef ARCH_X86
+	processorSetTaskSwitched();
+#endif
+
+	// Start the first (idle) time slice, and launch the idle thread.  It
+	// releases the kernel lock.
+	cpus[cpu].sliceLength = idleSliceLength(cpu);
+	kernelSmpTimerStart(cpus[cpu].sliceLength);
+#ifdef ARCH_X86
+	processStart();
+#endif
+
+	return (status = 0);
+}
+
+
+int kernelMultitaskerSetTimeSlices(int slicesPerSec)
+{
+	// Set the number of time slices per second.  More, shorter slices make
+	// the system more responsive when there are lots of runnable processes,
+	// at the cost of more scheduler interrupts.  Idle CPUs aren't affected.
+
+	int status = 0;
+	int interrupts = 0;
+
+	if ((slicesPerSec < TIME_SLICES_MIN_PER_SEC) ||
+		(slicesPerSec > TIME_SLICES_MAX_PER_SEC))
+	{
+		kernelError(kernel_error, "Time slices per second must be between "
+			"%d and %d", TIME_SLICES_MIN_PER_SEC, TIME_SLICES_MAX_PER_SEC);
+		return (status = ERR_RANGE);
+	}
+
+	processorSuspendInts(interrupts);
+
+	schedData.sliceLength = (SYSTIMER_FREQ_HZ / slicesPerSec);
+	schedData.cpuPercentSlices = (slicesPerSec / 2);
+
+	// Start counting slices afresh
+	schedData.schedulerTime = schedData.sliceCount = 0;
+
+	processorRestoreInts(interrupts);
+
+	return (status = 0);
+}
+
+
+void kernelException(int num, unsigned address, unsigned faultAddress)
 {
+	// Exceptions are a way into the kernel, like interrupts and API calls
+
+	kernelProcess *proc = NULL;
+	int status = 0;
+
+	kernelSmpLock();
+
+	proc = kernelCurrentProcess;
+
+	// If the process faulted inside an exception handler, then it's a
+	// double-fault and we are totally finished
+	if (proc && proc->inExceptionHandler)
+	{
+		kernelPanic("Double-fault (%s) in an exception handler",
+			exceptionVector[num].name);
+	}
+
+	// If there's a handler for this exception type, call it.  Handlers get
+	// the details as arguments, rather than in the exception data, because
+	// they can sleep (the page fault handler can wait for a lock), and while
+	// one does, other processes can take exceptions too.
+	if (exceptionVector[num].handler && proc)
+	{
+		proc->inExceptionHandler = 1;
+		status = exceptionVector[num].handler(proc, faultAddress);
+		proc->inExceptionHandler = 0;
+
+		if (status >= 0)
+		{
+			// The exception was handled.  Return to the caller.
+			kernelSmpUnlock();
+			return;
+		}
+	}
+
+	// If another CPU is processing one, wait for it to finish
+	while (exception.number && (exception.cpu != kernelSmpCpuNumber()))
+		kernelMultitaskerYield();
+
 	// If we are already processing one, then it's a double-fault and we are
 	// totally finished
 	if (exception.number)
@@ -2074,17 +2803,10 @@ void kernelException(int num, unsigned address)
 	}
 
 	exception.number = num;
-	exception.process = kernelCurrentProcess;
+	exception.process = proc;
 	exception.address = address;
-
-	// If there's a handler for this exception type, call it
-	if (exceptionVector[exception.number].handler &&
-		(exceptionVector[exception.number].handler() >= 0))
-	{
-		// The exception was handled.  Return to the caller.
-		memset((void *) &exception, 0, sizeof(exception));
-		return;
-	}
+	exception.faultAddress = faultAddress;
+	exception.cpu = kernelSmpCpuNumber();
 
 	// If multitasking is enabled, switch to the exception handler thread.
 	// Otherwise, just call the exception handler as a function.
@@ -2094,6 +2816,7 @@ void kernelException(int num, unsigned address)
 		exceptionHandler();
 
 	// If the exception is handled, then we return
+	kernelSmpUnlock();
 }
 
 
@@ -2122,6 +2845,8 @@ void kernelMultitaskerDumpProcessList(void)
 
 		while (proc)
 		{
+			updateCpuPercent(proc);
+
 			sprintf(buffer, "\"%s\"  PID=%d UID=%s priority=%d priv=%d "
 				"parent=%d\n        %d%% CPU State=",
 				(char *) proc->name, proc->processId, (proc->session?
@@ -2319,7 +3044,7 @@ int kernelMultitaskerSpawn(void *startAddress, const char *name, int argc,
 	// additional bytes from the stack pointer to account for the space where
 	// the return address would normally go
 #ifdef ARCH_X86
-	proc->context.taskStateSegment.ESP -= sizeof(void *);
+	proc->context.ESP -= sizeof(void *);
 #endif
 
 	// Share the environment of the parent
@@ -2352,7 +3077,7 @@ int kernelMultitaskerSpawn(void *startAddress, const char *name, int argc,
 	if (run)
 	{
 		// Make the new thread runnable
-		proc->state = proc_ready;
+		setProcessState(proc, proc_ready);
 	}
 
 	// Return the new process's Id.
@@ -2370,6 +3095,7 @@ int kernelMultitaskerSpawnKernelThread(void *startAddress, const char *name,
 
 	int status = 0;
 	int interrupts = 0;
+	int cpu = 0;
 	kernelProcess *proc;
 
 	// Make sure multitasking has been enabled
@@ -2383,13 +3109,14 @@ int kernelMultitaskerSpawnKernelThread(void *startAddress, const char *name,
 	processorSuspendInts(interrupts);
 
 	// Change the current process to the kernel process
-	kernelCurrentProcess = kernelProc;
+	cpu = kernelSmpCpuNumber();
+	kernelCurrentProcesses[cpu] = kernelProc;
 
 	// Spawn
 	status = kernelMultitaskerSpawn(startAddress, name, argc, argv, run);
 
 	// Reset the current process
-	kernelCurrentProcess = proc;
+	kernelCurrentProcesses[cpu] = proc;
 
 	// Re-enable interrupts
 	processorRestoreInts(interrupts);
@@ -2676,7 +3403,7 @@ int kernelMultitaskerSetProcessState(int processId, processState newState)
 	}
 
 	// Set the state value of the process
-	proc->state = newState;
+	setProcessState(proc, newState);
 
 	return (status);
 }
@@ -2792,6 +3519,10 @@ int kernelMultitaskerSetProcessPriority(int processId, int newPriority)
 	// Set the priority value of the process
 	proc->priority = newPriority;
 
+	// If the process is waiting to run, move it to the right ready queue
+	if ((proc->state == proc_ready) || (proc->state == proc_ioready))
+		setProcessState(proc, proc->state);
+
 	return (status = 0);
 }
 
@@ -3191,6 +3922,7 @@ int kernelMultitaskerGetProcessorTime(clock_t *clk)
 		return (status = ERR_NULLPARAMETER);
 
 	// Return the processor time of the current process
+	updateCpuPercent(kernelCurrentProcess);
 	*clk = kernelCurrentProcess->cpuTime;
 
 	return (status = 0);
@@ -3253,7 +3985,7 @@ void kernelMultitaskerWait(unsigned milliseconds)
 	kernelCurrentProcess->waitForProcess = 0;
 
 	// Set the current process to "waiting"
-	kernelCurrentProcess->state = proc_waiting;
+	setProcessState(kernelCurrentProcess, proc_waiting);
 
 	// And yield
 	kernelMultitaskerYield();
@@ -3306,7 +4038,7 @@ int kernelMultitaskerBlock(int processId)
 	kernelCurrentProcess->waitUntil = 0;
 
 	// Set the current process to "waiting"
-	kernelCurrentProcess->state = proc_waiting;
+	setProcessState(kernelCurrentProcess, proc_waiting);
 
 	// And yield
 	kernelMultitaskerYield();
@@ -3316,6 +4048,119 @@ int kernelMultitaskerBlock(int processId)
 }
 
 
+int kernelMultitaskerWaitQueueSleep(kernelWaitQueue *queue,
+	unsigned milliseconds)
+{
+	// Put the current process to sleep at the back of the wait queue, until
+	// it's woken by one of the wake functions below, or until the number of
+	// milliseconds (if non-zero) has passed.  The caller can suspend
+	// interrupts before checking whatever condition it's waiting for, and
+	// keep them suspended until this returns, so that a wakeup can't be
+	// missed in between.  Returns ERR_TIMEOUT if the time ran out first.
+
+	int status = 0;
+	int interrupts = 0;
+
+	// Make sure multitasking has been enabled
+	if (!multitaskingEnabled)
+		return (status = ERR_NOTINITIALIZED);
+
+	// Check params
+	if (!queue)
+		return (status = ERR_NULLPARAMETER);
+
+	// Don't do this inside an interrupt
+	if (kernelProcessingInterrupt())
+	{
+		kernelPanic("Cannot sleep inside an interrupt handler (%d)",
+			kernelInterruptGetCurrent());
+	}
+
+	processorSuspendInts(interrupts);
+
+	if (milliseconds)
+		kernelCurrentProcess->waitUntil = (kernelCpuGetMs() + milliseconds);
+	else
+		kernelCurrentProcess->waitUntil = 0;
+
+	kernelCurrentProcess->waitForProcess = 0;
+	kernelCurrentProcess->waitWoken = 0;
+
+	// Set the current process to "waiting", and put it on the queue.  Any
+	// later change of state takes it off again.
+	setProcessState(kernelCurrentProcess, proc_waiting);
+	queueAppend(queue, kernelCurrentProcess);
+
+	// And yield
+	kernelMultitaskerYield();
+
+	processorRestoreInts(interrupts);
+
+	if (!kernelCurrentProcess->waitWoken)
+		return (status = ERR_TIMEOUT);
+
+	return (status = 0);
+}
+
+
+int kernelMultitaskerWaitQueueWakeOne(kernelWaitQueue *queue)
+{
+	// Wake up the process at the front of the wait queue, if any, and return
+	// its process ID (or 0 if the queue was empty).  This can be called from
+	// interrupt handlers.
+
+	int processId = 0;
+	int interrupts = 0;
+	kernelProcess *proc = NULL;
+
+	// Check params
+	if (!queue)
+		return (processId = ERR_NULLPARAMETER);
+
+	processorSuspendInts(interrupts);
+
+	proc = queue->first;
+	if (proc)
+	{
+		processId = proc->processId;
+		proc->waitWoken = 1;
+		setProcessState(proc, proc_ready);
+	}
+
+	processorRestoreInts(interrupts);
+
+	return (processId);
+}
+
+
+int kernelMultitaskerWaitQueueWakeAll(kernelWaitQueue *queue)
+{
+	// Wake up all of the processes on the wait queue, and return the number
+	// of them.  This can be called from interrupt handlers.
+
+	int woken = 0;
+	int interrupts = 0;
+	kernelProcess *proc = NULL;
+
+	// Check params
+	if (!queue)
+		return (woken = ERR_NULLPARAMETER);
+
+	processorSuspendInts(interrupts);
+
+	while ((proc = queue->first))
+	{
+		proc->waitWoken = 1;
+		setProcessState(proc, proc_ready);
+		woken += 1;
+	}
+
+	processorRestoreInts(interrupts);
+
+	return (woken);
+}
+
+
 int kernelMultitaskerDetach(void)
 {
 	// This will allow a program or daemon to detach from its parent process
@@ -3352,7 +4197,7 @@ int kernelMultitaskerDetach(void)
 		parentProc->waitForProcess = 0;
 
 		// Make it runnable
-		parentProc->state = proc_ready;
+		setProcessState(parentProc, proc_ready);
 	}
 
 	return (status = 0);
@@ -3371,6 +4216,7 @@ int kernelMultitaskerKillProcess(int processId)
 	kernelProcess *proc = NULL;
 	kernelProcess *listProc = NULL;
 	linkedListItem *iter = NULL;
+	int count;
 
 	kernelDebug(debug_multitasker, "Multitasker kill process %d", processId);
 
@@ -3424,16 +4270,34 @@ int kernelMultitaskerKillProcess(int processId)
 	if ((kernelCurrentProcess->type == proc_thread) &&
 		(processId == kernelCurrentProcess->parentProcessId))
 	{
-		proc->state = proc_finished;
+		setProcessState(proc, proc_finished);
 		while (1)
 			kernelMultitaskerYield();
 	}
 
 	// The request is legitimate
 
+	// If the target process is an idle thread, spawn its replacement first,
+	// so that its CPU always has something to run
+	for (count = 0; count < MAX_CPUS; count ++)
+	{
+		if (proc == cpus[count].idleProc)
+		{
+			if (spawnIdleThread(count) >= 0)
+				setProcessState(cpus[count].idleProc, proc_ready);
+		}
+	}
+
 	// Mark the process as stopped in the process list, so that the scheduler
 	// will not inadvertently select it to run while we're destroying it
-	proc->state = proc_stopped;
+	setProcessState(proc, proc_stopped);
+
+	// If it's running on another CPU, wait for that CPU to switch it out
+	for (count = 0; count < MAX_CPUS; count ++)
+	{
+		while (kernelCurrentProcesses[count] == proc)
+			kernelMultitaskerYield();
+	}
 
 	// We must iterate through the list of existing processes, looking for any
 	// other processes whose states depend on this one (such as child threads
@@ -3461,7 +4325,7 @@ int kernelMultitaskerKillProcess(int processId)
 			{
 				listProc->blockingExitCode = ERR_KILLED;
 				listProc->waitForProcess = 0;
-				listProc->state = proc_ready;
+				setProcessState(listProc, proc_ready);
 			}
 
 			goto checkNext;
@@ -3529,14 +4393,10 @@ int kernelMultitaskerKillProcess(int processId)
 		// its resources won't be 'lost'.
 		kernelError(kernel_error, "Couldn't delete process %d: \"%s\"",
 			proc->processId, proc->name);
-		proc->state = proc_zombie;
+		setProcessState(proc, proc_zombie);
 		return (status);
 	}
 
-	// If the target process is the idle process, spawn another one
-	if (proc == idleProc)
-		spawnIdleThread();
-
 	// Done.  Return success.
 	return (status = 0);
 }
@@ -3588,7 +4448,7 @@ int kernelMultitaskerKillAll(void)
 	while (proc)
 	{
 		if (PROC_KILLABLE(proc))
-			proc->state = proc_stopped;
+			setProcessState(proc, proc_stopped);
 
 		proc = linkedListIterNext(&processList, &iter);
 	}
@@ -3646,7 +4506,7 @@ int kernelMultitaskerTerminate(int retCode)
 			// its blockingExitCode field.
 			parentProc->blockingExitCode = retCode;
 			parentProc->waitForProcess = 0;
-			parentProc->state = proc_ready;
+			setProcessState(parentProc, proc_ready);
 
 			// Done
 		}
@@ -3659,7 +4519,7 @@ int kernelMultitaskerTerminate(int retCode)
 		if (!kernelCurrentProcess->descendentThreads)
 		{
 			// Terminate
-			kernelCurrentProcess->state = proc_finished;
+			setProcessState(kernelCurrentProcess, proc_finished);
 		}
 
 		kernelMultitaskerYield();
@@ -3741,7 +4601,7 @@ int kernelMultitaskerSignal(int processId, int sig)
 	if (!(proc->signalMask & (1 << sig)) || !proc->signalStream.buffer)
 	{
 		// Not handled.  Terminate the process.
-		proc->state = proc_finished;
+		setProcessState(proc, proc_finished);
 		return (status = 0);
 	}
 
@@ -3819,8 +4679,12 @@ int kernelMultitaskerGetIoPerm(int processId, int portNum)
 	if (portNum >= X86_IO_PORTS)
 		return (status = ERR_BOUNDS);
 
+	// Supervisor processes can use any port
+	if (proc->processorPrivilege == PRIVILEGE_SUPERVISOR)
+		return (status = 1);
+
 	// If the bit is clear, permission is granted
-	if (!GET_PORT_BIT(proc->context.taskStateSegment.IOMap, portNum))
+	if (proc->context.ioMap && !GET_PORT_BIT(proc->context.ioMap, portNum))
 		return (status = 1);
 #endif
 
@@ -3834,6 +4698,9 @@ int kernelMultitaskerSetIoPerm(int processId, int portNum, int yesNo)
 
 	int status = 0;
 	kernelProcess *proc = NULL;
+#ifdef ARCH_X86
+	int cpu;
+#endif
 
 	// Make sure multitasking has been enabled
 	if (!multitaskingEnabled)
@@ -3852,10 +4719,39 @@ int kernelMultitaskerSetIoPerm(int processId, int portNum, int yesNo)
 	if (portNum >= X86_IO_PORTS)
 		return (status = ERR_BOUNDS);
 
+	if (!proc->context.ioMap)
+	{
+		if (!yesNo)
+			// Nothing to do
+			return (status = 0);
+
+		// Get a bitmap, with all ports denied to begin with
+		proc->context.ioMap = kernelMalloc(X86_PORTS_BYTES);
+		if (!proc->context.ioMap)
+			return (status = ERR_MEMORY);
+
+		memset((void *) proc->context.ioMap, 0xFF, X86_PORTS_BYTES);
+	}
+
 	if (yesNo)
-		UNSET_PORT_BIT(proc->context.taskStateSegment.IOMap, portNum);
+		UNSET_PORT_BIT(proc->context.ioMap, portNum);
 	else
-		SET_PORT_BIT(proc->context.taskStateSegment.IOMap, portNum);
+		SET_PORT_BIT(proc->context.ioMap, portNum);
+
+	// If the bitmap is loaded in any CPU's TSS, change it there as well
+	for (cpu = 0; cpu < MAX_CPUS; cpu ++)
+	{
+		if (proc != cpus[cpu].ioMapProcess)
+			continue;
+
+		if (yesNo)
+			UNSET_PORT_BIT(cpus[cpu].tss.IOMap, portNum);
+		else
+			SET_PORT_BIT(cpus[cpu].tss.IOMap, portNum);
+
+		if (proc == kernelCurrentProcesses[cpu])
+			cpus[cpu].tss.IOMapBase = X86_IOBITMAP_OFFSET;
+	}
 #endif
 
 	return (status = 0);
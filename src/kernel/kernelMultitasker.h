@@ -24,8 +24,10 @@
 
 #include "kernelDescriptor.h"
 #include "kernelPage.h"
+#include "kernelSmp.h"
 #include "kernelSysTimer.h"
 #include "kernelText.h"
+#include "kernelTimer.h"
 #include <time.h>
 #include <sys/file.h>
 #include <sys/loader.h>
@@ -35,13 +37,13 @@
 #include <sys/vis.h>
 
 // Definitions
-#define MAX_PROCESSES				((GDT_SIZE - RES_GLOBAL_DESCRIPTORS))
+#define MAX_PROCESSES				4096
 #define PRIORITY_LEVELS				8
 #define DEFAULT_STACK_SIZE			(32 * 1024)
 #define DEFAULT_SUPER_STACK_SIZE	(32 * 1024)
-#define TIME_SLICES_PER_SEC			64 // ~15ms per slice
-#define TIME_SLICE_LENGTH			(SYSTIMER_FREQ_HZ / TIME_SLICES_PER_SEC)
-#define CPU_PERCENT_TIMESLICES		(TIME_SLICES_PER_SEC / 2) // every 1/2 sec
+#define TIME_SLICES_PER_SEC			64 // ~15ms per slice, by default
+#define TIME_SLICES_MIN_PER_SEC		20 // The PIT can't count past ~55ms
+#define TIME_SLICES_MAX_PER_SEC		1000
 #define PRIORITY_RATIO				3
 #define PRIORITY_DEFAULT			((PRIORITY_LEVELS / 2) - 1)
 
@@ -68,16 +70,38 @@
 
 typedef volatile struct {
 #ifdef ARCH_X86
-	kernelSelector tssSelector;
-	x86TSS taskStateSegment;
+	// The saved (supervisor) stack pointer of a process that isn't running,
+	// or zero if the process has never run
+	unsigned stackPointer;
+	// Where the process starts, and (once it has run) where it was last
+	// switched out, for stack traces
+	unsigned EIP;
+	unsigned ESP;
+	unsigned EBP;
+	unsigned EFLAGS;
+	// I/O permission bitmap, if the process has been given any
+	unsigned char *ioMap;
 	unsigned char fpuState[X86_FPU_STATE_LEN];
 	int fpuStateSaved;
 #endif
 
 } kernelProcessContext;
 
-// A structure for processes
+// A queue of processes, linked through the process structures themselves so
+// that adding and removing don't require any memory allocation
 typedef volatile struct {
+	volatile struct _kernelProcess *first;
+	volatile struct _kernelProcess *last;
+	int numProcesses;
+
+} kernelProcessQueue;
+
+// A queue of processes waiting for something to happen.  See the
+// kernelMultitaskerWaitQueue*() functions.
+typedef kernelProcessQueue kernelWaitQueue;
+
+// A structure for processes
+typedef volatile struct _kernelProcess {
 	char name[MAX_PROCNAME_LENGTH + 1];
 	processImage execImage;
 	int processId;
@@ -89,11 +113,14 @@ typedef volatile struct {
 	int parentProcessId;
 	int descendentThreads;
 	unsigned cpuTime;
+	unsigned cpuPeriod;
 	int cpuPercent;
 	unsigned lastSlice;
-	unsigned waitTime;
+	unsigned readySince;
 	unsigned long long waitUntil;
+	kernelTimer waitTimer;
 	int waitForProcess;
+	int waitWoken;
 	int blockingExitCode;
 	processState state;
 	void *userStack;
@@ -111,17 +138,44 @@ typedef volatile struct {
 	stream signalStream;
 	loaderSymbolTable *symbols;
 	int switchedByCall;
+	int cpu;
+	int lockDepth;
+	int inExceptionHandler;
+	kernelProcessQueue *queue;
+	volatile struct _kernelProcess *queuePrev;
+	volatile struct _kernelProcess *queueNext;
 
 } kernelProcess;
 
 // When in system calls, processes will be allowed to access information
-// about themselves
-extern kernelProcess *kernelCurrentProcess;
+// about themselves.  There's one current process per CPU.
+extern kernelProcess *kernelCurrentProcesses[];
+
+static inline kernelProcess *kernelMultitaskerCurrentProcess(void)
+{
+	// Returns the process running on this CPU.  Interrupts are suspended
+	// so that we can't be moved to another CPU between finding our CPU
+	// number and reading its slot.
+
+	kernelProcess *proc = NULL;
+	int interrupts = 0;
+
+	processorSuspendInts(interrupts);
+	proc = kernelCurrentProcesses[kernelSmpCpuNumber()];
+	processorRestoreInts(interrupts);
+
+	return (proc);
+}
+
+#define kernelCurrentProcess kernelMultitaskerCurrentProcess()
 
 // Functions exported by kernelMultitasker.c
 int kernelMultitaskerInitialize(void *, unsigned);
 int kernelMultitaskerShutdown(int);
-void kernelException(int, unsigned);
+int kernelMultitaskerCpuInitialize(int);
+int kernelMultitaskerCpuStart(int);
+int kernelMultitaskerSetTimeSlices(int);
+void kernelException(int, unsigned, unsigned);
 void kernelMultitaskerDumpProcessList(void);
 int kernelMultitaskerGetCurrentProcessId(void);
 int kernelMultitaskerGetProcess(int, process *);
@@ -153,6 +207,9 @@ int kernelMultitaskerGetProcessorTime(clock_t *);
 void kernelMultitaskerYield(void);
 void kernelMultitaskerWait(unsigned);
 int kernelMultitaskerBlock(int);
+int kernelMultitaskerWaitQueueSleep(kernelWaitQueue *, unsigned);
+int kernelMultitaskerWaitQueueWakeOne(kernelWaitQueue *);
+int kernelMultitaskerWaitQueueWakeAll(kernelWaitQueue *);
 int kernelMultitaskerDetach(void);
 int kernelMultitaskerKillProcess(int);
 int kernelMultitaskerKillByName(const char *);
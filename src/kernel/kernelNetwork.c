@@ -38,6 +38,7 @@
 #include "kernelNetworkTcp.h"
 #include "kernelNetworkUdp.h"
 #include "kernelRtc.h"
+#include "kernelSlab.h"
 #include <stdlib.h>
 #include <string.h>
 #include <sys/kernconf.h>
@@ -50,6 +51,8 @@ static kernelNetworkDevice *devices[NETWORK_MAX_DEVICES];
 static int numDevices = 0;
 static int netThreadPid = 0;
 static int networkStop = 0;
+static kernelWaitQueue threadWaitQueue;
+static kernelSlabCache packetCache;
 static int initialized = 0;
 static int enabled = 0;
 
@@ -141,6 +144,7 @@ static void networkThread(void)
 	// output streams
 
 	int status = 0;
+	int interrupts = 0;
 	kernelNetworkDevice *netDev = NULL;
 	kernelNetworkPacket *packet = NULL;
 	kernelNetworkConnection *connection = NULL;
@@ -303,8 +307,30 @@ static void networkThread(void)
 			}
 		}
 
-		// Finished for this time slice
-		kernelMultitaskerYield();
+		// Sleep until there are packets to process, or it's time to do the
+		// time-based processing again.  Check with interrupts disabled, so
+		// that we can't miss a wakeup from a device interrupt.
+
+		processorSuspendInts(interrupts);
+
+		for (count = 0; count < numDevices; count ++)
+		{
+			netDev = devices[count];
+
+			if ((netDev->device.flags & NETWORK_DEVICEFLAG_RUNNING) &&
+				(netDev->inputStream.count || netDev->outputStream.count))
+			{
+				break;
+			}
+		}
+
+		if ((count >= numDevices) && !networkStop)
+		{
+			kernelMultitaskerWaitQueueSleep(&threadWaitQueue,
+				NETWORK_THREAD_INTERVAL_MS);
+		}
+
+		processorRestoreInts(interrupts);
 	}
 
 	// Finished
@@ -457,7 +483,8 @@ static void deviceStartThread(void)
 			}
 		}
 
-		kernelMultitaskerYield();
+		if (devicesToStart)
+			kernelMultitaskerWait(NETWORK_TIMEOUT_POLL_MS);
 	}
 
 	kernelDebug(debug_net, "NET device start thread exiting");
@@ -538,6 +565,11 @@ int kernelNetworkInitialize(void)
 		return (status = 0);
 	}
 
+	status = kernelSlabCacheInit(&packetCache, "network packets",
+		sizeof(kernelNetworkPacket), NULL /* no constructor */);
+	if (status < 0)
+		return (status);
+
 	hostName = kernelMalloc(NETWORK_MAX_HOSTNAMELENGTH + 1);
 	if (!hostName)
 		return (status = ERR_MEMORY);
@@ -786,11 +818,11 @@ kernelNetworkPacket *kernelNetworkPacketGet(void)
 
 	kernelNetworkPacket *packet = NULL;
 
-	packet = kernelMalloc(sizeof(kernelNetworkPacket));
+	packet = kernelSlabAlloc(&packetCache);
 	if (!packet)
 		return (packet);
 
-	// Can't set packet->release to kernelFree(), because that's a macro
+	// Packets without a release function go back to the packet cache
 
 	packet->refCount = 1;
 
@@ -854,7 +886,7 @@ void kernelNetworkPacketRelease(kernelNetworkPacket *packet)
 		if (packet->release)
 			packet->release(packet);
 		else
-			kernelFree(packet);
+			kernelSlabFree(&packetCache, packet);
 	}
 }
 
@@ -1135,6 +1167,8 @@ int kernelNetworkSendPacket(kernelNetworkDevice *netDev,
 
 		if (status < 0)
 			kernelError(kernel_error, "Error queueing packet");
+		else
+			kernelNetworkWakeThread();
 	}
 
 	return (status);
@@ -1229,6 +1263,16 @@ int kernelNetworkSendData(kernelNetworkConnection *connection,
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+void kernelNetworkWakeThread(void)
+{
+	// Wake up the network thread, if it's sleeping, because there are
+	// packets in a device's input or output stream.  This can be called from
+	// interrupt handlers.
+
+	kernelMultitaskerWaitQueueWakeAll(&threadWaitQueue);
+}
+
+
 int kernelNetworkEnabled(void)
 {
 	// Returns 1 if networking is currently enabled
@@ -1330,6 +1374,7 @@ int kernelNetworkDisable(void)
 	// Set the 'network stop' flag and yield to let the network thread finish
 	// whatever it might have been doing
 	networkStop = 1;
+	kernelNetworkWakeThread();
 	kernelMultitaskerYield();
 
 	// Stop each non-loop network device
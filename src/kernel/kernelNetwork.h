@@ -28,6 +28,12 @@
 #include <sys/vis.h>
 
 #define NETWORK_DEVICE_TIMEOUT_MS			30000
+// How long to sleep between checks, when waiting for something with a
+// timeout
+#define NETWORK_TIMEOUT_POLL_MS				10
+// How long the network thread sleeps, if no packets arrive or are queued,
+// before doing its time-based processing
+#define NETWORK_THREAD_INTERVAL_MS			20
 #define NETWORK_PACKETS_PER_STREAM			256
 #define NETWORK_DATASTREAM_LENGTH			1048576
 
@@ -191,6 +197,7 @@ int kernelNetworkSendPacket(kernelNetworkDevice *, kernelNetworkPacket *,
 int kernelNetworkSendData(kernelNetworkConnection *, unsigned char *,
 	unsigned, int);
 // More functions, but also exported to user space
+void kernelNetworkWakeThread(void);
 int kernelNetworkEnabled(void);
 int kernelNetworkEnable(void);
 int kernelNetworkDisable(void);
@@ -275,6 +275,9 @@ static int processPacket(kernelDevice *dev, kernelNetworkPacket *packet)
 
 	kernelNetworkPacketRelease(packet);
 
+	// Let the network thread know
+	kernelNetworkWakeThread();
+
 	if (status < 0)
 	{
 		// It would be good if we had a collection of 'deferred packets' for
@@ -304,7 +307,7 @@ static void networkInterrupt(void)
 	int serviced = 0;
 	int count;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 
 	// Which interrupt number is active?
 	interruptNum = kernelPicGetActive();
@@ -359,7 +362,7 @@ static void networkInterrupt(void)
 	}
 
 out:
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
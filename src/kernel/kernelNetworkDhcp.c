@@ -209,10 +209,11 @@ static int waitDhcpReply(kernelNetworkDevice *netDev,
 	// Time out after ~1.5 seconds
 	for (*packet = NULL; (kernelCpuGetMs() <= timeout) ; *packet = NULL)
 	{
-		kernelMultitaskerYield();
-
 		if (!netDev->inputStream.count)
+		{
+			kernelMultitaskerWait(NETWORK_TIMEOUT_POLL_MS);
 			continue;
+		}
 
 		// Read the packet from the stream
 		status = kernelNetworkPacketStreamRead(&netDev->inputStream, packet);
@@ -618,13 +618,14 @@ static int waitDnsReply(kernelNetworkConnection *connection,
 	// Time out after ~5 seconds
 	while (kernelCpuGetMs() <= timeout)
 	{
-		kernelMultitaskerYield();
-
 		bytes = kernelNetworkRead(connection, reply,
 			NETWORK_PACKET_MAX_LENGTH);
 
 		if (bytes <= 0)
+		{
+			kernelMultitaskerWait(NETWORK_TIMEOUT_POLL_MS);
 			continue;
+		}
 
 		kernelDebug(debug_net, "DNS got server reply");
 
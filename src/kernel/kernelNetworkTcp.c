@@ -701,7 +701,7 @@ int kernelNetworkTcpOpenConnection(kernelNetworkConnection *connection)
 			if (connection->tcp.state == tcp_closed)
 				break;
 
-			kernelMultitaskerYield();
+			kernelMultitaskerWait(NETWORK_TIMEOUT_POLL_MS);
 		}
 
 		if (retries >= NETWORK_TCP_SYN_RETRIES)
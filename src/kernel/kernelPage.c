@@ -31,6 +31,8 @@
 #include "kernelMemory.h"
 #include "kernelMultitasker.h"
 #include "kernelParameters.h"
+#include "kernelSmp.h"
+#include <stdlib.h>
 #include <string.h>
 #include <sys/processor.h>
 
@@ -46,18 +48,52 @@ static kernelPageTable pageTableMemory[MAX_PROCESSES];
 static kernelPageTable *pageTableList[MAX_PROCESSES];
 static volatile int numberPageTables = 0;
 
+// A pool of structures for the page directories' trees of free page ranges
+#define MAX_PAGE_RANGES			(MAX_PROCESSES * 2)
+static kernelPageRange rangeMemory[MAX_PAGE_RANGES];
+static kernelPageRange *unusedRanges = NULL;
+static spinLock rangeLock;
+
 // The physical memory location where we'll store the kernel's paging data.
 static unsigned long kernelPagingData = 0;
 
 static int haveGlobalPages = 0;
+static int haveLargePages = 0;
 static int havePageAttributeTable = 0;
+static int haveMtrrs = 0;
 static volatile int initialized = 0;
 
+#ifdef ARCH_X86
+// Without a PAT, write-combining is done with variable-range MTRRs.  Keep
+// track of the ones we've set, so that the other processors can be set up
+// the same way.
+#define MAX_WC_MTRRS			8
+static struct {
+	int number;
+	unsigned base;
+	unsigned maskLo;
+	unsigned maskHi;
+
+} wcMtrr[MAX_WC_MTRRS];
+static int numWcMtrrs = 0;
+#endif
+
 // Macros used internally
 #define getTableNumber(address) \
 	((((unsigned long)(address)) >> 22) & 0x000003FF)
 #define getPageNumber(address) \
 	((((unsigned long)(address)) >> 12) & 0x000003FF)
+#define getPageIndex(address) \
+	(((unsigned long)(address)) >> 12)
+#define getPageAddress(index) \
+	((void *)((unsigned long)(index) << 12))
+
+// The first page of a page table that can be used, and how many there are.
+// The first page of the first table is never used.
+#define tableFirstPage(tableNumber) \
+	(((tableNumber) * PROCESSOR_PAGES_PER_TABLE) + !(tableNumber))
+#define tableUsablePages(tableNumber) \
+	(PROCESSOR_PAGES_PER_TABLE - !(tableNumber))
 
 
 static kernelPageTable *findPageTable(kernelPageDirectory *directory,
@@ -82,6 +118,426 @@ static kernelPageTable *findPageTable(kernelPageDirectory *directory,
 }
 
 
+static kernelPageRange *rangeGet(void)
+{
+	// Get an unused range structure from the pool
+
+	kernelPageRange *range = NULL;
+
+	if (initialized && (kernelLockGet(&rangeLock) < 0))
+		return (range = NULL);
+
+	range = unusedRanges;
+	if (range)
+		unusedRanges = range->right;
+
+	if (initialized)
+		kernelLockRelease(&rangeLock);
+
+	if (range)
+		memset(range, 0, sizeof(kernelPageRange));
+
+	return (range);
+}
+
+
+static void rangePut(kernelPageRange *range)
+{
+	// Return a range structure to the pool
+
+	if (initialized && (kernelLockGet(&rangeLock) < 0))
+		return;
+
+	range->right = unusedRanges;
+	unusedRanges = range;
+
+	if (initialized)
+		kernelLockRelease(&rangeLock);
+}
+
+
+static inline int rangeHeight(kernelPageRange *range)
+{
+	return (range ? range->height : 0);
+}
+
+
+static void rangeUpdate(kernelPageRange *range)
+{
+	// Recalculate the height and the subtree totals of a node from those of
+	// its children
+
+	range->height = (max(rangeHeight(range->left),
+		rangeHeight(range->right)) + 1);
+
+	range->maxPages = range->pages;
+	range->totalPages = range->pages;
+
+	if (range->left)
+	{
+		range->maxPages = max(range->maxPages, range->left->maxPages);
+		range->totalPages += range->left->totalPages;
+	}
+
+	if (range->right)
+	{
+		range->maxPages = max(range->maxPages, range->right->maxPages);
+		range->totalPages += range->right->totalPages;
+	}
+}
+
+
+static kernelPageRange *rangeRotateLeft(kernelPageRange *range)
+{
+	kernelPageRange *newRoot = range->right;
+
+	range->right = newRoot->left;
+	newRoot->left = range;
+
+	rangeUpdate(range);
+	rangeUpdate(newRoot);
+
+	return (newRoot);
+}
+
+
+static kernelPageRange *rangeRotateRight(kernelPageRange *range)
+{
+	kernelPageRange *newRoot = range->left;
+
+	range->left = newRoot->right;
+	newRoot->right = range;
+
+	rangeUpdate(range);
+	rangeUpdate(newRoot);
+
+	return (newRoot);
+}
+
+
+static kernelPageRange *rangeBalance(kernelPageRange *range)
+{
+	// Restore the AVL property at this node, after one of its subtrees has
+	// changed height by 1.  Returns the new root of the subtree.
+
+	int balance = 0;
+
+	rangeUpdate(range);
+
+	balance = (rangeHeight(range->left) - rangeHeight(range->right));
+
+	if (balance > 1)
+	{
+		if (rangeHeight(range->left->left) < rangeHeight(range->left->right))
+			range->left = rangeRotateLeft(range->left);
+
+		return (rangeRotateRight(range));
+	}
+
+	if (balance < -1)
+	{
+		if (rangeHeight(range->right->right) <
+			rangeHeight(range->right->left))
+		{
+			range->right = rangeRotateRight(range->right);
+		}
+
+		return (rangeRotateLeft(range));
+	}
+
+	return (range);
+}
+
+
+static kernelPageRange *rangeInsert(kernelPageRange *root,
+	kernelPageRange *range)
+{
+	// Insert a range into the subtree, and return the new root of the subtree
+
+	if (!root)
+	{
+		range->left = range->right = NULL;
+		rangeUpdate(range);
+		return (range);
+	}
+
+	if (range->start < root->start)
+		root->left = rangeInsert(root->left, range);
+	else
+		root->right = rangeInsert(root->right, range);
+
+	return (rangeBalance(root));
+}
+
+
+static kernelPageRange *rangeRemoveFirst(kernelPageRange *root,
+	kernelPageRange **first)
+{
+	// Detach the lowest range from the subtree, and return the new root of
+	// the subtree
+
+	if (!root->left)
+	{
+		*first = root;
+		return (root->right);
+	}
+
+	root->left = rangeRemoveFirst(root->left, first);
+
+	return (rangeBalance(root));
+}
+
+
+static kernelPageRange *rangeRemove(kernelPageRange *root,
+	kernelPageRange *range)
+{
+	// Detach the range from the subtree, and return the new root of the
+	// subtree
+
+	kernelPageRange *next = NULL;
+
+	if (!root)
+		return (root);
+
+	if (range->start < root->start)
+	{
+		root->left = rangeRemove(root->left, range);
+	}
+	else if (range->start > root->start)
+	{
+		root->right = rangeRemove(root->right, range);
+	}
+	else
+	{
+		if (!root->left)
+			return (root->right);
+		if (!root->right)
+			return (root->left);
+
+		// Replace it with the next one up
+		root->right = rangeRemoveFirst(root->right, &next);
+		next->left = root->left;
+		next->right = root->right;
+		root = next;
+	}
+
+	return (rangeBalance(root));
+}
+
+
+static kernelPageRange *rangeFindBelow(kernelPageRange *root,
+	unsigned page)
+{
+	// Return the range with the highest start page that is <= page
+
+	kernelPageRange *range = NULL;
+
+	while (root)
+	{
+		if (root->start <= page)
+		{
+			range = root;
+			root = root->right;
+		}
+		else
+		{
+			root = root->left;
+		}
+	}
+
+	return (range);
+}
+
+
+static kernelPageRange *rangeFindAbove(kernelPageRange *root,
+	unsigned page)
+{
+	// Return the range with the lowest start page that is >= page
+
+	kernelPageRange *range = NULL;
+
+	while (root)
+	{
+		if (root->start >= page)
+		{
+			range = root;
+			root = root->left;
+		}
+		else
+		{
+			root = root->right;
+		}
+	}
+
+	return (range);
+}
+
+
+static kernelPageRange *rangeFindFirstFit(kernelPageRange *root,
+	unsigned pages)
+{
+	// Return the lowest range with at least the requested number of pages
+
+	while (root && (root->maxPages >= pages))
+	{
+		if (root->left && (root->left->maxPages >= pages))
+			root = root->left;
+		else if (root->pages >= pages)
+			return (root);
+		else
+			root = root->right;
+	}
+
+	return (root = NULL);
+}
+
+
+static void rangeFreeTree(kernelPageRange *root)
+{
+	if (!root)
+		return;
+
+	rangeFreeTree(root->left);
+	rangeFreeTree(root->right);
+	rangePut(root);
+}
+
+
+static void freeRangesDiscard(kernelPageDirectory *directory)
+{
+	// Throw away the directory's tree of free ranges.  If this happens
+	// because we ran out of range structures, we fall back to searching the
+	// page tables.
+
+	rangeFreeTree(directory->freeRanges);
+	directory->freeRanges = NULL;
+}
+
+
+static void freeRangesAdd(kernelPageDirectory *directory, unsigned start,
+	unsigned pages)
+{
+	// Pages have become free in the page directory.  Add them to the tree,
+	// merging them with the free ranges on either side, if any.
+
+	kernelPageRange *range = NULL;
+	kernelPageRange *adjacent = NULL;
+
+	if (directory->freeRangesInvalid || !pages)
+		return;
+
+	adjacent = rangeFindBelow(directory->freeRanges, start);
+	if (adjacent && ((adjacent->start + adjacent->pages) == start))
+	{
+		directory->freeRanges = rangeRemove(directory->freeRanges, adjacent);
+		start = adjacent->start;
+		pages += adjacent->pages;
+		range = adjacent;
+	}
+
+	adjacent = rangeFindAbove(directory->freeRanges, start);
+	if (adjacent && (adjacent->start == (start + pages)))
+	{
+		directory->freeRanges = rangeRemove(directory->freeRanges, adjacent);
+		pages += adjacent->pages;
+
+		if (range)
+			rangePut(adjacent);
+		else
+			range = adjacent;
+	}
+
+	if (!range)
+	{
+		range = rangeGet();
+		if (!range)
+		{
+			kernelDebugError("Out of free page ranges");
+			freeRangesDiscard(directory);
+			directory->freeRangesInvalid = 1;
+			return;
+		}
+	}
+
+	range->start = start;
+	range->pages = pages;
+
+	directory->freeRanges = rangeInsert(directory->freeRanges, range);
+}
+
+
+static void freeRangesRemove(kernelPageDirectory *directory, unsigned start,
+	unsigned pages)
+{
+	// Pages in the page directory are no longer free.  Remove them from any
+	// ranges that overlap them, splitting a range if necessary.
+
+	kernelPageRange *range = NULL;
+	kernelPageRange *after = NULL;
+	unsigned end = (start + pages);
+	unsigned rangeEnd = 0;
+
+	if (directory->freeRangesInvalid || !pages)
+		return;
+
+	while (1)
+	{
+		// Find a range that overlaps
+		range = rangeFindBelow(directory->freeRanges, start);
+		if (!range || ((range->start + range->pages) <= start))
+		{
+			range = rangeFindAbove(directory->freeRanges, start);
+			if (!range || (range->start >= end))
+				break;
+		}
+
+		directory->freeRanges = rangeRemove(directory->freeRanges, range);
+		rangeEnd = (range->start + range->pages);
+
+		// Keep any part that's after the removed pages
+		if (rangeEnd > end)
+		{
+			if (range->start < start)
+			{
+				after = rangeGet();
+				if (!after)
+				{
+					kernelDebugError("Out of free page ranges");
+					rangePut(range);
+					freeRangesDiscard(directory);
+					directory->freeRangesInvalid = 1;
+					return;
+				}
+			}
+			else
+			{
+				after = range;
+				range = NULL;
+			}
+
+			after->start = end;
+			after->pages = (rangeEnd - end);
+			directory->freeRanges = rangeInsert(directory->freeRanges, after);
+		}
+
+		// Keep any part that's before the removed pages
+		if (range)
+		{
+			if (range->start < start)
+			{
+				range->pages = (start - range->start);
+				directory->freeRanges = rangeInsert(directory->freeRanges,
+					range);
+			}
+			else
+			{
+				rangePut(range);
+			}
+		}
+	}
+}
+
+
 static unsigned countFreePages(kernelPageDirectory *directory)
 {
 	// Returns the number of unallocated pages in all the page tables
@@ -92,6 +548,15 @@ static unsigned countFreePages(kernelPageDirectory *directory)
 	int maxTables = 0;
 	kernelPageTable *table;
 
+	// The tree of free ranges knows the total
+	if (!directory->freeRangesInvalid)
+	{
+		if (directory->freeRanges)
+			return (directory->freeRanges->totalPages);
+		else
+			return (freePages = 0);
+	}
+
 	if (directory == kernelPageDir)
 	{
 		tableNumber = getTableNumber(KERNEL_VIRTUAL_ADDRESS);
@@ -153,6 +618,7 @@ static int findFreePages(kernelPageDirectory *directory, int pages,
 	// and returns 0.  On failure it returns negative.
 
 	int status = 0;
+	kernelPageRange *range = NULL;
 	void *startAddress = NULL;
 	int numberFree = 0;
 	kernelPageTable *table = NULL;
@@ -160,6 +626,20 @@ static int findFreePages(kernelPageDirectory *directory, int pages,
 	int maxTables = 0;
 	int pageNumber = 0;
 
+	// Normally we can just look in the tree of free ranges for the first one
+	// that's big enough
+	if (!directory->freeRangesInvalid)
+	{
+		range = rangeFindFirstFit(directory->freeRanges, pages);
+		if (!range)
+			return (status = ERR_NOFREE);
+
+		*virtualAddress = getPageAddress(range->start);
+		return (status = 0);
+	}
+
+	// Otherwise, search the page tables
+
 	if (directory == kernelPageDir)
 	{
 		tableNumber = getTableNumber(KERNEL_VIRTUAL_ADDRESS);
@@ -288,6 +768,7 @@ static kernelPageTable *createPageTable(kernelPageDirectory *directory,
 			PROCESSOR_PAGEFLAG_GLOBAL;
 	}
 	kernelTable->freePages--;
+	freeRangesRemove(kernelPageDir, getPageIndex(virtualAddr), 1);
 
 	// Clear this memory block, since kernelMemoryGetPhysical can't do it for
 	// us
@@ -305,6 +786,9 @@ static kernelPageTable *createPageTable(kernelPageDirectory *directory,
 	newTable->physical = physicalAddr;
 	newTable->virtual = virtualAddr;
 
+	// All of its pages are free
+	freeRangesAdd(directory, tableFirstPage(number), tableUsablePages(number));
+
 	// Now we actually go into the page directory memory and add the
 	// real page table to the requested slot number.  Always enable
 	// read/write and page-present
@@ -357,6 +841,8 @@ static int deletePageTable(kernelPageDirectory *directory,
 
 	// First remove the table from the directory
 	directory->virtual->table[table->tableNumber] = NULL;
+	freeRangesRemove(directory, tableFirstPage(table->tableNumber),
+		tableUsablePages(table->tableNumber));
 
 	// If this page table belonged to the kernel or one of its threads, it
 	// needs to be 'unshared' from all of the other real page directories.
@@ -382,9 +868,11 @@ static int deletePageTable(kernelPageDirectory *directory,
 	// Erase the entry for the page of kernel memory that this table used
 	kernelTable->virtual->page[kernelPageNumber] = NULL;
 	kernelTable->freePages++;
+	freeRangesAdd(kernelPageDir, getPageIndex(table->virtual), 1);
 
 	// Clear the TLB entry for this page
 	processorAddressCacheInvalidatePage(table->virtual);
+	kernelSmpTlbShootdown();
 
 	// Release the physical memory used by the table
 	status = kernelMemoryReleasePhysical((unsigned) table->physical);
@@ -427,6 +915,106 @@ static int deletePageTable(kernelPageDirectory *directory,
 }
 
 
+static void updateLargePage(kernelPageDirectory *directory,
+	kernelPageTable *table)
+{
+	// A kernel page table that maps 4MB of physically contiguous, suitably
+	// aligned memory, with the same attributes for every page, can be
+	// replaced in the page directory by a single large page, which only takes
+	// up one TLB entry.  We keep the page table itself, since that's where we
+	// keep track of the pages.  If the table no longer qualifies, point the
+	// page directory back at it.
+
+	unsigned ignoreFlags = (PROCESSOR_PAGEFLAG_ACCESSED |
+		PROCESSOR_PAGEFLAG_DIRTY);
+	unsigned first = 0;
+	unsigned entry = 0;
+	int count;
+
+	// The first table is never a large page, since its first page is never
+	// used
+	if (!haveLargePages || (directory != kernelPageDir) ||
+		!table->tableNumber)
+	{
+		return;
+	}
+
+	first = (table->virtual->page[0] & ~ignoreFlags);
+
+	if ((first & PROCESSOR_PAGEFLAG_PRESENT) &&
+		!((first & 0xFFFFF000) % PROCESSOR_LARGEPAGE_SIZE))
+	{
+		for (count = 1; count < PROCESSOR_PAGES_PER_TABLE; count ++)
+		{
+			if ((table->virtual->page[count] & ~ignoreFlags) !=
+				(first + (count * MEMORY_PAGE_SIZE)))
+			{
+				break;
+			}
+		}
+
+		if (count >= PROCESSOR_PAGES_PER_TABLE)
+		{
+			// The PAT bit moves in a large page directory entry
+			entry = ((first & ~PROCESSOR_PAGEFLAG_PAT) |
+				PROCESSOR_PAGEFLAG_LARGE);
+			if (first & PROCESSOR_PAGEFLAG_PAT)
+				entry |= PROCESSOR_PAGEFLAG_LARGEPAT;
+		}
+	}
+
+	if (!entry)
+	{
+		// The same entry that createPageTable() makes
+		entry = ((unsigned) table->physical | PROCESSOR_PAGEFLAG_WRITABLE |
+			PROCESSOR_PAGEFLAG_PRESENT);
+		if (haveGlobalPages)
+			entry |= PROCESSOR_PAGEFLAG_GLOBAL;
+	}
+
+	if (directory->virtual->table[table->tableNumber] == entry)
+		return;
+
+	// The kernel's page directory entries are shared with all of the other
+	// page directories
+	directory->virtual->table[table->tableNumber] = entry;
+	for (count = 0; count < numberPageDirectories; count ++)
+		pageDirList[count]->virtual->table[table->tableNumber] = entry;
+
+	// The TLB mustn't hold both small and large pages for the same memory,
+	// and the pages are global, so flush all of it
+	processorAddressCacheInvalidateAll();
+	kernelSmpTlbShootdown();
+}
+
+
+static void updateLargePages(kernelPageDirectory *directory,
+	void *virtualAddress, unsigned numPages)
+{
+	// Re-check whether each of the kernel page tables covering the supplied
+	// range can be (or can still be) a large page
+
+	kernelPageTable *table = NULL;
+	unsigned tableNumber = 0;
+	unsigned lastTable = 0;
+
+	if (!haveLargePages || (directory != kernelPageDir) || !numPages)
+		return;
+
+	tableNumber = getTableNumber(virtualAddress);
+	lastTable = getTableNumber(virtualAddress + ((numPages - 1) *
+		MEMORY_PAGE_SIZE));
+
+	for ( ; tableNumber <= lastTable; tableNumber ++)
+	{
+		// Tables that were deleted don't need anything
+		table = findPageTable(directory, tableNumber);
+		if (table)
+			updateLargePage(directory, table);
+	}
+}
+
+
 static int findPageTableEntry(kernelPageDirectory *directory,
 	void *virtualAddress, unsigned *entry)
 {
@@ -458,8 +1046,13 @@ static int findPageTableEntry(kernelPageDirectory *directory,
 		return (status = ERR_NODATA);
 	}
 
-	// Grab the value from the page table
-	*entry = (table->virtual->page[pageNumber] & 0xFFFFF000);
+	// Grab the value from the page table.  A page that's only reserved has
+	// no physical memory yet.
+	if (table->virtual->page[pageNumber] & PROCESSOR_PAGEFLAG_PRESENT)
+		*entry = (table->virtual->page[pageNumber] & 0xFFFFF000);
+	else
+		*entry = 0;
+
 	return (status = 0);
 }
 
@@ -564,6 +1157,16 @@ static void detectCpuPagingFeatures(void)
 		haveGlobalPages = 1;
 	}
 
+	// Does the processor support 4MB pages?
+	if ((regd >> 3) & 1)
+	{
+		processorGetCR4(rega);
+		rega |= 0x00000010;
+		processorSetCR4(rega);
+
+		haveLargePages = 1;
+	}
+
 	// Is there a PAT?
 	if ((regd >> 16) & 1)
 	{
@@ -583,10 +1186,191 @@ static void detectCpuPagingFeatures(void)
 		}
 	}
 
+	// Are there MTRRs?
+	if (((regd >> 12) & 1) && ((regd >> 5) & 1))
+		haveMtrrs = 1;
+
 #endif
 }
 
 
+#ifdef ARCH_X86
+static void writeMtrr(int number, unsigned base, unsigned maskLo,
+	unsigned maskHi)
+{
+	// Set a variable-range MTRR on this processor.  The processor manuals
+	// say that the caches must be disabled and flushed, and the MTRRs
+	// disabled, while they're changed.
+
+	unsigned cr0 = 0;
+	unsigned defTypeLo = 0, defTypeHi = 0;
+	int interrupts = 0;
+
+	processorSuspendInts(interrupts);
+
+	// Set CR0[CD] and clear CR0[NW], and flush the caches and the TLB
+	processorGetCR0(cr0);
+	processorSetCR0((cr0 | 0x40000000) & ~0x20000000);
+	processorCacheInvalidate();
+	processorAddressCacheInvalidateAll();
+
+	processorReadMsr(X86_MSR_MTRRDEFTYPE, defTypeLo, defTypeHi);
+	processorWriteMsr(X86_MSR_MTRRDEFTYPE, (defTypeLo &
+		~X86_MSR_MTRRDEFTYPE_ENABLE), defTypeHi);
+
+	processorWriteMsr(X86_MSR_MTRRPHYSBASE(number), base, 0);
+	processorWriteMsr(X86_MSR_MTRRPHYSMASK(number), maskLo, maskHi);
+
+	processorCacheInvalidate();
+	processorAddressCacheInvalidateAll();
+
+	// Turn the MTRRs and the caches back on
+	processorWriteMsr(X86_MSR_MTRRDEFTYPE, defTypeLo, defTypeHi);
+	processorSetCR0(cr0);
+
+	processorRestoreInts(interrupts);
+}
+
+
+static int mtrrWriteCombine(unsigned physical, unsigned size)
+{
+	// Make a range of physical memory write-combining using variable-range
+	// MTRRs.  Each one covers a naturally-aligned, power-of-2-sized range,
+	// so we might need more than one.
+
+	int status = 0;
+	unsigned rega = 0, regb = 0, regc = 0, regd = 0;
+	unsigned capLo = 0, capHi = 0;
+	unsigned baseLo = 0, baseHi = 0;
+	unsigned maskLo = 0, maskHi = 0;
+	unsigned physBits = 36;
+	unsigned chunk = 0;
+	int numMtrrs = 0;
+	int number = 0;
+	int covered = 0;
+	int count;
+
+	processorReadMsr(X86_MSR_MTRRCAP, capLo, capHi);
+	if (!(capLo & X86_MSR_MTRRCAP_WC))
+		return (status = ERR_NOTIMPLEMENTED);
+
+	numMtrrs = (capLo & X86_MSR_MTRRCAP_VCNT);
+
+	// The masks cover all of the physical address bits
+	processorId(0x80000000, rega, regb, regc, regd);
+	if (rega >= 0x80000008)
+	{
+		processorId(0x80000008, rega, regb, regc, regd);
+		physBits = (rega & 0xFF);
+	}
+
+	while (size >= MEMORY_PAGE_SIZE)
+	{
+		// The biggest naturally-aligned chunk that fits
+		chunk = 0x80000000;
+		while ((chunk > size) || (physical & (chunk - 1)))
+			chunk >>= 1;
+
+		// Look for a free MTRR, and make sure that none of the ones in use
+		// overlap this chunk.  Overlapping write-combining ones are OK.
+		number = -1;
+		covered = 0;
+		for (count = 0; count < numMtrrs; count ++)
+		{
+			processorReadMsr(X86_MSR_MTRRPHYSBASE(count), baseLo, baseHi);
+			processorReadMsr(X86_MSR_MTRRPHYSMASK(count), maskLo, maskHi);
+
+			if (!(maskLo & X86_MSR_MTRRPHYSMASK_VALID))
+			{
+				if (number < 0)
+					number = count;
+				continue;
+			}
+
+			if (baseHi || ((physical ^ baseLo) & ~(chunk - 1) & maskLo &
+				X86_MSR_MTRR_ADDR))
+			{
+				continue;
+			}
+
+			if ((baseLo & X86_MSR_MTRRPHYSBASE_TYPE) != X86_MTRR_TYPE_WC)
+			{
+				kernelDebug(debug_memory, "MTRR %d conflicts with "
+					"write-combining %08x", count, physical);
+				return (status = ERR_BUSY);
+			}
+
+			covered = 1;
+		}
+
+		if (!covered)
+		{
+			if ((number < 0) || (numWcMtrrs >= MAX_WC_MTRRS))
+				return (status = ERR_NOFREE);
+
+			wcMtrr[numWcMtrrs].number = number;
+			wcMtrr[numWcMtrrs].base = (physical | X86_MTRR_TYPE_WC);
+			wcMtrr[numWcMtrrs].maskLo = (~(chunk - 1) |
+				X86_MSR_MTRRPHYSMASK_VALID);
+			wcMtrr[numWcMtrrs].maskHi = ((physBits > 32)?
+				((1 << (physBits - 32)) - 1) : 0);
+
+			writeMtrr(wcMtrr[numWcMtrrs].number, wcMtrr[numWcMtrrs].base,
+				wcMtrr[numWcMtrrs].maskLo, wcMtrr[numWcMtrrs].maskHi);
+
+			numWcMtrrs += 1;
+		}
+
+		physical += chunk;
+		size -= chunk;
+	}
+
+	return (status = 0);
+}
+
+
+static int mtrrWriteCombinePages(kernelPageDirectory *directory,
+	void *virtualAddress, int pages)
+{
+	// Set up write-combining MTRRs for each physically contiguous run of
+	// the supplied pages
+
+	int status = 0;
+	unsigned physical = 0;
+	unsigned runStart = 0;
+	unsigned runSize = 0;
+
+	for ( ; pages > 0; pages --)
+	{
+		status = findPageTableEntry(directory, virtualAddress, &physical);
+		if (status < 0)
+			return (status);
+
+		if (!runSize || (physical != (runStart + runSize)))
+		{
+			if (runSize)
+			{
+				status = mtrrWriteCombine(runStart, runSize);
+				if (status < 0)
+					return (status);
+			}
+
+			runStart = physical;
+			runSize = 0;
+		}
+
+		runSize += MEMORY_PAGE_SIZE;
+		virtualAddress += MEMORY_PAGE_SIZE;
+	}
+
+	if (runSize)
+		status = mtrrWriteCombine(runStart, runSize);
+
+	return (status);
+}
+#endif
+
+
 static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 	void **virtualAddress, unsigned size, int flags)
 {
@@ -594,7 +1378,9 @@ static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 	// pages in the address space of a process.  This will map the physical
 	// memory to the first range of the process' unused pages that is large
 	// enough to handle the request.  By default, it will make all pages that
-	// it maps writable.
+	// it maps writable.  With PAGE_MAP_RESERVE, the pages are only marked as
+	// reserved (not present), and physical memory is committed to each one
+	// later by kernelPageCommit().
 
 	int status = 0;
 	kernelPageTable *pageTable = NULL;
@@ -603,6 +1389,8 @@ static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 	int tableNumber = 0;
 	unsigned pageNumber = 0;
 	unsigned numPages = 0;
+	unsigned alignPages = 0;
+	unsigned mappedPages = 0;
 
 	// Make sure that our arguments are reasonable.  The wrapper functions
 	// that are used to call us from external locations do not check them.
@@ -620,19 +1408,38 @@ static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 	// Determine how many pages we need to map
 	numPages = getNumPages(size);
 
-	if (flags == PAGE_MAP_ANY)
+	if (flags & PAGE_MAP_ANY)
 	{
+		// If the kernel is mapping at least a large page's worth of physical
+		// memory, look for enough extra room that the virtual pages can be
+		// lined up with the physical ones, so that whole page tables can be
+		// replaced by large pages
+		if (haveLargePages && (directory == kernelPageDir) &&
+			!(flags & PAGE_MAP_RESERVE) &&
+			(numPages >= PROCESSOR_PAGES_PER_TABLE))
+		{
+			alignPages = (PROCESSOR_PAGES_PER_TABLE - 1);
+		}
+
 		// Are there enough free pages in this page directory (plus 1 for the
 		// next page table)?  If not, add more page tables until we have
 		// enough.
-		while (((numPages + 1) >= countFreePages(directory)) ||
-			(findFreePages(directory, numPages, virtualAddress) < 0))
+		while (((numPages + alignPages + 1) >= countFreePages(directory)) ||
+			(findFreePages(directory, (numPages + alignPages),
+				virtualAddress) < 0))
 		{
 			if (!createPageTable(directory, findFreeTableNumber(directory)))
 				return (status = ERR_NOFREE);
 		}
+
+		if (alignPages)
+		{
+			*virtualAddress += (((getPageNumber(physicalAddress) -
+				getPageNumber(*virtualAddress)) &
+				(PROCESSOR_PAGES_PER_TABLE - 1)) * MEMORY_PAGE_SIZE);
+		}
 	}
-	else if (flags == PAGE_MAP_EXACT)
+	else if (flags & PAGE_MAP_EXACT)
 	{
 		if ((unsigned long) *virtualAddress % MEMORY_PAGE_SIZE)
 			return (status = ERR_ALIGN);
@@ -664,6 +1471,11 @@ static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 
 	currentPhysicalAddress = physicalAddress;
 	currentVirtualAddress = *virtualAddress;
+	mappedPages = numPages;
+
+	// The pages are no longer free
+	freeRangesRemove(directory, getPageIndex(currentVirtualAddress),
+		numPages);
 
 	// Change the entries in the page table
 	while (numPages > 0)
@@ -683,11 +1495,21 @@ static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 				return (status = ERR_NOSUCHENTRY);
 		}
 
-		// Put the real address into the page table entry.  Set the
-		// writable bit and the page present bit.
-		pageTable->virtual->page[pageNumber] = currentPhysicalAddress;
-		pageTable->virtual->page[pageNumber] |= (PROCESSOR_PAGEFLAG_WRITABLE |
-			PROCESSOR_PAGEFLAG_PRESENT);
+		if (flags & PAGE_MAP_RESERVE)
+		{
+			// No physical memory yet.  The entry is non-zero, so that the
+			// page counts as used, but the page is not present.
+			pageTable->virtual->page[pageNumber] =
+				(PROCESSOR_PAGEFLAG_RESERVED | PROCESSOR_PAGEFLAG_WRITABLE);
+		}
+		else
+		{
+			// Put the real address into the page table entry.  Set the
+			// writable bit and the page present bit.
+			pageTable->virtual->page[pageNumber] = currentPhysicalAddress;
+			pageTable->virtual->page[pageNumber] |=
+				(PROCESSOR_PAGEFLAG_WRITABLE | PROCESSOR_PAGEFLAG_PRESENT);
+		}
 
 		if (directory == kernelPageDir)
 		{
@@ -718,6 +1540,10 @@ static int map(kernelPageDirectory *directory, unsigned physicalAddress,
 		// Loop again
 	}
 
+	// Use large pages wherever we can
+	if (!(flags & PAGE_MAP_RESERVE))
+		updateLargePages(directory, *virtualAddress, mappedPages);
+
 	// Return success
 	return (status = 0);
 }
@@ -734,6 +1560,9 @@ static int unmap(kernelPageDirectory *directory, void *virtualAddress,
 	unsigned tableNumber = 0;
 	unsigned pageNumber = 0;
 	unsigned numPages = 0;
+	unsigned freeStart = 0;
+	unsigned freeCount = 0;
+	void *startAddress = virtualAddress;
 
 	// Make sure that our arguments are reasonable.  The wrapper functions
 	// that are used to call us from external locations do not check them.
@@ -771,6 +1600,20 @@ static int unmap(kernelPageDirectory *directory, void *virtualAddress,
 				return (status = ERR_NOSUCHENTRY);
 		}
 
+		// Collect the pages that become free, so we can add them to the tree
+		// of free ranges all at once
+		if (pageTable->virtual->page[pageNumber])
+		{
+			if (!freeCount)
+				freeStart = getPageIndex(virtualAddress);
+			freeCount++;
+		}
+		else if (freeCount)
+		{
+			freeRangesAdd(directory, freeStart, freeCount);
+			freeCount = 0;
+		}
+
 		// Clear out the physical address from the page table entry
 		pageTable->virtual->page[pageNumber] = NULL;
 
@@ -783,6 +1626,9 @@ static int unmap(kernelPageDirectory *directory, void *virtualAddress,
 		// Is the table now unused?
 		if (pageTable->freePages == PROCESSOR_PAGES_PER_TABLE)
 		{
+			freeRangesAdd(directory, freeStart, freeCount);
+			freeCount = 0;
+
 			// Try to deallocate it
 			deletePageTable(directory, pageTable);
 		}
@@ -796,6 +1642,14 @@ static int unmap(kernelPageDirectory *directory, void *virtualAddress,
 		// Loop again
 	}
 
+	freeRangesAdd(directory, freeStart, freeCount);
+
+	// Any large pages covering these are no longer valid
+	updateLargePages(directory, startAddress, getNumPages(size));
+
+	// Other processors might have the old mappings cached
+	kernelSmpTlbShootdown();
+
 	// Return success
 	return (status = 0);
 }
@@ -886,6 +1740,9 @@ static int deletePageDirectory(kernelPageDirectory *directory)
 	// Deallocate the dynamic memory that this directory is occupying
 	kernelMemoryReleasePhysical((unsigned) directory->physical);
 
+	// Its page tables are gone, so its tree of free ranges should be empty
+	freeRangesDiscard(directory);
+
 	// Unmap the directory from kernel memory
 	status = unmap(kernelPageDir, (void *) directory->virtual,
 		sizeof(kernelPageDirVirtualMem));
@@ -1009,6 +1866,10 @@ static int firstPageTable(void)
 	kernelPageDir->physical->table[tableNumber] |=
 		(PROCESSOR_PAGEFLAG_WRITABLE | PROCESSOR_PAGEFLAG_PRESENT);
 
+	// All of its pages are free
+	freeRangesAdd(kernelPageDir, tableFirstPage(tableNumber),
+		tableUsablePages(tableNumber));
+
 	return (status = 0);
 }
 
@@ -1147,6 +2008,8 @@ static int setPageAttrs(kernelPageDirectory *directory,
 
 	int status = 0;
 	kernelPageTable *pageTable = NULL;
+	void *startAddress = virtualAddress;
+	int numPages = pages;
 	int pageNumber = 0;
 
 	while (pages > 0)
@@ -1221,7 +2084,22 @@ static int setPageAttrs(kernelPageDirectory *directory,
 		}
 	}
 
-	return (status = 0);
+	// The attributes of any large pages covering these might change
+	updateLargePages(directory, startAddress, numPages);
+
+#ifdef ARCH_X86
+	// Without a PAT, fall back to MTRRs for write-combining
+	if ((attr == pageattr_writecombine) && !havePageAttributeTable &&
+		haveMtrrs)
+	{
+		status = mtrrWriteCombinePages(directory, startAddress, numPages);
+	}
+#endif
+
+	// Other processors might have the old attributes cached
+	kernelSmpTlbShootdown();
+
+	return (status);
 }
 
 
@@ -1263,6 +2141,17 @@ int kernelPageInitialize(unsigned kernelMemory)
 	numberPageDirectories = 0;
 	numberPageTables = 0;
 
+	// Put all of the free range structures in the pool
+	memset((void *) rangeMemory, 0,
+		(sizeof(kernelPageRange) * MAX_PAGE_RANGES));
+	memset((void *) &rangeLock, 0, sizeof(spinLock));
+	unusedRanges = NULL;
+	for (count = (MAX_PAGE_RANGES - 1); count >= 0; count --)
+	{
+		rangeMemory[count].right = unusedRanges;
+		unusedRanges = &rangeMemory[count];
+	}
+
 	// Detect paging-related CPU features
 	detectCpuPagingFeatures();
 
@@ -1284,6 +2173,28 @@ int kernelPageInitialize(unsigned kernelMemory)
 }
 
 
+void kernelPageInitializeCpu(void)
+{
+	// Called by each additional processor as it starts up, to enable the
+	// same paging features as the boot processor
+
+#ifdef ARCH_X86
+	int count;
+#endif
+
+	detectCpuPagingFeatures();
+
+#ifdef ARCH_X86
+	// Set any write-combining MTRRs the same as on the boot processor
+	for (count = 0; count < numWcMtrrs; count ++)
+	{
+		writeMtrr(wcMtrr[count].number, wcMtrr[count].base,
+			wcMtrr[count].maskLo, wcMtrr[count].maskHi);
+	}
+#endif
+}
+
+
 kernelPageDirectory *kernelPageGetDirectory(int processId)
 {
 	// This is an accessor function, which just returns the requested page
@@ -1592,6 +2503,175 @@ int kernelPageUnmap(int processId, void *virtualAddress, unsigned size)
 }
 
 
+int kernelPageReserve(int processId, void **virtualAddress, unsigned size)
+{
+	// Reserve a range of pages in an address space, at the first available
+	// virtual address, without any physical memory behind them.  Physical
+	// memory is committed to each page later, with kernelPageCommit().
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&directory->lock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (status = ERR_NOLOCK);
+	}
+
+	status = map(directory, 0, virtualAddress, size,
+		(PAGE_MAP_ANY | PAGE_MAP_RESERVE));
+
+	kernelLockRelease(&directory->lock);
+
+	return (status);
+}
+
+
+int kernelPageCommit(int processId, void *virtualAddress,
+	unsigned physicalAddress)
+{
+	// Put a page of physical memory behind a reserved page.  Any attributes
+	// that were set on the reserved page are kept.  Returns ERR_ALREADY if
+	// the page is already present, or ERR_NOSUCHENTRY if it was not
+	// reserved.
+
+	int status = 0;
+	kernelPageDirectory *directory = NULL;
+	kernelPageTable *pageTable = NULL;
+	int pageNumber = 0;
+	unsigned entry = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	if (((unsigned long) virtualAddress % MEMORY_PAGE_SIZE) ||
+		(physicalAddress % MEMORY_PAGE_SIZE))
+	{
+		return (status = ERR_ALIGN);
+	}
+
+	// Find the appropriate page directory
+	directory = findPageDirectory(processId);
+	if (!directory)
+		return (status = ERR_NOSUCHENTRY);
+
+	status = kernelLockGet(&directory->lock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get lock on page directory");
+		return (status = ERR_NOLOCK);
+	}
+
+	pageTable = findPageTable(directory, getTableNumber(virtualAddress));
+	if (!pageTable)
+	{
+		kernelLockRelease(&directory->lock);
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	pageNumber = getPageNumber(virtualAddress);
+	entry = pageTable->virtual->page[pageNumber];
+
+	if (entry & PROCESSOR_PAGEFLAG_PRESENT)
+	{
+		// Somebody (another thread sharing the address space) beat us to it
+		status = ERR_ALREADY;
+	}
+	else if (!(entry & PROCESSOR_PAGEFLAG_RESERVED))
+	{
+		status = ERR_NOSUCHENTRY;
+	}
+	else
+	{
+		// Not-present entries aren't cached, so there's no need to
+		// invalidate anything
+		pageTable->virtual->page[pageNumber] = (physicalAddress |
+			(entry & (MEMORY_PAGE_SIZE - 1) & ~PROCESSOR_PAGEFLAG_RESERVED) |
+			PROCESSOR_PAGEFLAG_PRESENT);
+
+		status = 0;
+	}
+
+	kernelLockRelease(&directory->lock);
+
+	return (status);
+}
+
+
+int kernelPageSetWindow(void *virtualAddress, unsigned physicalAddress,
+	unsigned size)
+{
+	// Point a 'window' of kernel pages, which were reserved or mapped
+	// beforehand, at some other physical memory.  This doesn't take any
+	// locks, so that it can be used by code that mustn't sleep, and only
+	// this processor's TLB is invalidated, so each window must only be used
+	// by one processor at a time (which invalidates any stale entries of its
+	// own when it sets the window).
+
+	int status = 0;
+	kernelPageTable *pageTable = NULL;
+	int pageNumber = 0;
+	unsigned entry = 0;
+	unsigned numPages = 0;
+
+	// Have we been initialized?
+	if (!initialized)
+		return (status = ERR_NOTINITIALIZED);
+
+	if (((unsigned long) virtualAddress % MEMORY_PAGE_SIZE) ||
+		(physicalAddress % MEMORY_PAGE_SIZE))
+	{
+		return (status = ERR_ALIGN);
+	}
+
+	for (numPages = getNumPages(size); numPages > 0; numPages --)
+	{
+		pageTable = findPageTable(kernelPageDir,
+			getTableNumber(virtualAddress));
+		if (!pageTable || (kernelPageDir->virtual->table[pageTable->
+			tableNumber] & PROCESSOR_PAGEFLAG_LARGE))
+		{
+			return (status = ERR_NOSUCHENTRY);
+		}
+
+		pageNumber = getPageNumber(virtualAddress);
+		entry = pageTable->virtual->page[pageNumber];
+
+		if (!entry)
+			return (status = ERR_NOSUCHENTRY);
+
+		pageTable->virtual->page[pageNumber] = (physicalAddress |
+			(entry & (MEMORY_PAGE_SIZE - 1) & ~(PROCESSOR_PAGEFLAG_RESERVED |
+			PROCESSOR_PAGEFLAG_ACCESSED | PROCESSOR_PAGEFLAG_DIRTY)) |
+			PROCESSOR_PAGEFLAG_PRESENT);
+
+		processorAddressCacheInvalidatePage(virtualAddress);
+
+		virtualAddress += MEMORY_PAGE_SIZE;
+		physicalAddress += MEMORY_PAGE_SIZE;
+	}
+
+	return (status = 0);
+}
+
+
 int kernelPageMapped(int processId, void *virtualAddress, unsigned size)
 {
 	// This function returns 1 if the range of pages are mapped, 0 if some or
@@ -1680,6 +2760,11 @@ unsigned kernelPageGetPhysical(int processId, void *virtualAddress)
 			virtualAddress);
 		return (address = NULL);
 	}
+	else if (!address)
+	{
+		// Not mapped, or reserved but not committed yet
+		return (address = NULL);
+	}
 	else
 	{
 		return (address + ((unsigned long) virtualAddress %
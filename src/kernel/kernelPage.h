@@ -30,6 +30,8 @@
 // Page mapping schemes
 #define PAGE_MAP_ANY			0x01
 #define PAGE_MAP_EXACT			0x02
+// Reserve the pages, without physical memory, to be committed later
+#define PAGE_MAP_RESERVE		0x04
 
 // Page caching types
 typedef enum {
@@ -56,12 +58,28 @@ typedef volatile struct {
 
 typedef kernelPageTablePhysicalMem kernelPageTableVirtualMem;
 
+// A range of free virtual pages.  Each page directory keeps a balanced tree
+// of these, ordered by address, so that finding a free range doesn't require
+// searching the page tables.
+typedef struct _kernelPageRange {
+	unsigned start;
+	unsigned pages;
+	unsigned maxPages;
+	unsigned totalPages;
+	int height;
+	struct _kernelPageRange *left;
+	struct _kernelPageRange *right;
+
+} kernelPageRange;
+
 typedef volatile struct {
 	int processId;
 	int numberShares;
 	int privilege;
 	kernelPageDirPhysicalMem *physical;
 	kernelPageDirVirtualMem *virtual;
+	kernelPageRange *freeRanges;
+	int freeRangesInvalid;
 	spinLock lock;
 
 } kernelPageDirectory;
@@ -85,6 +103,7 @@ typedef volatile struct {
 
 // Functions exported by kernelPage.c
 int kernelPageInitialize(unsigned);
+void kernelPageInitializeCpu(void);
 kernelPageDirectory *kernelPageGetDirectory(int);
 kernelPageDirectory *kernelPageNewDirectory(int);
 kernelPageDirectory *kernelPageShareDirectory(int, int);
@@ -92,6 +111,9 @@ int kernelPageDeleteDirectory(int);
 int kernelPageMap(int, unsigned, void *, unsigned);
 int kernelPageMapToFree(int, unsigned, void **, unsigned);
 int kernelPageUnmap(int, void *, unsigned);
+int kernelPageReserve(int, void **, unsigned);
+int kernelPageCommit(int, void *, unsigned);
+int kernelPageSetWindow(void *, unsigned, unsigned);
 int kernelPageMapped(int, void *, unsigned);
 unsigned kernelPageGetPhysical(int, void *);
 void *kernelPageFindFree(int, unsigned);
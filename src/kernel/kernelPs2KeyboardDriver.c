@@ -423,14 +423,14 @@ static void interrupt(void)
 
 	void *address = NULL;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 	kernelInterruptSetCurrent(INTERRUPT_NUM_KEYBOARD);
 
 	kernelDebug(debug_io, "Ps2Key keyboard interrupt");
 	readData();
 
 	kernelInterruptClearCurrent();
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
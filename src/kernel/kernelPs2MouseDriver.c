@@ -296,7 +296,7 @@ static void mouseInterrupt(void)
 
 	void *address = NULL;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 	kernelInterruptSetCurrent(INTERRUPT_NUM_MOUSE);
 
 	gotInterrupt += 1;
@@ -309,7 +309,7 @@ static void mouseInterrupt(void)
 	}
 
 	kernelInterruptClearCurrent();
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
@@ -253,7 +253,8 @@ static kernelDiskOps ramDiskOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	driverWriteSectors,
-	NULL	// driverFlush
+	NULL,	// driverFlush
+	NULL	// driverDiscardSectors
 };
 
 
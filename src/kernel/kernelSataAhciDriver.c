@@ -698,7 +698,7 @@ static void interruptHandler(void)
 	int serviced = 0;
 	int controllerCount, portCount;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 
 	// Which interrupt number is active?
 	interruptNum = kernelPicGetActive();
@@ -766,6 +766,20 @@ static void interruptHandler(void)
 								proc_ioready);
 							controller->port[portCount].waitProcess = 0;
 						}
+
+						// Queued commands can finish in any order, so wake
+						// up all the processes waiting for them, to check
+						// their own.  An error means that the port has to be
+						// restarted.
+						if (controller->port[portCount].queuedSlots &&
+							(controller->port[portCount].interruptStatus &
+								AHCI_PXIS_ERROR))
+						{
+							controller->port[portCount].queueRecover = 1;
+						}
+
+						kernelMultitaskerWaitQueueWakeAll(
+							&controller->port[portCount].waitQueue);
 					}
 				}
 
@@ -793,7 +807,7 @@ static void interruptHandler(void)
 	}
 
 out:
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
@@ -1226,13 +1240,14 @@ static int errorRecovery(ahciController *controller, int portNum)
 }
 
 
-static int issueCommand(ahciController *controller, int portNum,
+static int sendCommand(ahciController *controller, int portNum,
 	unsigned short feature, unsigned short sectorCount, unsigned short lbaLow,
 	unsigned short lbaMid, unsigned short lbaHigh, unsigned char dev,
 	unsigned char ataCommand, unsigned char *atapiPacket,
 	unsigned char *buffer, unsigned bufferLen, int write, unsigned timeout)
 {
-	// Issue a command on the requested port
+	// Send a non-queued command on the requested port.  There mustn't be any
+	// queued commands outstanding.
 
 	int status = 0;
 	ahciPortRegs *portRegs = &controller->regs->port[portNum];
@@ -1428,6 +1443,218 @@ out:
 }
 
 
+static void readNcqErrorLog(ahciController *controller, int portNum)
+{
+	// After a queued command fails, the disk aborts any other commands until
+	// its NCQ command error log has been read.  So read it, and report what
+	// it says.
+
+	unsigned char *log = NULL;
+	char errorString[256];
+
+	// The log is transferred by DMA, so it needs to be physically contiguous
+	log = kernelMemoryGetSystem(512, "ahci ncq error log");
+	if (!log)
+		return;
+
+	// The log address goes in the low byte of the LBA, and the page number
+	// in the next one.  The sector count is the number of pages.
+	if (sendCommand(controller, portNum, 0, 1, ATA_LOG_NCQERROR, 0, 0, 0,
+		ATA_READLOGEXT, NULL, log, 512, 0 /* read */, 0 /* default timeout */)
+			>= 0)
+	{
+		if (log[0] & ATA_NCQERROR_NQ)
+		{
+			kernelDebug(debug_io, "AHCI port %d NCQ error log - non-queued "
+				"command", portNum);
+		}
+		else
+		{
+			ataError2String(log[3], errorString);
+			kernelError(kernel_error, "AHCI port %d queued command tag %d "
+				"failed, status 0x%02x, error 0x%02x: %s", portNum,
+				(log[0] & ATA_NCQERROR_TAG), log[2], log[3], errorString);
+		}
+	}
+	else
+	{
+		kernelError(kernel_error, "AHCI port %d couldn't read the NCQ error "
+			"log", portNum);
+	}
+
+	kernelMemoryReleaseSystem(log);
+}
+
+
+static int portReset(ahciController *controller, int portNum)
+{
+	// Send a COMRESET to the device on the port, for when it won't come out
+	// of a busy state.  Port command processing must be stopped.
+
+	int status = 0;
+	ahciPortRegs *portRegs = &controller->regs->port[portNum];
+	int count;
+
+	kernelError(kernel_warn, "AHCI port %d device busy - resetting", portNum);
+
+	// Setting the DET field to 1 for at least 1ms sends the COMRESET
+	portRegs->SCTL = ((portRegs->SCTL & ~AHCI_PXSCTL_DET) | 1);
+	kernelCpuSpinMs(2);
+	portRegs->SCTL &= ~AHCI_PXSCTL_DET;
+
+	// Wait up to 1 second for the device to be detected again
+	for (count = 0; count < 1000; count ++)
+	{
+		if ((portRegs->SSTS & AHCI_PXSSTS_DET) == 0x0003)
+			break;
+
+		kernelCpuSpinMs(1);
+	}
+
+	// Establishing the link again sets error bits
+	portRegs->SERR |= AHCI_PXSERR_ALL;
+
+	if ((portRegs->SSTS & AHCI_PXSSTS_DET) != 0x0003)
+	{
+		kernelError(kernel_error, "AHCI port %d device lost after reset",
+			portNum);
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	// Wait up to 1 second for the device to be ready
+	for (count = 0; count < 1000; count ++)
+	{
+		if (!(portRegs->TFD & (AHCI_PXTFD_STS_BSY | AHCI_PXTFD_STS_DRQ)))
+			break;
+
+		kernelCpuSpinMs(1);
+	}
+
+	if (portRegs->TFD & (AHCI_PXTFD_STS_BSY | AHCI_PXTFD_STS_DRQ))
+	{
+		kernelError(kernel_error, "AHCI port %d device still busy after "
+			"reset", portNum);
+		return (status = ERR_TIMEOUT);
+	}
+
+	return (status = 0);
+}
+
+
+static void queueRecover(ahciController *controller, int portNum)
+{
+	// A queued command failed, or timed out.  The disk gives up on all of
+	// the outstanding ones when that happens, so fail them all, restart the
+	// port, and get the disk out of its error state so that the commands can
+	// be retried.  The caller must hold the port lock.
+
+	ahciPort *port = &controller->port[portNum];
+	ahciPortRegs *portRegs = &controller->regs->port[portNum];
+	unsigned failed = 0;
+	int interrupts = 0;
+
+	kernelError(kernel_warn, "AHCI port %d queued command error - restarting "
+		"port", portNum);
+
+	// Until the errors are recorded, nobody should take a slot that the port
+	// has forgotten about for one that finished
+	port->queueRecover = 1;
+
+	failed = (port->queuedSlots & (portRegs->SACT | portRegs->CI));
+
+	startStopPortCommands(controller, portNum, 0);
+	portRegs->SERR |= AHCI_PXSERR_ALL;
+	portRegs->IS |= (portRegs->IS & AHCI_PXIS_RWCBITS);
+	startStopPortCommands(controller, portNum, 1);
+
+	// Forget about the interrupts that the queued commands caused, so that
+	// they aren't mistaken for the completion of the commands below
+	processorSuspendInts(interrupts);
+	controller->portInterrupts &= ~(1 << portNum);
+	controller->port[portNum].interruptStatus = 0;
+	processorRestoreInts(interrupts);
+
+	if (portRegs->TFD & (AHCI_PXTFD_STS_BSY | AHCI_PXTFD_STS_DRQ))
+	{
+		// The device is stuck.  Reset it, which also clears its error state.
+		startStopPortCommands(controller, portNum, 0);
+		portReset(controller, portNum);
+		startStopPortCommands(controller, portNum, 1);
+	}
+	else
+	{
+		// The device won't take any more commands until the error log has
+		// been read
+		readNcqErrorLog(controller, portNum);
+	}
+
+	processorSuspendInts(interrupts);
+	port->queuedErrors |= failed;
+	port->queueRecover = 0;
+	controller->portInterrupts &= ~(1 << portNum);
+	processorRestoreInts(interrupts);
+
+	kernelMultitaskerWaitQueueWakeAll(&port->waitQueue);
+}
+
+
+static void queueDrain(ahciController *controller, int portNum)
+{
+	// Non-queued commands can't be issued while there are queued ones
+	// outstanding, so wait for them to finish.  The caller must hold the
+	// port lock, so that nobody issues any more in the meantime.
+
+	ahciPort *port = &controller->port[portNum];
+	ahciPortRegs *portRegs = &controller->regs->port[portNum];
+	uquad_t timeout = (kernelCpuGetMs() + AHCI_NCQ_TIMEOUT);
+	int interrupts = 0;
+
+	if (!portRegs->SACT)
+		return;
+
+	kernelDebug(debug_io, "AHCI port %d wait for queued commands", portNum);
+
+	while (portRegs->SACT)
+	{
+		if (port->queueRecover || (kernelCpuGetMs() > timeout))
+		{
+			queueRecover(controller, portNum);
+			break;
+		}
+
+		processorSuspendInts(interrupts);
+
+		if (portRegs->SACT && !port->queueRecover)
+			kernelMultitaskerWaitQueueSleep(&port->waitQueue,
+				AHCI_NCQ_TIMEOUT);
+
+		processorRestoreInts(interrupts);
+	}
+
+	// Forget about the interrupts that the queued commands caused
+	processorSuspendInts(interrupts);
+	controller->portInterrupts &= ~(1 << portNum);
+	processorRestoreInts(interrupts);
+}
+
+
+static int issueCommand(ahciController *controller, int portNum,
+	unsigned short feature, unsigned short sectorCount, unsigned short lbaLow,
+	unsigned short lbaMid, unsigned short lbaHigh, unsigned char dev,
+	unsigned char ataCommand, unsigned char *atapiPacket,
+	unsigned char *buffer, unsigned bufferLen, int write, unsigned timeout)
+{
+	// Issue a non-queued command on the requested port, once any queued
+	// ones have finished
+
+	queueDrain(controller, portNum);
+
+	return (sendCommand(controller, portNum, feature, sectorCount, lbaLow,
+		lbaMid, lbaHigh, dev, ataCommand, atapiPacket, buffer, bufferLen,
+		write, timeout));
+}
+
+
 static int setTransferMode(ahciController *controller, int portNum,
 	ataDmaMode *mode, ataIdentifyData *identData)
 {
@@ -1844,6 +2071,36 @@ static int detectDisks(kernelDriver *driver, kernelDevice *controllerDevice,
 			}
 		}
 
+		// Native command queuing, if both the controller and the disk
+		// support it.  The queue depth is the lesser of the disk's and the
+		// number of command slots.
+		if (!(physicalDisk->type & DISKTYPE_SATACDROM) &&
+			(controller->regs->CAP & AHCI_CAP_SNCQ) &&
+			(identData.field.sataCaps != 0xFFFF) &&
+			(identData.field.sataCaps & 0x0100) &&
+			(DISK(diskNum)->featureFlags & ATA_FEATURE_48BIT) &&
+			(DISK(diskNum)->featureFlags & ATA_FEATURE_DMA))
+		{
+			DISK(diskNum)->featureFlags |= ATA_FEATURE_NCQ;
+			physicalDisk->queueDepth = min(((identData.field.queueDepth &
+				0x1F) + 1), (int)(((controller->regs->CAP & AHCI_CAP_NCS) >>
+					8) + 1));
+
+			kernelLog("AHCI: Disk %d:%d NCQ queue depth %d",
+				controller->num, portNum, physicalDisk->queueDepth);
+		}
+
+		// TRIM is a DMA command, and only makes sense for (solid state) hard
+		// disks
+		if ((physicalDisk->type & DISKTYPE_SATACDROM) ||
+			!(DISK(diskNum)->featureFlags & ATA_FEATURE_DMA))
+		{
+			DISK(diskNum)->featureFlags &= ~ATA_FEATURE_TRIM;
+		}
+
+		if (DISK(diskNum)->featureFlags & ATA_FEATURE_TRIM)
+			physicalDisk->flags |= DISKFLAG_DISCARD;
+
 		// Initialize the variable list for attributes of the disk
 		status = variableListCreateSystem(&diskDevice->device.attrs);
 		if (status >= 0)
@@ -1879,6 +2136,12 @@ static int detectDisks(kernelDriver *driver, kernelDevice *controllerDevice,
 			if (DISK(diskNum)->featureFlags & ATA_FEATURE_48BIT)
 				strcat(value, ",48-bit");
 
+			if (DISK(diskNum)->featureFlags & ATA_FEATURE_NCQ)
+				strcat(value, ",NCQ");
+
+			if (DISK(diskNum)->featureFlags & ATA_FEATURE_TRIM)
+				strcat(value, ",TRIM");
+
 			variableListSet(&diskDevice->device.attrs, "disk.features",
 				value);
 		}
@@ -2233,6 +2496,238 @@ static int readWriteDma(ahciController *controller, ahciDisk *dsk,
 }
 
 
+static int queuedCommand(ahciController *controller, ahciDisk *dsk,
+	uquad_t logicalSector, unsigned numSectors, void *buffer, int write)
+{
+	// Issue a READ or WRITE FPDMA QUEUED command, and wait for it to finish.
+	// We only hold the port lock while issuing it, so other processes can
+	// issue theirs while we wait, up to the disk's queue depth, and the disk
+	// can do them in whatever order suits it.
+
+	int status = 0;
+	ahciPort *port = &controller->port[dsk->portNum];
+	ahciPortRegs *portRegs = &controller->regs->port[dsk->portNum];
+	unsigned bytes = (numSectors * dsk->physical.sectorSize);
+	unsigned numPrds = 0;
+	unsigned commandTableSize = 0;
+	unsigned commandTablePhysical = 0;
+	ahciCommandTable *commandTable = NULL;
+	ahciCommandHeader *commandHeader = NULL;
+	unsigned fisLen = 0;
+	int slotNum = -1;
+	unsigned slot = 0;
+	uquad_t slotTimeout = 0;
+	uquad_t timeout = 0;
+	uquad_t currTime = 0;
+	int interrupts = 0;
+	int count;
+
+	numPrds = ((bytes + (AHCI_PRD_MAXDATA - 1)) / AHCI_PRD_MAXDATA);
+
+	commandTableSize = allocCommandTable(numPrds, &commandTablePhysical,
+		&commandTable);
+	if (!commandTableSize)
+		return (status = ERR_MEMORY);
+
+	status = setupPrds(commandTable->prd, numPrds, buffer, bytes);
+	if (status < 0)
+		goto out;
+
+	slotTimeout = (kernelCpuGetMs() + AHCI_NCQ_TIMEOUT);
+
+	// Get the port lock, and a free slot
+	while (1)
+	{
+		status = kernelLockGet(&port->lock);
+		if (status < 0)
+			goto out;
+
+		if (port->queueRecover)
+			queueRecover(controller, dsk->portNum);
+
+		for (count = 0; count < dsk->physical.queueDepth; count ++)
+		{
+			if (!((portRegs->SACT | portRegs->CI | port->queuedSlots) &
+				(1 << count)))
+			{
+				slotNum = count;
+				break;
+			}
+		}
+
+		if (slotNum >= 0)
+			break;
+
+		kernelLockRelease(&port->lock);
+
+		if (kernelCpuGetMs() > slotTimeout)
+		{
+			kernelError(kernel_error, "No free command slot for port %d",
+				dsk->portNum);
+			status = ERR_NOFREE;
+			goto out;
+		}
+
+		// Wait for one of the others to finish
+		processorSuspendInts(interrupts);
+		if (port->queuedSlots)
+			kernelMultitaskerWaitQueueSleep(&port->waitQueue,
+				AHCI_NCQ_TIMEOUT);
+		processorRestoreInts(interrupts);
+	}
+
+	slot = (1 << slotNum);
+
+	kernelDebug(debug_io, "AHCI port %d queue %s %u at %llu using command "
+		"slot %d", dsk->portNum, (write? "write" : "read"), numSectors,
+		logicalSector, slotNum);
+
+	// The sector count goes in the features register, and the tag (which is
+	// the slot number) in the sector count register.  A count of 0 means
+	// 65536.
+	fisLen = makeCommandFis(commandTable, ((numSectors == 65536)? 0 :
+		numSectors), (slotNum << 3), (logicalSector & 0xFFFF),
+		((logicalSector >> 16) & 0xFFFF), ((logicalSector >> 32) & 0xFFFF),
+		0x40, (write? ATA_WRITEFPDMA : ATA_READFPDMA));
+
+	commandHeader = &port->commandList->command[slotNum];
+	memset((void *) commandHeader, 0, sizeof(ahciCommandHeader));
+	commandHeader->fisLen = ((fisLen >> 2) & 0x1F);
+	commandHeader->write = (write & 1);
+	commandHeader->prdDescTableEnts = numPrds;
+	commandHeader->cmdTablePhysAddr = commandTablePhysical;
+
+	// SACT and CI bits are set by writing 1s, and writing 0s does nothing,
+	// so don't read-modify-write them; other slots' bits might be cleared
+	// in between
+	processorSuspendInts(interrupts);
+	port->queuedSlots |= slot;
+	port->queuedErrors &= ~slot;
+	portRegs->SACT = slot;
+	portRegs->CI = slot;
+	processorRestoreInts(interrupts);
+
+	kernelLockRelease(&port->lock);
+
+	// The command's time starts now, not counting any wait for a slot
+	timeout = (kernelCpuGetMs() + AHCI_NCQ_TIMEOUT);
+
+	// Wait for it to finish
+	while (1)
+	{
+		processorSuspendInts(interrupts);
+
+		if (port->queuedErrors & slot)
+		{
+			status = ERR_IO;
+			break;
+		}
+
+		currTime = kernelCpuGetMs();
+
+		if (!port->queueRecover)
+		{
+			if (!((portRegs->SACT | portRegs->CI) & slot))
+			{
+				status = 0;
+				break;
+			}
+
+			if (currTime < timeout)
+			{
+				kernelMultitaskerWaitQueueSleep(&port->waitQueue,
+					(unsigned)(timeout - currTime));
+				processorRestoreInts(interrupts);
+				continue;
+			}
+		}
+
+		processorRestoreInts(interrupts);
+
+		// The port needs restarting, because of an error or because we
+		// timed out.  Unless somebody else beat us to it.
+		if (kernelLockGet(&port->lock) >= 0)
+		{
+			if (!(port->queuedErrors & slot) &&
+				(port->queueRecover || (currTime >= timeout)))
+			{
+				if (!port->queueRecover)
+					kernelError(kernel_error, "Queued command timeout");
+
+				queueRecover(controller, dsk->portNum);
+			}
+
+			kernelLockRelease(&port->lock);
+		}
+	}
+
+	// Give the slot back
+	port->queuedSlots &= ~slot;
+	port->queuedErrors &= ~slot;
+
+	processorRestoreInts(interrupts);
+
+	kernelMultitaskerWaitQueueWakeAll(&port->waitQueue);
+
+out:
+	if (commandTable)
+	{
+		kernelPageUnmap(KERNELPROCID, (void *) commandTable,
+			commandTableSize);
+	}
+
+	if (commandTablePhysical)
+		kernelMemoryReleasePhysical(commandTablePhysical);
+
+	return (status);
+}
+
+
+static int readWriteQueued(ahciController *controller, ahciDisk *dsk,
+	uquad_t logicalSector, uquad_t numSectors, void *buffer, int write)
+{
+	// Read or write using native command queuing.  If a queued command fails,
+	// try again without queuing.
+
+	int status = 0;
+	unsigned sectorsPerCommand = 0;
+	unsigned bytesPerCommand = 0;
+
+	while (numSectors > 0)
+	{
+		sectorsPerCommand = min(numSectors, 65536);
+		bytesPerCommand = (sectorsPerCommand * dsk->physical.sectorSize);
+
+		status = queuedCommand(controller, dsk, logicalSector,
+			sectorsPerCommand, buffer, write);
+
+		if (status < 0)
+		{
+			kernelDebug(debug_io, "AHCI port %d queued command failed - "
+				"retrying without queuing", dsk->portNum);
+
+			status = kernelLockGet(&controller->port[dsk->portNum].lock);
+			if (status < 0)
+				break;
+
+			status = readWriteDma(controller, dsk, logicalSector,
+				sectorsPerCommand, buffer, write);
+
+			kernelLockRelease(&controller->port[dsk->portNum].lock);
+
+			if (status < 0)
+				break;
+		}
+
+		buffer += bytesPerCommand;
+		numSectors -= sectorsPerCommand;
+		logicalSector += sectorsPerCommand;
+	}
+
+	return (status);
+}
+
+
 static int atapiSetLockState(ahciController *controller, ahciDisk *dsk,
 	int locked)
 {
@@ -2334,6 +2829,14 @@ static int readWriteSectors(int diskNum, uquad_t logicalSector,
 		return (status = ERR_BOUNDS);
 	}
 
+	if (dsk->featureFlags & ATA_FEATURE_NCQ)
+	{
+		// Queued commands only need the port lock while they're being
+		// issued
+		return (status = readWriteQueued(controller, dsk, logicalSector,
+			numSectors, buffer, write));
+	}
+
 	// Wait for a lock on the port
 	status = kernelLockGet(&controller->port[dsk->portNum].lock);
 	if (status < 0)
@@ -2578,6 +3081,65 @@ static int driverFlush(int diskNum)
 }
 
 
+static int driverDiscardSectors(int diskNum, uquad_t logicalSector,
+	uquad_t numSectors)
+{
+	// Tell a solid state disk that the contents of some sectors are no
+	// longer needed, using the TRIM function of DATA SET MANAGEMENT
+
+	int status = 0;
+	ahciController *controller = DISK_CTRL(diskNum);
+	ahciDisk *dsk = DISK(diskNum);
+	unsigned long long *ranges = NULL;
+
+	kernelDebug(debug_io, "AHCI disk on port %d discard %llu at %llu",
+		(diskNum & 0xFF), numSectors, logicalSector);
+
+	if (!controller || !dsk)
+	{
+		kernelError(kernel_error, "No such disk %d:%d", (diskNum >> 8),
+			(diskNum & 0xFF));
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	if (!(dsk->featureFlags & ATA_FEATURE_TRIM))
+		return (status = ERR_NOTIMPLEMENTED);
+
+	// The range list is transferred by DMA, so it needs to be physically
+	// contiguous
+	ranges = kernelMemoryGetSystem(512, "ahci trim ranges");
+	if (!ranges)
+		return (status = ERR_MEMORY);
+
+	// Wait for a lock on the port
+	status = kernelLockGet(&controller->port[dsk->portNum].lock);
+	if (status < 0)
+	{
+		kernelMemoryReleaseSystem(ranges);
+		return (status);
+	}
+
+	while (numSectors > 0)
+	{
+		kernelAtaTrimRanges(ranges, &logicalSector, &numSectors);
+
+		// One 512-byte block of ranges
+		status = issueCommand(controller, dsk->portNum, ATA_DSM_TRIM, 1, 0, 0,
+			0, 0x40, ATA_DATASETMGMT, NULL, (unsigned char *) ranges, 512,
+			1 /* write */, (10 * MS_PER_SEC) /* timeout 10s */);
+		if (status < 0)
+			break;
+	}
+
+	// Unlock the port
+	kernelLockRelease(&controller->port[dsk->portNum].lock);
+
+	kernelMemoryReleaseSystem(ranges);
+
+	return (status);
+}
+
+
 static kernelDiskOps ahciOps = {
 	NULL,	// driverSetMotorState
 	driverSetLockState,
@@ -2586,7 +3148,8 @@ static kernelDiskOps ahciOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	driverWriteSectors,
-	driverFlush
+	driverFlush,
+	driverDiscardSectors
 };
 
 
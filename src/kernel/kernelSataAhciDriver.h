@@ -38,6 +38,7 @@
 #define AHCI_RECVFIS_ALIGN	AHCI_RECVFIS_SIZE
 #define AHCI_PRD_MAXDATA	0x00400000
 #define AHCI_CMDTABLE_ALIGN	0x80
+#define AHCI_NCQ_TIMEOUT	(5 * MS_PER_SEC)
 
 // Bit definitions for HBA registers that we're interested in
 
@@ -301,6 +302,11 @@ typedef volatile struct {
 	ahciReceivedFises *recvFis;
 	int waitProcess;
 	unsigned interruptStatus;
+	// For native command queuing.  Each bit is a command slot.
+	unsigned queuedSlots;		// Issued, and the issuer hasn't finished
+	unsigned queuedErrors;		// Failed, or lost in restarting the port
+	int queueRecover;			// The port needs restarting
+	kernelWaitQueue waitQueue;
 	spinLock lock;
 
 } ahciPort;
@@ -31,6 +31,7 @@
 #include "kernelRandom.h"
 #include "kernelScsiDriver.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/processor.h>
 #include <sys/vis.h>
@@ -334,14 +335,58 @@ static int scsiInquiry(kernelScsiDisk *scsiDisk, unsigned char lun,
 }
 
 
+static int scsiInquiryVpd(kernelScsiDisk *scsiDisk, unsigned char lun,
+	unsigned char page, void *data, unsigned char length)
+{
+	// Do a SCSI 'inquiry' command for a page of vital product data.
+
+	int status = 0;
+	scsiCmd6 cmd6;
+	unsigned bytes = 0;
+
+	kernelDebug(debug_scsi, "SCSI inquiry VPD page 0x%02x", page);
+
+	memset(&cmd6, 0, sizeof(scsiCmd6));
+	cmd6.byte[0] = SCSI_CMD_INQUIRY;
+	cmd6.byte[1] = ((lun << 5) | 0x01 /* EVPD */);
+	cmd6.byte[2] = page;
+	cmd6.byte[4] = length;
+
+	if (scsiDisk->busTarget->bus->type == bus_usb)
+	{
+		// Set up the USB transaction, with the SCSI 'inquiry' command.
+		status = usbScsiCommand(scsiDisk, lun, (unsigned char *) &cmd6,
+			sizeof(scsiCmd6), data, length, &bytes, 0 /* default timeout */,
+			1 /* read */);
+		if ((status < 0) || (bytes < length))
+		{
+			kernelDebugError("SCSI inquiry VPD page 0x%02x failed", page);
+			if (status >= 0)
+				status = ERR_IO;
+			return (status);
+		}
+	}
+	else
+	{
+		kernelDebugError("Non-USB SCSI not supported");
+		return (status = ERR_NOTIMPLEMENTED);
+	}
+
+	kernelDebug(debug_scsi, "SCSI inquiry VPD successful");
+	return (status = 0);
+}
+
+
 static int scsiReadWrite(kernelScsiDisk *scsiDisk, unsigned char lun,
-	unsigned logicalSector, unsigned short numSectors, void *buffer, int read)
+	uquad_t logicalSector, unsigned numSectors, void *buffer, int read)
 {
-	// Do a SCSI 'read' or 'write' command
+	// Do a SCSI 'read' or 'write' command.  We use the 10-byte version if we
+	// can, and the 16-byte one for sectors or counts that don't fit in it.
 
 	int status = 0;
 	unsigned dataLength = 0;
-	scsiCmd10 cmd10;
+	scsiCmd16 cmd;
+	unsigned char cmdLength = 0;
 	unsigned bytes = 0;
 
 	dataLength = (numSectors * scsiDisk->sectorSize);
@@ -349,25 +394,46 @@ static int scsiReadWrite(kernelScsiDisk *scsiDisk, unsigned char lun,
 	kernelDebug(debug_scsi, "SCSI %s %u bytes sectorsize %u",
 		(read? "read" : "write"), dataLength, scsiDisk->sectorSize);
 
-	memset(&cmd10, 0, sizeof(scsiCmd10));
-	if (read)
-		cmd10.byte[0] = SCSI_CMD_READ10;
+	memset(&cmd, 0, sizeof(scsiCmd16));
+	if (((logicalSector + numSectors) <= 0xFFFFFFFFULL) &&
+		(numSectors <= 0xFFFF))
+	{
+		if (read)
+			cmd.byte[0] = SCSI_CMD_READ10;
+		else
+			cmd.byte[0] = SCSI_CMD_WRITE10;
+		cmd.byte[1] = (lun << 5);
+		*((unsigned *) &cmd.byte[2]) =
+			processorSwap32((unsigned) logicalSector);
+		*((unsigned short *) &cmd.byte[7]) = processorSwap16(numSectors);
+		cmdLength = sizeof(scsiCmd10);
+	}
 	else
-		cmd10.byte[0] = SCSI_CMD_WRITE10;
-	cmd10.byte[1] = (lun << 5);
-	*((unsigned *) &cmd10.byte[2]) = processorSwap32(logicalSector);
-	*((unsigned short *) &cmd10.byte[7]) = processorSwap16(numSectors);
+	{
+		if (read)
+			cmd.byte[0] = SCSI_CMD_READ16;
+		else
+			cmd.byte[0] = SCSI_CMD_WRITE16;
+		*((unsigned *) &cmd.byte[2]) =
+			processorSwap32((unsigned)(logicalSector >> 32));
+		*((unsigned *) &cmd.byte[6]) =
+			processorSwap32((unsigned) logicalSector);
+		*((unsigned *) &cmd.byte[10]) = processorSwap32(numSectors);
+		cmdLength = sizeof(scsiCmd16);
+	}
 
 	if (scsiDisk->busTarget->bus->type == bus_usb)
 	{
 		// Set up the USB transaction, with the SCSI 'read' or 'write' command.
-		status = usbScsiCommand(scsiDisk, lun, (unsigned char *) &cmd10,
-			sizeof(scsiCmd10), buffer, dataLength, &bytes,
+		status = usbScsiCommand(scsiDisk, lun, (unsigned char *) &cmd,
+			cmdLength, buffer, dataLength, &bytes,
 			(USB_STD_TIMEOUT_MS + (10 * numSectors)), read);
 		if ((status < 0) || (bytes < dataLength))
 		{
 			kernelError(kernel_error, "SCSI %s failed",
 				(read? "read" : "write"));
+			if (status >= 0)
+				status = ERR_IO;
 			return (status);
 		}
 	}
@@ -424,6 +490,91 @@ static int scsiReadCapacity(kernelScsiDisk *scsiDisk, unsigned char lun,
 }
 
 
+static int scsiReadCapacity16(kernelScsiDisk *scsiDisk, unsigned char lun,
+	scsiCapacityData16 *capacityData)
+{
+	// Do a SCSI 'read capacity (16)' command, for disks with too many
+	// sectors for the 10-byte version.
+
+	int status = 0;
+	scsiCmd16 cmd16;
+	unsigned bytes = 0;
+
+	kernelDebug(debug_scsi, "SCSI read capacity (16)");
+	memset(&cmd16, 0, sizeof(scsiCmd16));
+	cmd16.byte[0] = SCSI_CMD_SERVICEACTIONIN16;
+	cmd16.byte[1] = SCSI_SAI_READCAPACITY16;
+	*((unsigned *) &cmd16.byte[10]) =
+		processorSwap32(sizeof(scsiCapacityData16));
+
+	if (scsiDisk->busTarget->bus->type == bus_usb)
+	{
+		// Set up the USB transaction, with the SCSI 'read capacity (16)'
+		// command.
+		status = usbScsiCommand(scsiDisk, lun, (unsigned char *) &cmd16,
+			sizeof(scsiCmd16), capacityData, sizeof(scsiCapacityData16),
+			&bytes, 0 /* default timeout */, 1 /* read */);
+		if ((status < 0) || (bytes < 12))
+		{
+			kernelError(kernel_error, "SCSI read capacity (16) failed");
+			if (status >= 0)
+				status = ERR_IO;
+			return (status);
+		}
+	}
+	else
+	{
+		kernelDebugError("Non-USB SCSI not supported");
+		return (status = ERR_NOTIMPLEMENTED);
+	}
+
+	// Swap bytes around
+	capacityData->blockNumberHi = processorSwap32(capacityData->blockNumberHi);
+	capacityData->blockNumberLo = processorSwap32(capacityData->blockNumberLo);
+	capacityData->blockLength = processorSwap32(capacityData->blockLength);
+
+	kernelDebug(debug_scsi, "SCSI read capacity (16) successful");
+	return (status = 0);
+}
+
+
+static int scsiUnmap(kernelScsiDisk *scsiDisk, unsigned char lun,
+	scsiUnmapParams *params, unsigned short length)
+{
+	// Do a SCSI 'unmap' command.
+
+	int status = 0;
+	scsiCmd10 cmd10;
+
+	kernelDebug(debug_scsi, "SCSI unmap");
+	memset(&cmd10, 0, sizeof(scsiCmd10));
+	cmd10.byte[0] = SCSI_CMD_UNMAP;
+	*((unsigned short *) &cmd10.byte[7]) = processorSwap16(length);
+
+	if (scsiDisk->busTarget->bus->type == bus_usb)
+	{
+		// Set up the USB transaction, with the SCSI 'unmap' command.  Give
+		// it a longer timeout, since the disk might do the work right away.
+		status = usbScsiCommand(scsiDisk, lun, (unsigned char *) &cmd10,
+			sizeof(scsiCmd10), params, length, NULL,
+			(USB_STD_TIMEOUT_MS * 5), 0 /* write */);
+		if (status < 0)
+		{
+			kernelError(kernel_error, "SCSI unmap failed");
+			return (status);
+		}
+	}
+	else
+	{
+		kernelDebugError("Non-USB SCSI not supported");
+		return (status = ERR_NOTIMPLEMENTED);
+	}
+
+	kernelDebug(debug_scsi, "SCSI unmap successful");
+	return (status = 0);
+}
+
+
 static int scsiRequestSense(kernelScsiDisk *scsiDisk, unsigned char lun,
 	scsiSenseData *senseData)
 {
@@ -636,6 +787,8 @@ static kernelPhysicalDisk *detectTarget(void *parent, int busType,
 	scsiSenseData senseData;
 	scsiInquiryData inquiryData;
 	scsiCapacityData capacityData;
+	scsiCapacityData16 capacityData16;
+	scsiBlockLimitsData blockLimits;
 	int retries = 0;
 	int count;
 
@@ -795,6 +948,8 @@ static kernelPhysicalDisk *detectTarget(void *parent, int busType,
 	if (status < 0)
 		goto err_out;
 
+	scsiDisk->unitReady = 1;
+
 	// Spin up the new target by sending 'start unit' command
 	status = scsiStartStopUnit(scsiDisk, 0, 1, 0);
 	if (status < 0)
@@ -805,9 +960,47 @@ static kernelPhysicalDisk *detectTarget(void *parent, int busType,
 	if (status < 0)
 		goto err_out;
 
-	scsiDisk->numSectors = (capacityData.blockNumber + 1);
+	scsiDisk->numSectors = ((uquad_t) capacityData.blockNumber + 1);
 	scsiDisk->sectorSize = capacityData.blockLength;
 
+	// If the disk is too big for that, it should support the 16-byte
+	// version.  So should disks that implement SPC-3 or later, which also
+	// say there whether they can unmap (discard) sectors.
+	memset(&capacityData16, 0, sizeof(scsiCapacityData16));
+	if ((capacityData.blockNumber == 0xFFFFFFFF) ||
+		((inquiryData.byte2.ansiVersion & 0x07) >= 5))
+	{
+		status = scsiReadCapacity16(scsiDisk, 0, &capacityData16);
+		if (status < 0)
+		{
+			if (capacityData.blockNumber == 0xFFFFFFFF)
+				goto err_out;
+
+			memset(&capacityData16, 0, sizeof(scsiCapacityData16));
+		}
+		else
+		{
+			scsiDisk->numSectors = ((((uquad_t) capacityData16.blockNumberHi
+				<< 32) | capacityData16.blockNumberLo) + 1);
+			scsiDisk->sectorSize = capacityData16.blockLength;
+		}
+	}
+
+	// If it can unmap, find out how much at once
+	if ((capacityData16.provisioning & SCSI_CAP16_LBPME) &&
+		(scsiInquiryVpd(scsiDisk, 0, SCSI_VPD_BLOCKLIMITS, &blockLimits,
+			sizeof(scsiBlockLimitsData)) >= 0))
+	{
+		scsiDisk->unmapMaxBlocks = processorSwap32(blockLimits.maxUnmapCount);
+		scsiDisk->unmapMaxDescs = min(processorSwap32(blockLimits
+			.maxUnmapDescs), SCSI_UNMAP_MAXDESCS);
+		if (!scsiDisk->unmapMaxDescs)
+			scsiDisk->unmapMaxBlocks = 0;
+
+		kernelDebug(debug_scsi, "SCSI unmap max %u blocks, %u descriptors",
+			scsiDisk->unmapMaxBlocks, scsiDisk->unmapMaxDescs);
+	}
+
 	if ((scsiDisk->sectorSize <= 0) || (scsiDisk->sectorSize > 4096))
 	{
 		kernelError(kernel_error, "Unsupported sector size %u",
@@ -815,7 +1008,7 @@ static kernelPhysicalDisk *detectTarget(void *parent, int busType,
 		goto err_out;
 	}
 
-	kernelDebug(debug_scsi, "SCSI disk \"%s\" sectors %u sectorsize %u",
+	kernelDebug(debug_scsi, "SCSI disk \"%s\" sectors %llu sectorsize %u",
 		scsiDisk->vendorProductId, scsiDisk->numSectors, scsiDisk->sectorSize);
 
 	physicalDisk->deviceNumber = getNewDiskNumber();
@@ -824,6 +1017,8 @@ static kernelPhysicalDisk *detectTarget(void *parent, int busType,
 	physicalDisk->description = scsiDisk->vendorProductId;
 	physicalDisk->type |= (DISKTYPE_PHYSICAL | DISKTYPE_SCSIDISK);
 	physicalDisk->flags = DISKFLAG_MOTORON;
+	if (scsiDisk->unmapMaxBlocks)
+		physicalDisk->flags |= DISKFLAG_DISCARD;
 	physicalDisk->numSectors = scsiDisk->numSectors;
 	guessDiskGeom(physicalDisk);
 	physicalDisk->sectorSize = scsiDisk->sectorSize;
@@ -961,6 +1156,8 @@ static int readWriteSectors(int driveNum, uquad_t logicalSector,
 
 	int status = 0;
 	kernelScsiDisk *scsiDisk = NULL;
+	unsigned maxSectors = 0;
+	unsigned doSectors = 0;
 
 	// Check params
 	if (!buffer)
@@ -981,17 +1178,40 @@ static int readWriteSectors(int driveNum, uquad_t logicalSector,
 		return (status = ERR_NOSUCHENTRY);
 	}
 
-	// Send a 'test unit ready' command
-	status = scsiTestUnitReady(scsiDisk, 0);
-	if (status < 0)
-		return (status);
+	// Send a 'test unit ready' command, unless the last command succeeded.
+	// It's a whole extra command for each read or write otherwise.
+	if (!scsiDisk->unitReady)
+	{
+		status = scsiTestUnitReady(scsiDisk, 0);
+		if (status < 0)
+			return (status);
+
+		scsiDisk->unitReady = 1;
+	}
 
 	kernelDebug(debug_scsi, "SCSI %s %llu sectors on \"%s\" at %llu sectorsize "
 		"%u", (read? "read" : "write"), numSectors, scsiDisk->vendorProductId,
 		logicalSector, scsiDisk->sectorSize);
 
-	status = scsiReadWrite(scsiDisk, 0, logicalSector, numSectors, buffer,
-		read);
+	maxSectors = max((SCSI_MAX_TRANSFER / scsiDisk->sectorSize), 1);
+
+	while (numSectors)
+	{
+		doSectors = min(numSectors, maxSectors);
+
+		status = scsiReadWrite(scsiDisk, 0, logicalSector, doSectors, buffer,
+			read);
+		if (status < 0)
+		{
+			// Check that it's ready before the next command
+			scsiDisk->unitReady = 0;
+			break;
+		}
+
+		logicalSector += doSectors;
+		numSectors -= doSectors;
+		buffer += (doSectors * scsiDisk->sectorSize);
+	}
 
 	return (status);
 }
@@ -1023,6 +1243,75 @@ static int driverWriteSectors(int driveNum, uquad_t logicalSector,
 }
 
 
+static int driverDiscardSectors(int driveNum, uquad_t logicalSector,
+	uquad_t numSectors)
+{
+	// Tell the disk that the contents of some sectors are no longer needed,
+	// using the 'unmap' command.
+
+	int status = 0;
+	kernelScsiDisk *scsiDisk = NULL;
+	scsiUnmapParams *params = NULL;
+	unsigned doSectors = 0;
+	unsigned count = 0;
+	unsigned length = 0;
+
+	// Find the disk based on the disk number
+	scsiDisk = findDiskByNumber(driveNum);
+	if (!scsiDisk)
+	{
+		kernelError(kernel_error, "No such disk, device number %d", driveNum);
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	if (!scsiDisk->unmapMaxBlocks)
+		return (status = ERR_NOTIMPLEMENTED);
+
+	kernelDebug(debug_scsi, "SCSI unmap %llu sectors on \"%s\" at %llu",
+		numSectors, scsiDisk->vendorProductId, logicalSector);
+
+	params = kernelMalloc(SCSI_UNMAP_PARAMSIZE);
+	if (!params)
+		return (status = ERR_MEMORY);
+
+	while (numSectors)
+	{
+		memset(params, 0, SCSI_UNMAP_PARAMSIZE);
+
+		for (count = 0; ((count < scsiDisk->unmapMaxDescs) && numSectors);
+			count ++)
+		{
+			doSectors = min(numSectors, scsiDisk->unmapMaxBlocks);
+
+			params->desc[count].blockNumberHi =
+				processorSwap32((unsigned)(logicalSector >> 32));
+			params->desc[count].blockNumberLo =
+				processorSwap32((unsigned) logicalSector);
+			params->desc[count].numBlocks = processorSwap32(doSectors);
+
+			logicalSector += doSectors;
+			numSectors -= doSectors;
+		}
+
+		length = (sizeof(scsiUnmapParams) + (count * sizeof(scsiUnmapDesc)));
+		params->dataLength = processorSwap16(length - 2);
+		params->descLength = processorSwap16(count * sizeof(scsiUnmapDesc));
+
+		status = scsiUnmap(scsiDisk, 0, params, length);
+		if (status < 0)
+		{
+			// Check that it's ready before the next command
+			scsiDisk->unitReady = 0;
+			break;
+		}
+	}
+
+	kernelFree(params);
+
+	return (status);
+}
+
+
 static int driverDetect(void *parent __attribute__((unused)),
 	kernelDriver *driver)
 {
@@ -1160,7 +1449,8 @@ static kernelDiskOps scsiOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	driverWriteSectors,
-	NULL	// driverFlush
+	NULL,	// driverFlush
+	driverDiscardSectors
 };
 
 
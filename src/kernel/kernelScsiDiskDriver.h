@@ -24,17 +24,28 @@
 
 #include "kernelBus.h"
 #include "kernelUsbDriver.h"
+#include <sys/types.h>
 
 #define SCSI_MAX_DISKS	16
 
+// The most we read or write with a single command
+#define SCSI_MAX_TRANSFER	(1024 * 1024)
+
+// The most block descriptors we put in a single 'unmap' command
+#define SCSI_UNMAP_PARAMSIZE	512
+#define SCSI_UNMAP_MAXDESCS		((SCSI_UNMAP_PARAMSIZE - 8) / 16)
+
 typedef struct {
 	kernelBusTarget *busTarget;
 	kernelDevice dev;
 	char vendorId[9];
 	char productId[17];
 	char vendorProductId[26];
-	unsigned numSectors;
+	uquad_t numSectors;
 	unsigned sectorSize;
+	int unitReady;
+	unsigned unmapMaxBlocks;	// Per block descriptor; 0 if no 'unmap'
+	unsigned unmapMaxDescs;
 	struct {
 		usbDevice *usbDev;
 		unsigned char bulkInEndpoint;
@@ -37,16 +37,30 @@
 #define SCSI_CMD_RCVDIAGRESULTS		0x1C
 #define SCSI_CMD_READ6				0x08
 #define SCSI_CMD_READ10				0x28
+#define SCSI_CMD_READ16				0x88
 #define SCSI_CMD_READBUFFER			0x3C
 #define SCSI_CMD_READCAPACITY		0x25
 #define SCSI_CMD_REQUESTSENSE		0x03
 #define SCSI_CMD_SENDDIAGNOSTIC		0x1D
+#define SCSI_CMD_SERVICEACTIONIN16	0x9E
 #define SCSI_CMD_STARTSTOPUNIT		0x1B
 #define SCSI_CMD_TESTUNITREADY		0x00
+#define SCSI_CMD_UNMAP				0x42
 #define SCSI_CMD_WRITE6				0x0A
 #define SCSI_CMD_WRITE10			0x2A
+#define SCSI_CMD_WRITE16			0x8A
 #define SCSI_CMD_WRITEBUFFER		0x3B
 
+// SCSI 'service action in (16)' service actions
+#define SCSI_SAI_READCAPACITY16		0x10
+
+// SCSI 'inquiry' vital product data pages
+#define SCSI_VPD_BLOCKLIMITS		0xB0
+
+// SCSI 'read capacity (16)' logical block provisioning bits
+#define SCSI_CAP16_LBPME			0x80	// Provisioning management enabled
+#define SCSI_CAP16_LBPRZ			0x40	// Unmapped blocks read as zeros
+
 // SCSI status codes
 #define SCSI_STAT_MASK				0x3E
 #define SCSI_STAT_GOOD				0x00
@@ -245,6 +259,11 @@ typedef struct {
 
 } __attribute__((packed)) scsiCmd12;
 
+typedef struct {
+	unsigned char byte[16];
+
+} __attribute__((packed)) scsiCmd16;
+
 typedef struct {
 	union {
 		unsigned char periQual;		// 7-5 |
@@ -310,6 +329,52 @@ typedef struct {
 
 } __attribute__((packed)) scsiCapacityData;
 
+typedef struct {
+	unsigned blockNumberHi;
+	unsigned blockNumberLo;
+	unsigned blockLength;
+	unsigned char protection;
+	unsigned char exponents;
+	unsigned char provisioning;
+	unsigned char lowestAligned;
+	unsigned char res[16];
+
+} __attribute__((packed)) scsiCapacityData16;
+
+typedef struct {
+	unsigned char periDevType;
+	unsigned char pageCode;
+	unsigned short pageLength;
+	unsigned char flags;
+	unsigned char maxCompareWrite;
+	unsigned short optTransferGran;
+	unsigned maxTransferLength;
+	unsigned optTransferLength;
+	unsigned maxPrefetchLength;
+	unsigned maxUnmapCount;
+	unsigned maxUnmapDescs;
+	unsigned optUnmapGran;
+	unsigned unmapGranAlign;
+	unsigned char res[28];
+
+} __attribute__((packed)) scsiBlockLimitsData;
+
+typedef struct {
+	unsigned blockNumberHi;
+	unsigned blockNumberLo;
+	unsigned numBlocks;
+	unsigned res;
+
+} __attribute__((packed)) scsiUnmapDesc;
+
+typedef struct {
+	unsigned short dataLength;
+	unsigned short descLength;
+	unsigned res;
+	scsiUnmapDesc desc[];
+
+} __attribute__((packed)) scsiUnmapParams;
+
 typedef struct {
 	unsigned char validErrCode;
 	unsigned char segment;
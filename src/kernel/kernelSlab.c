@@ -0,0 +1,380 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2023 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  kernelSlab.c
+//
+
+// These functions implement caches of fixed-size kernel objects.  Each cache
+// gets system memory in 'slabs', which are carved up into equal-sized slots,
+// so that the kernel's most frequently-allocated structures don't all have
+// to go through kernelMalloc(), and so that we can account for the memory
+// used by each type.
+
+#include "kernelSlab.h"
+#include "kernelError.h"
+#include "kernelInterrupt.h"
+#include "kernelLock.h"
+#include "kernelMemory.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/vis.h>
+
+// All the caches, for statistics
+static kernelSlabCache *caches[MEMORY_MAX_CACHES];
+static int numCaches = 0;
+static spinLock cachesLock;
+
+// Linked list items are used all over the kernel, via libvis, which doesn't
+// have a module of its own in the kernel to keep their cache
+static kernelSlabCache listItemCache;
+
+#define slabHeaderSize() \
+	(((sizeof(kernelSlab) + (SLAB_OBJECT_ALIGN - 1)) / SLAB_OBJECT_ALIGN) * \
+		SLAB_OBJECT_ALIGN)
+
+
+static inline void slabListAdd(kernelSlab **list, kernelSlab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *list;
+
+	if (*list)
+		(*list)->prev = slab;
+
+	*list = slab;
+}
+
+
+static inline void slabListRemove(kernelSlab **list, kernelSlab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+
+	if (slab->next)
+		slab->next->prev = slab->prev;
+
+	slab->prev = slab->next = NULL;
+}
+
+
+static kernelSlab *newSlab(kernelSlabCache *cache)
+{
+	// Get system memory for a new slab, and link all of its slots into its
+	// list of free objects.  Each slot starts with a pointer back to the
+	// slab, and the object follows.
+
+	kernelSlab *slab = NULL;
+	void *slot = NULL;
+	int count;
+
+	slab = kernelMemoryGetSystem(cache->slabSize, cache->name);
+	if (!slab)
+		return (slab);
+
+	slab->cache = cache;
+
+	for (count = (cache->objectsPerSlab - 1); count >= 0; count --)
+	{
+		slot = ((void *) slab + slabHeaderSize() + (count * cache->slotSize));
+		*((kernelSlab **) slot) = slab;
+		*((void **)(slot + SLAB_OBJECT_ALIGN)) = slab->freeObjects;
+		slab->freeObjects = (slot + SLAB_OBJECT_ALIGN);
+	}
+
+	cache->slabs += 1;
+
+	return (slab);
+}
+
+
+static void releaseSlab(kernelSlab *slab)
+{
+	slab->cache->slabs -= 1;
+	kernelMemoryReleaseSystem(slab);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+//
+//  Below here, the functions are exported for external use
+//
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+int kernelSlabInitialize(void)
+{
+	// Set up the cache that the kernel's linked lists use.  Other caches
+	// belong to the subsystems that use them.
+
+	memset(caches, 0, sizeof(caches));
+	numCaches = 0;
+	memset((void *) &cachesLock, 0, sizeof(spinLock));
+
+	return (kernelSlabCacheInit(&listItemCache, "linked list items",
+		sizeof(linkedListItem), NULL /* no constructor */));
+}
+
+
+int kernelSlabCacheInit(kernelSlabCache *cache, const char *name,
+	unsigned objectSize, void (*constructor)(void *))
+{
+	// Set up a cache of objects of the requested size.  If there's a
+	// constructor, it's called on each object as it's allocated, after the
+	// object has been cleared.
+
+	int status = 0;
+
+	// Check params.  The constructor is allowed to be NULL.
+	if (!cache || !name)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (status = ERR_NULLPARAMETER);
+	}
+
+	if (!objectSize)
+	{
+		kernelError(kernel_error, "Object size is 0");
+		return (status = ERR_INVALID);
+	}
+
+	memset((void *) cache, 0, sizeof(kernelSlabCache));
+
+	strncpy(cache->name, name, MEMORY_MAX_DESC_LENGTH);
+	cache->objectSize = objectSize;
+	cache->constructor = constructor;
+
+	// Free objects hold the pointer to the next free object
+	if (objectSize < sizeof(void *))
+		objectSize = sizeof(void *);
+
+	cache->slotSize = (SLAB_OBJECT_ALIGN + (((objectSize +
+		(SLAB_OBJECT_ALIGN - 1)) / SLAB_OBJECT_ALIGN) * SLAB_OBJECT_ALIGN));
+
+	cache->slabSize = (slabHeaderSize() + (SLAB_MIN_OBJECTS *
+		cache->slotSize));
+	if (cache->slabSize < SLAB_MIN_SIZE)
+		cache->slabSize = SLAB_MIN_SIZE;
+	cache->slabSize = (((cache->slabSize + (MEMORY_BLOCK_SIZE - 1)) /
+		MEMORY_BLOCK_SIZE) * MEMORY_BLOCK_SIZE);
+
+	cache->objectsPerSlab = ((cache->slabSize - slabHeaderSize()) /
+		cache->slotSize);
+
+	// Add it to the list of caches
+	status = kernelLockGet(&cachesLock);
+	if (status < 0)
+		return (status);
+
+	if (numCaches < MEMORY_MAX_CACHES)
+		caches[numCaches++] = cache;
+	else
+		kernelError(kernel_warn, "Too many caches to keep statistics for %s",
+			name);
+
+	kernelLockRelease(&cachesLock);
+
+	return (status = 0);
+}
+
+
+void *kernelSlabAlloc(kernelSlabCache *cache)
+{
+	// Get a cleared object from the cache
+
+	kernelSlab *slab = NULL;
+	void *object = NULL;
+
+	// Check params
+	if (!cache)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (object = NULL);
+	}
+
+	if (kernelProcessingInterrupt())
+		return (object = NULL);
+
+	if (kernelLockGet(&cache->lock) < 0)
+		return (object = NULL);
+
+	// Prefer a slab that's already partly used, then the spare empty one,
+	// before getting a new one
+	slab = cache->partialSlabs;
+	if (!slab)
+	{
+		if (cache->emptySlab)
+		{
+			slab = cache->emptySlab;
+			cache->emptySlab = NULL;
+		}
+		else
+		{
+			slab = newSlab(cache);
+			if (!slab)
+			{
+				kernelLockRelease(&cache->lock);
+				return (object = NULL);
+			}
+		}
+
+		slabListAdd(&cache->partialSlabs, slab);
+	}
+
+	object = slab->freeObjects;
+	slab->freeObjects = *((void **) object);
+	slab->usedObjects += 1;
+
+	if (slab->usedObjects >= cache->objectsPerSlab)
+	{
+		slabListRemove(&cache->partialSlabs, slab);
+		slabListAdd(&cache->fullSlabs, slab);
+	}
+
+	cache->usedObjects += 1;
+	cache->allocs += 1;
+
+	kernelLockRelease(&cache->lock);
+
+	memset(object, 0, cache->objectSize);
+
+	if (cache->constructor)
+		cache->constructor(object);
+
+	return (object);
+}
+
+
+int kernelSlabFree(kernelSlabCache *cache, void *object)
+{
+	// Return an object to the cache it came from
+
+	int status = 0;
+	kernelSlab *slab = NULL;
+
+	// Check params
+	if (!cache || !object)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (status = ERR_NULLPARAMETER);
+	}
+
+	if (kernelProcessingInterrupt())
+		return (status = ERR_INVALID);
+
+	slab = *((kernelSlab **)(object - SLAB_OBJECT_ALIGN));
+	if (!slab || (slab->cache != cache))
+	{
+		kernelError(kernel_error, "Object %p is not from cache %s", object,
+			cache->name);
+		return (status = ERR_INVALID);
+	}
+
+	status = kernelLockGet(&cache->lock);
+	if (status < 0)
+		return (status);
+
+	if (slab->usedObjects >= cache->objectsPerSlab)
+	{
+		slabListRemove(&cache->fullSlabs, slab);
+		slabListAdd(&cache->partialSlabs, slab);
+	}
+
+	*((void **) object) = slab->freeObjects;
+	slab->freeObjects = object;
+	slab->usedObjects -= 1;
+
+	// Keep one empty slab around, so that a cache hovering around a slab
+	// boundary doesn't keep getting and releasing memory
+	if (!slab->usedObjects)
+	{
+		slabListRemove(&cache->partialSlabs, slab);
+
+		if (!cache->emptySlab)
+			cache->emptySlab = slab;
+		else
+			releaseSlab(slab);
+	}
+
+	cache->usedObjects -= 1;
+	cache->frees += 1;
+
+	kernelLockRelease(&cache->lock);
+
+	return (status = 0);
+}
+
+
+void *kernelSlabListItemGet(void)
+{
+	// Used by libvis, for linked list items
+	return (kernelSlabAlloc(&listItemCache));
+}
+
+
+void kernelSlabListItemRelease(void *item)
+{
+	// Used by libvis, for linked list items
+	kernelSlabFree(&listItemCache, item);
+}
+
+
+int kernelSlabGetCaches(memoryCacheStats *stats, unsigned buffSize)
+{
+	// Fill a memoryCacheStats array with information about each cache, up
+	// to buffSize bytes.  Returns the number filled in.
+
+	int status = 0;
+	int doCaches = 0;
+	int count;
+
+	// Check params
+	if (!stats)
+	{
+		kernelError(kernel_error, "NULL parameter");
+		return (status = ERR_NULLPARAMETER);
+	}
+
+	status = kernelLockGet(&cachesLock);
+	if (status < 0)
+		return (status);
+
+	doCaches = min(numCaches, (int)(buffSize / sizeof(memoryCacheStats)));
+
+	for (count = 0; count < doCaches; count ++)
+	{
+		memset(&stats[count], 0, sizeof(memoryCacheStats));
+		strncpy(stats[count].name, caches[count]->name,
+			MEMORY_MAX_DESC_LENGTH);
+		stats[count].objectSize = caches[count]->objectSize;
+		stats[count].slabs = caches[count]->slabs;
+		stats[count].slabSize = caches[count]->slabSize;
+		stats[count].totalObjects = (caches[count]->slabs *
+			caches[count]->objectsPerSlab);
+		stats[count].usedObjects = caches[count]->usedObjects;
+		stats[count].allocs = caches[count]->allocs;
+		stats[count].frees = caches[count]->frees;
+	}
+
+	kernelLockRelease(&cachesLock);
+
+	return (status = doCaches);
+}
+
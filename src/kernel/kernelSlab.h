@@ -0,0 +1,77 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2023 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  kernelSlab.h
+//
+
+// This header file contains definitions for the kernel's caches of
+// fixed-size objects
+
+#ifndef _KERNELSLAB_H
+#define _KERNELSLAB_H
+
+#include <sys/lock.h>
+#include <sys/memory.h>
+
+// Each slab is at least this big, and big enough for at least this many
+// objects
+#define SLAB_MIN_SIZE			(16 * 1024)
+#define SLAB_MIN_OBJECTS		32
+// Objects are aligned to this, and each one is preceded by this many bytes
+// which point back at its slab
+#define SLAB_OBJECT_ALIGN		8
+
+typedef struct _kernelSlab {
+	struct _kernelSlab *prev;
+	struct _kernelSlab *next;
+	struct _kernelSlabCache *cache;
+	void *freeObjects;
+	int usedObjects;
+
+} kernelSlab;
+
+typedef struct _kernelSlabCache {
+	char name[MEMORY_MAX_DESC_LENGTH + 1];
+	unsigned objectSize;
+	unsigned slotSize;
+	unsigned slabSize;
+	int objectsPerSlab;
+	void (*constructor)(void *);
+	kernelSlab *partialSlabs;
+	kernelSlab *fullSlabs;
+	kernelSlab *emptySlab;
+	unsigned slabs;
+	unsigned usedObjects;
+	unsigned allocs;
+	unsigned frees;
+	spinLock lock;
+
+} kernelSlabCache;
+
+// Functions exported by kernelSlab.c
+int kernelSlabInitialize(void);
+int kernelSlabCacheInit(kernelSlabCache *, const char *, unsigned,
+	void (*)(void *));
+void *kernelSlabAlloc(kernelSlabCache *);
+int kernelSlabFree(kernelSlabCache *, void *);
+void *kernelSlabListItemGet(void);
+void kernelSlabListItemRelease(void *);
+int kernelSlabGetCaches(memoryCacheStats *, unsigned);
+
+#endif
+
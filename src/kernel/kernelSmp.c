@@ -0,0 +1,688 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2023 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  kernelSmp.c
+//
+
+// This file contains the kernel's multiprocessor support.  It starts the
+// application processors (APs) listed in the multiprocessor tables, and
+// provides the 'big kernel lock' which allows only one processor at a time to
+// run kernel code, plus the inter-processor interrupts used for rescheduling
+// and TLB shootdowns.
+//
+// The kernel lock is a fair ticket lock, which a processor can take
+// recursively.  It's taken on every entry into the kernel (API calls,
+// interrupts, exceptions) and released on the way out.  The depth is saved
+// and restored for each process by the multitasker's context switch, so a
+// processor keeps holding the lock while it switches from one process to
+// another inside the kernel.  User code, and the idle threads, run without
+// it.
+
+#include "kernelSmp.h"
+#include "kernelApicDriver.h"
+#include "kernelCpu.h"
+#include "kernelDebug.h"
+#include "kernelDescriptor.h"
+#include "kernelDevice.h"
+#include "kernelError.h"
+#include "kernelLog.h"
+#include "kernelMalloc.h"
+#include "kernelMemory.h"
+#include "kernelMultitasker.h"
+#include "kernelPage.h"
+#include "kernelParameters.h"
+#include "kernelSysTimer.h"
+#include "kernelSystemDriver.h"
+#include <string.h>
+#include <sys/multiproc.h>
+#include <sys/processor.h>
+
+// Per-CPU data
+typedef volatile struct {
+	int started;
+	int online;
+	int apicId;
+	int lockDepth;
+	int wantLock;
+	unsigned tlbGeneration;
+	unsigned timerCount;
+	uquad_t untimedSince;
+
+} smpCpu;
+
+// The boot CPU is online from the start, and holds the kernel lock on
+// behalf of the kernel process
+static smpCpu cpus[MAX_CPUS] = {
+	{ 1 /* started */, 1 /* online */, 0, 1 /* lockDepth */,
+		1 /* wantLock */, 0, 0, 0 }
+};
+static volatile int numCpus = 1;
+
+// The kernel lock.  Ticket 0 is being served to the boot CPU.
+static volatile struct {
+	unsigned next;
+	unsigned serving;
+	int owner;
+
+} bigLock = { 1, 0, 0 };
+
+// Incremented each time page mappings are changed while there's more than
+// one CPU online
+static volatile unsigned tlbGeneration = 0;
+
+// Local APIC timer counts per system timer tick
+static unsigned timerCountsPerTick = 0;
+
+#ifdef ARCH_X86
+// The data area at the end of the AP startup code, below.  The offsets are
+// used by the startup code.
+typedef struct {
+	unsigned short gdtLimit;		// 0
+	unsigned gdtBase;				// 2
+	unsigned jumpOffset;			// 6
+	unsigned short jumpSelector;	// 10
+	unsigned cr3;					// 12
+	unsigned cr4;					// 16
+	unsigned stack;					// 20
+	unsigned entry;					// 24
+	unsigned gdt[8];				// 28
+
+} __attribute__((packed)) smpStartData;
+
+extern unsigned char smpStartCode[];
+extern unsigned char smpStart32[];
+extern unsigned char smpStartDataArea[];
+extern unsigned char smpStartEnd[];
+
+// The AP startup code.  It gets copied to a page in low memory, where the
+// AP starts executing it in real mode, with CS set to the page's segment.
+// It loads a temporary GDT with the same code, data and stack selectors as
+// the kernel's, switches to protected mode and paging, and jumps to
+// apMain() on its own stack.
+__asm__ (
+	".pushsection .text \n"
+	".code16 \n"
+	"smpStartCode: \n"
+	"	cli \n"
+	"	cld \n"
+	"	movw %cs, %ax \n"
+	"	movw %ax, %ds \n"
+	"	xorl %esi, %esi \n"
+	"	movw %ax, %si \n"
+	"	shll $4, %esi \n"
+	"	lgdtl (smpStartDataArea - smpStartCode) \n"
+	"	movl %cr0, %eax \n"
+	"	orl $1, %eax \n"
+	"	movl %eax, %cr0 \n"
+	"	ljmpl *(smpStartDataArea - smpStartCode + 6) \n"
+	".code32 \n"
+	"smpStart32: \n"
+	"	movw $0x10, %ax \n"
+	"	movw %ax, %ds \n"
+	"	movw %ax, %es \n"
+	"	movw %ax, %fs \n"
+	"	movw %ax, %gs \n"
+	"	movw $0x18, %ax \n"
+	"	movw %ax, %ss \n"
+	"	movl (smpStartDataArea - smpStartCode + 16)(%esi), %eax \n"
+	"	movl %eax, %cr4 \n"
+	"	movl (smpStartDataArea - smpStartCode + 12)(%esi), %eax \n"
+	"	movl %eax, %cr3 \n"
+	"	movl %cr0, %eax \n"
+	"	orl $0x80000000, %eax \n"
+	"	movl %eax, %cr0 \n"
+	"	movl (smpStartDataArea - smpStartCode + 20)(%esi), %esp \n"
+	"	jmp *(smpStartDataArea - smpStartCode + 24)(%esi) \n"
+	".p2align 3 \n"
+	"smpStartDataArea: \n"
+	"	.fill 60, 1, 0 \n"
+	"smpStartEnd: \n"
+	".popsection \n"
+);
+
+// The number of the CPU currently being started
+static volatile int startingCpu = 0;
+#endif
+
+
+static void flushTlb(int cpu)
+{
+	processorAddressCacheInvalidateAll();
+	cpus[cpu].tlbGeneration = tlbGeneration;
+}
+
+
+#ifdef ARCH_X86
+static void rescheduleInterrupt(void)
+{
+	// Another CPU has made a process ready to run on this one.  This only
+	// needs to wake up the idle thread, which will then yield.
+
+	void *address = NULL;
+
+	processorIsrEnter(address);
+	kernelApicEndOfInterrupt();
+	processorIsrExit(address);
+}
+
+
+static void tlbFlushInterrupt(void)
+{
+	// Another CPU has changed some page mappings.  This doesn't take the
+	// kernel lock, since the other CPU is holding it while it waits for us.
+
+	void *address = NULL;
+
+	processorIsrEnter(address);
+	flushTlb(kernelSmpCpuNumber());
+	kernelApicEndOfInterrupt();
+	processorIsrExit(address);
+}
+
+
+__attribute__((noreturn))
+static void apMain(void)
+{
+	// Application processors arrive here from the startup code, in protected
+	// mode with paging enabled, and the kernel's page directory
+
+	int cpu = startingCpu;
+
+	// Load the real descriptor tables.  The selectors are the same as the
+	// temporary ones.
+	kernelDescriptorLoad();
+
+	// Load our TSS, after which we know which CPU we are
+	kernelMultitaskerCpuInitialize(cpu);
+
+	cpus[cpu].started = 1;
+
+	kernelSmpLock();
+
+	kernelPageInitializeCpu();
+	kernelApicInitializeCpu();
+	kernelApicTimerSetup(SMP_VECTOR_TIMER);
+
+	cpus[cpu].online = 1;
+	numCpus += 1;
+
+	kernelLog("CPU %d (local APIC ID %d) started", cpu, cpus[cpu].apicId);
+
+	// Start scheduling processes.  This doesn't return.
+	kernelMultitaskerCpuStart(cpu);
+
+	while (1)
+		processorStop();
+}
+
+
+static void calibrateTimer(void)
+{
+	// Count how fast the local APIC timer runs, relative to the system
+	// timer.  The boot CPU's timer is used for this, and it's assumed that
+	// they all run at the same rate.
+
+	int interrupts = 0;
+	unsigned count = 0;
+
+	processorSuspendInts(interrupts);
+
+	kernelApicTimerSetup(SMP_VECTOR_TIMER);
+	kernelApicTimerStart(0xFFFFFFFF);
+	kernelCpuSpinMs(10);
+	count = (0xFFFFFFFF - kernelApicTimerRead());
+	kernelApicTimerStart(0);
+
+	processorRestoreInts(interrupts);
+
+	// Counts per 10ms, to counts per system timer tick
+	timerCountsPerTick = ((count * 100) / SYSTIMER_FREQ_HZ);
+	if (!timerCountsPerTick)
+		timerCountsPerTick = 1;
+
+	kernelDebug(debug_misc, "SMP local APIC timer %u counts per tick",
+		timerCountsPerTick);
+}
+
+
+static int startCpu(kernelIoMemory *startMem, int apicId)
+{
+	// Start one application processor, and wait for it to arrive in
+	// apMain()
+
+	int status = 0;
+	int cpu = numCpus;
+	smpStartData *data = NULL;
+	void *stack = NULL;
+	int count;
+
+	stack = kernelMalloc(SMP_CPU_STACK_SIZE);
+	if (!stack)
+		return (status = ERR_MEMORY);
+
+	data = (startMem->virtual + (smpStartDataArea - smpStartCode));
+	data->stack = ((unsigned) stack + SMP_CPU_STACK_SIZE);
+	data->entry = (unsigned) &apMain;
+
+	memset((void *) &cpus[cpu], 0, sizeof(smpCpu));
+	cpus[cpu].apicId = apicId;
+	startingCpu = cpu;
+
+	status = kernelApicStartCpu(apicId, startMem->physical);
+	if (status < 0)
+		return (status);
+
+	for (count = 0; count < SMP_START_TIMEOUT_MS; count ++)
+	{
+		if (cpus[cpu].started)
+			return (status = 0);
+
+		kernelCpuSpinMs(1);
+	}
+
+	kernelError(kernel_warn, "CPU with local APIC ID %d didn't start",
+		apicId);
+	return (status = ERR_TIMEOUT);
+}
+
+
+static int startCpus(kernelDevice *mpDevice)
+{
+	// Copy the startup code to low memory, and start each of the enabled
+	// application processors
+
+	int status = 0;
+	kernelMultiProcOps *mpOps = (kernelMultiProcOps *) mpDevice->driver->ops;
+	multiProcCpuEntry *cpuEntry = NULL;
+	kernelIoMemory startMem;
+	smpStartData *data = NULL;
+	int identityMapped = 0;
+	unsigned cr = 0;
+	uquad_t endTime = 0;
+	int count;
+
+	status = kernelMemoryGetIo(MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE,
+		1 /* low memory */, "smp startup", &startMem);
+	if (status < 0)
+		return (status);
+
+	if (startMem.physical >= 0x100000)
+	{
+		kernelError(kernel_error, "Couldn't get low memory for the CPU "
+			"startup code");
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	// The startup code switches on paging with the kernel's page directory,
+	// so it needs to be identity-mapped there
+	if (!kernelPageMapped(KERNELPROCID, (void *) startMem.physical,
+		MEMORY_PAGE_SIZE))
+	{
+		status = kernelPageMap(KERNELPROCID, startMem.physical, (void *)
+			startMem.physical, MEMORY_PAGE_SIZE);
+		if (status < 0)
+			goto out;
+
+		identityMapped = 1;
+	}
+
+	memcpy(startMem.virtual, smpStartCode, (smpStartEnd - smpStartCode));
+
+	data = (startMem.virtual + (smpStartDataArea - smpStartCode));
+
+	// Temporary GDT: null, code (0x08), data (0x10) and stack (0x18)
+	data->gdt[2] = data->gdt[4] = data->gdt[6] = 0x0000FFFF;
+	data->gdt[3] = 0x00CF9A00;
+	data->gdt[5] = data->gdt[7] = 0x00CF9200;
+	data->gdtLimit = (sizeof(data->gdt) - 1);
+	data->gdtBase = (startMem.physical + (smpStartDataArea - smpStartCode) +
+		28);
+
+	data->jumpOffset = (startMem.physical + (smpStart32 - smpStartCode));
+	data->jumpSelector = PRIV_CODE;
+
+	processorGetCR3(cr);
+	data->cr3 = cr;
+	processorGetCR4(cr);
+	data->cr4 = cr;
+
+	for (count = 0; numCpus < MAX_CPUS; count ++)
+	{
+		cpuEntry = mpOps->driverGetEntry(mpDevice, MULTIPROC_ENTRY_CPU,
+			count);
+		if (!cpuEntry)
+			break;
+
+		if (!(cpuEntry->cpuFlags & MULTIPROC_CPUFLAG_ENABLED) ||
+			(cpuEntry->cpuFlags & MULTIPROC_CPUFLAG_BOOT) ||
+			(cpuEntry->localApicId == cpus[0].apicId))
+		{
+			continue;
+		}
+
+		// If a CPU doesn't start, we can't safely start any others, since
+		// it might still turn up later
+		status = startCpu(&startMem, cpuEntry->localApicId);
+		if (status < 0)
+			break;
+
+		// Wait until it's online, which happens once it gets the kernel
+		// lock.  The scheduler gives it a turn when we yield.
+		endTime = (kernelCpuGetMs() + SMP_START_TIMEOUT_MS);
+		while (!cpus[startingCpu].online && (kernelCpuGetMs() < endTime))
+			kernelMultitaskerYield();
+
+		if (!cpus[startingCpu].online)
+		{
+			kernelError(kernel_warn, "CPU with local APIC ID %d didn't "
+				"come online", cpuEntry->localApicId);
+			status = ERR_TIMEOUT;
+			break;
+		}
+	}
+
+out:
+	if (identityMapped)
+		kernelPageUnmap(KERNELPROCID, (void *) startMem.physical,
+			MEMORY_PAGE_SIZE);
+
+	kernelMemoryReleaseIo(&startMem);
+
+	return (status);
+}
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+//
+//  Below here, the functions are exported for external use
+//
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+int kernelSmpInitialize(void)
+{
+	// Start up any application processors.  This is called by the kernel
+	// process, after the multitasker has been initialized.  If there aren't
+	// any, or there's no enabled local APIC, we just keep running on the
+	// boot CPU.
+
+	int status = 0;
+#ifdef ARCH_X86
+	kernelDevice *mpDevice = NULL;
+
+	// See whether we have a multiprocessor table
+	if (kernelDeviceFindType(
+		kernelDeviceGetClass(DEVICESUBCLASS_SYSTEM_MULTIPROC), NULL,
+			&mpDevice, 1) < 1)
+	{
+		return (status = 0);
+	}
+
+	// The APIC driver has to have enabled the boot CPU's local APIC
+	status = kernelApicGetId();
+	if (status < 0)
+		return (status = 0);
+
+	cpus[0].apicId = status;
+
+	calibrateTimer();
+
+	kernelDescriptorSetIDTInterruptGate(SMP_VECTOR_RESCHEDULE,
+		&rescheduleInterrupt);
+	kernelDescriptorSetIDTInterruptGate(SMP_VECTOR_TLBFLUSH,
+		&tlbFlushInterrupt);
+
+	status = startCpus(mpDevice);
+
+	kernelLog("%d CPU%s online", numCpus, ((numCpus > 1)? "s" : ""));
+#endif
+
+	return (status);
+}
+
+
+int kernelSmpNumCpus(void)
+{
+	// Returns the number of CPUs that are online.  They're numbered from 0.
+
+	return (numCpus);
+}
+
+
+void kernelSmpLock(void)
+{
+	// Take the kernel lock, or increase the depth if this CPU already has it
+
+	int interrupts = 0;
+	int cpu = 0;
+	unsigned ticket = 1;
+
+	// Interrupts stay disabled while we wait, otherwise an interrupt handler
+	// here would wait behind our own ticket
+	processorSuspendInts(interrupts);
+
+	cpu = kernelSmpCpuNumber();
+
+	if (!cpus[cpu].lockDepth)
+	{
+		cpus[cpu].wantLock = 1;
+
+		processorLockFetchAdd(bigLock.next, ticket);
+		while (bigLock.serving != ticket)
+			processorPause();
+
+		bigLock.owner = cpu;
+
+		// If page mappings changed while we didn't have the lock, our TLB
+		// might be stale
+		if (cpus[cpu].tlbGeneration != tlbGeneration)
+			flushTlb(cpu);
+	}
+
+	cpus[cpu].lockDepth += 1;
+
+	processorRestoreInts(interrupts);
+}
+
+
+void kernelSmpUnlock(void)
+{
+	// Decrease the depth of the kernel lock, and release it when it gets to
+	// zero
+
+	int interrupts = 0;
+	int cpu = 0;
+
+	processorSuspendInts(interrupts);
+
+	cpu = kernelSmpCpuNumber();
+
+	if (cpus[cpu].lockDepth && !(cpus[cpu].lockDepth -= 1))
+	{
+		bigLock.owner = -1;
+		cpus[cpu].wantLock = 0;
+		bigLock.serving += 1;
+	}
+
+	processorRestoreInts(interrupts);
+}
+
+
+void kernelSmpLockBreak(void)
+{
+	// Called by the scheduler, with interrupts disabled.  If other CPUs are
+	// waiting for the kernel lock, release it and get back in line, so that
+	// they get a turn even if this CPU only runs kernel threads.
+
+	int cpu = 0;
+	int depth = 0;
+
+	if ((numCpus < 2) || (bigLock.next == (bigLock.serving + 1)))
+		return;
+
+	cpu = kernelSmpCpuNumber();
+	depth = cpus[cpu].lockDepth;
+
+	if (!depth)
+		return;
+
+	cpus[cpu].lockDepth = 1;
+	kernelSmpUnlock();
+	kernelSmpLock();
+	cpus[cpu].lockDepth = depth;
+}
+
+
+int kernelSmpGetLockDepth(void)
+{
+	return (cpus[kernelSmpCpuNumber()].lockDepth);
+}
+
+
+void kernelSmpSetLockDepth(int depth)
+{
+	// Used by the context switch, to restore the depth of the next process.
+	// This CPU must hold the lock, and keeps it.
+
+	cpus[kernelSmpCpuNumber()].lockDepth = depth;
+}
+
+
+void kernelSmpReschedule(int cpu)
+{
+	// Interrupt another CPU, so that it notices a newly-ready process
+
+#ifdef ARCH_X86
+	if ((cpu == kernelSmpCpuNumber()) || (cpu >= numCpus) ||
+		!cpus[cpu].online)
+	{
+		return;
+	}
+
+	kernelApicSendIpi(cpus[cpu].apicId, (APIC_IPI_FIXED |
+		SMP_VECTOR_RESCHEDULE));
+#endif
+}
+
+
+void kernelSmpTlbShootdown(void)
+{
+	// Called with the kernel lock held, after page mappings have been changed
+	// or removed.  The other CPUs flush their TLBs, either in the interrupt
+	// handler or, if they're waiting for the kernel lock, when they get it.
+
+#ifdef ARCH_X86
+	int interrupts = 0;
+	int cpu = 0;
+	unsigned generation = 0;
+	int count;
+
+	if (numCpus < 2)
+		return;
+
+	processorSuspendInts(interrupts);
+
+	cpu = kernelSmpCpuNumber();
+	generation = (tlbGeneration += 1);
+	cpus[cpu].tlbGeneration = generation;
+
+	for (count = 0; count < numCpus; count ++)
+	{
+		if (count != cpu)
+		{
+			kernelApicSendIpi(cpus[count].apicId, (APIC_IPI_FIXED |
+				SMP_VECTOR_TLBFLUSH));
+		}
+	}
+
+	for (count = 0; count < numCpus; count ++)
+	{
+		while ((cpus[count].tlbGeneration != generation) &&
+			!cpus[count].wantLock)
+		{
+			processorPause();
+		}
+	}
+
+	processorRestoreInts(interrupts);
+#endif
+}
+
+
+void kernelSmpTimerStart(unsigned ticks)
+{
+	// Start a new time slice of the given number of system timer ticks on an
+	// application processor.  Zero means there's nothing to time, so the
+	// timer is stopped, and the slice lasts until some other interrupt comes
+	// along.
+
+#ifdef ARCH_X86
+	int cpu = kernelSmpCpuNumber();
+
+	if (!ticks)
+	{
+		// Remember when, so that the time used can still be worked out
+		cpus[cpu].timerCount = 0;
+		cpus[cpu].untimedSince = kernelCpuGetMs();
+	}
+	else if (ticks > (0xFFFFFFFF / timerCountsPerTick))
+	{
+		cpus[cpu].timerCount = 0xFFFFFFFF;
+	}
+	else
+	{
+		cpus[cpu].timerCount = (ticks * timerCountsPerTick);
+	}
+
+	kernelApicTimerStart(cpus[cpu].timerCount);
+#endif
+}
+
+
+unsigned kernelSmpTimerUsed(void)
+{
+	// Returns the number of system timer ticks used of the current time slice
+	// on an application processor
+
+	unsigned used = 0;
+
+#ifdef ARCH_X86
+	int cpu = kernelSmpCpuNumber();
+	uquad_t ticks = 0;
+
+	if (!cpus[cpu].timerCount)
+	{
+		// The timer was stopped
+		ticks = (((kernelCpuGetMs() - cpus[cpu].untimedSince) *
+			SYSTIMER_FREQ_HZ) / 1000);
+		if (ticks > 0xFFFFFFFF)
+			ticks = 0xFFFFFFFF;
+		used = (unsigned) ticks;
+	}
+	else if (timerCountsPerTick)
+	{
+		used = ((cpus[cpu].timerCount - kernelApicTimerRead()) /
+			timerCountsPerTick);
+	}
+#endif
+
+	return (used);
+}
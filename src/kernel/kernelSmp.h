@@ -0,0 +1,84 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2023 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  kernelSmp.h
+//
+
+// This is the header file to go with the kernel's multiprocessor support
+
+#ifndef _KERNELSMP_H
+#define _KERNELSMP_H
+
+#include "kernelDescriptor.h"
+#include <sys/processor.h>
+
+#ifdef ARCH_X86
+	#define MAX_CPUS				CPU_TSS_SELECTORS
+#else
+	#define MAX_CPUS				1
+#endif
+
+// Local APIC vectors used by the processors amongst themselves.  These are
+// above the ones used for IRQs, and below the APIC spurious interrupt vector.
+#define SMP_VECTOR_TIMER			0xFC
+#define SMP_VECTOR_RESCHEDULE		0xFD
+#define SMP_VECTOR_TLBFLUSH			0xFE
+
+// How long to wait for an application processor to start
+#define SMP_START_TIMEOUT_MS		200
+
+#define SMP_CPU_STACK_SIZE			4096
+
+static inline int kernelSmpCpuNumber(void)
+{
+	// Returns the number of the current CPU.  Each CPU's task register holds
+	// the fixed selector of its own TSS.  Before that is loaded, we can only
+	// be running on the boot CPU.
+
+#ifdef ARCH_X86
+	unsigned selector = 0;
+
+	processorGetTaskReg(selector);
+
+	if ((selector < CPU_TSS_SELECTOR(0)) ||
+		(selector >= CPU_TSS_SELECTOR(MAX_CPUS)))
+	{
+		return (0);
+	}
+
+	return ((selector - CPU_TSS_SELECTOR(0)) >> 3);
+#else
+	return (0);
+#endif
+}
+
+// Functions exported by kernelSmp.c
+int kernelSmpInitialize(void);
+int kernelSmpNumCpus(void);
+void kernelSmpLock(void);
+void kernelSmpUnlock(void);
+void kernelSmpLockBreak(void);
+int kernelSmpGetLockDepth(void);
+void kernelSmpSetLockDepth(int);
+void kernelSmpReschedule(int);
+void kernelSmpTlbShootdown(void);
+void kernelSmpTimerStart(unsigned);
+unsigned kernelSmpTimerUsed(void);
+
+#endif
+
@@ -41,7 +41,7 @@ static void timerInterrupt(void)
 
 	void *address = NULL;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 	kernelInterruptSetCurrent(INTERRUPT_NUM_SYSTIMER);
 
 	// Call the driver function
@@ -50,7 +50,7 @@ static void timerInterrupt(void)
 
 	kernelPicEndOfInterrupt(INTERRUPT_NUM_SYSTIMER);
 	kernelInterruptClearCurrent();
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
@@ -0,0 +1,245 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2023 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  kernelTimer.c
+//
+
+// This file contains the kernel's one-shot timers.  Pending timers are kept
+// in a binary min-heap ordered by deadline, so that the scheduler only needs
+// to look at the first one on each tick, and only does work for timers that
+// have actually expired.
+
+#include "kernelTimer.h"
+#include "kernelCpu.h"
+#include "kernelError.h"
+#include <stddef.h>
+#include <sys/processor.h>
+
+static kernelTimer *heap[TIMER_MAX_PENDING];
+static volatile int numPending = 0;
+
+
+static inline void heapPlace(kernelTimer *timer, int position)
+{
+	// Heap positions are stored in the timers 1-based, so that zero means
+	// 'not pending'
+	heap[position] = timer;
+	timer->index = (position + 1);
+}
+
+
+static void siftUp(int position)
+{
+	kernelTimer *timer = heap[position];
+	int parent = 0;
+
+	while (position)
+	{
+		parent = ((position - 1) / 2);
+
+		if (heap[parent]->deadline <= timer->deadline)
+			break;
+
+		heapPlace(heap[parent], position);
+		position = parent;
+	}
+
+	heapPlace(timer, position);
+}
+
+
+static void siftDown(int position)
+{
+	kernelTimer *timer = heap[position];
+	int child = 0;
+
+	while ((child = ((position * 2) + 1)) < numPending)
+	{
+		if (((child + 1) < numPending) &&
+			(heap[child + 1]->deadline < heap[child]->deadline))
+		{
+			child += 1;
+		}
+
+		if (timer->deadline <= heap[child]->deadline)
+			break;
+
+		heapPlace(heap[child], position);
+		position = child;
+	}
+
+	heapPlace(timer, position);
+}
+
+
+static void heapRemove(kernelTimer *timer)
+{
+	// Remove the timer from the heap, and fill its hole with the last one
+
+	int position = (timer->index - 1);
+
+	timer->index = 0;
+	numPending -= 1;
+
+	if (position == numPending)
+		return;
+
+	heapPlace(heap[numPending], position);
+
+	if (position && (heap[(position - 1) / 2]->deadline >
+		heap[position]->deadline))
+	{
+		siftUp(position);
+	}
+	else
+	{
+		siftDown(position);
+	}
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+//
+// Below here, the functions are exported for external use
+//
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+int kernelTimerSet(kernelTimer *timer, uquad_t deadline,
+	void (*function)(kernelTimer *), void *data)
+{
+	// Arm (or re-arm) a timer to call the function once the CPU time in
+	// milliseconds has passed the deadline.  The timer memory belongs to the
+	// caller, and must not be freed while the timer is pending.
+
+	int status = 0;
+	int interrupts = 0;
+
+	// Check params
+	if (!timer || !function)
+		return (status = ERR_NULLPARAMETER);
+
+	processorSuspendInts(interrupts);
+
+	if (timer->index)
+		heapRemove(timer);
+
+	if (numPending >= TIMER_MAX_PENDING)
+	{
+		processorRestoreInts(interrupts);
+		kernelError(kernel_error, "Too many pending timers");
+		return (status = ERR_NOFREE);
+	}
+
+	timer->deadline = deadline;
+	timer->function = function;
+	timer->data = data;
+
+	heap[numPending++] = timer;
+	siftUp(numPending - 1);
+
+	processorRestoreInts(interrupts);
+	return (status = 0);
+}
+
+
+int kernelTimerCancel(kernelTimer *timer)
+{
+	// Disarm a timer, if it's pending.  It's not an error if it isn't.
+
+	int status = 0;
+	int interrupts = 0;
+
+	// Check params
+	if (!timer)
+		return (status = ERR_NULLPARAMETER);
+
+	processorSuspendInts(interrupts);
+
+	if (timer->index)
+		heapRemove(timer);
+
+	processorRestoreInts(interrupts);
+	return (status = 0);
+}
+
+
+int kernelTimerPending(kernelTimer *timer)
+{
+	// Returns 1 if the timer is armed and hasn't expired yet
+
+	if (!timer)
+		return (0);
+
+	return (timer->index != 0);
+}
+
+
+uquad_t kernelTimerNextDeadline(void)
+{
+	// Returns the earliest pending deadline, or zero if there are no pending
+	// timers
+
+	uquad_t deadline = 0;
+	int interrupts = 0;
+
+	processorSuspendInts(interrupts);
+
+	if (numPending)
+		deadline = heap[0]->deadline;
+
+	processorRestoreInts(interrupts);
+	return (deadline);
+}
+
+
+int kernelTimerExpire(void)
+{
+	// Called by the scheduler.  Runs the functions of any timers whose
+	// deadlines have passed, and returns the number of them.  If nothing is
+	// pending this doesn't even read the clock.
+
+	int expired = 0;
+	int interrupts = 0;
+	uquad_t cpuTime = 0;
+	kernelTimer *timer = NULL;
+
+	if (!numPending)
+		return (expired = 0);
+
+	processorSuspendInts(interrupts);
+
+	cpuTime = kernelCpuGetMs();
+
+	while (numPending && (heap[0]->deadline < cpuTime))
+	{
+		timer = heap[0];
+
+		// Take it off the heap first, in case the function wants to re-arm
+		// it
+		heapRemove(timer);
+
+		timer->function(timer);
+		expired += 1;
+	}
+
+	processorRestoreInts(interrupts);
+	return (expired);
+}
+
@@ -0,0 +1,54 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2023 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  kernelTimer.h
+//
+
+// This header file contains definitions for the kernel's one-shot timers
+
+#ifndef _KERNELTIMER_H
+#define _KERNELTIMER_H
+
+#include <sys/process.h>
+#include <sys/types.h>
+
+// The maximum number of timers that can be pending at one time.  Every
+// process can have its wait timer pending, so there must be room for all of
+// them.
+#define TIMER_MAX_PENDING	MAX_PROCESSES
+
+// A timer.  These are normally embedded in some other structure (such as a
+// process) and the function is called with interrupts disabled, from the
+// scheduler, once the deadline has passed.  It must not block.
+typedef volatile struct _kernelTimer {
+	uquad_t deadline;
+	void (*function)(volatile struct _kernelTimer *);
+	void *data;
+	int index;
+
+} kernelTimer;
+
+// Functions exported by kernelTimer.c
+int kernelTimerSet(kernelTimer *, uquad_t, void (*)(kernelTimer *), void *);
+int kernelTimerCancel(kernelTimer *);
+int kernelTimerPending(kernelTimer *);
+uquad_t kernelTimerNextDeadline(void);
+int kernelTimerExpire(void);
+
+#endif
+
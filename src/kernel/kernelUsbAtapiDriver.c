@@ -1224,7 +1224,8 @@ static kernelDiskOps usbAtapiOps = {
 	NULL,	// driverMediaChanged
 	driverReadSectors,
 	NULL,	// driverWriteSectors
-	NULL	// driverFlush
+	NULL,	// driverFlush
+	NULL	// driverDiscardSectors
 };
 
 
@@ -239,7 +239,7 @@ static void usbInterrupt(void)
 	linkedListItem *iter = NULL;
 	int serviced = 0;
 
-	processorIsrEnter(address);
+	kernelInterruptEnter(address);
 
 	// Which interrupt number is active?
 	interruptNum = kernelPicGetActive();
@@ -287,7 +287,7 @@ static void usbInterrupt(void)
 	}
 
 out:
-	processorIsrExit(address);
+	kernelInterruptExit(address);
 }
 
 
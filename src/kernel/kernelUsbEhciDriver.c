@@ -1455,6 +1455,16 @@ static int runTransaction(ehciTransQueue *transQueue, unsigned timeout)
 				error = 1;
 				break;
 			}
+			else if ((transQueue->qtdItems[count]->qtd->token &
+				EHCI_QTDTOKEN_TOTBYTES) &&
+				!(transQueue->qtdItems[count]->qtd->altNextQtd &
+					EHCI_LINK_TERM))
+			{
+				// Short packet.  The controller has skipped any remaining
+				// qTDs, and gone on to the next transaction.
+				kernelDebug(debug_usb, "EHCI short packet on qTD %d", count);
+				break;
+			}
 		}
 
 		// If no more active, or errors, we're finished
@@ -2330,7 +2340,11 @@ static int queue(usbController *controller, usbDevice *usbDev,
 	usbTransaction *trans, int numTrans)
 {
 	// This function contains the intelligence necessary to initiate a
-	// transaction (all phases)
+	// transaction (all phases).  All of the transactions are set up and
+	// linked into their queue heads before we wait for any of them, so that
+	// the controller can go straight from one to the next (for example the
+	// command, data, and status phases of a mass storage command) without
+	// waiting for us.
 
 	int status = 0;
 	ehciTransQueue *transQueues = NULL;
@@ -2345,7 +2359,7 @@ static int queue(usbController *controller, usbDevice *usbDev,
 	ehciQtdItem **dataQtdItems = NULL;
 	ehciQtdItem *statusQtdItem = NULL;
 	unsigned timeout = 0;
-	int transCount, qtdCount;
+	int transCount, nextCount, qtdCount;
 
 	kernelDebug(debug_usb, "EHCI queue %d transaction%s", numTrans,
 		((numTrans > 1)? "s" : ""));
@@ -2362,17 +2376,18 @@ static int queue(usbController *controller, usbDevice *usbDev,
 	if (!transQueues)
 		return (status = ERR_MEMORY);
 
+	// Lock the controller
+	status = kernelLockGet(&controller->lock);
+	if (status < 0)
+	{
+		kernelError(kernel_error, "Can't get controller lock");
+		kernelFree(transQueues);
+		return (status);
+	}
+
 	// Loop to set up each transaction
 	for (transCount = 0; transCount < numTrans; transCount ++)
 	{
-		// Lock the controller
-		status = kernelLockGet(&controller->lock);
-		if (status < 0)
-		{
-			kernelError(kernel_error, "Can't get controller lock");
-			goto out;
-		}
-
 		// Try to find an existing queue head for this transaction's endpoint
 		transQueues[transCount].queueHeadItem = findQueueHead(controller,
 			usbDev, trans[transCount].endpoint);
@@ -2589,15 +2604,60 @@ static int queue(usbController *controller, usbDevice *usbDev,
 			if (status < 0)
 				goto out;
 		}
+	}
+
+	// If an IN transaction is followed by another one on the same endpoint
+	// (such as a mass storage data phase, followed by the status phase), a
+	// short packet should skip the rest of its data qTDs and go straight on
+	// to the next transaction
+	for (transCount = 0; transCount < (numTrans - 1); transCount ++)
+	{
+		if ((trans[transCount].pid != USB_PID_IN) ||
+			!transQueues[transCount].numDataQtds)
+		{
+			continue;
+		}
+
+		for (nextCount = (transCount + 1); nextCount < numTrans;
+			nextCount ++)
+		{
+			if (transQueues[nextCount].queueHeadItem !=
+				transQueues[transCount].queueHeadItem)
+			{
+				continue;
+			}
+
+			dataQtdItems = &transQueues[transCount].qtdItems[0];
+			if (trans[transCount].type == usbxfer_control)
+				dataQtdItems = &transQueues[transCount].qtdItems[1];
+
+			for (qtdCount = 0; qtdCount <
+				transQueues[transCount].numDataQtds; qtdCount ++)
+			{
+				dataQtdItems[qtdCount]->qtd->altNextQtd =
+					transQueues[nextCount].qtdItems[0]->physical;
+			}
 
-		// Link the qTDs into the queue via the queue head
+			break;
+		}
+	}
+
+	// Link the qTDs of all the transactions into the queues via their
+	// queue heads
+	for (transCount = 0; transCount < numTrans; transCount ++)
+	{
 		status = queueTransaction(&transQueues[transCount]);
 		if (status < 0)
 			goto out;
 
-		// Release the controller lock to process the transaction
-		kernelLockRelease(&controller->lock);
+		transQueues[transCount].queued = 1;
+	}
+
+	// Release the controller lock to process the transactions
+	kernelLockRelease(&controller->lock);
 
+	for (transCount = 0; transCount < numTrans; transCount ++)
+	{
 		timeout = trans[transCount].timeout;
 		if (!timeout)
 			timeout = USB_STD_TIMEOUT_MS;
@@ -2629,7 +2689,8 @@ out:
 			if (transQueues[transCount].qtdItems)
 			{
 				// De-queue the qTDs from the queue head
-				dequeueTransaction(&transQueues[transCount]);
+				if (transQueues[transCount].queued)
+					dequeueTransaction(&transQueues[transCount]);
 
 				// Release the qTDs
 				releaseQtds(controller->data,
@@ -259,6 +259,7 @@ typedef struct {
 	int numDataQtds;
 	ehciQtdItem **qtdItems;
 	unsigned bytesRemaining;
+	int queued;
 
 } ehciTransQueue;
 
@@ -1858,20 +1858,16 @@ static int configDevSlot(xhciData *xhci, xhciSlot *slot, usbDevice *usbDev)
 }
 
 
-static int transfer(usbController *controller, xhciSlot *slot, int endpoint,
-	unsigned timeout, int numTrbs, xhciTrb *trbs)
+static int queueTransfer(xhciData *xhci, xhciSlot *slot, int endpoint,
+	xhciTransfer *xfer)
 {
-	// Enqueue the supplied transaction on the transfer ring of the requested
-	// endpoint
+	// Enqueue the supplied transfer on the transfer ring of the requested
+	// endpoint, and ring the doorbell
 
 	int status = 0;
-	xhciData *xhci = controller->data;
 	xhciTrbRing *transRing = NULL;
 	xhciTrb *srcTrb = NULL;
 	xhciTrb *destTrb = NULL;
-	xhciTrb eventTrb;
-	uquad_t currTime = 0;
-	uquad_t endTime = 0;
 	int trbCount;
 
 	transRing = slot->transRings[TRANSRING_INDEX(endpoint)];
@@ -1883,11 +1879,12 @@ static int transfer(usbController *controller, xhciSlot *slot, int endpoint,
 	}
 
 	kernelDebug(debug_usb, "XHCI queue transfer (%d TRBs) slot %d, endpoint "
-		"0x%02x, pos %d", numTrbs, slot->num, endpoint, transRing->nextTrb);
+		"0x%02x, pos %d", xfer->numTrbs, slot->num, endpoint,
+		transRing->nextTrb);
 
-	for (trbCount = 0; trbCount < numTrbs; trbCount ++)
+	for (trbCount = 0; trbCount < xfer->numTrbs; trbCount ++)
 	{
-		srcTrb = &trbs[trbCount];
+		srcTrb = &xfer->trbs[trbCount];
 		destTrb = &transRing->trbs[transRing->nextTrb];
 
 		kernelDebug(debug_usb, "XHCI use TRB with physical address=0x%08x",
@@ -1897,7 +1894,7 @@ static int transfer(usbController *controller, xhciSlot *slot, int endpoint,
 		memcpy((void *) destTrb, (void *) srcTrb, sizeof(xhciTrb));
 
 		// Set the last TRB to interrupt
-		if (trbCount == (numTrbs - 1))
+		if (trbCount == (xfer->numTrbs - 1))
 			destTrb->typeFlags |= XHCI_TRBFLAG_INTONCOMP;
 
 		// Set the cycle bit
@@ -1928,20 +1925,41 @@ static int transfer(usbController *controller, xhciSlot *slot, int endpoint,
 		}
 	}
 
+	// Remember the last TRB, to recognize its completion event
+	xfer->lastTrbPhysical = trbPhysical(transRing, destTrb);
+	xfer->done = 0;
+
 	// Ring the slot doorbell with the endpoint number
 	kernelDebug(debug_usb, "XHCI ring endpoint 0x%02x doorbell", endpoint);
 	xhci->dbRegs->doorbell[slot->num] = DOORBELL_INDEX(endpoint);
 
-	// Unlock the controller while we wait
-	kernelLockRelease(&controller->lock);
+	return (status = 0);
+}
 
-	// Wait until the transfer has completed
-	kernelDebug(debug_usb, "XHCI wait for transaction complete");
+
+static int waitTransfers(xhciData *xhci, xhciTransfer *xfers, int numXfers,
+	unsigned timeout)
+{
+	// Wait until the queued transfers have completed, or one of them has
+	// failed (in which case any later ones, such as the status phase after a
+	// failed data phase, won't complete).  The completion event of each one
+	// is copied back to its last transfer TRB.
+
+	int status = 0;
+	xhciTrb eventTrb;
+	uquad_t currTime = 0;
+	uquad_t endTime = 0;
+	int remaining = numXfers;
+	int failed = 0;
+	int count;
+
+	kernelDebug(debug_usb, "XHCI wait for %d transaction%s complete",
+		numXfers, ((numXfers > 1)? "s" : ""));
 
 	currTime = kernelCpuGetMs();
 	endTime = (currTime + timeout);
 
-	while (currTime <= endTime)
+	while (remaining && !failed && (currTime <= endTime))
 	{
 		memset((void *) &eventTrb, 0, sizeof(xhciTrb));
 
@@ -1962,35 +1980,82 @@ static int transfer(usbController *controller, xhciSlot *slot, int endpoint,
 					debugTrbCompletion2String(&eventTrb));
 			}
 
-			if ((eventTrb.paramLo & ~0xFU) == trbPhysical(transRing, destTrb))
-				break;
+			for (count = 0; count < numXfers; count ++)
+			{
+				if (!xfers[count].done && ((eventTrb.paramLo & ~0xFU) ==
+					xfers[count].lastTrbPhysical))
+				{
+					// Copy the completion event TRB back to the last
+					// transfer TRB
+					memcpy((void *) &xfers[count].trbs[xfers[count].numTrbs -
+						1], (void *) &eventTrb, sizeof(xhciTrb));
+
+					xfers[count].done = 1;
+					remaining -= 1;
+
+					if (((eventTrb.status & XHCI_TRBCOMP_MASK) !=
+						XHCI_TRBCOMP_SUCCESS) && ((eventTrb.status &
+						XHCI_TRBCOMP_MASK) != XHCI_TRBCOMP_SHORTPACKET))
+					{
+						failed = 1;
+					}
+
+					break;
+				}
+			}
 		}
 
 		currTime = kernelCpuGetMs();
 	}
 
-	if (currTime > endTime)
+	if (remaining && !failed)
 	{
 		kernelError(kernel_error, "No transfer event received");
 		return (status = ERR_TIMEOUT);
 	}
 
-	kernelDebug(debug_usb, "XHCI transaction finished");
-
-	// Copy the completion event TRB back to the last transfer TRB
-	memcpy((void *) &trbs[numTrbs - 1], (void *) &eventTrb, sizeof(xhciTrb));
+	kernelDebug(debug_usb, "XHCI transaction%s finished",
+		((numXfers > 1)? "s" : ""));
 
 	return (status = 0);
 }
 
 
-static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
-	usbTransaction *trans, unsigned maxPacketSize, unsigned timeout)
+static int transfer(usbController *controller, xhciSlot *slot, int endpoint,
+	unsigned timeout, int numTrbs, xhciTrb *trbs)
+{
+	// Enqueue the supplied transaction on the transfer ring of the requested
+	// endpoint, and wait for it to complete
+
+	int status = 0;
+	xhciData *xhci = controller->data;
+	xhciTransfer xfer;
+
+	memset((void *) &xfer, 0, sizeof(xhciTransfer));
+	xfer.trbs = trbs;
+	xfer.numTrbs = numTrbs;
+
+	status = queueTransfer(xhci, slot, endpoint, &xfer);
+	if (status < 0)
+		return (status);
+
+	// Unlock the controller while we wait
+	kernelLockRelease(&controller->lock);
+
+	// Wait until the transfer has completed
+	return (status = waitTransfers(xhci, &xfer, 1, timeout));
+}
+
+
+static int setupTransferTrbs(usbTransaction *trans, unsigned maxPacketSize,
+	xhciTrb *trbs, int *numTrbsRet)
 {
+	// Set up the TRBs for a control or bulk transaction, in the supplied
+	// array of XHCI_TRANSRING_SIZE TRBs
+
 	int status = 0;
 	unsigned numTrbs = 0;
 	unsigned numDataTrbs = 0;
-	xhciTrb trbs[XHCI_TRANSRING_SIZE];
 	xhciSetupTrb *setupTrb = NULL;
 	unsigned bytesToTransfer = 0;
 	unsigned buffPtr = 0;
@@ -2000,9 +2065,6 @@ static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
 	xhciTrb *statusTrb = NULL;
 	unsigned trbCount;
 
-	kernelDebug(debug_usb, "XHCI control/bulk transfer for endpoint "
-		"0x%02x, maxPacketSize=%u", trans->endpoint, maxPacketSize);
-
 	// Figure out how many TRBs we're going to need for this transfer
 
 	if (trans->type == usbxfer_control)
@@ -2014,8 +2076,20 @@ static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
 	// Data descriptors?
 	if (trans->length)
 	{
-		numDataTrbs = ((trans->length + (XHCI_TRB_MAXBYTES - 1)) /
-			XHCI_TRB_MAXBYTES);
+		buffPtr = (unsigned) kernelPageGetPhysical((((unsigned)
+			trans->buffer < KERNEL_VIRTUAL_ADDRESS)?
+				kernelCurrentProcess->processId : KERNELPROCID),
+			trans->buffer);
+		if (!buffPtr)
+		{
+			kernelDebugError("Can't get physical address for buffer at %p",
+				trans->buffer);
+			return (status = ERR_MEMORY);
+		}
+
+		// The data buffer of a TRB can't cross a 64K boundary
+		numDataTrbs = (((buffPtr % XHCI_TRB_MAXBYTES) + trans->length +
+			(XHCI_TRB_MAXBYTES - 1)) / XHCI_TRB_MAXBYTES);
 
 		kernelDebug(debug_usb, "XHCI data payload of %u requires %d "
 			"descriptors", trans->length, numDataTrbs);
@@ -2032,7 +2106,7 @@ static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
 		return (status = ERR_RANGE);
 	}
 
-	memset((void *) &trbs, 0, (numTrbs * sizeof(xhciTrb)));
+	memset((void *) trbs, 0, (numTrbs * sizeof(xhciTrb)));
 
 	if (trans->type == usbxfer_control)
 	{
@@ -2069,17 +2143,6 @@ static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
 	// TRB is not chained to anything.
 	if (trans->length)
 	{
-		buffPtr = (unsigned) kernelPageGetPhysical((((unsigned)
-			trans->buffer < KERNEL_VIRTUAL_ADDRESS)?
-				kernelCurrentProcess->processId : KERNELPROCID),
-			trans->buffer);
-		if (!buffPtr)
-		{
-			kernelDebugError("Can't get physical address for buffer at %p",
-				trans->buffer);
-			return (status = ERR_MEMORY);
-		}
-
 		bytesToTransfer = trans->length;
 
 		dataTrbs = &trbs[0];
@@ -2088,7 +2151,8 @@ static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
 
 		for (trbCount = 0; trbCount < numDataTrbs; trbCount ++)
 		{
-			doBytes = min(bytesToTransfer, XHCI_TRB_MAXBYTES);
+			doBytes = min(bytesToTransfer, (XHCI_TRB_MAXBYTES - (buffPtr %
+				XHCI_TRB_MAXBYTES)));
 			remainingPackets = (((bytesToTransfer - doBytes) +
 				(maxPacketSize - 1)) / maxPacketSize);
 
@@ -2148,11 +2212,17 @@ static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
 		}
 	}
 
-	// Queue the TRBs in the endpoint's transfer ring
-	status = transfer(controller, slot, trans->endpoint, timeout, numTrbs,
-		trbs);
-	if (status < 0)
-		return (status);
+	*numTrbsRet = numTrbs;
+	return (status = 0);
+}
+
+
+static int transferResult(usbTransaction *trans, xhciTrb *trbs, int numTrbs)
+{
+	// Check the completion event of a transaction, which has been copied to
+	// its last TRB, and record the number of bytes transferred
+
+	int status = 0;
 
 	if ((trbs[numTrbs - 1].status & XHCI_TRBCOMP_MASK) !=
 		XHCI_TRBCOMP_SUCCESS)
@@ -2184,6 +2254,30 @@ static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
 }
 
 
+static int controlBulkTransfer(usbController *controller, xhciSlot *slot,
+	usbTransaction *trans, unsigned maxPacketSize, unsigned timeout)
+{
+	int status = 0;
+	xhciTrb trbs[XHCI_TRANSRING_SIZE];
+	int numTrbs = 0;
+
+	kernelDebug(debug_usb, "XHCI control/bulk transfer for endpoint "
+		"0x%02x, maxPacketSize=%u", trans->endpoint, maxPacketSize);
+
+	status = setupTransferTrbs(trans, maxPacketSize, trbs, &numTrbs);
+	if (status < 0)
+		return (status);
+
+	// Queue the TRBs in the endpoint's transfer ring
+	status = transfer(controller, slot, trans->endpoint, timeout, numTrbs,
+		trbs);
+	if (status < 0)
+		return (status);
+
+	return (status = transferResult(trans, trbs, numTrbs));
+}
+
+
 static int recordHubAttrs(xhciData *xhci, xhciSlot *slot, usbHubDesc *hubDesc)
 {
 	// If we have discovered that a device is a hub, we need to tell the
@@ -2331,16 +2425,26 @@ static int controlTransfer(usbController *controller, usbDevice *usbDev,
 
 
 static int bulkTransfer(usbController *controller, usbDevice *usbDev,
-	usbTransaction *trans, unsigned timeout)
+	usbTransaction *trans, int numTrans, unsigned timeout)
 {
+	// Do one or more bulk transactions.  All of their TRBs are queued before
+	// we wait for any of them, so that the controller can go straight from
+	// one to the next (for example the command, data, and status phases of a
+	// mass storage command) without waiting for us.
+
 	int status = 0;
 	xhciData *xhci = controller->data;
 	xhciSlot *slot = NULL;
 	usbEndpoint *endpoint = NULL;
 	unsigned maxPacketSize = 0;
+	xhciTransfer *xfers = NULL;
+	xhciTrb *trbs = NULL;
+	int ringTrbs = 0;
+	int count, prevCount;
 
-	kernelDebug(debug_usb, "XHCI bulk transfer to controller %d, device %d, "
-		"endpoint 0x%02x", controller->num, usbDev->address, trans->endpoint);
+	kernelDebug(debug_usb, "XHCI %d bulk transfer%s to controller %d, device "
+		"%d", numTrans, ((numTrans > 1)? "s" : ""), controller->num,
+		usbDev->address);
 
 	slot = getDevSlot(xhci, usbDev);
 	if (!slot)
@@ -2349,25 +2453,101 @@ static int bulkTransfer(usbController *controller, usbDevice *usbDev,
 		return (status = ERR_NOSUCHENTRY);
 	}
 
-	// Get the endpoint descriptor
-	endpoint = kernelUsbGetEndpoint(usbDev, trans->endpoint);
-	if (!endpoint)
+	xfers = kernelMalloc(numTrans * sizeof(xhciTransfer));
+	trbs = kernelMalloc(numTrans * XHCI_TRANSRING_SIZE * sizeof(xhciTrb));
+	if (!xfers || !trbs)
 	{
-		kernelError(kernel_error, "No such endpoint 0x%02x", trans->endpoint);
-		return (status = ERR_NOSUCHFUNCTION);
+		status = ERR_MEMORY;
+		goto out;
 	}
 
-	// Get the maximum packet size for the endpoint
-	maxPacketSize = endpoint->maxPacketSize;
-	if (!maxPacketSize)
+	for (count = 0; count < numTrans; count ++)
 	{
-		kernelError(kernel_error, "Device endpoint 0x%02x has a max packet"
-			"size of 0", trans->endpoint);
-		return (status = ERR_BADDATA);
+		// Get the endpoint descriptor
+		endpoint = kernelUsbGetEndpoint(usbDev, trans[count].endpoint);
+		if (!endpoint)
+		{
+			kernelError(kernel_error, "No such endpoint 0x%02x",
+				trans[count].endpoint);
+			status = ERR_NOSUCHFUNCTION;
+			goto out;
+		}
+
+		// Get the maximum packet size for the endpoint
+		maxPacketSize = endpoint->maxPacketSize;
+		if (!maxPacketSize)
+		{
+			kernelError(kernel_error, "Device endpoint 0x%02x has a max "
+				"packet size of 0", trans[count].endpoint);
+			status = ERR_BADDATA;
+			goto out;
+		}
+
+		kernelDebug(debug_usb, "XHCI bulk transfer for endpoint 0x%02x, "
+			"maxPacketSize=%u", trans[count].endpoint, maxPacketSize);
+
+		xfers[count].trbs = &trbs[count * XHCI_TRANSRING_SIZE];
+
+		status = setupTransferTrbs(&trans[count], maxPacketSize,
+			xfers[count].trbs, &xfers[count].numTrbs);
+		if (status < 0)
+			goto out;
+
+		// Everything we queue on an endpoint's transfer ring at once has to
+		// fit in it, not counting the link TRB
+		ringTrbs = 0;
+		for (prevCount = 0; prevCount <= count; prevCount ++)
+		{
+			if (trans[prevCount].endpoint == trans[count].endpoint)
+				ringTrbs += xfers[prevCount].numTrbs;
+		}
+
+		if (ringTrbs > (XHCI_TRANSRING_SIZE - 1))
+		{
+			kernelDebugError("Number of TRBs exceeds maximum allowed for "
+				"endpoint 0x%02x (%d)", trans[count].endpoint,
+				(XHCI_TRANSRING_SIZE - 1));
+			status = ERR_RANGE;
+			goto out;
+		}
 	}
 
-	status = controlBulkTransfer(controller, slot, trans, maxPacketSize,
-		timeout);
+	// Queue the TRBs in the endpoints' transfer rings
+	for (count = 0; count < numTrans; count ++)
+	{
+		status = queueTransfer(xhci, slot, trans[count].endpoint,
+			&xfers[count]);
+		if (status < 0)
+			goto out;
+	}
+
+	// Unlock the controller while we wait
+	kernelLockRelease(&controller->lock);
+
+	status = waitTransfers(xhci, xfers, numTrans, timeout);
+	if (status < 0)
+		goto out;
+
+	for (count = 0; count < numTrans; count ++)
+	{
+		// If one failed, the ones after it didn't complete
+		if (!xfers[count].done)
+		{
+			status = ERR_IO;
+			break;
+		}
+
+		status = transferResult(&trans[count], xfers[count].trbs,
+			xfers[count].numTrbs);
+		if (status < 0)
+			break;
+	}
+
+out:
+	if (trbs)
+		kernelFree((void *) trbs);
+	if (xfers)
+		kernelFree(xfers);
 
 	return (status);
 }
@@ -3414,6 +3594,7 @@ static int queue(usbController *controller, usbDevice *usbDev,
 
 	int status = 0;
 	unsigned timeout = 0;
+	int numBulk = 0;
 	int transCount;
 
 	kernelDebug(debug_usb, "XHCI queue %d transaction%s for controller %d, "
@@ -3450,8 +3631,20 @@ static int queue(usbController *controller, usbDevice *usbDev,
 				break;
 
 			case usbxfer_bulk:
+				// Do this and any bulk transactions that follow it all
+				// together
+				for (numBulk = 1; ((transCount + numBulk) < numTrans) &&
+					(trans[transCount + numBulk].type == usbxfer_bulk);
+					numBulk ++)
+				{
+					timeout = max(timeout,
+						trans[transCount + numBulk].timeout);
+				}
+
 				status = bulkTransfer(controller, usbDev,
-					&trans[transCount], timeout);
+					&trans[transCount], numBulk, timeout);
+
+				transCount += (numBulk - 1);
 				break;
 
 			default:
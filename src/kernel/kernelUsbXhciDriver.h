@@ -533,6 +533,16 @@ typedef struct {
 
 } xhciIntrReg;
 
+// For keeping track of transfers that have been queued, while we wait for
+// them to complete
+typedef struct {
+	xhciTrb *trbs;
+	int numTrbs;
+	unsigned lastTrbPhysical;
+	int done;
+
+} xhciTransfer;
+
 // Our main structure for storing information about the controller
 typedef struct {
 	xhciCapRegs *capRegs;
@@ -2447,6 +2447,11 @@ int kernelWindowInitialize(void)
 	screenWidth = kernelGraphicGetScreenWidth();
 	screenHeight = kernelGraphicGetScreenHeight();
 
+	// Set up the memory for components
+	status = kernelWindowComponentInitialize();
+	if (status < 0)
+		return (status);
+
 	status = windowStart();
 	if (status < 0)
 		return (status);
@@ -653,6 +653,7 @@ kernelWindowComponent *kernelWindowShellIconify(kernelWindow *, int, image *);
 
 // Functions for managing components.  This first batch is from
 // kernelWindowComponent.c
+int kernelWindowComponentInitialize(void);
 kernelWindowComponent *kernelWindowComponentNew(objectKey,
 	componentParameters *);
 void kernelWindowComponentDestroy(kernelWindowComponent *);
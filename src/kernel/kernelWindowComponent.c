@@ -27,6 +27,7 @@
 #include "kernelError.h"
 #include "kernelMalloc.h"
 #include "kernelMultitasker.h"
+#include "kernelSlab.h"
 #include "kernelWindowEventStream.h"
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +36,9 @@
 
 extern kernelWindowVariables *windowVariables;
 
+// Memory for components
+static kernelSlabCache componentCache;
+
 
 static int drawBorder(kernelWindowComponent *component, int draw)
 {
@@ -111,6 +115,16 @@ static void renderComponent(kernelWindowComponent *component)
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+int kernelWindowComponentInitialize(void)
+{
+	// Called once, when the window system is initialized, to set up the
+	// cache of component memory
+
+	return (kernelSlabCacheInit(&componentCache, "window components",
+		sizeof(kernelWindowComponent), NULL /* no constructor */));
+}
+
+
 kernelWindowComponent *kernelWindowComponentNew(objectKey parent,
 	componentParameters *params)
 {
@@ -127,7 +141,7 @@ kernelWindowComponent *kernelWindowComponentNew(objectKey parent,
 		return (component = NULL);
 
 	// Get memory for the basic component
-	component = kernelMalloc(sizeof(kernelWindowComponent));
+	component = kernelSlabAlloc(&componentCache);
 	if (!component)
 		return (component);
 
@@ -185,7 +199,7 @@ kernelWindowComponent *kernelWindowComponentNew(objectKey parent,
 	status = kernelWindowEventStreamNew(&component->events);
 	if (status < 0)
 	{
-		kernelFree((void *) component);
+		kernelSlabFree(&componentCache, (void *) component);
 		return (component = NULL);
 	}
 
@@ -209,7 +223,7 @@ kernelWindowComponent *kernelWindowComponentNew(objectKey parent,
 	else
 	{
 		kernelError(kernel_error, "Invalid parent object for new component");
-		kernelFree((void *) component);
+		kernelSlabFree(&componentCache, (void *) component);
 		return (component = NULL);
 	}
 
@@ -218,7 +232,7 @@ kernelWindowComponent *kernelWindowComponentNew(objectKey parent,
 
 	if (status < 0)
 	{
-		kernelFree((void *) component);
+		kernelSlabFree(&componentCache, (void *) component);
 		return (component = NULL);
 	}
 
@@ -288,7 +302,7 @@ void kernelWindowComponentDestroy(kernelWindowComponent *component)
 	kernelStreamDestroy(&component->events);
 
 	// Free the component itself
-	kernelFree((void *) component);
+	kernelSlabFree(&componentCache, (void *) component);
 }
 
 
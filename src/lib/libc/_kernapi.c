@@ -22,6 +22,7 @@
 // This contains code for calling the Visopsys kernel
 
 #include <sys/api.h>
+#include <sys/processor.h>
 
 #ifndef _X_
 #define _X_
@@ -39,8 +40,56 @@
 		: "r" (fnum), "r" (args)				\
 		: "%eax", "memory");
 
+// This is the fast method, using SYSENTER, for user processes on processors
+// that support it.  The kernel returns to the address in EDX and the stack
+// pointer in ECX, with the high dword of the result in EDI.
+#define kernelFastCall(fnum, args, codeLo, codeHi)	\
+	__asm__ __volatile__ ("pushl %%ebx \n\t"		\
+		"pushl %%esi \n\t"						\
+		"pushl %%edi \n\t"						\
+		"pushl %3 \n\t"							\
+		"pushl %2 \n\t"							\
+		"movl %%esp, %%ecx \n\t"				\
+		"call 0f \n\t"							\
+		"0: popl %%edx \n\t"					\
+		"addl $(1f - 0b), %%edx \n\t"			\
+		"sysenter \n\t"							\
+		"1: movl %%edi, %%ecx \n\t"				\
+		"addl $8, %%esp \n\t"					\
+		"popl %%edi \n\t"						\
+		"popl %%esi \n\t"						\
+		"popl %%ebx"							\
+		: "=a" (codeLo), "=c" (codeHi)			\
+		: "r" (fnum), "r" (args)				\
+		: "%edx", "memory");
+
 #define _U_ __attribute__((unused))
 
+static int fastCall = -1;
+
+
+static int fastCallAvailable(void)
+{
+	// The kernel uses SYSENTER for API calls whenever the processor supports
+	// it, but SYSEXIT can only return to user privilege, so processes running
+	// at supervisor privilege always use the call gate
+
+	unsigned short codeSelector = 0;
+	unsigned rega = 0, regb = 0, regc = 0, regd = 0;
+
+	__asm__ __volatile__ ("movw %%cs, %0" : "=r" (codeSelector));
+	if ((codeSelector & 3) != 3)
+		return (0);
+
+	processorId(0, rega, regb, regc, regd);
+	if (rega < 1)
+		return (0);
+
+	processorId(1, rega, regb, regc, regd);
+
+	return (X86_CPUID1_SEP(rega, regd)? 1 : 0);
+}
+
 
 static quad_t _syscall(int fnum, void *args)
 {
@@ -53,8 +102,18 @@ static quad_t _syscall(int fnum, void *args)
 
 	if (!visopsys_in_kernel)
 	{
+		if (fastCall < 0)
+			fastCall = fastCallAvailable();
+
 		// Call the kernel
-		kernelCall(fnum, args, statusLo, statusHi);
+		if (fastCall)
+		{
+			kernelFastCall(fnum, args, statusLo, statusHi);
+		}
+		else
+		{
+			kernelCall(fnum, args, statusLo, statusHi);
+		}
 	}
 
 	status = ((quad_t) statusHi << 32);
@@ -700,6 +759,13 @@ _X_ unsigned filesystemGetBlockSize(const char *fs)
 	return (_syscall(_fnum_filesystemGetBlockSize, &fs));
 }
 
+_X_ int filesystemTrim(const char *name, progress *prog _U_)
+{
+	// Proto: int kernelFilesystemTrim(const char *, progress *)
+	// Desc : Discard (trim) the unused blocks of the filesystem on disk 'name', so that a solid state disk knows it doesn't need to keep their contents.  Progress can optionally be monitored by passing a non-NULL progress structure pointer 'prog'.  The disk must support discarding sectors, and it is optional for filesystem drivers to implement this function.
+	return (_syscall(_fnum_filesystemTrim, &name));
+}
+
 
 //
 // File functions
@@ -976,6 +1042,20 @@ _X_ int memoryGetBlocks(memoryBlock *blocksArray, unsigned buffSize _U_, int ker
 	return (_syscall(_fnum_memoryGetBlocks, &blocksArray));
 }
 
+_X_ int memoryGetCaches(memoryCacheStats *stats, unsigned buffSize _U_)
+{
+	// Proto: int kernelSlabGetCaches(memoryCacheStats *, unsigned);
+	// Desc : Returns statistics about the kernel's object caches in 'stats', up to 'buffSize' bytes.  Returns the number of caches filled in.
+	return (_syscall(_fnum_memoryGetCaches, &stats));
+}
+
+_X_ void *memoryReserve(unsigned size, const char *desc _U_)
+{
+	// Proto: void *kernelMemoryReserve(unsigned, const char *);
+	// Desc : Reserve a region of memory of size 'size', adding the (optional) description 'desc', without using any physical memory yet.  Each page gets (cleared) memory the first time it's touched, so this is cheap for large, sparsely-used allocations.  Release it with memoryRelease().
+	return ((void *)(long) _syscall(_fnum_memoryReserve, &size));
+}
+
 
 //
 // Multitasker functions
@@ -1198,6 +1278,13 @@ _X_ int multitaskerStackTrace(int processId)
 	return (_syscall(_fnum_multitaskerStackTrace, &processId));
 }
 
+_X_ int multitaskerGetNumCpus(void)
+{
+	// Proto: int kernelSmpNumCpus(void);
+	// Desc : Returns the number of CPUs that are online.
+	return (_syscall(_fnum_multitaskerGetNumCpus, NULL));
+}
+
 
 //
 // Loader functions
@@ -22,6 +22,14 @@
 // These functions comprise Visopsys heap memory management system.  They rely
 // upon the kernelMemory code, and do similar things, but instead of whole
 // memory pages, they allocate arbitrary-sized chunks.
+//
+// Small allocations are rounded up to one of a set of size classes, and
+// carved out of 'runs' of equal-sized slots, each size class having its own
+// free lists.  Larger allocations are found in free blocks which are kept in
+// bins by size (a two-level segregated fit), so that a good fit is found
+// without searching all the free blocks.  In user space, each thread also
+// keeps a small 'magazine' of free objects for each size class, so that most
+// small allocations don't need the lock at all.
 
 #include <errno.h>
 #include <stdio.h>
@@ -32,20 +40,84 @@
 #include <sys/lock.h>
 #include <sys/vis.h>
 
+// Size classes of small allocations
+#define MALLOC_SIZE_CLASSES		20
+#define MALLOC_SMALL_MAX		1024
+#define MALLOC_RUN_SIZE			(16 * 1024)
+#define MALLOC_SLOT_ALIGN		16
+
+// Bins of free blocks.  The first level is the power of 2 of the size, and
+// the second level divides that range into equal parts.
+#define MALLOC_FL_BINS			32
+#define MALLOC_SL_BITS			2
+#define MALLOC_SL_BINS			(1 << MALLOC_SL_BITS)
+#define MALLOC_BIN_SCAN			8
+
+// Hash tables for finding used blocks and runs by address
+#define MALLOC_USED_BUCKETS		256
+#define MALLOC_RUN_BUCKETS		64
+
+// Per-thread caches, found by process ID
+#define MALLOC_CACHE_BUCKETS	64
+#define MALLOC_MAGAZINE_SIZE	16
+
+typedef struct _mallocRun {
+	unsigned start;
+	unsigned firstSlot;
+	int process;
+	int sizeClass;
+	unsigned slotSize;
+	int numSlots;
+	int numFree;
+	void *freeList;
+	struct _mallocRun *prev;
+	struct _mallocRun *next;
+	struct _mallocRun *hashNext;
+	struct _mallocRun *allNext;
+	const char *function[];
+
+} mallocRun;
+
+typedef struct _mallocThreadCache {
+	int processId;
+	struct _mallocThreadCache *next;
+	struct {
+		int count;
+		void *object[MALLOC_MAGAZINE_SIZE];
+
+	} magazine[MALLOC_SIZE_CLASSES];
+
+} mallocThreadCache;
+
+static const unsigned classSize[MALLOC_SIZE_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+	640, 768, 896, 1024
+};
+
 static mallocBlock *usedBlockList = NULL;
-static mallocBlock *freeBlockList = NULL;
+static mallocBlock *usedHash[MALLOC_USED_BUCKETS];
+static mallocBlock *freeBin[MALLOC_FL_BINS][MALLOC_SL_BINS];
+static unsigned freeBinBitmap = 0;
+static unsigned freeSubBinBitmap[MALLOC_FL_BINS];
 static mallocBlock *vacantBlockList = NULL;
+static mallocRun * volatile runHash[MALLOC_RUN_BUCKETS];
+static mallocRun *allRuns = NULL;
+static mallocRun *partialRuns[MALLOC_SIZE_CLASSES];
+static mallocRun *emptyRuns = NULL;
+static mallocThreadCache * volatile threadCache[MALLOC_CACHE_BUCKETS];
 static volatile unsigned totalBlocks = 0;
 static volatile unsigned vacantBlocks = 0;
 static volatile unsigned totalMemory = 0;
 static volatile unsigned usedMemory = 0;
+static volatile unsigned numRuns = 0;
 static spinLock blocksLock = { 0 };
 
 unsigned mallocHeapMultiple = USER_MEMORY_HEAP_MULTIPLE;
 
-#define USEDLIST_REF (&usedBlockList)
-#define FREELIST_REF (&freeBlockList)
 #define blockEnd(block) (block->start + (block->size - 1))
+#define runEnd(run) (run->start + (MALLOC_RUN_SIZE - 1))
 
 // Malloc debugging messages are off by default, even in a debug build
 #undef DEBUG
@@ -87,11 +159,14 @@ static inline int process_id(void)
 
 static inline void *memory_get(unsigned size, const char *desc)
 {
+	// In user space, heap memory is only reserved.  The kernel commits
+	// (cleared) memory to each page the first time it's touched, so that
+	// parts of the heap that are never used don't use any memory.
 	debug("Request memory block of size %u", size);
 	if (visopsys_in_kernel)
 		return (kernLibOps.memoryGetSystem(size, desc));
 	else
-		return (memoryGet(size, desc));
+		return (memoryReserve(size, desc));
 }
 
 
@@ -123,86 +198,158 @@ static inline void lock_release(spinLock *lock)
 }
 
 
-static inline void insertBlock(mallocBlock **list, mallocBlock *insBlock,
-	mallocBlock *nextBlock)
+static inline int highBit(unsigned value)
 {
-	// Stick the first block in front of the second block
+	// The number of the highest set bit.  value must be non-zero.
+	return (31 - __builtin_clz(value));
+}
 
-	debug("Insert block %08x->%08x (%u) before %08x->%08x (%u)",
-		insBlock->start, blockEnd(insBlock), insBlock->size, nextBlock->start,
-		blockEnd(nextBlock), nextBlock->size);
 
-	insBlock->prev = nextBlock->prev;
-	insBlock->next = nextBlock;
+static inline int lowBit(unsigned value)
+{
+	// The number of the lowest set bit.  value must be non-zero.
+	return (__builtin_ctz(value));
+}
+
 
-	if (nextBlock->prev)
-		nextBlock->prev->next = insBlock;
+static inline void binIndex(unsigned size, int *fl, int *sl)
+{
+	// Which bin does a free block of this size belong in?
 
-	nextBlock->prev = insBlock;
+	*fl = highBit(size);
 
-	if (nextBlock == *list)
-		*list = insBlock;
+	if (*fl < MALLOC_SL_BITS)
+		*sl = 0;
+	else
+		*sl = ((size >> (*fl - MALLOC_SL_BITS)) & (MALLOC_SL_BINS - 1));
 }
 
 
-static inline void appendBlock(mallocBlock *appBlock, mallocBlock *prevBlock)
+static void binInsert(mallocBlock *block)
 {
-	// Stick the first block behind the second block
+	// Put a free block at the front of its bin
+
+	int fl = 0, sl = 0;
 
-	debug("Append block %08x->%08x (%u) after %08x->%08x (%u)",
-		appBlock->start, blockEnd(appBlock), appBlock->size,
-		prevBlock->start, blockEnd(prevBlock), prevBlock->size);
+	binIndex(block->size, &fl, &sl);
 
-	appBlock->prev = prevBlock;
-	appBlock->next = prevBlock->next;
+	debug("Bin free block %08x->%08x (%u) in %d/%d", block->start,
+		blockEnd(block), block->size, fl, sl);
+
+	block->flags |= MALLOCBLOCK_FREE;
+	block->prev = NULL;
+	block->next = freeBin[fl][sl];
 
-	if (prevBlock->next)
-		prevBlock->next->prev = appBlock;
+	if (freeBin[fl][sl])
+		freeBin[fl][sl]->prev = block;
 
-	prevBlock->next = appBlock;
+	freeBin[fl][sl] = block;
+	freeSubBinBitmap[fl] |= (1 << sl);
+	freeBinBitmap |= (1 << fl);
 }
 
 
-static int sortInsertBlock(mallocBlock **list, mallocBlock *block)
+static void binRemove(mallocBlock *block)
 {
-	// Find the correct (sorted) place for in the block list for this block
+	// Take a free block out of its bin
 
-	int status = 0;
-	mallocBlock *nextBlock = NULL;
+	int fl = 0, sl = 0;
 
-	debug("Sort insert block %08x->%08x (%u) in %s list", block->start,
-		blockEnd(block), block->size, ((list == USEDLIST_REF)? "used" :
-			"free"));
+	binIndex(block->size, &fl, &sl);
 
-	if (*list)
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		freeBin[fl][sl] = block->next;
+
+	if (block->next)
+		block->next->prev = block->prev;
+
+	if (!freeBin[fl][sl])
 	{
-		nextBlock = *list;
+		freeSubBinBitmap[fl] &= ~(1 << sl);
+		if (!freeSubBinBitmap[fl])
+			freeBinBitmap &= ~(1 << fl);
+	}
 
-		while (nextBlock)
-		{
-			if (nextBlock->start > block->start)
-			{
-				insertBlock(list, block, nextBlock);
-				break;
-			}
+	block->flags &= ~MALLOCBLOCK_FREE;
+	block->prev = NULL;
+	block->next = NULL;
+}
 
-			if (!nextBlock->next)
-			{
-				appendBlock(block, nextBlock);
-				break;
-			}
 
-			nextBlock = nextBlock->next;
+static inline unsigned usedHashIndex(unsigned start)
+{
+	return (((start >> 4) ^ (start >> 12)) % MALLOC_USED_BUCKETS);
+}
+
+
+static void usedInsert(mallocBlock *block)
+{
+	// Add a block to the used block list, and the hash table for finding it
+
+	unsigned bucket = usedHashIndex(block->start);
+
+	block->prev = NULL;
+	block->next = usedBlockList;
+
+	if (usedBlockList)
+		usedBlockList->prev = block;
+
+	usedBlockList = block;
+
+	block->hashNext = usedHash[bucket];
+	usedHash[bucket] = block;
+}
+
+
+static void usedRemove(mallocBlock *block)
+{
+	// Remove a block from the used block list and the hash table
+
+	mallocBlock **link = &usedHash[usedHashIndex(block->start)];
+
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		usedBlockList = block->next;
+
+	if (block->next)
+		block->next->prev = block->prev;
+
+	block->prev = NULL;
+	block->next = NULL;
+
+	while (*link)
+	{
+		if (*link == block)
+		{
+			*link = block->hashNext;
+			break;
 		}
+
+		link = &((*link)->hashNext);
 	}
-	else
+
+	block->hashNext = NULL;
+}
+
+
+static mallocBlock *findUsed(unsigned start)
+{
+	// Find the used block that starts at the supplied address
+
+	mallocBlock *block = usedHash[usedHashIndex(start)];
+
+	while (block)
 	{
-		block->prev = NULL;
-		block->next = NULL;
-		*list = block;
+		if (block->start == start)
+			return (block);
+
+		block = block->hashNext;
 	}
 
-	return (status = 0);
+	return (block = NULL);
 }
 
 
@@ -276,34 +423,10 @@ static mallocBlock *getBlock(void)
 }
 
 
-static void removeBlock(mallocBlock **list, mallocBlock *block)
+static void putBlock(mallocBlock *block)
 {
-	// Remove a block from a list
-
-	debug("Remove block %08x->%08x (%u) from %s list", block->start,
-		blockEnd(block), block->size, ((list == USEDLIST_REF)? "used" :
-			"free"));
-
-	if (block->prev)
-		block->prev->next = block->next;
-	if (block->next)
-		block->next->prev = block->prev;
-
-	if (block == *list)
-		*list = block->next;
-
-	block->prev = NULL;
-	block->next = NULL;
-}
-
-
-static void putBlock(mallocBlock **list, mallocBlock *block)
-{
-	// This function gets called when a block is no longer needed.  We zero
-	// out its fields and move it to the end of the used blocks.
-
-	// Remove the block from the list
-	removeBlock(list, block);
+	// This function gets called when a block is no longer needed, and not in
+	// any list.  We zero out its fields and make it vacant.
 
 	// Clear it
 	memset(block, 0, sizeof(mallocBlock));
@@ -316,36 +439,12 @@ static void putBlock(mallocBlock **list, mallocBlock *block)
 }
 
 
-static int createBlock(mallocBlock **list, unsigned start, unsigned size,
-	unsigned heapAlloc, unsigned heapAllocSize)
-{
-	// Creates a used or free block in the supplied block list
-
-	int status = 0;
-	mallocBlock *block = NULL;
-
-	debug("Create block %08x-%08x (%u) in %s list", start,
-		(start + (size - 1)), size, ((list == USEDLIST_REF)? "used" :
-			"free"));
-
-	block = getBlock();
-	if (!block)
-		return (status = ERR_NOFREE);
-
-	block->start = start;
-	block->size = size;
-	block->heapAlloc = heapAlloc;
-	block->heapAllocSize = heapAllocSize;
-
-	return (status = sortInsertBlock(list, block));
-}
-
-
 static int growHeap(unsigned minSize)
 {
 	// This grows the pool of heap memory by at least minSize bytes
 
 	void *newHeap = NULL;
+	mallocBlock *block = NULL;
 
 	// Don't allocate less than the default heap multiple
 	if (minSize < mallocHeapMultiple)
@@ -359,6 +458,10 @@ static int growHeap(unsigned minSize)
 	if (minSize > mallocHeapMultiple)
 		debug("Size is greater than %u", mallocHeapMultiple);
 
+	block = getBlock();
+	if (!block)
+		return (ERR_NOFREE);
+
 	// Get the heap memory
 	if (visopsys_in_kernel)
 		newHeap = memory_get(minSize, "kernel heap");
@@ -368,30 +471,42 @@ static int growHeap(unsigned minSize)
 	if (!newHeap)
 	{
 		error("Unable to allocate heap memory");
+		putBlock(block);
 		return (ERR_MEMORY);
 	}
 
 	totalMemory += minSize;
 
 	// Add it as a single free block
-	return (createBlock(FREELIST_REF, (unsigned) newHeap, minSize,
-		(unsigned) newHeap, minSize));
+	block->start = (unsigned) newHeap;
+	block->size = minSize;
+	block->heapAlloc = (unsigned) newHeap;
+	block->heapAllocSize = minSize;
+	binInsert(block);
+
+	return (0);
 }
 
 
 static mallocBlock *findFree(unsigned size)
 {
-	// This is a best-fit algorithm to search the free block list for the free
-	// block that's closest to the size requested.  We do it this way in order
-	// to (hopefully) reduce memory fragmentation - i.e. reduce heap memory
-	// usage - at the possible expense of slightly longer searches.
+	// Find a free block that's big enough.  First we look for the best fit
+	// amongst the first few blocks in the bin this size belongs in, which
+	// might or might not be big enough.  Failing that, the first block from
+	// the next bin whose blocks are all big enough.
 
-	mallocBlock *block = freeBlockList;
+	mallocBlock *block = NULL;
 	mallocBlock *closestBlock = NULL;
+	unsigned bits = 0;
+	int fl = 0, sl = 0;
+	int count;
 
 	debug("Search for free block of at least %u", size);
 
-	while (block)
+	binIndex(size, &fl, &sl);
+
+	block = freeBin[fl][sl];
+	for (count = 0; (block && (count < MALLOC_BIN_SCAN)); count ++)
 	{
 		// If the block is exactly the right size, return it
 		if (block->size == size)
@@ -415,21 +530,54 @@ static mallocBlock *findFree(unsigned size)
 		debug("Found free block of size %u", closestBlock->size);
 		return (closestBlock);
 	}
+
+	// Round the size up to the start of the next bin
+	if (fl >= MALLOC_SL_BITS)
+	{
+		if (size > (0xFFFFFFFF - (1 << (fl - MALLOC_SL_BITS))))
+			return (block = NULL);
+
+		binIndex((size + (1 << (fl - MALLOC_SL_BITS))), &fl, &sl);
+	}
 	else
 	{
-		debug("No block found");
-		return (block = NULL);
+		sl += 1;
+	}
+
+	bits = 0;
+	if (sl < MALLOC_SL_BINS)
+		bits = (freeSubBinBitmap[fl] & (0xFFFFFFFF << sl));
+
+	if (!bits)
+	{
+		bits = 0;
+		if (fl < (MALLOC_FL_BINS - 1))
+			bits = (freeBinBitmap & (0xFFFFFFFF << (fl + 1)));
+
+		if (!bits)
+		{
+			debug("No block found");
+			return (block = NULL);
+		}
+
+		fl = lowBit(bits);
+		bits = freeSubBinBitmap[fl];
 	}
+
+	sl = lowBit(bits);
+	block = freeBin[fl][sl];
+
+	debug("Found free block of size %u", block->size);
+	return (block);
 }
 
 
-static void *allocateBlock(unsigned size, const char *function)
+static mallocBlock *allocateBlock(unsigned size, const char *function)
 {
-	// Find a block of unused memory, and return the start pointer
+	// Find a block of unused memory, and move it to the used list
 
-	int status = 0;
 	mallocBlock *block = NULL;
-	unsigned remainder = 0;
+	mallocBlock *remainder = NULL;
 
 	// Make sure we do allocations on nice boundaries
 	if (size % sizeof(int))
@@ -443,144 +591,588 @@ static void *allocateBlock(unsigned size, const char *function)
 	// time we're invoked, as totalMemory will be zero.
 	if ((size > (totalMemory - usedMemory)) || !(block = findFree(size)))
 	{
-		status = growHeap(size);
-		if (status < 0)
-		{
-			errno = status;
-			return (NULL);
-		}
+		errno = growHeap(size);
+		if (errno < 0)
+			return (block = NULL);
 
 		block = findFree(size);
 		if (!block)
 		{
 			// Something really wrong
 			error("Unable to allocate block of size %u (%s)", size, function);
-			return (NULL);
+			return (block = NULL);
 		}
 	}
 
-	// Remove it from the free list
-	removeBlock(FREELIST_REF, block);
+	// Remove it from its bin
+	binRemove(block);
+
+	// If part of this block will be unused, we will need to create a free
+	// block for the remainder.  If we can't get one, just leave it attached.
+	if ((block->size > size) && (remainder = getBlock()))
+	{
+		debug("Split block of size %u from remainder of size %u", size,
+			(block->size - size));
+
+		remainder->start = (block->start + size);
+		remainder->size = (block->size - size);
+		remainder->heapAlloc = block->heapAlloc;
+		remainder->heapAllocSize = block->heapAllocSize;
+		remainder->adjPrev = block;
+		remainder->adjNext = block->adjNext;
+
+		if (block->adjNext)
+			block->adjNext->adjPrev = remainder;
+
+		block->adjNext = remainder;
+		block->size = size;
+
+		binInsert(remainder);
+	}
 
 	block->function = function;
 	block->process = process_id();
 
 	// Add it to the used block list
-	sortInsertBlock(USEDLIST_REF, block);
-	if (status < 0)
-		return (NULL);
+	usedInsert(block);
 
-	// If part of this block will be unused, we will need to create a free
-	// block for the remainder
-	if (block->size > size)
+	usedMemory += block->size;
+
+	return (block);
+}
+
+
+static void deallocateBlock(mallocBlock *block)
+{
+	// Give a used block back, merging it with the free blocks on either side
+	// of it, and releasing the heap memory if it's all free
+
+	mallocBlock *adj = NULL;
+
+	// Remove it from the used list
+	usedRemove(block);
+
+	// Clear out the memory
+	memset((void *) block->start, 0, block->size);
+
+	usedMemory -= block->size;
+
+	block->process = 0;
+	block->function = NULL;
+	block->flags = 0;
+
+	// Merge with the previous block, if it's free
+	adj = block->adjPrev;
+	if (adj && (adj->flags & MALLOCBLOCK_FREE))
 	{
-		remainder = (block->size - size);
-		block->size = size;
+		binRemove(adj);
+		adj->size += block->size;
+		adj->adjNext = block->adjNext;
+		if (block->adjNext)
+			block->adjNext->adjPrev = adj;
+		putBlock(block);
+		block = adj;
+	}
 
-		debug("Split block of size %u from remainder of size %u", size,
-			remainder);
+	// Merge with the next block, if it's free
+	adj = block->adjNext;
+	if (adj && (adj->flags & MALLOCBLOCK_FREE))
+	{
+		binRemove(adj);
+		block->size += adj->size;
+		block->adjNext = adj->adjNext;
+		if (adj->adjNext)
+			adj->adjNext->adjPrev = block;
+		putBlock(adj);
+	}
+
+	// If the block comprises an entire heap allocation, return that heap
+	// memory and get rid of the block
+	if (block->size == block->heapAllocSize)
+	{
+		debug("Release heap memory allocation %08x->%08x (%u)", block->start,
+			blockEnd(block), block->size);
+
+		memory_release((void *) block->start);
+		totalMemory -= block->size;
+		putBlock(block);
+		return;
+	}
+
+	binInsert(block);
+}
+
+
+static inline int getSizeClass(unsigned size)
+{
+	// Which size class does an allocation of this size belong to?
+
+	if (size <= 128)
+		return (((size + 15) / 16) - 1);
+	else if (size <= 256)
+		return (8 + ((size - 129) / 32));
+	else if (size <= 512)
+		return (12 + ((size - 257) / 64));
+	else
+		return (16 + ((size - 513) / 128));
+}
+
+
+static inline unsigned runHashIndex(unsigned address)
+{
+	return ((address / MALLOC_RUN_SIZE) % MALLOC_RUN_BUCKETS);
+}
+
+
+static mallocRun *findRun(unsigned address)
+{
+	// Find the run that contains the supplied address, if any.  Runs are
+	// never released, and are only ever added to the front of their hash
+	// chains, so this is safe without the lock.  A run starts in the same
+	// granule as the address, or the one before.
+
+	mallocRun *run = NULL;
+	int count;
 
-		if (createBlock(FREELIST_REF, (block->start + size), remainder,
-			block->heapAlloc, block->heapAllocSize) < 0)
+	for (count = 0; count < 2; count ++)
+	{
+		run = runHash[runHashIndex(address - (count * MALLOC_RUN_SIZE))];
+
+		while (run)
 		{
-			return (NULL);
+			if ((address >= run->start) && (address <= runEnd(run)))
+				return (run);
+
+			run = run->hashNext;
 		}
 	}
 
-	usedMemory += size;
+	return (run = NULL);
+}
+
+
+static inline int runSlot(mallocRun *run, void *object)
+{
+	// Returns the slot number of the object in the run, or negative if it's
+	// not the start of a slot
 
-	return ((void *) block->start);
+	unsigned offset = 0;
+
+	if ((unsigned) object < run->firstSlot)
+		return (ERR_BADADDRESS);
+
+	offset = ((unsigned) object - run->firstSlot);
+	if ((offset % run->slotSize) ||
+		((int)(offset / run->slotSize) >= run->numSlots))
+	{
+		return (ERR_BADADDRESS);
+	}
+
+	return (offset / run->slotSize);
 }
 
 
-static void mergeFree(mallocBlock *block)
+static void formatRun(mallocRun *run, int sizeClass)
 {
-	// Merge this free block with the previous and/or next blocks if they are
-	// also free
+	// Divide a run into slots for the size class.  The run must be empty.
+
+	void *slot = NULL;
+	unsigned headerSize = 0;
+	int count;
 
-	// Check whether we're contiguous with the previous block
-	if (block->prev && (block->prev->heapAlloc == block->heapAlloc) &&
-		(blockEnd(block->prev) == (block->start - 1)))
+	run->sizeClass = sizeClass;
+	run->slotSize = classSize[sizeClass];
+
+	// The header has a function pointer for each slot
+	run->numSlots = ((MALLOC_RUN_SIZE - sizeof(mallocRun)) /
+		(run->slotSize + sizeof(const char *)));
+
+	while (1)
 	{
-		block->start = block->prev->start;
-		block->size += block->prev->size;
-		putBlock(FREELIST_REF, block->prev);
+		headerSize = (sizeof(mallocRun) + (run->numSlots *
+			sizeof(const char *)));
+		headerSize = (((headerSize + (MALLOC_SLOT_ALIGN - 1)) /
+			MALLOC_SLOT_ALIGN) * MALLOC_SLOT_ALIGN);
+
+		if ((headerSize + (run->numSlots * run->slotSize)) <=
+			MALLOC_RUN_SIZE)
+		{
+			break;
+		}
+
+		run->numSlots -= 1;
 	}
 
-	// Check whether we're contiguous with the next block
-	if (block->next && (block->next->heapAlloc == block->heapAlloc) &&
-		(blockEnd(block) == (block->next->start - 1)))
+	run->firstSlot = (run->start + headerSize);
+
+	// Clear out the old layout, and link up the free list
+	memset((void *) &run->function[0], 0, (MALLOC_RUN_SIZE -
+		sizeof(mallocRun)));
+
+	run->freeList = NULL;
+	for (count = (run->numSlots - 1); count >= 0; count --)
 	{
-		block->size += block->next->size;
-		putBlock(FREELIST_REF, block->next);
+		slot = (void *)(run->firstSlot + (count * run->slotSize));
+		*((void **) slot) = run->freeList;
+		run->freeList = slot;
 	}
+
+	run->numFree = run->numSlots;
 }
 
 
-static void cleanupHeap(mallocBlock *block)
+static inline void runListAdd(mallocRun **list, mallocRun *run)
 {
-	// If the supplied free block comprises an entire heap allocation, return
-	// that heap memory and get rid of the block
+	run->prev = NULL;
+	run->next = *list;
 
-	if (block->size != block->heapAllocSize)
-		return;
+	if (*list)
+		(*list)->prev = run;
+
+	*list = run;
+}
+
+
+static inline void runListRemove(mallocRun **list, mallocRun *run)
+{
+	if (run->prev)
+		run->prev->next = run->next;
+	else
+		*list = run->next;
 
-	// Looks like we can return this memory
-	debug("Release heap memory allocation %08x->%08x (%u)", block->start,
-		blockEnd(block), block->size);
+	if (run->next)
+		run->next->prev = run->prev;
 
-	memory_release((void *) block->start);
-	totalMemory -= block->size;
-	putBlock(FREELIST_REF, block);
+	run->prev = run->next = NULL;
 }
 
 
-static int deallocateBlock(void *start, const char *function)
+static mallocRun *newRun(void)
 {
-	// Find an allocated (used) block and deallocate it
+	// Get a new run from the heap
 
-	int status = 0;
-	mallocBlock *block = usedBlockList;
+	mallocBlock *block = NULL;
+	mallocRun *run = NULL;
+	unsigned bucket = 0;
 
-	while (block)
+	block = allocateBlock(MALLOC_RUN_SIZE, "malloc size classes");
+	if (!block)
+		return (run = NULL);
+
+	block->flags |= MALLOCBLOCK_RUN;
+
+	run = (mallocRun *) block->start;
+	run->start = block->start;
+	run->process = block->process;
+	run->sizeClass = -1;
+
+	run->allNext = allRuns;
+	allRuns = run;
+
+	// Put it in the hash table last, once it's all set up
+	bucket = runHashIndex(run->start);
+	run->hashNext = runHash[bucket];
+	runHash[bucket] = run;
+
+	numRuns += 1;
+
+	return (run);
+}
+
+
+static void *smallAllocate(int sizeClass)
+{
+	// Take a free object of the size class from a run.  The lock must be
+	// held.
+
+	mallocRun *run = partialRuns[sizeClass];
+	void *object = NULL;
+
+	if (!run)
+	{
+		// Use an empty run, or failing that, a new one
+		run = emptyRuns;
+		if (run)
+			runListRemove(&emptyRuns, run);
+		else
+			run = newRun();
+
+		if (!run)
+			return (object = NULL);
+
+		if (run->sizeClass != sizeClass)
+			formatRun(run, sizeClass);
+
+		runListAdd(&partialRuns[sizeClass], run);
+	}
+
+	object = run->freeList;
+	run->freeList = *((void **) object);
+	*((void **) object) = NULL;
+
+	run->numFree -= 1;
+	if (!run->numFree)
+		runListRemove(&partialRuns[sizeClass], run);
+
+	return (object);
+}
+
+
+static void smallFree(mallocRun *run, void *object)
+{
+	// Put a (cleared) object back on its run's free list.  The lock must be
+	// held.
+
+	if (!run->numFree)
+		runListAdd(&partialRuns[run->sizeClass], run);
+
+	*((void **) object) = run->freeList;
+	run->freeList = object;
+	run->numFree += 1;
+
+	// Empty runs can be used for any size class
+	if (run->numFree >= run->numSlots)
+	{
+		runListRemove(&partialRuns[run->sizeClass], run);
+		runListAdd(&emptyRuns, run);
+	}
+}
+
+
+static void flushMagazine(mallocThreadCache *cache, int sizeClass,
+	int keep)
+{
+	// Give objects in a thread's magazine back to their runs, keeping
+	// 'keep' of them.  The lock must be held.  Objects are only checked
+	// without the lock when they go into a magazine, so make sure they still
+	// belong to a run of this size class, and aren't already free.
+
+	void *object = NULL;
+	mallocRun *run = NULL;
+	int slot = 0;
+
+	while (cache->magazine[sizeClass].count > keep)
 	{
-		if (block->start == (unsigned) start)
+		cache->magazine[sizeClass].count -= 1;
+		object = cache->magazine[sizeClass].object[
+			cache->magazine[sizeClass].count];
+
+		run = findRun((unsigned) object);
+		if (run)
+			slot = runSlot(run, object);
+
+		if (!run || (run->sizeClass != sizeClass) || (slot < 0) ||
+			run->function[slot])
 		{
-			// Remove it from the used list
-			removeBlock(USEDLIST_REF, block);
+			error("Stale memory block %08x in a thread cache",
+				(unsigned) object);
+			continue;
+		}
+
+		smallFree(run, object);
+	}
+}
+
 
-			// Clear out the memory
-			memset(start, 0, block->size);
+static mallocThreadCache *getThreadCache(int processId)
+{
+	// Find the calling thread's cache, or set one up.  Only user space
+	// threads have them.  Returns NULL if there isn't one to be had.
+
+	unsigned bucket = (processId % MALLOC_CACHE_BUCKETS);
+	mallocThreadCache *cache = NULL;
+	mallocBlock *block = NULL;
+	int sizeClass;
+
+	if (visopsys_in_kernel)
+		return (cache = NULL);
+
+	// Caches are never freed, are only ever added to the front of their
+	// bucket's chain, and are only handed on to threads in the same bucket,
+	// so a thread can find its own without the lock
+	for (cache = threadCache[bucket]; cache; cache = cache->next)
+	{
+		if (cache->processId == processId)
+			return (cache);
+	}
 
-			block->process = 0;
-			block->function = NULL;
+	if (lock_get(&blocksLock) < 0)
+		return (cache = NULL);
 
-			// Add it to the free block list
-			sortInsertBlock(FREELIST_REF, block);
+	// Take over the cache of a thread that has gone away, or set up a new
+	// one
+	for (cache = threadCache[bucket]; cache; cache = cache->next)
+	{
+		if (!multitaskerProcessIsAlive(cache->processId))
+		{
+			for (sizeClass = 0; sizeClass < MALLOC_SIZE_CLASSES;
+				sizeClass ++)
+			{
+				flushMagazine(cache, sizeClass, 0);
+			}
+
+			cache->processId = processId;
+			break;
+		}
+	}
+
+	if (!cache)
+	{
+		block = allocateBlock(sizeof(mallocThreadCache),
+			"malloc thread cache");
+		if (block)
+		{
+			cache = (mallocThreadCache *) block->start;
+			cache->processId = processId;
+			cache->next = threadCache[bucket];
+			threadCache[bucket] = cache;
+		}
+	}
+
+	lock_release(&blocksLock);
+
+	return (cache);
+}
+
+
+static void *allocateSmall(unsigned size, const char *function)
+{
+	// Allocate an object from the size classes, from the thread's cache if
+	// we can.  The lock is only needed to refill the cache.
+
+	mallocThreadCache *cache = NULL;
+	int sizeClass = getSizeClass(size);
+	mallocRun *run = NULL;
+	void *object = NULL;
+
+	cache = getThreadCache(process_id());
+
+	if (cache)
+	{
+		if (!cache->magazine[sizeClass].count)
+		{
+			// Refill half of the magazine
+			if (lock_get(&blocksLock) < 0)
+				return (object = NULL);
+
+			while (cache->magazine[sizeClass].count <
+				(MALLOC_MAGAZINE_SIZE / 2))
+			{
+				object = smallAllocate(sizeClass);
+				if (!object)
+					break;
+
+				cache->magazine[sizeClass].object[
+					cache->magazine[sizeClass].count++] = object;
+			}
+
+			lock_release(&blocksLock);
+
+			if (!cache->magazine[sizeClass].count)
+				return (object = NULL);
+		}
+
+		cache->magazine[sizeClass].count -= 1;
+		object = cache->magazine[sizeClass].object[
+			cache->magazine[sizeClass].count];
+
+		// Objects in a magazine are still allocated as far as their run is
+		// concerned, so the run can't be reformatted underneath us
+		run = findRun((unsigned) object);
+		run->function[runSlot(run, object)] = function;
+	}
+	else
+	{
+		if (lock_get(&blocksLock) < 0)
+			return (object = NULL);
+
+		object = smallAllocate(sizeClass);
+		if (object)
+		{
+			run = findRun((unsigned) object);
+			run->function[runSlot(run, object)] = function;
+		}
+
+		lock_release(&blocksLock);
+	}
+
+	return (object);
+}
+
+
+static int deallocateSmall(mallocRun *run, void *object,
+	const char *function)
+{
+	// Give back an object from the size classes, to the thread's cache if
+	// we can.  The lock is only needed to flush the cache, or if there
+	// isn't one.
+
+	int status = 0;
+	mallocThreadCache *cache = NULL;
+	int slot = 0;
+
+	cache = getThreadCache(process_id());
+
+	if (cache)
+	{
+		// An allocated object's run can't be reformatted, so this check is
+		// good without the lock.  A stale pointer whose run is being
+		// reformatted could get past it, but then it's caught when the
+		// magazine is flushed.
+		slot = runSlot(run, object);
+		if ((slot < 0) || !run->function[slot])
+		{
+			error("No such memory block %08x to deallocate (%s)",
+				(unsigned) object, function);
+			return (status = ERR_NOSUCHENTRY);
+		}
+
+		// If the magazine is full, give half of it back
+		if (cache->magazine[run->sizeClass].count >= MALLOC_MAGAZINE_SIZE)
+		{
+			status = lock_get(&blocksLock);
 			if (status < 0)
 				return (status);
 
-			usedMemory -= block->size;
+			flushMagazine(cache, run->sizeClass, (MALLOC_MAGAZINE_SIZE / 2));
 
-			// Merge free blocks on either side of this one
-			mergeFree(block);
+			lock_release(&blocksLock);
+		}
 
-			// Can the heap be deallocated?
-			cleanupHeap(block);
+		// Clear out the memory
+		memset(object, 0, run->slotSize);
+		run->function[slot] = NULL;
 
-			// Don't try to use 'block' after this point, it might have
-			// disappeared
-			block = NULL;
+		cache->magazine[run->sizeClass].object[
+			cache->magazine[run->sizeClass].count++] = object;
 
-			return (status = 0);
-		}
+		return (status = 0);
+	}
 
-		block = block->next;
+	// Without a cache, the run's layout is only looked at with the lock
+	// held, since an empty run can be reformatted at any time
+	status = lock_get(&blocksLock);
+	if (status < 0)
+		return (status);
+
+	slot = runSlot(run, object);
+	if ((slot < 0) || !run->function[slot])
+	{
+		lock_release(&blocksLock);
+		error("No such memory block %08x to deallocate (%s)",
+			(unsigned) object, function);
+		return (status = ERR_NOSUCHENTRY);
 	}
 
-	error("No such memory block %08x to deallocate (%s)", (unsigned) start,
-		function);
-	return (status = ERR_NOSUCHENTRY);
+	// Clear out the memory
+	memset(object, 0, run->slotSize);
+	run->function[slot] = NULL;
+
+	smallFree(run, object);
+
+	lock_release(&blocksLock);
+
+	return (status = 0);
 }
 
 
@@ -595,24 +1187,36 @@ static inline void mallocBlock2MemoryBlock(mallocBlock *maBlock,
 }
 
 
+static inline void runSlot2MemoryBlock(mallocRun *run, int slot,
+	memoryBlock *meBlock)
+{
+	meBlock->processId = run->process;
+	strncpy(meBlock->description, run->function[slot],
+		MEMORY_MAX_DESC_LENGTH);
+	meBlock->description[MEMORY_MAX_DESC_LENGTH] = '\0';
+	meBlock->startLocation = (run->firstSlot + (slot * run->slotSize));
+	meBlock->endLocation = (meBlock->startLocation + (run->slotSize - 1));
+}
+
+
 #if defined(DEBUG)
-static int checkPointer(mallocBlock *block)
+static int checkPointer(void *pointer)
 {
 	int status = 0;
 
 	if (visopsys_in_kernel)
 	{
-		if ((unsigned) block < 0xC0000000)
+		if ((unsigned) pointer < 0xC0000000)
 		{
-			error("Kernel block %p is not in kernel memory space", block);
+			error("Kernel block %p is not in kernel memory space", pointer);
 			return (status = ERR_BADADDRESS);
 		}
 	}
 	else
 	{
-		if ((unsigned) block > 0xC0000000)
+		if ((unsigned) pointer > 0xC0000000)
 		{
-			error("User block %p is in kernel memory space", block);
+			error("User block %p is in kernel memory space", pointer);
 			return (status = ERR_BADADDRESS);
 		}
 	}
@@ -621,108 +1225,121 @@ static int checkPointer(mallocBlock *block)
 }
 
 
-static int checkBlocks(void)
+static int checkBlock(mallocBlock *block, const char *listName)
 {
+	// Check a block, and its relationship with its neighbours in memory
+
 	int status = 0;
-	mallocBlock **lists[2] = {
-		FREELIST_REF, USEDLIST_REF,
-	};
-	const char *listName = NULL;
-	mallocBlock *block = NULL;
-	mallocBlock *prev = NULL;
-	mallocBlock *next = NULL;
-	int count;
+	mallocBlock *prev = block->adjPrev;
+	mallocBlock *next = block->adjNext;
 
-	for (count = 0; count < 2; count ++)
+	status = checkPointer(block);
+	if (status < 0)
+		return (status);
+
+	if ((block->start < block->heapAlloc) || (blockEnd(block) >
+		(block->heapAlloc + (block->heapAllocSize - 1))))
 	{
-		if (lists[count] == FREELIST_REF)
-			listName = "free";
-		else if (lists[count] == USEDLIST_REF)
-			listName = "used";
-		else
-			listName = "unknown";
+		error("Block %08x->%08x (%u) is outside its heap allocation in %s "
+			"list", block->start, blockEnd(block), block->size, listName);
+		return (status = ERR_BADDATA);
+	}
 
-		block = *lists[count];
+	if (prev)
+	{
+		status = checkPointer(prev);
+		if (status < 0)
+			return (status);
 
-		while (block)
+		if ((prev->adjNext != block) || (blockEnd(prev) != (block->start - 1)))
 		{
-			status = checkPointer(block);
-			if (status < 0)
-				return (status);
+			error("Previous block %08x->%08x (%u) is not adjacent to "
+				"current block %08x->%08x (%u) in %s list", prev->start,
+				blockEnd(prev), prev->size, block->start, blockEnd(block),
+				block->size, listName);
+			return (status = ERR_BADDATA);
+		}
+	}
 
-			if (block->prev)
-			{
-				prev = block->prev;
+	if (next)
+	{
+		status = checkPointer(next);
+		if (status < 0)
+			return (status);
 
-				status = checkPointer(prev);
-				if (status < 0)
-					return (status);
+		if ((next->adjPrev != block) || (blockEnd(block) != (next->start - 1)))
+		{
+			error("Next block %08x->%08x (%u) is not adjacent to current "
+				"block %08x->%08x (%u) in %s list", next->start,
+				blockEnd(next), next->size, block->start, blockEnd(block),
+				block->size, listName);
+			return (status = ERR_BADDATA);
+		}
+	}
 
-				if (prev->next != block)
-				{
-					error("Previous block %08x->%08x (%u) does not point to "
-						"current block %08x->%08x (%u) in %s list",
-						prev->start, blockEnd(prev), prev->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-
-				if (prev->start >= block->start)
-				{
-					error("Previous block %08x->%08x (%u) does not start "
-						"before current block %08x->%08x (%u) in %s list",
-						prev->start, blockEnd(prev), prev->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-
-				if (blockEnd(prev) >= block->start)
-				{
-					error("Previous block %08x->%08x (%u) end overlaps "
-						"current block %08x->%08x (%u) in %s list",
-						prev->start, blockEnd(prev), prev->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-			}
+	if ((block->flags & MALLOCBLOCK_FREE) && next &&
+		(next->flags & MALLOCBLOCK_FREE))
+	{
+		error("Free block %08x->%08x (%u) was not merged with the next one",
+			block->start, blockEnd(block), block->size);
+		return (status = ERR_BADDATA);
+	}
 
-			if (block->next)
-			{
-				next = block->next;
+	return (status = 0);
+}
+
+
+static int checkBlocks(void)
+{
+	int status = 0;
+	mallocBlock *block = NULL;
+	mallocRun *run = NULL;
+	int fl, sl;
+
+	for (block = usedBlockList; block; block = block->next)
+	{
+		status = checkBlock(block, "used");
+		if (status < 0)
+			return (status);
 
-				status = checkPointer(next);
+		if (findUsed(block->start) != block)
+		{
+			error("Used block %08x->%08x (%u) is not in the hash table",
+				block->start, blockEnd(block), block->size);
+			return (status = ERR_BADDATA);
+		}
+	}
+
+	for (fl = 0; fl < MALLOC_FL_BINS; fl ++)
+	{
+		for (sl = 0; sl < MALLOC_SL_BINS; sl ++)
+		{
+			for (block = freeBin[fl][sl]; block; block = block->next)
+			{
+				status = checkBlock(block, "free");
 				if (status < 0)
 					return (status);
-
-				if (next->prev != block)
-				{
-					error("Next block %08x->%08x (%u) does not point to "
-						"current block %08x->%08x (%u) in %s list",
-						next->start, blockEnd(next), next->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-
-				if (block->start >= next->start)
-				{
-					error("Next block %08x->%08x (%u) does not start after "
-						"current block %08x->%08x (%u) in %s list",
-						next->start, blockEnd(next), next->size, block->start,
-						blockEnd(block), block->size, listName);
-					return (status = ERR_BADDATA);
-				}
-
-				if (blockEnd(block) >= next->start)
-				{
-					error("Current block %08x->%08x (%u) end overlaps next "
-						"block %08x->%08x (%u) in %s list", block->start,
-						blockEnd(block), block->size, next->start,
-						blockEnd(next), next->size, listName);
-					return (status = ERR_BADDATA);
-				}
 			}
+		}
+	}
+
+	for (run = allRuns; run; run = run->allNext)
+	{
+		status = checkPointer(run);
+		if (status < 0)
+			return (status);
+
+		if (findRun(run->start) != run)
+		{
+			error("Run %08x is not in the hash table", run->start);
+			return (status = ERR_BADDATA);
+		}
 
-			block = block->next;
+		if ((run->numFree < 0) || (run->numFree > run->numSlots))
+		{
+			error("Run %08x has %d free of %d slots", run->start,
+				run->numFree, run->numSlots);
+			return (status = ERR_BADDATA);
 		}
 	}
 
@@ -744,6 +1361,7 @@ void *_doMalloc(unsigned size, const char *function)
 	// These are the guts of malloc() and kernelMalloc()
 
 	int status = 0;
+	mallocBlock *block = NULL;
 	void *address = NULL;
 
 	debug("%s alloc %u", function, size);
@@ -757,6 +1375,16 @@ void *_doMalloc(unsigned size, const char *function)
 		return (address = NULL);
 	}
 
+	// Small allocations come from the size classes
+	if (size <= MALLOC_SMALL_MAX)
+	{
+		address = allocateSmall(size, function);
+		if (!address)
+			errno = ERR_MEMORY;
+
+		return (address);
+	}
+
 	status = lock_get(&blocksLock);
 	if (status < 0)
 	{
@@ -766,7 +1394,9 @@ void *_doMalloc(unsigned size, const char *function)
 	}
 
 	// Find a free block big enough
-	address = allocateBlock(size, function);
+	block = allocateBlock(size, function);
+	if (block)
+		address = (void *) block->start;
 
 	#if defined(DEBUG)
 	if (checkBlocks())
@@ -802,6 +1432,8 @@ void _doFree(void *start, const char *function)
 	// These are the guts of free() and kernelFree()
 
 	int status = 0;
+	mallocRun *run = NULL;
+	mallocBlock *block = NULL;
 
 	if (!start)
 	{
@@ -811,13 +1443,23 @@ void _doFree(void *start, const char *function)
 	}
 
 	// Make sure we've been initialized
-	if (!usedBlockList)
+	if (!totalMemory)
 	{
 		error("No memory allocated (%s)", function);
 		errno = ERR_NOTINITIALIZED;
 		return;
 	}
 
+	// Is it from the size classes?
+	run = findRun((unsigned) start);
+	if (run)
+	{
+		status = deallocateSmall(run, start, function);
+		if (status < 0)
+			errno = status;
+		return;
+	}
+
 	status = lock_get(&blocksLock);
 	if (status < 0)
 	{
@@ -826,7 +1468,17 @@ void _doFree(void *start, const char *function)
 		return;
 	}
 
-	status = deallocateBlock(start, function);
+	block = findUsed((unsigned) start);
+	if (block && !(block->flags & MALLOCBLOCK_RUN))
+	{
+		deallocateBlock(block);
+	}
+	else
+	{
+		error("No such memory block %08x to deallocate (%s)",
+			(unsigned) start, function);
+		status = ERR_NOSUCHENTRY;
+	}
 
 	#if defined(DEBUG)
 	if (checkBlocks())
@@ -865,7 +1517,9 @@ int _mallocBlockInfo(void *start, memoryBlock *meBlock)
 	// the structure with information about it
 
 	int status = 0;
-	mallocBlock *maBlock = usedBlockList;
+	mallocRun *run = NULL;
+	mallocBlock *maBlock = NULL;
+	int slot = 0;
 
 	// Check params
 	if (!start || !meBlock)
@@ -878,17 +1532,27 @@ int _mallocBlockInfo(void *start, memoryBlock *meBlock)
 		return (errno = status);
 	}
 
-	// Loop through the used block list
-	while (maBlock)
+	run = findRun((unsigned) start);
+	if (run)
 	{
-		if (maBlock->start == (unsigned) start)
+		slot = runSlot(run, start);
+		if ((slot >= 0) && run->function[slot])
 		{
-			mallocBlock2MemoryBlock(maBlock, meBlock);
+			runSlot2MemoryBlock(run, slot, meBlock);
 			lock_release(&blocksLock);
 			return (status = 0);
 		}
 
-		maBlock = maBlock->next;
+		lock_release(&blocksLock);
+		return (status = ERR_NOSUCHENTRY);
+	}
+
+	maBlock = findUsed((unsigned) start);
+	if (maBlock && !(maBlock->flags & MALLOCBLOCK_RUN))
+	{
+		mallocBlock2MemoryBlock(maBlock, meBlock);
+		lock_release(&blocksLock);
+		return (status = 0);
 	}
 
 	lock_release(&blocksLock);
@@ -904,6 +1568,8 @@ int _mallocGetStats(memoryStats *stats)
 
 	int status = 0;
 	mallocBlock *block = usedBlockList;
+	mallocRun *run = NULL;
+	int slot;
 
 	// Check params
 	if (!stats)
@@ -921,13 +1587,34 @@ int _mallocGetStats(memoryStats *stats)
 
 	stats->totalBlocks = totalBlocks;
 	stats->usedBlocks = 0;
+	stats->totalMemory = totalMemory;
+	stats->usedMemory = (usedMemory - (numRuns * MALLOC_RUN_SIZE));
+
 	while (block)
 	{
-		stats->usedBlocks += 1;
+		if (!(block->flags & MALLOCBLOCK_RUN))
+			stats->usedBlocks += 1;
 		block = block->next;
 	}
-	stats->totalMemory = totalMemory;
-	stats->usedMemory = usedMemory;
+
+	// Objects from the size classes count as used if they're allocated
+	for (run = allRuns; run; run = run->allNext)
+	{
+		for (slot = 0; slot < run->numSlots; slot ++)
+		{
+			if (run->function[slot])
+			{
+				stats->usedBlocks += 1;
+				stats->usedMemory += run->slotSize;
+			}
+		}
+	}
+
+	stats->freeRanges = 0;
+	stats->largestFree = 0;
+	stats->zeroedMemory = 0;
+	stats->zeroedHits = 0;
+	stats->zeroedMisses = 0;
 
 	lock_release(&blocksLock);
 
@@ -941,7 +1628,9 @@ int _mallocGetBlocks(memoryBlock *blocksArray, int doBlocks)
 
 	int status = 0;
 	mallocBlock *block = usedBlockList;
-	int count;
+	mallocRun *run = NULL;
+	int count = 0;
+	int slot;
 
 	// Check params
 	if (!blocksArray)
@@ -957,11 +1646,22 @@ int _mallocGetBlocks(memoryBlock *blocksArray, int doBlocks)
 		return (errno = status);
 	}
 
-	// Loop through the used block list
-	for (count = 0; (block && (count < doBlocks)); count ++)
+	// Loop through the used block list.  Runs are listed by their objects,
+	// below.
+	for ( ; (block && (count < doBlocks)); block = block->next)
 	{
-		mallocBlock2MemoryBlock(block, &blocksArray[count]);
-		block = block->next;
+		if (!(block->flags & MALLOCBLOCK_RUN))
+			mallocBlock2MemoryBlock(block, &blocksArray[count++]);
+	}
+
+	for (run = allRuns; (run && (count < doBlocks)); run = run->allNext)
+	{
+		for (slot = 0; ((slot < run->numSlots) && (count < doBlocks));
+			slot ++)
+		{
+			if (run->function[slot])
+				runSlot2MemoryBlock(run, slot, &blocksArray[count++]);
+		}
 	}
 
 	lock_release(&blocksLock);
@@ -26,12 +26,16 @@
 #include <sys/api.h>
 #include <sys/cdefs.h>
 
+// How long to sleep between checks, if there are no events yet
+#define POLL_INTERVAL_MS	10
+
 
 int poll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
 	int status = 0;
 	int numEvents = 0;
 	uquad_t endTime = 0;
+	uquad_t currentTime = 0;
 	fileDescType type = filedesc_unknown;
 	void *data = NULL;
 	nfds_t count;
@@ -98,7 +102,18 @@ int poll(struct pollfd *fds, nfds_t nfds, int timeout)
 			}
 		}
 
-	} while (!numEvents && (cpuGetMs() < endTime));
+		if (numEvents)
+			break;
+
+		// Sleep until it's time to check again, rather than spinning
+		currentTime = cpuGetMs();
+		if (currentTime < endTime)
+		{
+			multitaskerWait(((endTime - currentTime) < POLL_INTERVAL_MS)?
+				(unsigned)(endTime - currentTime) : POLL_INTERVAL_MS);
+		}
+
+	} while (cpuGetMs() < endTime);
 
 	return (numEvents);
 }
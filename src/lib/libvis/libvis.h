@@ -119,6 +119,26 @@ static inline void *memory_malloc(size_t size)
 }
 
 
+static inline void *list_item_get(void)
+{
+	debug("Request linked list item");
+	if (visopsys_in_kernel)
+		return (kernLibOps.listItemGet());
+	else
+		return (malloc(sizeof(linkedListItem)));
+}
+
+
+static inline void list_item_release(void *item)
+{
+	debug("Release linked list item");
+	if (visopsys_in_kernel)
+		kernLibOps.listItemRelease(item);
+	else
+		free(item);
+}
+
+
 static inline int memory_release(void *start)
 {
 	debug("Release memory block at %p", start);
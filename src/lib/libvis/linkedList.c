@@ -39,7 +39,7 @@ static int add(linkedList *list, void *data, int back)
 		return (status = ERR_NULLPARAMETER);
 	}
 
-	new = memory_malloc(sizeof(linkedListItem));
+	new = list_item_get();
 	if (!new)
 	{
 		error("Memory allocation failure");
@@ -52,7 +52,7 @@ static int add(linkedList *list, void *data, int back)
 	if (status < 0)
 	{
 		error("Couldn't get lock");
-		memory_free(new);
+		list_item_release(new);
 		return (status);
 	}
 
@@ -173,7 +173,7 @@ _X_ int linkedListRemove(linkedList *list, void *data)
 
 			list->numItems -= 1;
 
-			memory_free(iter);
+			list_item_release(iter);
 			lock_release(&list->lock);
 
 			return (status = 0);
@@ -215,7 +215,7 @@ _X_ int linkedListClear(linkedList *list)
 	while (iter)
 	{
 		next = iter->next;
-		memory_free(iter);
+		list_item_release(iter);
 		iter = next;
 	}
 
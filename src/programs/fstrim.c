@@ -0,0 +1,240 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2023 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  fstrim.c
+//
+
+// This is the UNIX-style command for discarding the unused space of
+// filesystems on solid state disks
+
+/* This is the text that appears when a user requests help about this program
+<help>
+
+ -- fstrim --
+
+Discard (trim) the unused space of filesystems.
+
+Usage:
+  fstrim [-s] [disk_name ...]
+
+This command tells a solid state disk which parts of a filesystem are not in
+use, so that the disk doesn't need to preserve their contents.  This can help
+to keep the disk's write performance up, and reduce its wear.
+
+The optional parameters are the names of (logical) disks to trim (use the
+'disks' command to list the disks).  If no disk names are specified, all
+mounted filesystems that can be trimmed are trimmed.  A trim can only proceed
+if the disk supports discarding sectors, and if the driver for the
+filesystem type supports this functionality.
+
+You must be a privileged user to use this command.
+
+Options:
+-s  : Silent mode
+
+</help>
+*/
+
+#include <errno.h>
+#include <libintl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/api.h>
+#include <sys/env.h>
+#include <sys/vsh.h>
+
+#define _(string) gettext(string)
+
+static int silentMode = 0;
+
+
+static void usage(char *name)
+{
+	printf("%s", _("usage:\n"));
+	printf(_("%s [-s] [disk_name ...]\n"), name);
+}
+
+
+static int trimDisk(disk *theDisk)
+{
+	// Trim the filesystem on one disk
+
+	int status = 0;
+	progress prog;
+
+	// Make sure we know the filesystem type
+	if (!strcmp(theDisk->fsType, "unknown"))
+		diskGetFilesystemType(theDisk->name, theDisk->fsType,
+			FSTYPE_MAX_NAMELENGTH);
+
+	// Make sure things are up to date
+	status = diskGet(theDisk->name, theDisk);
+	if (status < 0)
+	{
+		if (!silentMode)
+			printf(_("Error getting info for disk \"%s\"\n"), theDisk->name);
+		return (status);
+	}
+
+	if (!(theDisk->flags & DISKFLAG_DISCARD))
+	{
+		if (!silentMode)
+			printf(_("Disk \"%s\" does not support trimming\n"),
+				theDisk->name);
+		return (status = ERR_NOTIMPLEMENTED);
+	}
+
+	if (!(theDisk->opFlags & FS_OP_TRIM))
+	{
+		if (!silentMode)
+			printf(_("Trimming the filesystem type \"%s\" is not "
+				"supported\n"), theDisk->fsType);
+		return (status = ERR_NOTIMPLEMENTED);
+	}
+
+	memset((void *) &prog, 0, sizeof(progress));
+	if (!silentMode)
+	{
+		printf(_("Trimming disk %s\n"), theDisk->name);
+		vshProgressBar(&prog);
+	}
+
+	status = filesystemTrim(theDisk->name, &prog);
+
+	if (!silentMode)
+	{
+		vshProgressBarDestroy(&prog);
+
+		if (status >= 0)
+			printf("%s: %s\n", theDisk->name, prog.statusMessage);
+		else
+			printf(_("Error trimming disk %s\n"), theDisk->name);
+	}
+
+	return (status);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int status = 0;
+	char opt;
+	int numberDisks = 0;
+	disk *diskInfo = NULL;
+	int found = 0;
+	int count1, count2;
+
+	setlocale(LC_ALL, getenv(ENV_LANG));
+	textdomain("fstrim");
+
+	// Check options
+	while (strchr("s?", (opt = getopt(argc, argv, "s"))))
+	{
+		switch (opt)
+		{
+			case 's':
+				// Operate in silent/script mode
+				silentMode = 1;
+				break;
+
+			default:
+				if (!silentMode)
+					fprintf(stderr, _("Unknown option '%c'\n"), optopt);
+				usage(argv[0]);
+				return (status = ERR_INVALID);
+		}
+	}
+
+	// Check privilege level
+	if (multitaskerGetProcessPrivilege(multitaskerGetCurrentProcessId()))
+	{
+		if (!silentMode)
+			fprintf(stderr, "%s", _("You must be a privileged user to use "
+				"this command.\n(Try logging in as user \"admin\")\n"));
+		return (status = ERR_PERMISSION);
+	}
+
+	// Call the kernel to give us the number of available disks
+	numberDisks = diskGetCount();
+	if (numberDisks <= 0)
+		return (status = ERR_NOSUCHENTRY);
+
+	diskInfo = malloc(numberDisks * sizeof(disk));
+	if (!diskInfo)
+		return (status = ERR_MEMORY);
+
+	status = diskGetAll(diskInfo, (numberDisks * sizeof(disk)));
+	if (status < 0)
+	{
+		errno = status;
+		perror(argv[0]);
+		free(diskInfo);
+		return (status);
+	}
+
+	status = 0;
+
+	if (optind >= argc)
+	{
+		// No disks were named.  Trim all of the mounted filesystems that can
+		// be trimmed.
+		for (count1 = 0; count1 < numberDisks; count1 ++)
+		{
+			if (!diskInfo[count1].mounted ||
+				!(diskInfo[count1].flags & DISKFLAG_DISCARD) ||
+				!(diskInfo[count1].opFlags & FS_OP_TRIM))
+			{
+				continue;
+			}
+
+			if (trimDisk(&diskInfo[count1]) < 0)
+				status = ERR_IO;
+		}
+	}
+	else
+	{
+		for (count1 = optind; count1 < argc; count1 ++)
+		{
+			found = 0;
+
+			for (count2 = 0; count2 < numberDisks; count2 ++)
+			{
+				if (!strcmp(diskInfo[count2].name, argv[count1]))
+				{
+					found = 1;
+					if (trimDisk(&diskInfo[count2]) < 0)
+						status = ERR_IO;
+					break;
+				}
+			}
+
+			if (!found)
+			{
+				if (!silentMode)
+					printf(_("No such disk \"%s\"\n"), argv[count1]);
+				status = ERR_NOSUCHENTRY;
+			}
+		}
+	}
+
+	free(diskInfo);
+	return (status);
+}
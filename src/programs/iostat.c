@@ -0,0 +1,374 @@
+//
+//  Visopsys
+//  Copyright (C) 1998-2023 J. Andrew McLaughlin
+//
+//  This program is free software; you can redistribute it and/or modify it
+//  under the terms of the GNU General Public License as published by the Free
+//  Software Foundation; either version 2 of the License, or (at your option)
+//  any later version.
+//
+//  This program is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+//  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+//  for more details.
+//
+//  You should have received a copy of the GNU General Public License along
+//  with this program; if not, write to the Free Software Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+//
+//  iostat.c
+//
+
+// This is the UNIX-style command for showing disk I/O statistics
+
+/* This is the text that appears when a user requests help about this program
+<help>
+
+ -- iostat --
+
+Show disk input/output statistics.
+
+Usage:
+  iostat [-h] [-i seconds] [-c count] [disk_name ...]
+
+This command shows how busy the disks are, and how long their requests take.
+The first report covers the time since the system started.  If an interval
+is given with -i, further reports are shown every that many seconds, each
+covering the time since the previous one, until the program is interrupted
+or the number of reports given with -c has been shown.
+
+By default, all physical disks are shown.  Otherwise, the optional
+parameters are the names of the disks to show (use the 'disks' command to
+list the disks).  Logical disks show the statistics of their physical disks.
+
+The columns are:
+  r/s, w/s     : read and write requests per second
+  rKb/s, wKb/s : kilobytes read and written per second
+  hit%         : percentage of sectors read that were in the disk cache
+  io/s         : operations done by the disk itself per second, including
+                 read-ahead and writing back the cache
+  qdep         : average number of operations waiting for the disk, or that
+                 it's doing, when a new one is queued
+  svc          : average time the disk took per operation, in microseconds
+  rlat, wlat   : average time per read and write request, in microseconds
+
+With -h, the latencies of the requests are also shown as histograms, split
+by reads and writes, and by whether the cache took care of them (hits) or
+the disk was needed (misses).
+
+Options:
+-c <count>   : Show this many reports, and then stop
+-h           : Show latency histograms
+-i <seconds> : Show a report every this many seconds
+
+</help>
+*/
+
+#include <errno.h>
+#include <libintl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/api.h>
+#include <sys/env.h>
+
+#define _(string) gettext(string)
+
+static const char *kindNames[DISKSTAT_KINDS] = {
+	"read hit", "read miss", "write hit", "write miss"
+};
+
+
+static void usage(char *name)
+{
+	printf("%s", _("usage:\n"));
+	printf(_("%s [-h] [-i seconds] [-c count] [disk_name ...]\n"), name);
+}
+
+
+static unsigned perSecond(uquad_t count, uquad_t ms)
+{
+	// Returns the rate of 'count' things over 'ms' milliseconds
+
+	if (!ms)
+		return (0);
+
+	return ((unsigned)((count * 1000) / ms));
+}
+
+
+static void printHistograms(diskStats *now, diskStats *then)
+{
+	// Print the latency histograms for the period between the two sets of
+	// stats, leaving out the empty buckets at either end
+
+	unsigned count[DISKSTAT_KINDS][DISKSTAT_BUCKETS];
+	int first = DISKSTAT_BUCKETS;
+	int last = -1;
+	int kind, bucket;
+
+	for (bucket = 0; bucket < DISKSTAT_BUCKETS; bucket ++)
+	{
+		for (kind = 0; kind < DISKSTAT_KINDS; kind ++)
+		{
+			count[kind][bucket] = (now->latency[kind][bucket] -
+				then->latency[kind][bucket]);
+
+			if (count[kind][bucket])
+			{
+				first = min(first, bucket);
+				last = max(last, bucket);
+			}
+		}
+	}
+
+	if (last < 0)
+		return;
+
+	printf("  %-12s", _("latency"));
+	for (kind = 0; kind < DISKSTAT_KINDS; kind ++)
+		printf(" %10s", kindNames[kind]);
+	printf("\n");
+
+	for (bucket = first; bucket <= last; bucket ++)
+	{
+		if (bucket < (DISKSTAT_BUCKETS - 1))
+			printf("  < %7u us", (1U << bucket));
+		else
+			printf("  >=%7u us", (1U << (bucket - 1)));
+
+		for (kind = 0; kind < DISKSTAT_KINDS; kind ++)
+			printf(" %10u", count[kind][bucket]);
+		printf("\n");
+	}
+}
+
+
+static void printStats(const char *name, diskStats *now, diskStats *then,
+	uquad_t ms, int histograms)
+{
+	// Print one line of stats for the disk, for the period between the two
+	// sets of stats, which is 'ms' milliseconds long
+
+	unsigned reads = (now->reads - then->reads);
+	unsigned writes = (now->writes - then->writes);
+	unsigned hits = (now->cacheHits - then->cacheHits);
+	unsigned misses = (now->cacheMisses - then->cacheMisses);
+	unsigned ios = ((now->ioReads - then->ioReads) + (now->ioWrites -
+		then->ioWrites));
+	unsigned queued = (now->queued - then->queued);
+	uquad_t depthTenths = 0;
+	uquad_t svcUs = 0;
+	uquad_t readUs = 0;
+	uquad_t writeUs = 0;
+
+	if (queued)
+		depthTenths = (((now->queueDepthTotal - then->queueDepthTotal) *
+			10) / queued);
+
+	if (ios)
+		svcUs = (((now->ioReadUs - then->ioReadUs) + (now->ioWriteUs -
+			then->ioWriteUs)) / ios);
+
+	if (reads)
+		readUs = (((now->latencyUs[DISKSTAT_READHIT] -
+			then->latencyUs[DISKSTAT_READHIT]) +
+			(now->latencyUs[DISKSTAT_READMISS] -
+			then->latencyUs[DISKSTAT_READMISS])) / reads);
+
+	if (writes)
+		writeUs = (((now->latencyUs[DISKSTAT_WRITEHIT] -
+			then->latencyUs[DISKSTAT_WRITEHIT]) +
+			(now->latencyUs[DISKSTAT_WRITEMISS] -
+			then->latencyUs[DISKSTAT_WRITEMISS])) / writes);
+
+	printf("%-8s %6u %6u %7u %7u %4u %6u %3u.%u %7llu %7llu %7llu\n", name,
+		perSecond(reads, ms), perSecond(writes, ms),
+		perSecond((now->readKbytes - then->readKbytes), ms),
+		perSecond((now->writeKbytes - then->writeKbytes), ms),
+		((hits + misses)? ((hits * 100) / (hits + misses)) : 0),
+		perSecond(ios, ms), (unsigned)(depthTenths / 10),
+		(unsigned)(depthTenths % 10), svcUs, readUs, writeUs);
+
+	if (now->errors != then->errors)
+		printf(_("  %u errors\n"), (now->errors - then->errors));
+
+	if (histograms)
+		printHistograms(now, then);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int status = 0;
+	char opt;
+	int histograms = 0;
+	unsigned interval = 0;
+	int reports = 0;
+	int numNames = 0;
+	char (*names)[DISK_MAX_NAMELENGTH + 1] = NULL;
+	disk *physicalDisks = NULL;
+	diskStats *now = NULL;
+	diskStats *then = NULL;
+	uquad_t nowMs = 0;
+	uquad_t thenMs = 0;
+	int count;
+
+	setlocale(LC_ALL, getenv(ENV_LANG));
+	textdomain("iostat");
+
+	// Check options
+	while (strchr("c:hi:?", (opt = getopt(argc, argv, "c:hi:"))))
+	{
+		switch (opt)
+		{
+			case 'c':
+				// Number of reports
+				if (!optarg)
+				{
+					fprintf(stderr, "%s", _("Missing count argument\n"));
+					usage(argv[0]);
+					return (status = ERR_NULLPARAMETER);
+				}
+				reports = atoi(optarg);
+				break;
+
+			case 'h':
+				// Show the histograms
+				histograms = 1;
+				break;
+
+			case 'i':
+				// Interval between reports
+				if (!optarg)
+				{
+					fprintf(stderr, "%s", _("Missing interval argument\n"));
+					usage(argv[0]);
+					return (status = ERR_NULLPARAMETER);
+				}
+				interval = atoi(optarg);
+				break;
+
+			case ':':
+				fprintf(stderr, _("Missing parameter for %s option\n"),
+					argv[optind - 1]);
+				usage(argv[0]);
+				return (status = ERR_NULLPARAMETER);
+
+			default:
+				fprintf(stderr, _("Unknown option '%c'\n"), optopt);
+				usage(argv[0]);
+				return (status = ERR_INVALID);
+		}
+	}
+
+	// Without an interval, there's only the one report
+	if (!interval)
+		reports = 1;
+
+	if (optind < argc)
+	{
+		// Use the disk names we were given
+		numNames = (argc - optind);
+
+		names = calloc(numNames, (DISK_MAX_NAMELENGTH + 1));
+		if (!names)
+		{
+			status = ERR_MEMORY;
+			goto out;
+		}
+
+		for (count = 0; count < numNames; count ++)
+			strncpy(names[count], argv[optind + count], DISK_MAX_NAMELENGTH);
+	}
+	else
+	{
+		// Use all of the physical disks
+		numNames = diskGetPhysicalCount();
+		if (numNames <= 0)
+		{
+			status = ERR_NOSUCHENTRY;
+			goto out;
+		}
+
+		physicalDisks = malloc(numNames * sizeof(disk));
+		names = calloc(numNames, (DISK_MAX_NAMELENGTH + 1));
+		if (!physicalDisks || !names)
+		{
+			status = ERR_MEMORY;
+			goto out;
+		}
+
+		status = diskGetAllPhysical(physicalDisks, (numNames * sizeof(disk)));
+		if (status < 0)
+			goto out;
+
+		for (count = 0; count < numNames; count ++)
+			strncpy(names[count], physicalDisks[count].name,
+				DISK_MAX_NAMELENGTH);
+	}
+
+	// The first report is since the system started, so it's compared with
+	// nothing
+	now = calloc(numNames, sizeof(diskStats));
+	then = calloc(numNames, sizeof(diskStats));
+	if (!now || !then)
+	{
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	while (1)
+	{
+		nowMs = cpuGetMs();
+
+		for (count = 0; count < numNames; count ++)
+		{
+			status = diskGetStats(names[count], &now[count]);
+			if (status < 0)
+			{
+				fprintf(stderr, _("Can't get stats for disk %s\n"),
+					names[count]);
+				goto out;
+			}
+		}
+
+		printf("\n%-8s %6s %6s %7s %7s %4s %6s %5s %7s %7s %7s\n",
+			_("disk"), "r/s", "w/s", "rKb/s", "wKb/s", "hit%", "io/s",
+			"qdep", "svc", "rlat", "wlat");
+
+		for (count = 0; count < numNames; count ++)
+			printStats(names[count], &now[count], &then[count],
+				(nowMs - thenMs), histograms);
+
+		if (reports && !--reports)
+			break;
+
+		memcpy(then, now, (numNames * sizeof(diskStats)));
+		thenMs = nowMs;
+
+		sleep(interval);
+	}
+
+	status = 0;
+
+out:
+	if (status < 0)
+	{
+		errno = status;
+		perror(argv[0]);
+	}
+
+	if (then)
+		free(then);
+	if (now)
+		free(now);
+	if (physicalDisks)
+		free(physicalDisks);
+	if (names)
+		free(names);
+
+	return (status);
+}
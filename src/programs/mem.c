@@ -33,7 +33,8 @@ Usage:
 
 This command prints a listing of memory allocations, plus a summary at the
 end.  If the (optional) '-k' parameter is supplied, then 'mem' will display
-system (kernel) memory usage instead.
+system (kernel) memory usage instead, along with the usage of each of the
+kernel's object caches.
 
 Options:
 -k  : Show kernel memory usage
@@ -64,6 +65,9 @@ int main(int argc, char *argv[])
 	int kernelMem = 0;
 	memoryStats stats;
 	memoryBlock *blocksArray = NULL;
+	memoryCacheStats caches[MEMORY_MAX_CACHES];
+	int numCaches = 0;
+	diskStats dskStats;
 	unsigned totalFree = 0;
 	unsigned percentUsed = 0;
 	unsigned count;
@@ -148,6 +152,43 @@ int main(int argc, char *argv[])
 		stats.usedBlocks, stats.totalMemory, stats.usedMemory, percentUsed,
 		totalFree, (100 - percentUsed));
 
+	if (!kernelMem)
+	{
+		// Print the state of the pool of memory that's cleared ahead of time
+		printf(_("Cleared pool: %u Kb - %u hits, %u misses\n"),
+			(stats.zeroedMemory >> 10), stats.zeroedHits,
+			stats.zeroedMisses);
+
+		// Print the state of the disk caches, which share a budget
+		if (diskGetStats(NULL, &dskStats) >= 0)
+		{
+			printf(_("Disk caches : %u/%u Kb - %u hits, %u misses, %u "
+				"evictions\n"), (unsigned)(dskStats.cacheSize >> 10),
+				(unsigned)(dskStats.cacheMax >> 10), dskStats.cacheHits,
+				dskStats.cacheMisses, dskStats.cacheEvictions);
+		}
+	}
+
+	if (kernelMem)
+	{
+		// Print the usage of each of the kernel's object caches
+		numCaches = memoryGetCaches(caches, sizeof(caches));
+		if (numCaches > 0)
+		{
+			printf(_(" --- Kernel object caches ---\n"));
+			for (count = 0; count < (unsigned) numCaches; count ++)
+			{
+				printf("%s", caches[count].name);
+				textSetColumn(24);
+				printf(_("%u/%u objects of %u"), caches[count].usedObjects,
+					caches[count].totalObjects, caches[count].objectSize);
+				textSetColumn(52);
+				printf(_("%u Kb\n"), ((caches[count].slabs *
+					caches[count].slabSize) >> 10));
+			}
+		}
+	}
+
 	return (status = 0);
 }
 
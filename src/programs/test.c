@@ -482,6 +482,1258 @@ out:
 }
 
 
+#define SCHEDULER_MAX_THREADS	500
+#define SCHEDULER_TEST_MS		2000
+
+static volatile struct {
+	int stop;
+	unsigned yields[SCHEDULER_MAX_THREADS];
+
+} schedulerData;
+
+
+static int schedulerThread(int argc, char *argv[])
+{
+	// Counts how many times it gets to run, by yielding as fast as it can
+
+	int index = 0;
+
+	if (argc > 1)
+		index = atoi(argv[1]);
+
+	while (!schedulerData.stop)
+	{
+		schedulerData.yields[index] += 1;
+		multitaskerYield();
+	}
+
+	exit(0);
+}
+
+
+static int scheduler_threads(int numThreads)
+{
+	int status = 0;
+	int procId[SCHEDULER_MAX_THREADS];
+	char indexString[12];
+	char *args[] = { indexString };
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	uquad_t switches = 0;
+	int count;
+
+	memset((void *) &schedulerData, 0, sizeof(schedulerData));
+	memset(procId, 0, sizeof(procId));
+
+	for (count = 0; count < numThreads; count ++)
+	{
+		sprintf(indexString, "%d", count);
+
+		procId[count] = multitaskerSpawn(&schedulerThread,
+			"scheduler thread", 1, (void **) args, 1 /* run */);
+		if (procId[count] < 0)
+		{
+			FAILMSG("Couldn't spawn scheduler thread %d", count);
+			status = procId[count];
+			goto out;
+		}
+	}
+
+	// Let them run for a while
+	startTime = cpuGetMs();
+	multitaskerWait(SCHEDULER_TEST_MS);
+	schedulerData.stop = 1;
+	elapsed = (cpuGetMs() - startTime);
+
+	for (count = 0; count < numThreads; count ++)
+		switches += schedulerData.yields[count];
+
+	printf("\n%d threads: %llu switches in %llu ms", numThreads, switches,
+		elapsed);
+	if (switches)
+	{
+		printf(" (%llu us per switch)", ((elapsed * 1000) / switches));
+	}
+
+	status = 0;
+
+out:
+	schedulerData.stop = 1;
+
+	for (count = 0; count < numThreads; count ++)
+	{
+		if ((procId[count] > 0) && multitaskerProcessIsAlive(procId[count]))
+			multitaskerKillProcess(procId[count]);
+	}
+
+	return (status);
+}
+
+
+static int scheduler(void)
+{
+	// Measures the overhead of the scheduler with increasing numbers of
+	// runnable threads.  With constant-time scheduling, the time per switch
+	// should stay roughly flat as the number of threads goes up.
+
+	int status = 0;
+	int numThreads[] = { 10, 100, 500, 0 };
+	int count;
+
+	for (count = 0; numThreads[count]; count ++)
+	{
+		status = scheduler_threads(numThreads[count]);
+		if (status < 0)
+			break;
+	}
+
+	printf("\n");
+	return (status);
+}
+
+
+#define LOCK_MAX_THREADS		50
+#define LOCK_TEST_MS			2000
+
+static volatile struct {
+	int stop;
+	spinLock lock;
+	int inside;
+	unsigned violations;
+	unsigned acquired[LOCK_MAX_THREADS];
+
+} lockData;
+
+
+static int lockThread(int argc, char *argv[])
+{
+	// Gets and releases the shared lock as fast as it can, and checks that
+	// nobody else is ever inside at the same time
+
+	int index = 0;
+
+	if (argc > 1)
+		index = atoi(argv[1]);
+
+	while (!lockData.stop)
+	{
+		if (lockGet(&lockData.lock) < 0)
+			continue;
+
+		if (lockData.inside)
+			lockData.violations += 1;
+
+		lockData.inside = 1;
+		lockData.acquired[index] += 1;
+		lockData.inside = 0;
+
+		lockRelease(&lockData.lock);
+	}
+
+	exit(0);
+}
+
+
+static int lock_threads(int numThreads)
+{
+	int status = 0;
+	int procId[LOCK_MAX_THREADS];
+	char indexString[12];
+	char *args[] = { indexString };
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	uquad_t total = 0;
+	unsigned least = ~0U, most = 0;
+	int count;
+
+	memset((void *) &lockData, 0, sizeof(lockData));
+	memset(procId, 0, sizeof(procId));
+
+	for (count = 0; count < numThreads; count ++)
+	{
+		sprintf(indexString, "%d", count);
+
+		procId[count] = multitaskerSpawn(&lockThread, "lock thread", 1,
+			(void **) args, 1 /* run */);
+		if (procId[count] < 0)
+		{
+			FAILMSG("Couldn't spawn lock thread %d", count);
+			status = procId[count];
+			goto out;
+		}
+	}
+
+	// Let them contend for a while
+	startTime = cpuGetMs();
+	multitaskerWait(LOCK_TEST_MS);
+	lockData.stop = 1;
+	elapsed = (cpuGetMs() - startTime);
+
+	for (count = 0; count < numThreads; count ++)
+	{
+		total += lockData.acquired[count];
+
+		if (lockData.acquired[count] < least)
+			least = lockData.acquired[count];
+		if (lockData.acquired[count] > most)
+			most = lockData.acquired[count];
+	}
+
+	printf("\n%d threads: %llu locks in %llu ms", numThreads, total, elapsed);
+	if (total)
+		printf(" (%llu us per lock)", ((elapsed * 1000) / total));
+	printf(", per thread %u-%u", least, most);
+
+	if (lockData.violations)
+	{
+		FAILMSG("%u mutual exclusion violations", lockData.violations);
+		status = ERR_BUG;
+		goto out;
+	}
+
+	status = 0;
+
+out:
+	lockData.stop = 1;
+
+	for (count = 0; count < numThreads; count ++)
+	{
+		if ((procId[count] > 0) && multitaskerProcessIsAlive(procId[count]))
+			multitaskerKillProcess(procId[count]);
+	}
+
+	return (status);
+}
+
+
+static int locks(void)
+{
+	// Measures the cost of lock contention, with increasing numbers of
+	// threads hammering on a single lock.  Waiters should sleep rather than
+	// spin, so the total throughput shouldn't collapse as threads are added,
+	// and the lock should be shared fairly between them.
+
+	int status = 0;
+	int numThreads[] = { 2, 10, 50, 0 };
+	int count;
+
+	for (count = 0; numThreads[count]; count ++)
+	{
+		status = lock_threads(numThreads[count]);
+		if (status < 0)
+			break;
+	}
+
+	printf("\n");
+	return (status);
+}
+
+
+#define PINGPONG_TEST_MS		2000
+
+static volatile struct {
+	int stop;
+	int turn;
+	unsigned trips;
+
+} pingPongData;
+
+
+static int pingPongThread(int argc, char *argv[])
+{
+	// Waits for its turn, hands the turn to the other thread, and yields to
+	// it, so that every pass is a context switch between the two
+
+	int index = 0;
+
+	if (argc > 1)
+		index = atoi(argv[1]);
+
+	while (!pingPongData.stop)
+	{
+		if (pingPongData.turn == index)
+		{
+			if (index)
+				pingPongData.trips += 1;
+
+			pingPongData.turn = !index;
+		}
+
+		multitaskerYield();
+	}
+
+	exit(0);
+}
+
+
+static int pingpong(void)
+{
+	// Measures the raw cost of a context switch, with two threads passing
+	// control back and forth
+
+	int status = 0;
+	int procId[2] = { 0, 0 };
+	char indexString[12];
+	char *args[] = { indexString };
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	uquad_t switches = 0;
+	int count;
+
+	memset((void *) &pingPongData, 0, sizeof(pingPongData));
+
+	for (count = 0; count < 2; count ++)
+	{
+		sprintf(indexString, "%d", count);
+
+		procId[count] = multitaskerSpawn(&pingPongThread, "ping pong thread",
+			1, (void **) args, 1 /* run */);
+		if (procId[count] < 0)
+		{
+			FAILMSG("Couldn't spawn ping pong thread %d", count);
+			status = procId[count];
+			goto out;
+		}
+	}
+
+	// Let them run for a while
+	startTime = cpuGetMs();
+	multitaskerWait(PINGPONG_TEST_MS);
+	pingPongData.stop = 1;
+	elapsed = (cpuGetMs() - startTime);
+
+	// Each round trip is two switches
+	switches = (pingPongData.trips * 2);
+
+	printf("\n%llu round trips in %llu ms", (uquad_t) pingPongData.trips,
+		elapsed);
+	if (switches)
+		printf(" (%llu us per switch)", ((elapsed * 1000) / switches));
+	printf("\n");
+
+	status = 0;
+
+out:
+	pingPongData.stop = 1;
+
+	for (count = 0; count < 2; count ++)
+	{
+		if ((procId[count] > 0) && multitaskerProcessIsAlive(procId[count]))
+			multitaskerKillProcess(procId[count]);
+	}
+
+	return (status);
+}
+
+
+#define SMP_THREADS				16
+#define SMP_MAX_CPUS			32
+#define SMP_TEST_MS				3000
+
+static volatile struct {
+	int stop;
+	spinLock lock;
+	int inside;
+	unsigned *page;
+	unsigned generation;
+	unsigned violations;
+	unsigned stale;
+	unsigned checked[SMP_THREADS];
+
+} smpData;
+
+
+static int smpThread(int argc, char *argv[])
+{
+	// Gets the shared lock, checks that nobody else is inside, and checks
+	// that the shared page holds the current generation.  The main thread
+	// keeps replacing the page, so a CPU that missed a TLB shootdown will
+	// see an old generation, or fault.
+
+	int index = 0;
+
+	if (argc > 1)
+		index = atoi(argv[1]);
+
+	while (!smpData.stop)
+	{
+		if (lockGet(&smpData.lock) < 0)
+			continue;
+
+		if (smpData.inside)
+			smpData.violations += 1;
+
+		smpData.inside = 1;
+
+		if (smpData.page && (*smpData.page != smpData.generation))
+			smpData.stale += 1;
+
+		smpData.checked[index] += 1;
+		smpData.inside = 0;
+
+		lockRelease(&smpData.lock);
+	}
+
+	exit(0);
+}
+
+
+static int smp(void)
+{
+	// Runs lock and memory mapping traffic in threads spread across the
+	// CPUs, and checks that they were seen running on all of the CPUs that
+	// the kernel brought online.  On a uniprocessor system this is just
+	// another lock test.
+
+	int status = 0;
+	int procId[SMP_THREADS];
+	char indexString[12];
+	char *args[] = { indexString };
+	process proc;
+	unsigned cpusSeen = 0;
+	int cpusOnline = 0;
+	int numCpus = 0;
+	unsigned replaced = 0;
+	unsigned total = 0;
+	uquad_t endTime = 0;
+	int count;
+
+	memset((void *) &smpData, 0, sizeof(smpData));
+	memset(procId, 0, sizeof(procId));
+
+	cpusOnline = multitaskerGetNumCpus();
+	if (cpusOnline < 1)
+	{
+		FAILMSG("Couldn't get the number of CPUs");
+		return (status = ERR_BUG);
+	}
+
+	for (count = 0; count < SMP_THREADS; count ++)
+	{
+		sprintf(indexString, "%d", count);
+
+		procId[count] = multitaskerSpawn(&smpThread, "smp thread", 1,
+			(void **) args, 1 /* run */);
+		if (procId[count] < 0)
+		{
+			FAILMSG("Couldn't spawn smp thread %d", count);
+			status = procId[count];
+			goto out;
+		}
+	}
+
+	endTime = (cpuGetMs() + SMP_TEST_MS);
+
+	while (cpuGetMs() < endTime)
+	{
+		// Replace the shared page.  Releasing the old one unmaps it from
+		// every CPU.
+		status = lockGet(&smpData.lock);
+		if (status < 0)
+		{
+			FAILMSG("Couldn't get the smp lock");
+			goto out;
+		}
+
+		if (smpData.page)
+		{
+			memoryRelease(smpData.page);
+			smpData.page = NULL;
+		}
+
+		smpData.page = memoryGet(MEMORY_PAGE_SIZE, "smp test");
+		if (smpData.page)
+		{
+			smpData.generation += 1;
+			*smpData.page = smpData.generation;
+			replaced += 1;
+		}
+
+		lockRelease(&smpData.lock);
+
+		// Note where the threads are running
+		for (count = 0; count < SMP_THREADS; count ++)
+		{
+			if ((multitaskerGetProcess(procId[count], &proc) >= 0) &&
+				(proc.cpu >= 0) && (proc.cpu < SMP_MAX_CPUS))
+			{
+				cpusSeen |= (1U << proc.cpu);
+			}
+		}
+
+		multitaskerYield();
+	}
+
+	smpData.stop = 1;
+
+	for (count = 0; count < SMP_MAX_CPUS; count ++)
+	{
+		if (cpusSeen & (1U << count))
+			numCpus += 1;
+	}
+
+	for (count = 0; count < SMP_THREADS; count ++)
+		total += smpData.checked[count];
+
+	printf("\n%d threads on %d of %d CPUs: %u locks, %u page replacements\n",
+		SMP_THREADS, numCpus, cpusOnline, total, replaced);
+
+	if (smpData.violations)
+	{
+		FAILMSG("%u mutual exclusion violations", smpData.violations);
+		status = ERR_BUG;
+		goto out;
+	}
+
+	if (smpData.stale)
+	{
+		FAILMSG("%u stale page reads", smpData.stale);
+		status = ERR_BUG;
+		goto out;
+	}
+
+	if (numCpus < min(cpusOnline, SMP_MAX_CPUS))
+	{
+		FAILMSG("Threads only ran on %d of %d CPUs", numCpus, cpusOnline);
+		status = ERR_BUG;
+		goto out;
+	}
+
+	if (!total || !replaced)
+	{
+		FAILMSG("No progress (%u locks, %u replacements)", total, replaced);
+		status = ERR_BUG;
+		goto out;
+	}
+
+	status = 0;
+
+out:
+	smpData.stop = 1;
+
+	for (count = 0; count < SMP_THREADS; count ++)
+	{
+		if ((procId[count] > 0) && multitaskerProcessIsAlive(procId[count]))
+			multitaskerKillProcess(procId[count]);
+	}
+
+	if (smpData.page)
+		memoryRelease(smpData.page);
+
+	return (status);
+}
+
+
+#define MEMALLOC_SLOTS			64
+#define MEMALLOC_OPS			4000
+#define MEMALLOC_MAX_PAGES		64
+
+static int memory_alloc(void)
+{
+	// Measures the cost of physical memory allocations, with a random mix of
+	// sizes being allocated and released, and how fragmented the free
+	// memory is afterwards
+
+	int status = 0;
+	void *slots[MEMALLOC_SLOTS];
+	memoryStats before;
+	memoryStats after;
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	unsigned ops = 0;
+	int slot = 0;
+	int count;
+
+	memset(slots, 0, sizeof(slots));
+
+	status = memoryGetStats(&before, 0);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting memory stats", status);
+		goto out;
+	}
+
+	startTime = cpuGetMs();
+
+	for (count = 0; count < MEMALLOC_OPS; count ++)
+	{
+		slot = (rand() % MEMALLOC_SLOTS);
+
+		if (slots[slot])
+		{
+			status = memoryRelease(slots[slot]);
+			if (status < 0)
+			{
+				FAILMSG("Error %d releasing memory", status);
+				goto out;
+			}
+
+			slots[slot] = NULL;
+		}
+		else
+		{
+			slots[slot] = memoryGet((((rand() % MEMALLOC_MAX_PAGES) + 1) *
+				MEMORY_PAGE_SIZE), "test memory");
+			if (!slots[slot])
+			{
+				FAILMSG("Couldn't get memory");
+				status = ERR_MEMORY;
+				goto out;
+			}
+		}
+
+		ops += 1;
+	}
+
+	elapsed = (cpuGetMs() - startTime);
+
+	// Give it all back, so we can see whether the free memory coalesced
+	for (count = 0; count < MEMALLOC_SLOTS; count ++)
+	{
+		if (slots[count])
+		{
+			memoryRelease(slots[count]);
+			slots[count] = NULL;
+		}
+	}
+
+	status = memoryGetStats(&after, 0);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting memory stats", status);
+		goto out;
+	}
+
+	printf("\n%u operations in %llu ms", ops, elapsed);
+	if (ops)
+		printf(" (%llu us per operation)", ((elapsed * 1000) / ops));
+	printf("\nFree ranges %u (largest %u KB) before, %u (largest %u KB) after"
+		"\n", before.freeRanges, (before.largestFree >> 10),
+		after.freeRanges, (after.largestFree >> 10));
+	printf("Cleared memory pool: %u hits, %u misses (%u KB ready)\n",
+		(after.zeroedHits - before.zeroedHits),
+		(after.zeroedMisses - before.zeroedMisses),
+		(after.zeroedMemory >> 10));
+
+	status = 0;
+
+out:
+	for (count = 0; count < MEMALLOC_SLOTS; count ++)
+	{
+		if (slots[count])
+			memoryRelease(slots[count]);
+	}
+
+	return (status);
+}
+
+
+#define PAGEMAP_REGIONS			2048
+#define PAGEMAP_OPS				4000
+#define PAGEMAP_MAX_PAGES		4
+#define PAGEMAP_LARGE_PAGES		256
+
+static int page_map(void)
+{
+	// Measures the cost of mapping memory into the address space of a
+	// process that already has thousands of variable-sized regions mapped,
+	// with holes between them, and of mapping a large region afterwards
+
+	int status = 0;
+	void **regions = NULL;
+	void *large = NULL;
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	unsigned ops = 0;
+	int region = 0;
+	int count;
+
+	regions = calloc(PAGEMAP_REGIONS, sizeof(void *));
+	if (!regions)
+	{
+		FAILMSG("Couldn't allocate memory");
+		return (status = ERR_MEMORY);
+	}
+
+	startTime = cpuGetMs();
+
+	for (count = 0; count < PAGEMAP_REGIONS; count ++)
+	{
+		regions[count] = memoryGet((((rand() % PAGEMAP_MAX_PAGES) + 1) *
+			MEMORY_PAGE_SIZE), "test memory");
+		if (!regions[count])
+		{
+			FAILMSG("Couldn't get memory");
+			status = ERR_MEMORY;
+			goto out;
+		}
+
+		ops += 1;
+	}
+
+	// Punch holes in the address space
+	for (count = 0; count < PAGEMAP_REGIONS; count += 2)
+	{
+		memoryRelease(regions[count]);
+		regions[count] = NULL;
+		ops += 1;
+	}
+
+	// Now release and re-map randomly
+	for (count = 0; count < PAGEMAP_OPS; count ++)
+	{
+		region = (rand() % PAGEMAP_REGIONS);
+
+		if (regions[region])
+		{
+			status = memoryRelease(regions[region]);
+			if (status < 0)
+			{
+				FAILMSG("Error %d releasing memory", status);
+				goto out;
+			}
+
+			regions[region] = NULL;
+		}
+		else
+		{
+			regions[region] = memoryGet((((rand() % PAGEMAP_MAX_PAGES) + 1) *
+				MEMORY_PAGE_SIZE), "test memory");
+			if (!regions[region])
+			{
+				FAILMSG("Couldn't get memory");
+				status = ERR_MEMORY;
+				goto out;
+			}
+		}
+
+		ops += 1;
+	}
+
+	elapsed = (cpuGetMs() - startTime);
+
+	printf("\n%u map/unmap operations in %llu ms", ops, elapsed);
+	if (ops)
+		printf(" (%llu us per operation)", ((elapsed * 1000) / ops));
+
+	// A large mapping, which won't fit in any of the holes
+	startTime = cpuGetMs();
+
+	large = memoryGet((PAGEMAP_LARGE_PAGES * MEMORY_PAGE_SIZE),
+		"test memory");
+	if (!large)
+	{
+		FAILMSG("Couldn't get memory");
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	elapsed = (cpuGetMs() - startTime);
+
+	printf("\n%u page mapping in %llu ms\n", PAGEMAP_LARGE_PAGES, elapsed);
+
+	status = 0;
+
+out:
+	if (large)
+		memoryRelease(large);
+
+	for (count = 0; count < PAGEMAP_REGIONS; count ++)
+	{
+		if (regions[count])
+			memoryRelease(regions[count]);
+	}
+
+	free(regions);
+
+	return (status);
+}
+
+
+#define MEMRESERVE_SIZE			(64 * 1024 * 1024)
+#define MEMRESERVE_STRIDE		(64 * MEMORY_PAGE_SIZE)
+// Allow for other processes allocating while we're measuring
+#define MEMRESERVE_SLACK		(1024 * 1024)
+
+static int memory_reserve(void)
+{
+	// Reserves a large region of memory and touches it sparsely, to make
+	// sure that memory is only committed to the pages that get used, and
+	// that they read as cleared
+
+	int status = 0;
+	unsigned char *region = NULL;
+	memoryStats before;
+	memoryStats after;
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	unsigned touched = 0;
+	unsigned offset = 0;
+
+	status = memoryGetStats(&before, 0);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting memory stats", status);
+		goto out;
+	}
+
+	startTime = cpuGetMs();
+
+	region = memoryReserve(MEMRESERVE_SIZE, "test memory");
+	if (!region)
+	{
+		FAILMSG("Couldn't reserve memory");
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	for (offset = 0; offset < MEMRESERVE_SIZE; offset += MEMRESERVE_STRIDE)
+	{
+		if (region[offset])
+		{
+			FAILMSG("Reserved memory at offset %u is not clear", offset);
+			status = ERR_BADDATA;
+			goto out;
+		}
+
+		region[offset] = (unsigned char)((offset / MEMRESERVE_STRIDE) + 1);
+		touched += 1;
+	}
+
+	elapsed = (cpuGetMs() - startTime);
+
+	for (offset = 0; offset < MEMRESERVE_SIZE; offset += MEMRESERVE_STRIDE)
+	{
+		if (region[offset] != (unsigned char)((offset / MEMRESERVE_STRIDE) +
+			1))
+		{
+			FAILMSG("Reserved memory at offset %u lost its value", offset);
+			status = ERR_BADDATA;
+			goto out;
+		}
+	}
+
+	status = memoryGetStats(&after, 0);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting memory stats", status);
+		goto out;
+	}
+
+	printf("\nReserved %u KB and touched %u pages in %llu ms, used memory "
+		"grew by %u KB\n", (MEMRESERVE_SIZE >> 10), touched, elapsed,
+		((after.usedMemory > before.usedMemory)?
+			((after.usedMemory - before.usedMemory) >> 10) : 0));
+
+	if (after.usedMemory > (before.usedMemory + (touched * MEMORY_PAGE_SIZE) +
+		MEMRESERVE_SLACK))
+	{
+		FAILMSG("Used memory grew by more than the pages touched");
+		status = ERR_BADDATA;
+		goto out;
+	}
+
+	status = 0;
+
+out:
+	if (region)
+		memoryRelease(region);
+
+	return (status);
+}
+
+
+#define MEMFAULT_THREADS		8
+#define MEMFAULT_SIZE			(1024 * 1024)
+#define MEMFAULT_TEST_MS		3000
+
+static volatile struct {
+	int stop;
+	unsigned char *region[MEMFAULT_THREADS];
+	unsigned faults[MEMFAULT_THREADS];
+	unsigned lockOps;
+	int errors;
+
+} memFaultData;
+
+
+static int memFaultThread(int argc, char *argv[])
+{
+	// Touches every page of its own reserved region, so that each touch is
+	// a page fault that has to commit memory
+
+	int index = 0;
+	unsigned char *region = NULL;
+	unsigned offset = 0;
+
+	if (argc > 1)
+		index = atoi(argv[1]);
+
+	region = memFaultData.region[index];
+
+	for (offset = 0; offset < MEMFAULT_SIZE; offset += MEMORY_PAGE_SIZE)
+	{
+		if (region[offset])
+		{
+			memFaultData.errors += 1;
+			break;
+		}
+
+		region[offset] = (unsigned char)(index + 1);
+		memFaultData.faults[index] += 1;
+	}
+
+	exit(0);
+}
+
+
+static int memLockThread(int argc __attribute__((unused)),
+	char *argv[] __attribute__((unused)))
+{
+	// Keeps the memory manager's lock busy, by getting and releasing memory,
+	// until told to stop
+
+	void *memory = NULL;
+
+	while (!memFaultData.stop)
+	{
+		memory = memoryGet((64 * MEMORY_PAGE_SIZE), "test memory lock");
+		if (!memory)
+		{
+			memFaultData.errors += 1;
+			break;
+		}
+
+		memoryRelease(memory);
+		memFaultData.lockOps += 1;
+	}
+
+	exit(0);
+}
+
+
+static int memory_faults(void)
+{
+	// Several threads fault in pages of reserved memory at the same time,
+	// while another one keeps the memory manager busy, so that the page
+	// fault handler often has to wait for the memory lock.  A fault that
+	// sleeps mustn't make the others look like double-faults, or lose its
+	// own details.
+
+	int status = 0;
+	int lockPid = 0;
+	int procId[MEMFAULT_THREADS];
+	char indexString[12];
+	char *args[] = { indexString };
+	uquad_t startTime = 0;
+	unsigned offset = 0;
+	int count;
+
+	memset((void *) &memFaultData, 0, sizeof(memFaultData));
+	memset(procId, 0, sizeof(procId));
+
+	for (count = 0; count < MEMFAULT_THREADS; count ++)
+	{
+		memFaultData.region[count] = memoryReserve(MEMFAULT_SIZE,
+			"test memory faults");
+		if (!memFaultData.region[count])
+		{
+			FAILMSG("Couldn't reserve memory");
+			status = ERR_MEMORY;
+			goto out;
+		}
+	}
+
+	lockPid = multitaskerSpawn(&memLockThread, "memory lock thread", 0, NULL,
+		1 /* run */);
+	if (lockPid < 0)
+	{
+		FAILMSG("Couldn't spawn memory lock thread");
+		status = lockPid;
+		goto out;
+	}
+
+	for (count = 0; count < MEMFAULT_THREADS; count ++)
+	{
+		sprintf(indexString, "%d", count);
+
+		procId[count] = multitaskerSpawn(&memFaultThread,
+			"memory fault thread", 1, (void **) args, 1 /* run */);
+		if (procId[count] < 0)
+		{
+			FAILMSG("Couldn't spawn memory fault thread %d", count);
+			status = procId[count];
+			goto out;
+		}
+	}
+
+	// Wait for the faulting threads to finish
+	startTime = cpuGetMs();
+	for (count = 0; count < MEMFAULT_THREADS; count ++)
+	{
+		while (multitaskerProcessIsAlive(procId[count]))
+		{
+			if ((cpuGetMs() - startTime) > MEMFAULT_TEST_MS)
+			{
+				FAILMSG("Memory fault thread %d is stuck", count);
+				status = ERR_TIMEOUT;
+				goto out;
+			}
+
+			multitaskerYield();
+		}
+	}
+
+	if (memFaultData.errors)
+	{
+		FAILMSG("%d errors", memFaultData.errors);
+		status = ERR_BADDATA;
+		goto out;
+	}
+
+	for (count = 0; count < MEMFAULT_THREADS; count ++)
+	{
+		if (memFaultData.faults[count] != (MEMFAULT_SIZE / MEMORY_PAGE_SIZE))
+		{
+			FAILMSG("Memory fault thread %d touched %u pages, not %u", count,
+				memFaultData.faults[count],
+				(MEMFAULT_SIZE / MEMORY_PAGE_SIZE));
+			status = ERR_BADDATA;
+			goto out;
+		}
+
+		for (offset = 0; offset < MEMFAULT_SIZE; offset += MEMORY_PAGE_SIZE)
+		{
+			if (memFaultData.region[count][offset] !=
+				(unsigned char)(count + 1))
+			{
+				FAILMSG("Reserved memory at offset %u of region %d lost its "
+					"value", offset, count);
+				status = ERR_BADDATA;
+				goto out;
+			}
+		}
+	}
+
+	printf("\n%d threads faulted in %u pages each, with %u memory lock "
+		"operations\n", MEMFAULT_THREADS, (MEMFAULT_SIZE / MEMORY_PAGE_SIZE),
+		memFaultData.lockOps);
+
+	status = 0;
+
+out:
+	memFaultData.stop = 1;
+
+	for (count = 0; count < MEMFAULT_THREADS; count ++)
+	{
+		if ((procId[count] > 0) && multitaskerProcessIsAlive(procId[count]))
+			multitaskerKillProcess(procId[count]);
+	}
+
+	while ((lockPid > 0) && multitaskerProcessIsAlive(lockPid))
+		multitaskerYield();
+
+	for (count = 0; count < MEMFAULT_THREADS; count ++)
+	{
+		if (memFaultData.region[count])
+			memoryRelease(memFaultData.region[count]);
+	}
+
+	return (status);
+}
+
+
+#define MALLOC_SLOTS			256
+#define MALLOC_OPS				20000
+#define MALLOC_SMALL_MAX		1024
+#define MALLOC_LARGE_MAX		65536
+#define MALLOC_RING_SIZE		64
+#define MALLOC_RING_OPS			10000
+
+static volatile struct {
+	int stop;
+	unsigned produced;
+	void *ring[MALLOC_RING_SIZE];
+
+} mallocData;
+
+
+static inline unsigned mallocRandomSize(void)
+{
+	// Mostly small allocations, with some larger ones
+	if (rand() % 8)
+		return ((rand() % MALLOC_SMALL_MAX) + 1);
+	else
+		return ((rand() % MALLOC_LARGE_MAX) + 1);
+}
+
+
+static int mallocProducerThread(void)
+{
+	// Allocates memory into the ring, for the main thread to free
+
+	void *pointer = NULL;
+	int slot = 0;
+
+	while (!mallocData.stop && (mallocData.produced < MALLOC_RING_OPS))
+	{
+		if (mallocData.ring[slot])
+		{
+			multitaskerYield();
+			continue;
+		}
+
+		pointer = malloc(mallocRandomSize());
+		if (!pointer)
+			break;
+
+		mallocData.ring[slot] = pointer;
+		mallocData.produced += 1;
+		slot = ((slot + 1) % MALLOC_RING_SIZE);
+	}
+
+	exit(0);
+}
+
+
+static int malloc_speed(void)
+{
+	// Measures the cost of malloc() and free(), first with a random mix of
+	// sizes being allocated and freed by one thread, and then with memory
+	// being allocated by one thread and freed by another
+
+	int status = 0;
+	unsigned char *slots[MALLOC_SLOTS];
+	unsigned sizes[MALLOC_SLOTS];
+	int procId = 0;
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	unsigned ops = 0;
+	unsigned freed = 0;
+	int slot = 0;
+	int count;
+
+	memset(slots, 0, sizeof(slots));
+	memset((void *) &mallocData, 0, sizeof(mallocData));
+
+	startTime = cpuGetMs();
+
+	for (count = 0; count < MALLOC_OPS; count ++)
+	{
+		slot = (rand() % MALLOC_SLOTS);
+
+		if (slots[slot])
+		{
+			// Make sure nobody else wrote over it
+			if ((slots[slot][0] != (unsigned char) slot) ||
+				(slots[slot][sizes[slot] - 1] != (unsigned char) slot))
+			{
+				FAILMSG("Memory at %p was overwritten", slots[slot]);
+				status = ERR_BADDATA;
+				goto out;
+			}
+
+			free(slots[slot]);
+			slots[slot] = NULL;
+		}
+		else
+		{
+			sizes[slot] = mallocRandomSize();
+			slots[slot] = malloc(sizes[slot]);
+			if (!slots[slot])
+			{
+				FAILMSG("Couldn't allocate %u bytes", sizes[slot]);
+				status = ERR_MEMORY;
+				goto out;
+			}
+
+			// Memory from malloc() is supposed to be cleared
+			if (slots[slot][0] || slots[slot][sizes[slot] - 1])
+			{
+				FAILMSG("Memory at %p was not cleared", slots[slot]);
+				status = ERR_BADDATA;
+				goto out;
+			}
+
+			slots[slot][0] = slots[slot][sizes[slot] - 1] = slot;
+		}
+
+		ops += 1;
+	}
+
+	elapsed = (cpuGetMs() - startTime);
+
+	printf("\n%u operations in %llu ms", ops, elapsed);
+	if (ops)
+		printf(" (%llu us per operation)", ((elapsed * 1000) / ops));
+
+	// Now allocate in another thread, and free here
+	procId = multitaskerSpawn(&mallocProducerThread, "malloc producer thread",
+		0, NULL, 1 /* run */);
+	if (procId < 0)
+	{
+		FAILMSG("Couldn't spawn malloc producer thread");
+		status = procId;
+		goto out;
+	}
+
+	startTime = cpuGetMs();
+
+	slot = 0;
+	while (freed < MALLOC_RING_OPS)
+	{
+		if (!mallocData.ring[slot])
+		{
+			if (!multitaskerProcessIsAlive(procId))
+				break;
+
+			multitaskerYield();
+			continue;
+		}
+
+		free(mallocData.ring[slot]);
+		mallocData.ring[slot] = NULL;
+		freed += 1;
+		slot = ((slot + 1) % MALLOC_RING_SIZE);
+	}
+
+	elapsed = (cpuGetMs() - startTime);
+
+	if (freed < MALLOC_RING_OPS)
+	{
+		FAILMSG("Producer thread stopped after %u allocations", freed);
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	printf("\n%u cross-thread allocations and frees in %llu ms", freed,
+		elapsed);
+	printf(" (%llu us per pair)\n", ((elapsed * 1000) / freed));
+
+	status = 0;
+
+out:
+	mallocData.stop = 1;
+
+	if ((procId > 0) && multitaskerProcessIsAlive(procId))
+		multitaskerKillProcess(procId);
+
+	for (count = 0; count < MALLOC_SLOTS; count ++)
+	{
+		if (slots[count])
+			free(slots[count]);
+	}
+
+	for (count = 0; count < MALLOC_RING_SIZE; count ++)
+	{
+		if (mallocData.ring[count])
+			free(mallocData.ring[count]);
+	}
+
+	return (status);
+}
+
+
 static int text_output(void)
 {
 	// Does a bunch of text-output testing.
@@ -973,6 +2225,398 @@ fail:
 }
 
 
+#define DISKSPEED_BYTES			(8 * 1024 * 1024)
+#define DISKSPEED_CHUNK			4096
+
+
+static int disk_speed(void)
+{
+	// Measures sequential read throughput from the boot disk, reading in
+	// small chunks the way programs such as 'cp' do, so that the disk
+	// cache's read-ahead is what makes the difference.  The start is chosen
+	// at random, since we can't empty the cache of anything read already.
+
+	int status = 0;
+	char diskName[DISK_MAX_NAMELENGTH + 1];
+	disk theDisk;
+	diskStats beforeStats;
+	diskStats afterStats;
+	unsigned char *buffer = NULL;
+	unsigned chunkSectors = 0;
+	uquad_t numSectors = 0;
+	uquad_t startSector = 0;
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	uquad_t count;
+
+	// Get the name of the physical boot disk
+	status = diskGetBoot(diskName);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting disk name", status);
+		goto out;
+	}
+
+	if (isalpha(diskName[strlen(diskName) - 1]))
+		diskName[strlen(diskName) - 1] = '\0';
+
+	status = diskGet(diskName, &theDisk);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting disk %s", status, diskName);
+		goto out;
+	}
+
+	chunkSectors = max((DISKSPEED_CHUNK / theDisk.sectorSize), 1);
+	numSectors = min((DISKSPEED_BYTES / theDisk.sectorSize),
+		theDisk.numSectors);
+	numSectors -= (numSectors % chunkSectors);
+	startSector = randomFormatted(0, (theDisk.numSectors - numSectors));
+
+	buffer = malloc(chunkSectors * theDisk.sectorSize);
+	if (!buffer)
+	{
+		FAILMSG("Error getting %u bytes disk buffer memory",
+			(chunkSectors * theDisk.sectorSize));
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	diskGetStats(diskName, &beforeStats);
+	startTime = cpuGetMs();
+
+	for (count = 0; count < numSectors; count += chunkSectors)
+	{
+		status = diskReadSectors(diskName, (startSector + count),
+			chunkSectors, buffer);
+		if (status < 0)
+		{
+			FAILMSG("Error %d reading %u sectors at %llu on %s", status,
+				chunkSectors, (startSector + count), diskName);
+			goto out;
+		}
+	}
+
+	elapsed = (cpuGetMs() - startTime);
+	diskGetStats(diskName, &afterStats);
+
+	printf("\nRead %llu Kb from %s in %u-byte chunks in %llu ms",
+		((numSectors * theDisk.sectorSize) / 1024), diskName,
+		(chunkSectors * theDisk.sectorSize), elapsed);
+	if (elapsed)
+		printf(" (%llu Kb/s)", (((numSectors * theDisk.sectorSize) /
+			1024) * 1000) / elapsed);
+	printf("\nCache hits %u, misses %u\n", (afterStats.cacheHits -
+		beforeStats.cacheHits), (afterStats.cacheMisses -
+		beforeStats.cacheMisses));
+
+	status = 0;
+
+out:
+	if (buffer)
+		free(buffer);
+
+	return (status);
+}
+
+
+#define DISKQUEUE_MAX_THREADS	32
+#define DISKQUEUE_TEST_MS		3000
+
+static volatile struct {
+	int stop;
+	char name[DISK_MAX_NAMELENGTH + 1];
+	uquad_t numSectors;
+	unsigned sectorSize;
+	unsigned chunkSectors;
+	unsigned reads[DISKQUEUE_MAX_THREADS];
+	int errors;
+
+} diskQueueData;
+
+
+static int diskQueueThread(int argc, char *argv[])
+{
+	// Reads chunks from random places on the disk until told to stop, so
+	// that its reads nearly all miss the disk cache
+
+	int index = 0;
+	unsigned char *buffer = NULL;
+	uquad_t sector = 0;
+
+	if (argc > 1)
+		index = atoi(argv[1]);
+
+	srand(cpuGetMs() + index);
+
+	buffer = malloc(diskQueueData.chunkSectors *
+		diskQueueData.sectorSize);
+	if (!buffer)
+	{
+		diskQueueData.errors += 1;
+		exit(0);
+	}
+
+	while (!diskQueueData.stop)
+	{
+		sector = ((((uquad_t) rand() << 16) ^ rand()) %
+			(diskQueueData.numSectors / diskQueueData.chunkSectors));
+		sector *= diskQueueData.chunkSectors;
+
+		if (diskReadSectors((char *) diskQueueData.name, sector,
+			diskQueueData.chunkSectors, buffer) < 0)
+		{
+			diskQueueData.errors += 1;
+			break;
+		}
+
+		diskQueueData.reads[index] += 1;
+	}
+
+	free(buffer);
+	exit(0);
+}
+
+
+static int disk_queue_threads(int numThreads)
+{
+	int status = 0;
+	int procId[DISKQUEUE_MAX_THREADS];
+	char indexString[12];
+	char *args[] = { indexString };
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	uquad_t total = 0;
+	int count;
+
+	diskQueueData.stop = 0;
+	diskQueueData.errors = 0;
+	memset((void *) diskQueueData.reads, 0, sizeof(diskQueueData.reads));
+	memset(procId, 0, sizeof(procId));
+
+	for (count = 0; count < numThreads; count ++)
+	{
+		sprintf(indexString, "%d", count);
+
+		procId[count] = multitaskerSpawn(&diskQueueThread,
+			"disk queue thread", 1, (void **) args, 1 /* run */);
+		if (procId[count] < 0)
+		{
+			FAILMSG("Couldn't spawn disk queue thread %d", count);
+			status = procId[count];
+			goto out;
+		}
+	}
+
+	startTime = cpuGetMs();
+	multitaskerWait(DISKQUEUE_TEST_MS);
+	diskQueueData.stop = 1;
+	elapsed = (cpuGetMs() - startTime);
+
+	for (count = 0; count < numThreads; count ++)
+		total += diskQueueData.reads[count];
+
+	printf("\n%d readers: %llu reads in %llu ms", numThreads, total,
+		elapsed);
+	if (elapsed)
+		printf(" (%llu IOPS)", ((total * 1000) / elapsed));
+
+	if (diskQueueData.errors)
+	{
+		FAILMSG("%d read errors", diskQueueData.errors);
+		status = ERR_IO;
+		goto out;
+	}
+
+	status = 0;
+
+out:
+	diskQueueData.stop = 1;
+
+	// Let them finish their last reads
+	for (count = 0; count < numThreads; count ++)
+	{
+		while ((procId[count] > 0) && multitaskerProcessIsAlive(procId[count]))
+			multitaskerYield();
+	}
+
+	return (status);
+}
+
+
+static int disk_queue(void)
+{
+	// Measures random read IOPS from the boot disk with increasing numbers
+	// of concurrent readers.  With a driver that can have more than one
+	// request outstanding on a disk (such as AHCI with native command
+	// queuing, in QEMU for example), IOPS should go up with the number of
+	// readers, up to the disk's queue depth.
+
+	int status = 0;
+	int numThreads[] = { 1, 2, 4, 8, 16, 32, 0 };
+	disk theDisk;
+	int count;
+
+	memset((void *) &diskQueueData, 0, sizeof(diskQueueData));
+
+	// Get the name of the physical boot disk
+	status = diskGetBoot((char *) diskQueueData.name);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting disk name", status);
+		return (status);
+	}
+
+	if (isalpha(diskQueueData.name[strlen((char *) diskQueueData.name) - 1]))
+		diskQueueData.name[strlen((char *) diskQueueData.name) - 1] = '\0';
+
+	status = diskGet((char *) diskQueueData.name, &theDisk);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting disk %s", status, diskQueueData.name);
+		return (status);
+	}
+
+	diskQueueData.numSectors = theDisk.numSectors;
+	diskQueueData.sectorSize = theDisk.sectorSize;
+	diskQueueData.chunkSectors = max((4096 / theDisk.sectorSize), 1);
+
+	for (count = 0; numThreads[count]; count ++)
+	{
+		status = disk_queue_threads(numThreads[count]);
+		if (status < 0)
+			break;
+	}
+
+	printf("\n");
+	return (status);
+}
+
+
+static unsigned disk_stats_count(diskStats *stats, int kind)
+{
+	// Total of the latency histogram for one kind of request
+
+	unsigned total = 0;
+	int count;
+
+	for (count = 0; count < DISKSTAT_BUCKETS; count ++)
+		total += stats->latency[kind][count];
+
+	return (total);
+}
+
+
+static int disk_stats(void)
+{
+	// Reads the same sector of the boot disk twice, and checks that the
+	// disk's request counts and latency histograms account for both reads.
+	// If the disk is cached, the second one has to be a hit.
+
+	int status = 0;
+	char diskName[DISK_MAX_NAMELENGTH + 1];
+	disk theDisk;
+	diskStats beforeStats;
+	diskStats afterStats;
+	unsigned char *buffer = NULL;
+	uquad_t sector = 0;
+	unsigned hits = 0;
+	unsigned misses = 0;
+	int count;
+
+	// Get the name of the physical boot disk
+	status = diskGetBoot(diskName);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting disk name", status);
+		goto out;
+	}
+
+	if (isalpha(diskName[strlen(diskName) - 1]))
+		diskName[strlen(diskName) - 1] = '\0';
+
+	status = diskGet(diskName, &theDisk);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting disk %s", status, diskName);
+		goto out;
+	}
+
+	buffer = malloc(theDisk.sectorSize);
+	if (!buffer)
+	{
+		FAILMSG("Error getting %u bytes disk buffer memory",
+			theDisk.sectorSize);
+		status = ERR_MEMORY;
+		goto out;
+	}
+
+	sector = randomFormatted(0, (theDisk.numSectors - 1));
+
+	status = diskGetStats(diskName, &beforeStats);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting stats for %s", status, diskName);
+		goto out;
+	}
+
+	for (count = 0; count < 2; count ++)
+	{
+		status = diskReadSectors(diskName, sector, 1, buffer);
+		if (status < 0)
+		{
+			FAILMSG("Error %d reading sector %llu on %s", status, sector,
+				diskName);
+			goto out;
+		}
+	}
+
+	status = diskGetStats(diskName, &afterStats);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting stats for %s", status, diskName);
+		goto out;
+	}
+
+	hits = (disk_stats_count(&afterStats, DISKSTAT_READHIT) -
+		disk_stats_count(&beforeStats, DISKSTAT_READHIT));
+	misses = (disk_stats_count(&afterStats, DISKSTAT_READMISS) -
+		disk_stats_count(&beforeStats, DISKSTAT_READMISS));
+
+	// Other processes might be reading the disk too, so there can be more
+	if ((afterStats.reads - beforeStats.reads) < 2)
+	{
+		FAILMSG("Disk %s counted %u reads, not 2", diskName,
+			(afterStats.reads - beforeStats.reads));
+		status = ERR_BADDATA;
+		goto out;
+	}
+
+	if ((hits + misses) < 2)
+	{
+		FAILMSG("Disk %s latency histograms counted %u reads, not 2",
+			diskName, (hits + misses));
+		status = ERR_BADDATA;
+		goto out;
+	}
+
+	if (!(theDisk.flags & DISKFLAG_NOCACHE) && !hits)
+	{
+		FAILMSG("Disk %s second read wasn't a cache hit", diskName);
+		status = ERR_BADDATA;
+		goto out;
+	}
+
+	status = 0;
+
+out:
+	if (buffer)
+		free(buffer);
+
+	return (status);
+}
+
+
 static int file_recurse(const char *dirPath, unsigned startTime)
 {
 	int status = 0;
@@ -2302,6 +3946,66 @@ out:
 }
 
 
+#define FRAMEBUFFER_BLITS		100
+
+static int framebuffer(void)
+{
+	// Measures full-screen blits to the framebuffer, which touch every page
+	// of it each time, so depend heavily on how it's mapped
+
+	int status = 0;
+	image screenImage;
+	int width = graphicGetScreenWidth();
+	int height = graphicGetScreenHeight();
+	uquad_t startTime = 0;
+	uquad_t elapsed = 0;
+	uquad_t bytes = 0;
+	int count;
+
+	memset(&screenImage, 0, sizeof(image));
+
+	// Grab the current contents of the screen, so that drawing it back
+	// doesn't change anything
+	status = graphicGetImage(NULL, &screenImage, 0, 0, width, height);
+	if (status < 0)
+	{
+		FAILMSG("Error %d getting screen image", status);
+		goto out;
+	}
+
+	startTime = cpuGetMs();
+
+	for (count = 0; count < FRAMEBUFFER_BLITS; count ++)
+	{
+		status = graphicDrawImage(NULL, &screenImage, draw_normal, 0, 0, 0,
+			0, width, height);
+		if (status < 0)
+		{
+			FAILMSG("Error %d drawing screen image", status);
+			goto out;
+		}
+	}
+
+	elapsed = (cpuGetMs() - startTime);
+
+	bytes = ((uquad_t) graphicCalculateAreaBytes(width, height) *
+		FRAMEBUFFER_BLITS);
+
+	printf("\n%d %dx%d blits in %llu ms", FRAMEBUFFER_BLITS, width, height,
+		elapsed);
+	if (elapsed)
+		printf(" (%llu KB/s)", ((bytes * 1000) / (elapsed * 1024)));
+	printf("\n");
+
+	status = 0;
+
+out:
+	imageFree(&screenImage);
+
+	return (status);
+}
+
+
 // This table describes all of the functions to run
 struct {
 	int (*function)(void);
@@ -2314,11 +4018,23 @@ struct {
 	{ pipes,			"pipes",			0,  0 },
 	{ format_strings,	"format strings",	0,  0 },
 	{ exceptions,		"exceptions",		0,  0 },
+	{ scheduler,		"scheduler",		0,  0 },
+	{ locks,			"locks",			0,  0 },
+	{ pingpong,			"ping pong",		0,  0 },
+	{ smp,				"smp",				0,  0 },
+	{ memory_alloc,		"memory alloc",		0,  0 },
+	{ page_map,			"page map",			0,  0 },
+	{ memory_reserve,	"memory reserve",	0,  0 },
+	{ memory_faults,	"memory faults",	0,  0 },
+	{ malloc_speed,		"malloc",			0,  0 },
 	{ text_output,		"text output",		0,  0 },
 	{ text_colors,		"text colors",		0,  0 },
 	{ xtra_chars,		"xtra chars",		0,  0 },
 	{ port_io,			"port io",			0,  0 },
 	{ disk_io,			"disk io",			0,  0 },
+	{ disk_speed,		"disk speed",		0,  0 },
+	{ disk_queue,		"disk queue",		0,  0 },
+	{ disk_stats,		"disk stats",		0,  0 },
 	{ file_ops,			"file ops",			0,  0 },
 	{ file_reopen,		"file reopen",		0,  0 },
 	{ divide64,			"divide64",			0,  0 },
@@ -2329,6 +4045,7 @@ struct {
 	{ randoms,			"randoms",			0,  0 },
 	{ gui,				"gui",				0,  1 },
 	{ icons,			"icons",			0,  1 },
+	{ framebuffer,		"framebuffer",		0,  1 },
 	{ NULL, NULL, 0, 0 }
 };
 